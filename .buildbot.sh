@@ -16,5 +16,24 @@ cargo fmt --all -- --check
 cargo test
 cargo test --release
 
+# Benchmark main first, saving its results as the `ci` baseline, and then this
+# tree, comparing against them on the same machine. Benchmarks which main
+# doesn't have yet are run without a comparison. The results (both baselines
+# and the reports) are left in criterion.tar.gz for the CI to keep as a build
+# artifact.
+bench_args="--warm-up-time 1 --measurement-time 2"
+main_rev=`git rev-parse --verify -q origin/master || true`
+if [ -n "$main_rev" ] && [ "$main_rev" != "`git rev-parse HEAD`" ]; then
+    rm -rf main_tree && git worktree prune
+    git worktree add --detach main_tree "$main_rev"
+    (cd main_tree && CARGO_TARGET_DIR=../target cargo bench -- --save-baseline ci $bench_args)
+    git worktree remove --force main_tree
+    cargo bench -- --baseline-lenient ci $bench_args
+else
+    # This is main (or main can't be found): there's nothing to compare with.
+    cargo bench -- --save-baseline ci $bench_args
+fi
+tar czf criterion.tar.gz -C target criterion
+
 which cargo-deny | cargo install cargo-deny
 cargo-deny check license
@@ -0,0 +1,113 @@
+//! Benchmarks for trace collection.
+//!
+//! To compare against an earlier run, save a baseline with `cargo bench -- --save-baseline
+//! <name>` and compare with `cargo bench -- --baseline <name>`.
+
+mod common;
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use hwtracer::collect::{
+    PerfCollectorConfig, PerfDrainMode, TraceCollector, TraceCollectorBuilder, TraceCollectorConfig,
+};
+use std::hint::black_box;
+
+/// Build the default collector for the platform, with its Perf configuration changed by `conf`.
+fn mk_collector<F: FnOnce(&mut PerfCollectorConfig)>(conf: F) -> TraceCollector {
+    let mut bldr = TraceCollectorBuilder::new();
+    match bldr.config() {
+        TraceCollectorConfig::Perf(ref mut ppt_conf) => conf(ppt_conf),
+    }
+    bldr.build().unwrap()
+}
+
+/// Measure how long it takes to get from starting a collector to having a (decodable) trace in
+/// hand, with and without Perf context reuse.
+///
+/// Nothing is executed between start and stop, so the resulting traces are little more than the
+/// initial `PSB+` sequence. With context reuse, the shared drain thread and traces handed back
+/// for reuse, starting and stopping allocate nothing.
+fn start_to_first_packet(c: &mut Criterion) {
+    let mut group = c.benchmark_group("start_to_first_packet");
+    for (name, reuse_ctx) in [("fresh_ctx", false), ("reused_ctx", true)] {
+        let tc = mk_collector(|c| c.reuse_ctx = reuse_ctx);
+        group.bench_function(name, |b| {
+            b.iter(|| {
+                tc.start_thread_collector().unwrap();
+                let trace = tc.stop_thread_collector().unwrap();
+                assert_ne!(trace.len(), 0);
+                trace
+            })
+        });
+    }
+    let tc = mk_collector(|c| {
+        c.reuse_ctx = true;
+        c.shared_drain = true;
+    });
+    group.bench_function("recycled", |b| {
+        b.iter(|| {
+            tc.start_thread_collector().unwrap();
+            let trace = tc.stop_thread_collector().unwrap();
+            assert_ne!(trace.len(), 0);
+            tc.recycle_trace(trace);
+        })
+    });
+    group.finish();
+}
+
+/// Measure how much slower code runs while it is traced, by running the same work untraced and
+/// traced (including starting and stopping the collector).
+fn traced_slowdown(c: &mut Criterion) {
+    let mut group = c.benchmark_group("traced_slowdown");
+    let tc = mk_collector(|_| ());
+    for iters in [100, 10000] {
+        group.bench_function(BenchmarkId::new("untraced", iters), |b| {
+            b.iter(|| black_box(common::work_loop(iters)))
+        });
+        group.bench_function(BenchmarkId::new("traced", iters), |b| {
+            b.iter(|| common::trace(&tc, || common::work_loop(iters)))
+        });
+    }
+    group.finish();
+}
+
+/// Measure how quickly each drain mode gets trace data out of the AUX buffer, in bytes of trace
+/// per second.
+///
+/// The AUX buffer is smaller than the trace, so that it has to be drained many times over, but
+/// big enough that even the slowest mode keeps up. Collection isn't lossy, so a mode that didn't
+/// keep up would fail the benchmark rather than appear faster for having copied less.
+fn drain_throughput(c: &mut Criterion) {
+    let mut group = c.benchmark_group("drain_throughput");
+    group.sample_size(20);
+    for (name, drain_mode, compress) in [
+        ("poll", PerfDrainMode::Poll, false),
+        ("busy_poll", PerfDrainMode::BusyPoll, false),
+        ("adaptive", PerfDrainMode::Adaptive, false),
+        ("poll_compressed", PerfDrainMode::Poll, true),
+    ] {
+        let tc = mk_collector(|c| {
+            c.aux_bufsize = 512;
+            c.drain_mode = drain_mode;
+            c.compress = compress;
+        });
+        let trace = common::trace(&tc, || common::work_loop(100000));
+        assert!(trace.gaps().is_empty());
+        group.throughput(Throughput::Bytes(trace.len() as u64));
+        group.bench_function(name, |b| {
+            b.iter(|| {
+                let trace = common::trace(&tc, || common::work_loop(100000));
+                assert!(trace.gaps().is_empty());
+                trace
+            })
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    start_to_first_packet,
+    traced_slowdown,
+    drain_throughput
+);
+criterion_main!(benches);
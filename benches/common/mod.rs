@@ -0,0 +1,83 @@
+//! Workloads shared by the benchmarks.
+//!
+//! Each bench uses only some of these.
+#![allow(dead_code)]
+
+use hwtracer::{collect::TraceCollector, Trace};
+use std::{hint::black_box, time::SystemTime};
+
+/// A loop that does some work, to give us something to trace.
+#[inline(never)]
+pub fn work_loop(iters: u64) -> u64 {
+    let mut res = 0;
+    for _ in 0..iters {
+        res += SystemTime::now().elapsed().unwrap().subsec_nanos() as u64;
+    }
+    res
+}
+
+/// A tight loop full of data-dependent conditional branches, whose trace is mostly `TNT` packets.
+#[inline(never)]
+pub fn loop_heavy(iters: u64) -> u64 {
+    let mut x = black_box(27u64);
+    let mut res = 0;
+    for i in 0..iters {
+        x = if x & 1 == 0 { x / 2 } else { 3 * x + 1 };
+        if x == 1 {
+            x = i + 27;
+        }
+        res ^= x;
+    }
+    res
+}
+
+#[inline(never)]
+fn op_add(x: u64) -> u64 {
+    x.wrapping_add(0x9e37_79b9)
+}
+
+#[inline(never)]
+fn op_mul(x: u64) -> u64 {
+    x.wrapping_mul(0x2545_f491)
+}
+
+#[inline(never)]
+fn op_rot(x: u64) -> u64 {
+    x.rotate_left(13)
+}
+
+#[inline(never)]
+fn op_xor(x: u64) -> u64 {
+    x ^ (x >> 7)
+}
+
+/// A loop of calls through a table of function pointers, chosen pseudo-randomly, whose trace is
+/// mostly `TIP` packets.
+#[inline(never)]
+pub fn indirect_heavy(iters: u64) -> u64 {
+    let ops: [fn(u64) -> u64; 4] = black_box([op_add, op_mul, op_rot, op_xor]);
+    let mut x = 1u64;
+    for _ in 0..iters {
+        x = ops[(x >> 61) as usize & 3](x);
+    }
+    x
+}
+
+/// Trace `f` with `tc`.
+pub fn trace<F: FnOnce() -> u64>(tc: &TraceCollector, f: F) -> Box<dyn Trace> {
+    tc.start_thread_collector().unwrap();
+    black_box(f());
+    tc.stop_thread_collector().unwrap()
+}
+
+/// A corpus of traces, from small to large and from loop-heavy to indirect-branch-heavy, to
+/// decode. They are collected afresh each run, as the YkPT decoder can only decode traces of the
+/// running process.
+pub fn corpus(tc: &TraceCollector) -> Vec<(&'static str, Box<dyn Trace>)> {
+    vec![
+        ("small", trace(tc, || work_loop(100))),
+        ("large", trace(tc, || work_loop(100000))),
+        ("loop_heavy", trace(tc, || loop_heavy(1000000))),
+        ("indirect_heavy", trace(tc, || indirect_heavy(200000))),
+    ]
+}
@@ -0,0 +1,74 @@
+//! Benchmarks for trace decoding.
+//!
+//! Each decoder decodes each trace of a corpus (see [common::corpus]), measured both in bytes of
+//! trace per second and in blocks per second. To compare against an earlier run, save a baseline
+//! with `cargo bench -- --save-baseline <name>` and compare with `cargo bench -- --baseline
+//! <name>`. The corpus is collected afresh each run, so traces differ a little between runs.
+
+mod common;
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use hwtracer::{
+    collect::TraceCollectorBuilder,
+    decode::{TraceDecoder, TraceDecoderBuilder, TraceDecoderKind},
+    Block, Trace,
+};
+
+/// The decoders compiled in, by name.
+fn decoders() -> Vec<(&'static str, Box<dyn TraceDecoder>)> {
+    [
+        ("libipt", TraceDecoderKind::LibIPT),
+        ("ykpt", TraceDecoderKind::YkPT),
+        ("auto", TraceDecoderKind::Auto),
+    ]
+    .iter()
+    // Those not compiled in fail to build.
+    .filter_map(|&(name, kind)| Some((name, TraceDecoderBuilder::new().kind(kind).build().ok()?)))
+    .collect()
+}
+
+/// Measure how fast each decoder gets through the corpus, with throughput `measure` of each trace
+/// (given its blocks).
+fn decode_corpus(
+    c: &mut Criterion,
+    group_name: &str,
+    measure: fn(&dyn Trace, &[Block]) -> Throughput,
+) {
+    let tc = TraceCollectorBuilder::new().build().unwrap();
+    let corpus = common::corpus(&tc);
+    let decoders = decoders();
+    let mut group = c.benchmark_group(group_name);
+    // The large traces take a while to decode.
+    group.sample_size(20);
+    for (trace_name, trace) in &corpus {
+        for (dec_name, dec) in &decoders {
+            let mut blocks = Vec::new();
+            dec.decode_into(&**trace, &mut blocks).unwrap();
+            group.throughput(measure(&**trace, &blocks));
+            group.bench_function(BenchmarkId::new(*dec_name, trace_name), |b| {
+                b.iter(|| {
+                    blocks.clear();
+                    dec.decode_into(&**trace, &mut blocks).unwrap();
+                })
+            });
+        }
+    }
+    group.finish();
+}
+
+/// Measure how many bytes of trace per second each decoder gets through.
+fn bytes_per_sec(c: &mut Criterion) {
+    decode_corpus(c, "bytes_per_sec", |trace, _| {
+        Throughput::Bytes(trace.len() as u64)
+    });
+}
+
+/// Measure how many blocks per second each decoder finds.
+fn blocks_per_sec(c: &mut Criterion) {
+    decode_corpus(c, "blocks_per_sec", |_, blocks| {
+        Throughput::Elements(blocks.len() as u64)
+    });
+}
+
+criterion_group!(benches, bytes_per_sec, blocks_per_sec);
+criterion_main!(benches);
@@ -105,6 +105,12 @@ fn main() {
     {
         c_build.file("src/collect/perf/collect.c");
         println!("cargo:rustc-cfg=collector_perf");
+        // For dlsym(3) and friends, used to resolve address filters.
+        println!("cargo:rustc-link-lib=dl");
+        // For compressing traces as they are collected. zstd-sys tells us where its headers are.
+        if let Ok(root) = env::var("DEP_ZSTD_ROOT") {
+            c_build.include(format!("{}/include", root));
+        }
     }
 
     // FIXME: libipt support is unconditionally built-in for now.
@@ -1,8 +1,14 @@
+use std::iter::FromIterator;
+
 #[cfg(target_arch = "x86_64")]
 type BlockAddr = u64;
 
 /// Information about a basic block.
-#[derive(Debug, Eq, PartialEq)]
+///
+/// This is `repr(C)` so that decoders can fill buffers of blocks from C (see
+/// `struct hwt_ipt_block`).
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
 pub struct Block {
     /// Virtual address of the start of the first instruction in this block.
     first_instr: BlockAddr,
@@ -21,6 +27,20 @@ impl Block {
         }
     }
 
+    /// Creates a marker for a point in the trace where data was lost. Blocks either side of it may
+    /// not be contiguous.
+    pub fn new_gap() -> Self {
+        Self {
+            first_instr: 0,
+            last_instr: 0,
+        }
+    }
+
+    /// Returns `true` if this is a gap marker (see [Block::new_gap]), not a real block.
+    pub fn is_gap(&self) -> bool {
+        self.first_instr == 0
+    }
+
     /// Returns the virtual address of the start of the first instruction in this block.
     pub fn first_instr(&self) -> BlockAddr {
         self.first_instr
@@ -31,3 +51,312 @@ impl Block {
         self.last_instr
     }
 }
+
+/// How many of the most recent blocks a [BlockTrace] can refer back to.
+const WINDOW: usize = 256;
+
+/// How many entries the table of recently seen blocks used by [BlockTrace::push] has.
+const SEEN_TABLE: usize = 1024;
+
+/// Repeats of fewer than this many blocks are stored as the blocks themselves.
+const MIN_REPEAT: u64 = 3;
+
+/// A compact, append-only sequence of blocks.
+///
+/// Blocks are encoded as a stream of varints. Each block is stored as the (zigzag encoded)
+/// distance from the last instruction of the block before it to its first instruction, followed
+/// by its size: code mostly flows from one block to one nearby, so both are usually small. A run
+/// of blocks which repeats blocks no more than [WINDOW] blocks back, as the body of a loop does, is
+/// stored as a single repeat, giving how many blocks to copy and from how far back. Repeats may
+/// overlap themselves, so that a loop running many times is one repeat of its first iteration.
+///
+/// A trace of a program spending its time in hot loops thus takes a few bytes per loop, rather than
+/// 16 bytes per block as in a `Vec<Block>`. Blocks can only be read back in order (see
+/// [BlockTrace::iter]).
+#[derive(Clone)]
+pub struct BlockTrace {
+    bytes: Vec<u8>,
+    /// How many blocks have been pushed.
+    len: u64,
+    /// The last [WINDOW] blocks pushed, indexed by their position in the trace modulo [WINDOW].
+    recent: [Block; WINDOW],
+    /// For each hash of a block, one more than the position of the last block pushed with that
+    /// hash, or 0.
+    seen: [u64; SEEN_TABLE],
+    /// The repeat being built up, as the distance back and the number of blocks so far. Only pushed
+    /// to `bytes` once it ends (or [BlockTrace::iter] takes it into account).
+    repeat: Option<(u64, u64)>,
+    /// The last block encoded in `bytes`.
+    last: Block,
+}
+
+impl BlockTrace {
+    pub fn new() -> Self {
+        Self {
+            bytes: Vec::new(),
+            len: 0,
+            recent: [Block::new_gap(); WINDOW],
+            seen: [0; SEEN_TABLE],
+            repeat: None,
+            last: Block::new_gap(),
+        }
+    }
+
+    /// Returns the number of blocks in the trace.
+    pub fn len(&self) -> usize {
+        self.len as usize
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Returns the number of bytes taken up by the encoded blocks.
+    pub fn encoded_len(&self) -> usize {
+        self.bytes.len()
+    }
+
+    /// Append `block` to the trace.
+    pub fn push(&mut self, block: Block) {
+        if let Some((dist, n)) = &mut self.repeat {
+            if self.recent[(self.len - *dist) as usize % WINDOW] == block {
+                *n += 1;
+                self.remember(block);
+                return;
+            }
+            self.end_repeat();
+        }
+        let slot = Self::hash(&block);
+        match self.seen[slot].checked_sub(1) {
+            Some(pos)
+                if self.len - pos <= WINDOW as u64
+                    && self.recent[pos as usize % WINDOW] == block =>
+            {
+                self.repeat = Some((self.len - pos, 1));
+            }
+            _ => self.encode_block(block),
+        }
+        self.remember(block);
+    }
+
+    /// Returns an iterator over the blocks of the trace.
+    pub fn iter(&self) -> BlockTraceIter<'_> {
+        BlockTraceIter {
+            bytes: &self.bytes,
+            pos: 0,
+            index: 0,
+            recent: [Block::new_gap(); WINDOW],
+            last: Block::new_gap(),
+            repeat: None,
+            pending: self.repeat,
+        }
+    }
+
+    fn hash(block: &Block) -> usize {
+        (block.first_instr.wrapping_mul(0x9e37_79b9_7f4a_7c15) >> 54) as usize % SEEN_TABLE
+    }
+
+    /// Record that `block` has been pushed.
+    fn remember(&mut self, block: Block) {
+        self.recent[self.len as usize % WINDOW] = block;
+        self.seen[Self::hash(&block)] = self.len + 1;
+        self.len += 1;
+    }
+
+    /// Encode the repeat being built up, which ends with the last block pushed.
+    fn end_repeat(&mut self) {
+        let (dist, n) = self.repeat.take().unwrap();
+        if n < MIN_REPEAT {
+            for pos in self.len - n..self.len {
+                self.encode_block(self.recent[pos as usize % WINDOW]);
+            }
+        } else {
+            write_varint(&mut self.bytes, n << 1 | 1);
+            write_varint(&mut self.bytes, dist);
+            self.last = self.recent[(self.len - 1) as usize % WINDOW];
+        }
+    }
+
+    fn encode_block(&mut self, block: Block) {
+        let delta = block.first_instr.wrapping_sub(self.last.last_instr) as i64;
+        write_varint(&mut self.bytes, zigzag(delta) << 1);
+        write_varint(
+            &mut self.bytes,
+            block.last_instr.wrapping_sub(block.first_instr),
+        );
+        self.last = block;
+    }
+}
+
+impl Extend<Block> for BlockTrace {
+    fn extend<I: IntoIterator<Item = Block>>(&mut self, iter: I) {
+        for b in iter {
+            self.push(b);
+        }
+    }
+}
+
+impl FromIterator<Block> for BlockTrace {
+    fn from_iter<I: IntoIterator<Item = Block>>(iter: I) -> Self {
+        let mut bt = Self::new();
+        bt.extend(iter);
+        bt
+    }
+}
+
+impl<'a> IntoIterator for &'a BlockTrace {
+    type Item = Block;
+    type IntoIter = BlockTraceIter<'a>;
+
+    fn into_iter(self) -> Self::IntoIter {
+        self.iter()
+    }
+}
+
+impl std::fmt::Debug for BlockTrace {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("BlockTrace")
+            .field("len", &self.len)
+            .field("encoded_len", &self.bytes.len())
+            .finish()
+    }
+}
+
+/// Iterates over the blocks of a [BlockTrace], in order.
+pub struct BlockTraceIter<'a> {
+    bytes: &'a [u8],
+    /// The offset of the next varint to read from `bytes`.
+    pos: usize,
+    /// How many blocks have been yielded.
+    index: u64,
+    recent: [Block; WINDOW],
+    last: Block,
+    /// The repeat being yielded, as the distance back and the number of blocks left.
+    repeat: Option<(u64, u64)>,
+    /// The repeat that the trace was building up when the iterator was made, to yield once `bytes`
+    /// is exhausted.
+    pending: Option<(u64, u64)>,
+}
+
+impl<'a> BlockTraceIter<'a> {
+    fn read_varint(&mut self) -> u64 {
+        let mut v = 0;
+        let mut shift = 0;
+        loop {
+            let b = self.bytes[self.pos];
+            self.pos += 1;
+            v |= u64::from(b & 0x7f) << shift;
+            if b & 0x80 == 0 {
+                return v;
+            }
+            shift += 7;
+        }
+    }
+
+    fn yielded(&mut self, block: Block) -> Block {
+        self.recent[self.index as usize % WINDOW] = block;
+        self.index += 1;
+        self.last = block;
+        block
+    }
+}
+
+impl<'a> Iterator for BlockTraceIter<'a> {
+    type Item = Block;
+
+    fn next(&mut self) -> Option<Block> {
+        if self.repeat.is_none() {
+            if self.pos == self.bytes.len() {
+                self.repeat = self.pending.take();
+            } else {
+                let tag = self.read_varint();
+                if tag & 1 == 1 {
+                    self.repeat = Some((self.read_varint(), tag >> 1));
+                } else {
+                    let first_instr = self.last.last_instr.wrapping_add(unzigzag(tag >> 1) as u64);
+                    let last_instr = first_instr.wrapping_add(self.read_varint());
+                    return Some(self.yielded(Block::new(first_instr, last_instr)));
+                }
+            }
+        }
+        let (dist, left) = self.repeat.as_mut()?;
+        let block = self.recent[(self.index - *dist) as usize % WINDOW];
+        *left -= 1;
+        if *left == 0 {
+            self.repeat = None;
+        }
+        Some(self.yielded(block))
+    }
+}
+
+fn write_varint(bytes: &mut Vec<u8>, mut v: u64) {
+    while v >= 0x80 {
+        bytes.push(v as u8 | 0x80);
+        v >>= 7;
+    }
+    bytes.push(v as u8);
+}
+
+fn zigzag(v: i64) -> u64 {
+    ((v << 1) ^ (v >> 63)) as u64
+}
+
+fn unzigzag(v: u64) -> i64 {
+    (v >> 1) as i64 ^ -((v & 1) as i64)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Block, BlockTrace, WINDOW};
+
+    fn round_trip(blocks: &[Block]) -> BlockTrace {
+        let bt = blocks.iter().copied().collect::<BlockTrace>();
+        assert_eq!(bt.len(), blocks.len());
+        assert_eq!(bt.iter().collect::<Vec<_>>(), blocks);
+        bt
+    }
+
+    #[test]
+    fn literals() {
+        round_trip(&[]);
+        round_trip(&[
+            Block::new(0x1000, 0x1008),
+            Block::new(0x10, 0x10),
+            Block::new_gap(),
+            Block::new(u64::MAX - 4, u64::MAX),
+            Block::new(0x1000, 0x1008),
+        ]);
+    }
+
+    #[test]
+    fn loops() {
+        let body = (0..5)
+            .map(|i| Block::new(0x40_0000 + i * 0x20, 0x40_0010 + i * 0x20))
+            .collect::<Vec<_>>();
+        let mut blocks = vec![Block::new(0x50_0000, 0x50_0004)];
+        for _ in 0..10_000 {
+            blocks.extend(&body);
+        }
+        blocks.push(Block::new_gap());
+        blocks.extend(&body[..2]);
+        // A loop body too far apart to refer back to.
+        let big = (0..WINDOW as u64 + 1)
+            .map(|i| Block::new(0x60_0000 + i * 0x10, 0x60_0008 + i * 0x10))
+            .collect::<Vec<_>>();
+        blocks.extend(&big);
+        blocks.extend(&big);
+        let bt = round_trip(&blocks);
+        // Each big loop is stored block by block, but the small loop takes a few bytes in all.
+        assert!(bt.encoded_len() < 3 * big.len() * 4);
+        assert!(bt.encoded_len() * 100 < blocks.len() * std::mem::size_of::<Block>());
+
+        // The trace can be read while a repeat is being built up, and appended to afterwards.
+        let mut bt = BlockTrace::new();
+        for (i, &b) in blocks.iter().enumerate().take(1000) {
+            bt.push(b);
+            if i % 99 == 0 {
+                assert_eq!(bt.iter().collect::<Vec<_>>(), &blocks[..=i]);
+            }
+        }
+    }
+}
@@ -1,9 +1,26 @@
 //! Trace collectors.
 
-use crate::{errors::HWTracerError, Trace};
+use crate::{
+    decode::{scan::find_psb, stream, TraceDecoder},
+    errors::HWTracerError,
+    Block, Trace,
+};
 use core::arch::x86_64::__cpuid_count;
 use libc::{size_t, sysconf, _SC_PAGESIZE};
-use std::{cell::RefCell, convert::TryFrom, sync::LazyLock};
+use std::{
+    cell::RefCell,
+    collections::HashMap,
+    convert::TryFrom,
+    path::PathBuf,
+    slice,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        mpsc::Receiver,
+        LazyLock,
+    },
+};
+#[cfg(test)]
+use std::{fs::File, io::Write};
 use strum::IntoEnumIterator;
 use strum_macros::EnumIter;
 
@@ -20,56 +37,428 @@ static PERF_DFLT_AUX_BUFSIZE: LazyLock<size_t> = LazyLock::new(|| {
     mb64 / page_sz + size_t::from(mb64 % page_sz != 0)
 });
 
+const PERF_DFLT_MIN_AUX_BUFSIZE: size_t = 256; // 1MiB with 4KiB pages.
+
 const PERF_DFLT_INITIAL_TRACE_BUFSIZE: size_t = 1024 * 1024; // 1MiB
 
+/// Gives each [TraceCollector] an ID of its own.
+static NEXT_COLLECTOR_ID: AtomicU64 = AtomicU64::new(0);
+
 thread_local! {
-    /// When `Some` holds the `ThreadTraceCollector` that is collecting a trace of the current
-    /// thread.
-    static THREAD_TRACE_COLLECTOR: RefCell<Option<Box<dyn ThreadTraceCollector>>> = RefCell::new(None);
+    /// When `Some` holds the `ThreadTraceCollector` that last collected (or is collecting) a trace
+    /// of the current thread, which is reused by later sessions of the same `TraceCollector`.
+    static THREAD_TRACE_COLLECTOR: RefCell<Option<ThreadSlot>> = RefCell::new(None);
+    /// When `Some` holds the consumer decoding the current thread's trace as it is collected.
+    static THREAD_TRACE_CONSUMER: RefCell<Option<stream::Consumer>> = RefCell::new(None);
 }
 
 /// The private innards of a `TraceCollector`.
 pub(crate) trait TraceCollectorImpl: Send + Sync {
     unsafe fn thread_collector(&self) -> Box<dyn ThreadTraceCollector>;
+    /// Start collecting per CPU. See [TraceCollector::start_cpu_collector].
+    fn cpu_collector(&self) -> Result<Box<dyn CpuCollection>, HWTracerError>;
+}
+
+/// A thread's `ThreadTraceCollector`, kept between tracing sessions.
+struct ThreadSlot {
+    /// The ID of the [TraceCollector] that made `thr_col`.
+    owner: u64,
+    /// Is `thr_col` collecting?
+    active: bool,
+    thr_col: Box<dyn ThreadTraceCollector>,
+}
+
+/// The storage of a trace that is no longer needed, which a collector can collect another trace
+/// into. See [Trace::into_storage].
+#[derive(Debug)]
+pub struct TraceStorage {
+    #[cfg(collector_perf)]
+    pub(crate) perf: Box<perf::PerfTrace>,
 }
 
 /// The public interface offered by all trace collectors.
 pub struct TraceCollector {
     col_impl: Box<dyn TraceCollectorImpl>,
+    id: u64,
 }
 
 impl TraceCollector {
     pub(crate) fn new(col_impl: Box<dyn TraceCollectorImpl>) -> Self {
-        Self { col_impl }
+        Self {
+            col_impl,
+            id: NEXT_COLLECTOR_ID.fetch_add(1, Ordering::Relaxed),
+        }
+    }
+
+    /// Get this collector's `ThreadTraceCollector` for the current thread out of `slot`, making
+    /// one if the thread last traced with another collector. Fails if another collector is
+    /// collecting.
+    fn thread_slot<'s>(
+        &self,
+        slot: &'s mut Option<ThreadSlot>,
+    ) -> Result<&'s mut ThreadSlot, HWTracerError> {
+        match slot {
+            Some(s) if s.owner == self.id => (),
+            Some(s) if s.active => return Err(HWTracerError::AlreadyCollecting),
+            _ => {
+                *slot = Some(ThreadSlot {
+                    owner: self.id,
+                    active: false,
+                    thr_col: unsafe { self.col_impl.thread_collector() },
+                })
+            }
+        }
+        Ok(slot.as_mut().unwrap())
     }
 
     /// Start collecting a trace of the current thread.
+    ///
+    /// The thread's collector is kept from one tracing session to the next, so once it has been
+    /// set up, starting and stopping only allocate what the collector's configuration requires.
+    /// For the Perf collector, with `reuse_ctx` and `shared_drain` set and traces handed back with
+    /// [TraceCollector::recycle_trace], that's nothing.
     pub fn start_thread_collector(&self) -> Result<(), HWTracerError> {
-        THREAD_TRACE_COLLECTOR.with(|inner| {
-            let mut inner = inner.borrow_mut();
-            if inner.is_some() {
-                Err(HWTracerError::AlreadyCollecting)
-            } else {
-                let mut thr_col = unsafe { self.col_impl.thread_collector() };
-                thr_col.start_collector()?;
-                *inner = Some(thr_col);
-                Ok(())
+        THREAD_TRACE_COLLECTOR.with(|slot| {
+            let mut slot = slot.borrow_mut();
+            let s = self.thread_slot(&mut slot)?;
+            if s.active {
+                return Err(HWTracerError::AlreadyCollecting);
+            }
+            s.thr_col.start_collector()?;
+            s.active = true;
+            Ok(())
+        })
+    }
+
+    /// Hand back a trace that is no longer needed, so that the next trace that this collector
+    /// collects on the current thread reuses its storage instead of allocating more. Traces that
+    /// can't be reused (e.g. ones streamed to a file) are just dropped.
+    ///
+    /// Only one trace is kept per thread, until either this collector collects on the thread
+    /// again, or another collector does (in which case the trace is dropped).
+    pub fn recycle_trace(&self, trace: Box<dyn Trace>) {
+        let Some(storage) = trace.into_storage() else {
+            return;
+        };
+        THREAD_TRACE_COLLECTOR.with(|slot| {
+            if let Ok(s) = self.thread_slot(&mut slot.borrow_mut()) {
+                s.thr_col.recycle(storage);
+            }
+        });
+    }
+
+    /// Start collecting a trace of the current thread, decoding it with `decoder` on another thread
+    /// while it is collected. Batches of blocks are sent on the returned channel as they are
+    /// decoded. [TraceCollector::stop_thread_collector] then only has to decode the rest of the
+    /// trace: it sends the last of the blocks and closes the channel.
+    ///
+    /// Only data which has been drained out of the hardware's buffers can be decoded, so how soon
+    /// blocks arrive depends on the collector's drain mode and buffer sizes. The Perf collector
+    /// needs `Pooled` or `PooledHugePages` storage (which never moves) for this, and can't combine
+    /// it with `zero_copy`, `flight_recorder` or a `Directory` sink.
+    pub fn start_thread_collector_streaming(
+        &self,
+        decoder: Box<dyn TraceDecoder>,
+    ) -> Result<Receiver<Vec<Block>>, HWTracerError> {
+        THREAD_TRACE_COLLECTOR.with(|slot| {
+            let mut slot = slot.borrow_mut();
+            let s = self.thread_slot(&mut slot)?;
+            if s.active {
+                return Err(HWTracerError::AlreadyCollecting);
             }
+            s.thr_col.start_collector()?;
+            let live = match s.thr_col.live_trace() {
+                Some(live) => live,
+                None => {
+                    s.thr_col.stop_collector()?;
+                    return Err(HWTracerError::BadConfig(String::from(
+                        "this collector's configuration can't decode traces while collecting",
+                    )));
+                }
+            };
+            let (consumer, blocks) = stream::Consumer::start(decoder, live);
+            THREAD_TRACE_CONSUMER.with(|c| *c.borrow_mut() = Some(consumer));
+            s.active = true;
+            Ok(blocks)
+        })
+    }
+
+    /// Take a snapshot of the most recently collected part of the current thread's trace, leaving
+    /// collection running. Only collectors configured as flight recorders support this.
+    pub fn snapshot_thread_collector(&self) -> Result<Box<dyn Trace>, HWTracerError> {
+        THREAD_TRACE_COLLECTOR.with(|slot| match &mut *slot.borrow_mut() {
+            Some(s) if s.active => s.thr_col.snapshot_collector(),
+            _ => Err(HWTracerError::AlreadyStopped),
         })
     }
 
     /// Stop collecting a trace of the current thread.
+    ///
+    /// If the trace is being decoded as it is collected, the rest of it is decoded before this
+    /// returns, and any error decoding it is returned instead of the trace.
     pub fn stop_thread_collector(&self) -> Result<Box<dyn Trace>, HWTracerError> {
-        THREAD_TRACE_COLLECTOR.with(|inner| {
-            let mut inner = inner.borrow_mut();
-            if let Some(thr_col) = &mut *inner {
-                let ret = thr_col.stop_collector();
-                *inner = None;
-                ret
-            } else {
-                Err(HWTracerError::AlreadyStopped)
+        // The consumer must stop reading the trace before the collector lets go of it.
+        let tail = THREAD_TRACE_CONSUMER
+            .with(|c| c.borrow_mut().take())
+            .map(stream::Consumer::join);
+        let trace = THREAD_TRACE_COLLECTOR.with(|slot| match &mut *slot.borrow_mut() {
+            Some(s) if s.active => {
+                s.active = false;
+                s.thr_col.stop_collector()
             }
-        })
+            _ => Err(HWTracerError::AlreadyStopped),
+        })?;
+        if let Some(tail) = tail {
+            tail.decode(&*trace)?;
+        }
+        Ok(trace)
+    }
+
+    /// Start collecting traces of the current thread, and of every thread that it (or any thread
+    /// so traced) creates from now on, until [CpuCollection::stop] is called. Threads which
+    /// already exist (other than the current one) aren't traced.
+    ///
+    /// Rather than one buffer per thread, the Perf collector uses one Perf event and AUX buffer
+    /// per CPU, whatever the number of threads. The traces of the threads which ran on each CPU
+    /// are interleaved in its buffer, and are pulled apart when collection stops (see
+    /// [ThreadTrace]). It needs `shared_drain` (which it turns on) and can't combine this with
+    /// `reuse_ctx`, `zero_copy`, `flight_recorder`, `compress`, `aux_budget`, a `Directory`
+    /// sink, or drain mode `BusyPoll`.
+    ///
+    /// The threads traced this way can't also be traced by [TraceCollector::start_thread_collector]
+    /// until collection stops.
+    pub fn start_cpu_collector(&self) -> Result<Box<dyn CpuCollection>, HWTracerError> {
+        let collecting =
+            THREAD_TRACE_COLLECTOR.with(|slot| matches!(&*slot.borrow(), Some(s) if s.active));
+        if collecting {
+            return Err(HWTracerError::AlreadyCollecting);
+        }
+        self.col_impl.cpu_collector()
+    }
+}
+
+/// The collection of the traces of a group of threads with one buffer per CPU. See
+/// [TraceCollector::start_cpu_collector].
+pub trait CpuCollection {
+    /// Stop collecting, and split what was collected into one trace per thread, in the order in
+    /// which the threads first wrote to the trace.
+    fn stop(self: Box<Self>) -> Result<Vec<ThreadTrace>, HWTracerError>;
+}
+
+/// A part of the trace of a CPU which was written while one thread was running on it.
+#[derive(Clone, Copy, Debug)]
+pub(crate) struct CpuChunk {
+    /// Which CPU's trace the part is in.
+    pub(crate) cpu: usize,
+    /// Where in the CPU's trace the part starts.
+    pub(crate) offset: usize,
+    pub(crate) size: usize,
+    /// When the part ended. Only the order matters.
+    pub(crate) time: u64,
+    pub(crate) pid: u32,
+    pub(crate) tid: u32,
+}
+
+/// The trace of one thread, pieced together from the traces of the CPUs it ran on.
+///
+/// Whenever the thread was switched out and another traced thread ran on the same CPU, or it moved
+/// to another CPU, the parts either side don't follow on from each other. The trace has a gap at
+/// each such point, so it is always lossy: decoders report a gap and resume at the next `PSB`.
+/// If the hardware didn't emit a `PSB` when tracing of the thread resumed, the trace up to the
+/// next one is lost.
+#[derive(Debug)]
+pub struct ThreadTrace {
+    pid: u32,
+    tid: u32,
+    bytes: Vec<u8>,
+    gaps: Vec<usize>,
+    mmaps: Vec<Mmap>,
+}
+
+impl ThreadTrace {
+    /// The ID of the process the thread belongs to.
+    pub fn pid(&self) -> u32 {
+        self.pid
+    }
+
+    /// The ID of the thread.
+    pub fn tid(&self) -> u32 {
+        self.tid
+    }
+
+    /// Split the traces `cpus` into one trace per thread, using `chunks` to tell which thread
+    /// wrote what. Data which no chunk accounts for is dropped.
+    ///
+    /// The threads share an address space, so each gets the mappings of all the CPUs' traces. A
+    /// mapping was made after the parts of its CPU's trace before it (see [Mmap::trace_offset])
+    /// ended, so it is placed in each thread's trace at the first of the thread's parts to end
+    /// later than them.
+    pub(crate) fn split(cpus: &[&dyn Trace], mut chunks: Vec<CpuChunk>) -> Vec<Self> {
+        // Each mapping, with the time by which the parts before it had ended, if there were any.
+        let mut mmaps = cpus
+            .iter()
+            .enumerate()
+            .flat_map(|(cpu, t)| t.mmaps().iter().map(move |m| (cpu, m)))
+            .map(|(cpu, m)| {
+                let after = chunks
+                    .iter()
+                    .filter(|c| c.cpu == cpu && c.offset + c.size <= m.trace_offset)
+                    .map(|c| c.time)
+                    .max();
+                (after, m.clone())
+            })
+            .collect::<Vec<_>>();
+        mmaps.sort_by_key(|(after, _)| *after);
+        // A thread runs on one CPU at a time, and each of its parts ends when it stops running, so
+        // the times put its parts in order.
+        chunks.sort_by_key(|c| (c.time, c.cpu, c.offset));
+        let mut threads = Vec::new();
+        // Where each thread's last part ended.
+        let mut last_ends = Vec::new();
+        // How many of `mmaps` have been placed in each thread's trace.
+        let mut placed = Vec::new();
+        let mut by_tid = HashMap::new();
+        for c in chunks {
+            let (bytes, gaps) = (cpus[c.cpu].bytes(), cpus[c.cpu].gaps());
+            let start = c.offset.min(bytes.len());
+            let end = (c.offset + c.size).min(bytes.len());
+            if start == end {
+                continue;
+            }
+            let i = *by_tid.entry(c.tid).or_insert_with(|| {
+                threads.push(ThreadTrace {
+                    pid: c.pid,
+                    tid: c.tid,
+                    bytes: Vec::new(),
+                    gaps: Vec::new(),
+                    mmaps: Vec::new(),
+                });
+                last_ends.push(None);
+                placed.push(0);
+                threads.len() - 1
+            });
+            let t: &mut ThreadTrace = &mut threads[i];
+            while let Some((after, m)) = mmaps.get(placed[i]) {
+                if after.map_or(false, |a| c.time <= a) {
+                    break;
+                }
+                t.mmaps.push(Mmap {
+                    trace_offset: t.bytes.len(),
+                    ..m.clone()
+                });
+                placed[i] += 1;
+            }
+            if last_ends[i] != Some((c.cpu, start)) {
+                t.push_gap(t.bytes.len());
+            }
+            // Data lost while the thread was running is lost from its trace too.
+            for &g in gaps.iter().filter(|&&g| g >= start && g < end) {
+                t.push_gap(t.bytes.len() + g - start);
+            }
+            t.bytes.extend_from_slice(&bytes[start..end]);
+            last_ends[i] = Some((c.cpu, end));
+        }
+        for (t, placed) in threads.iter_mut().zip(placed) {
+            // The rest were made after the thread's last part ended.
+            for (_, m) in &mmaps[placed..] {
+                t.mmaps.push(Mmap {
+                    trace_offset: t.bytes.len(),
+                    ..m.clone()
+                });
+            }
+            t.trim_to_psb();
+        }
+        threads
+    }
+
+    /// Note that data was lost at `off`. There's nothing to note at the very start.
+    fn push_gap(&mut self, off: usize) {
+        if off > 0 && self.gaps.last() != Some(&off) {
+            self.gaps.push(off);
+        }
+    }
+
+    /// Cut the trace back to its first `PSB`, so that decoders can sync from the first byte.
+    fn trim_to_psb(&mut self) {
+        let first = find_psb(&self.bytes, 0).unwrap_or(self.bytes.len());
+        if first > 0 {
+            self.bytes.drain(..first);
+            self.gaps.retain(|&g| g > first);
+            for g in &mut self.gaps {
+                *g -= first;
+            }
+            for m in &mut self.mmaps {
+                m.trace_offset = m.trace_offset.saturating_sub(first);
+            }
+        }
+    }
+}
+
+impl Trace for ThreadTrace {
+    fn bytes(&self) -> &[u8] {
+        &self.bytes
+    }
+
+    #[cfg(test)]
+    fn capacity(&self) -> usize {
+        self.bytes.capacity()
+    }
+
+    fn len(&self) -> usize {
+        self.bytes.len()
+    }
+
+    fn gaps(&self) -> &[usize] {
+        &self.gaps
+    }
+
+    fn is_lossy(&self) -> bool {
+        true
+    }
+
+    fn mmaps(&self) -> &[Mmap] {
+        &self.mmaps
+    }
+
+    #[cfg(test)]
+    fn to_file(&self, file: &mut File) {
+        file.write_all(&self.bytes).unwrap();
+    }
+}
+
+/// The part of a trace collected so far, which can be read while collection goes on. The collector
+/// only ever appends to it, and its data never moves.
+pub(crate) struct LiveTrace {
+    /// Where the trace's buffer pointer is kept.
+    buf: *const *mut u8,
+    /// How many bytes of the buffer can be read. The collector stores to this (with release
+    /// ordering) after appending to the buffer.
+    len: *const AtomicU64,
+}
+
+/// The collector keeps the trace alive for as long as a `LiveTrace` is used (see
+/// [ThreadTraceCollector::live_trace]), from whichever thread.
+unsafe impl Send for LiveTrace {}
+
+impl LiveTrace {
+    /// # Safety
+    ///
+    /// `buf` and `len` must stay valid until the collector is stopped.
+    pub(crate) unsafe fn new(buf: *const *mut u8, len: *const AtomicU64) -> Self {
+        Self { buf, len }
+    }
+
+    /// Returns the bytes collected so far.
+    ///
+    /// # Safety
+    ///
+    /// The collector must not have been stopped.
+    pub(crate) unsafe fn bytes(&self) -> &[u8] {
+        let len = (*self.len).load(Ordering::Acquire) as usize;
+        if len == 0 {
+            return &[];
+        }
+        slice::from_raw_parts(*self.buf, len)
     }
 }
 
@@ -83,6 +472,16 @@ pub(crate) trait ThreadTraceCollector {
     ///
     /// Tracing continues until [stop_collector] is called.
     fn stop_collector(&mut self) -> Result<Box<dyn Trace>, HWTracerError>;
+    /// Returns the most recent part of the trace so far, without stopping the tracer.
+    fn snapshot_collector(&mut self) -> Result<Box<dyn Trace>, HWTracerError>;
+    /// Returns a view of the trace being collected that can be read while collection goes on, if
+    /// the collector (as configured) offers one. The view may be used until [stop_collector] is
+    /// called.
+    fn live_trace(&self) -> Option<LiveTrace> {
+        None
+    }
+    /// Keep `storage` to collect the next trace into, if the collector can.
+    fn recycle(&mut self, _storage: TraceStorage) {}
 }
 
 /// Kinds of collector that hwtracer supports (in order of "auto-selection preference").
@@ -132,16 +531,213 @@ pub enum TraceCollectorConfig {
 
 /// Configures the Perf collector.
 ///
-// Must stay in sync with the C code.
-#[derive(Clone, Debug)]
-#[repr(C)]
+/// The `Option` fields near the end control what Intel PT packets the hardware emits: `None`
+/// leaves the hardware/kernel default in place. Anything that is set is checked against the
+/// capabilities advertised under `/sys/bus/event_source/devices/intel_pt/` when the collector is
+/// built.
+#[derive(Clone, Debug, PartialEq, Eq)]
 pub struct PerfCollectorConfig {
     /// Data buffer size, in pages. Must be a power of 2.
     pub data_bufsize: size_t,
     /// AUX buffer size, in pages. Must be a power of 2.
     pub aux_bufsize: size_t,
+    /// If the kernel refuses to map an AUX buffer of `aux_bufsize` pages (e.g. because it would
+    /// take more than `perf_event_mlock_kb`), successively halve its size down to no less than
+    /// this many pages, rather than failing. Must be a power of 2. If not smaller than
+    /// `aux_bufsize`, sizes are never reduced.
+    pub min_aux_bufsize: size_t,
+    /// The most AUX buffer memory (in pages) that all the threads tracing with this collector may
+    /// have mapped at once. Each thread's AUX buffer is then sized (between `min_aux_bufsize` and
+    /// `aux_bufsize` pages) from how full the buffers of its recent tracing sessions got, so that
+    /// threads which trace little don't hold on to memory that busy ones could use. Starting a
+    /// collector fails with `ENOMEM` if not even `min_aux_bufsize` pages are left. Can't be
+    /// combined with `reuse_ctx`. The buffers of `zero_copy` traces still alive after their
+    /// session are not counted.
+    pub aux_budget: Option<size_t>,
     /// The initial trace storage buffer size (in bytes) of new traces.
     pub initial_trace_bufsize: size_t,
+    /// Keep the Perf file descriptor and buffers of a finished tracing session around so that the
+    /// next session on the same thread (with the same configuration) can reuse them, instead of
+    /// setting them up from scratch.
+    ///
+    /// Traces collected from a reused context still begin with a `PSB+` packet sequence. Nothing
+    /// can make the hardware emit one when tracing is re-enabled, so if it doesn't, what comes
+    /// before the first PSB is lost: the trace is trimmed back to its first PSB, the loss is
+    /// recorded as a gap at offset 0 and in [CollectionStats::bytes_before_psb], and reuse is
+    /// turned off for the rest of the process.
+    pub reuse_ctx: bool,
+    /// Instead of spawning a collector thread for each tracing session, have a single, long-lived
+    /// thread drain the buffers of all active sessions (of all collectors with this option
+    /// enabled) via one epoll(7) set. Starting and stopping a session then costs a registration
+    /// with that thread, rather than a thread creation and join.
+    pub shared_drain: bool,
+    /// Where possible, hand traces out without copying them from the AUX buffer: the resulting
+    /// trace borrows the buffer until it is dropped, and the collector context stays alive (and
+    /// can't be reused) until then. Data is still copied if a session fills most of the AUX
+    /// buffer, or if the data wraps around its end.
+    pub zero_copy: bool,
+    /// How the storage of collected traces is allocated. Defaults to `Heap`: pooled storage
+    /// reserves a large range of address space for each trace, and holds on to at least one chunk
+    /// per trace, so it's best kept for collectors of long traces.
+    pub storage: PerfTraceStorage,
+    /// Where collected trace data goes. Overrides `storage` and `initial_trace_bufsize` if it
+    /// isn't [TraceSink::Memory].
+    pub sink: TraceSink,
+    /// Run the AUX buffer in overwrite mode, so that it always holds the most recent trace data,
+    /// and never drain it. Traces (from snapshots or from stopping the collector) then contain
+    /// (at most) the last `aux_bufsize` pages of trace, starting from a `PSB` packet. This makes
+    /// always-on tracing cheap. Can't be combined with `reuse_ctx`, `shared_drain` or
+    /// `zero_copy`.
+    pub flight_recorder: bool,
+    /// Tolerate lost trace data (when the AUX buffer fills up before it is drained, or Perf loses
+    /// records) instead of failing. The trace then records each place where data went missing
+    /// (see [Trace::gaps]), and decoders report a gap there and resume at the next `PSB`. This
+    /// makes smaller `aux_bufsize`s viable.
+    pub lossy: bool,
+    /// How the collector's buffers are drained (see [PerfDrainMode]).
+    pub drain_mode: PerfDrainMode,
+    /// Compress trace data (with zstd, at a fast level) as it is drained from the AUX buffer, so
+    /// that long traces take much less memory. The trace is decompressed when it is first read
+    /// (e.g. by a decoder). Can't be combined with `zero_copy`, `flight_recorder`, `reuse_ctx` or
+    /// a [TraceSink::Directory] sink, and traces can't be decoded while they are collected.
+    pub compress: bool,
+    /// Keep a record of the executable file mappings made while collecting (see [Trace::mmaps]),
+    /// so that decoders can find code which was mapped (and perhaps unmapped again) during the
+    /// trace. Only mappings made by the traced thread itself (or, when collecting per CPU, by a
+    /// traced thread) are seen. Can't be combined with `flight_recorder`.
+    pub record_mmaps: bool,
+    /// How often the hardware emits a `PSB+` sequence: roughly every `2^(psb_period + 11)`
+    /// bytes of trace. A shorter period means more places from which decoding can (re)start, at
+    /// the cost of larger traces.
+    pub psb_period: Option<u8>,
+    /// Disable return compression, so that every return produces a `TIP` packet.
+    pub noretcomp: Option<bool>,
+    /// Emit control flow packets. Turning this off only makes sense when other (e.g. timing)
+    /// packets are wanted on their own.
+    pub branch: Option<bool>,
+    /// Emit `TSC` timestamp packets.
+    pub tsc: Option<bool>,
+    /// Emit `MTC` timing packets.
+    pub mtc: Option<bool>,
+    /// The `MTC` frequency (requires `mtc`): one packet every `2^mtc_period` crystal clock
+    /// cycles.
+    pub mtc_period: Option<u8>,
+    /// Emit `CYC` cycle-accurate timing packets.
+    pub cyc: Option<bool>,
+    /// The `CYC` threshold (requires `cyc`): at least `2^(cyc_thresh - 1)` cycles between
+    /// packets.
+    pub cyc_thresh: Option<u8>,
+}
+
+/// An executable file mapping made while a trace was collected. See
+/// [PerfCollectorConfig::record_mmaps].
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Mmap {
+    /// The virtual address the mapping starts at.
+    pub vaddr: u64,
+    /// The length of the mapping, in bytes.
+    pub len: u64,
+    /// The offset into the file of the start of the mapping.
+    pub offset: u64,
+    /// The file mapped, as it was named when it was mapped.
+    pub path: PathBuf,
+    /// How far (in bytes) into the trace the mapping was made, as near as the collector can tell.
+    /// The collector only learns of trace data some time after it was written, so this may be
+    /// somewhat before the mapping was really made, but is never after it. Decoders use the
+    /// mapping for the code traced from the `PSB` at or before here onwards.
+    pub trace_offset: usize,
+}
+
+/// How the Perf collector allocates trace storage.
+///
+// Must stay in sync with the C code.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+#[repr(C)]
+pub enum PerfTraceStorage {
+    /// A single heap buffer, which is reallocated (and thus copied) as the trace grows.
+    Heap,
+    /// Fixed-size chunks from a process-wide pool, mapped side by side into a reserved address
+    /// range. A growing trace gets new chunks appended without its existing data being copied,
+    /// and the chunks of a dropped trace are reused by later traces.
+    Pooled,
+    /// Like `Pooled`, but using huge pages where the system has them available (falling back to
+    /// normal pages otherwise).
+    PooledHugePages,
+}
+
+/// Statistics about the collection of a trace, for working out why a trace overflowed or took a
+/// long time to stop, and for sizing `aux_bufsize` and `data_bufsize`.
+///
+/// The counters are plain (non-atomic) ones bumped by whichever thread is draining the buffers, so
+/// keeping them costs next to nothing.
+///
+// Must stay in sync with the C code.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+#[repr(C)]
+pub struct CollectionStats {
+    /// How many bytes were copied out of the AUX buffer. Zero-copy traces which stayed in the AUX
+    /// buffer have nothing here.
+    pub bytes_drained: u64,
+    /// How many times the buffers were drained: once per wakeup of the draining thread (or, when
+    /// busy-polling, once per batch of new data), plus once at the end of the session.
+    pub wakeups: u64,
+    /// How many `PERF_RECORD_AUX` records the kernel emitted.
+    pub aux_records: u64,
+    /// How many times the trace storage buffer had to grow.
+    pub reallocs: u64,
+    /// How many bytes of trace were copied by the storage buffer growing. Pooled storage grows
+    /// without copying.
+    pub realloc_bytes_moved: u64,
+    /// The most bytes ever found waiting in the AUX buffer. If this gets close to the AUX buffer's
+    /// size, it should be bigger.
+    pub max_aux_fill: u64,
+    /// Nanoseconds spent copying data out of the AUX buffer.
+    pub memcpy_ns: u64,
+    /// How many times opening the Perf event (for the collector context used) had to be retried
+    /// because the device was busy.
+    pub open_retries: u64,
+    /// Nanoseconds from the start of stopping the collector until the trace was ready, including
+    /// the final drain and waiting for the collector thread.
+    pub stop_ns: u64,
+    /// The size (in bytes) of the AUX buffer used, which may be smaller than configured (see
+    /// [PerfCollectorConfig::min_aux_bufsize] and [PerfCollectorConfig::aux_budget]).
+    pub aux_bufsize: u64,
+    /// How many bytes were lost from the start of the trace because a reused collector context
+    /// (see [PerfCollectorConfig::reuse_ctx]) didn't start it with a `PSB+`, which decoders need
+    /// to start from. If this isn't zero, the trace has a gap at offset 0 and contexts are no
+    /// longer reused.
+    pub bytes_before_psb: u64,
+}
+
+/// How the Perf collector drains trace data out of its buffers while a session is running.
+///
+// Must stay in sync with the C code.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+#[repr(C)]
+pub enum PerfDrainMode {
+    /// Sleep until the kernel signals that the AUX buffer is half full.
+    Poll,
+    /// Spin (with backoff) on the buffers, making no syscalls. This uses a CPU for the duration of
+    /// each session, but new data is picked up sooner and less is left to drain when the
+    /// collector is stopped, making for the lowest stop-to-trace latency. Best suited to short
+    /// traces. Can't be combined with `shared_drain`.
+    BusyPoll,
+    /// Have the kernel signal new data more often, but only copy it out once the AUX buffer is
+    /// half full or, at the observed fill rate, would soon fill up. This copes better with bursty
+    /// code than `Poll`, without a copy for each signal.
+    Adaptive,
+}
+
+/// Where the Perf collector puts trace data as it is drained.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub enum TraceSink {
+    /// Trace storage in memory (see [PerfTraceStorage]).
+    Memory,
+    /// Stream the trace, straight out of the AUX buffer, into an anonymous (`O_TMPFILE`) file in
+    /// the specified directory, which is then mapped for decoding when collection stops. The
+    /// collector's memory use then stays flat, however long the trace. The file is deleted when
+    /// the trace is dropped. Can't be combined with `zero_copy` or `flight_recorder`.
+    Directory(PathBuf),
 }
 
 impl Default for PerfCollectorConfig {
@@ -149,11 +745,49 @@ impl Default for PerfCollectorConfig {
         Self {
             data_bufsize: PERF_DFLT_DATA_BUFSIZE,
             aux_bufsize: *PERF_DFLT_AUX_BUFSIZE,
+            min_aux_bufsize: PERF_DFLT_MIN_AUX_BUFSIZE,
+            aux_budget: None,
             initial_trace_bufsize: PERF_DFLT_INITIAL_TRACE_BUFSIZE,
+            reuse_ctx: false,
+            shared_drain: false,
+            zero_copy: false,
+            storage: PerfTraceStorage::Heap,
+            sink: TraceSink::Memory,
+            flight_recorder: false,
+            lossy: false,
+            drain_mode: PerfDrainMode::Poll,
+            compress: false,
+            record_mmaps: false,
+            psb_period: None,
+            noretcomp: None,
+            branch: None,
+            tsc: None,
+            mtc: None,
+            mtc_period: None,
+            cyc: None,
+            cyc_thresh: None,
         }
     }
 }
 
+/// Restricts tracing to particular code, so that the hardware doesn't even generate trace for
+/// anything else.
+///
+/// Filters are resolved to object-relative ranges when the collector is built, so the code in
+/// question must already be loaded by then. The number of filters the hardware supports is limited
+/// (often to 2), and an object or symbol may need more than one.
+#[derive(Clone, Debug)]
+pub enum AddrFilter {
+    /// The `size` bytes of code from virtual address `start`, which must lie within one
+    /// executable segment of a loaded object.
+    Range { start: usize, size: usize },
+    /// All executable segments of the loaded object at `path` (the path to the main executable
+    /// works too).
+    Object(PathBuf),
+    /// A dynamic symbol (as found by dlsym(3) in the global namespace).
+    Symbol(String),
+}
+
 impl TraceCollectorConfig {
     fn kind(&self) -> TraceCollectorKind {
         match self {
@@ -192,8 +826,16 @@ impl TraceCollectorConfig {
 /// }
 /// bldr.build().unwrap();
 /// ```
+///
+/// # Make a trace collector that only traces the main executable.
+/// ```
+/// use hwtracer::collect::{AddrFilter, TraceCollectorBuilder};
+/// let exe = std::env::current_exe().unwrap();
+/// let res = TraceCollectorBuilder::new().addr_filter(AddrFilter::Object(exe)).build();
+/// ```
 pub struct TraceCollectorBuilder {
     config: TraceCollectorConfig,
+    addr_filters: Vec<AddrFilter>,
 }
 
 impl TraceCollectorBuilder {
@@ -202,7 +844,10 @@ impl TraceCollectorBuilder {
         let config = match TraceCollectorKind::default_for_platform().unwrap() {
             TraceCollectorKind::Perf => TraceCollectorConfig::Perf(PerfCollectorConfig::default()),
         };
-        Self { config }
+        Self {
+            config,
+            addr_filters: Vec::new(),
+        }
     }
 
     /// Select the kind of trace collector.
@@ -213,6 +858,13 @@ impl TraceCollectorBuilder {
         self
     }
 
+    /// Only trace the code selected by `filter` (and that of any other filters added). By default
+    /// all user-space code is traced.
+    pub fn addr_filter(mut self, filter: AddrFilter) -> Self {
+        self.addr_filters.push(filter);
+        self
+    }
+
     /// Get a mutable reference to the collector configuraion.
     pub fn config(&mut self) -> &mut TraceCollectorConfig {
         &mut self.config
@@ -230,6 +882,7 @@ impl TraceCollectorBuilder {
                 #[cfg(collector_perf)]
                 return Ok(TraceCollector::new(Box::new(PerfTraceCollector::new(
                     _pt_conf,
+                    &self.addr_filters,
                 )?)));
                 #[cfg(not(collector_perf))]
                 return Err(HWTracerError::CollectorUnavailable(self.kind));
@@ -268,6 +921,22 @@ pub(crate) mod test_helpers {
         }
     }
 
+    /// Check that traces handed back to the collector have their storage reused, and that the
+    /// traces collected into it are as good as new.
+    pub fn recycled_collection(tc: TraceCollector) {
+        let first = trace_closure(&tc, || work_loop(500));
+        let buf = first.bytes().as_ptr();
+        tc.recycle_trace(first);
+        for _ in 0..10 {
+            let trace = trace_closure(&tc, || work_loop(500));
+            assert_eq!(trace.bytes().as_ptr(), buf);
+            assert_ne!(trace.len(), 0);
+            assert_eq!(&trace.bytes()[..2], &[0x02, 0x82]);
+            assert!(trace.gaps().is_empty());
+            tc.recycle_trace(trace);
+        }
+    }
+
     /// Check that repeated collection using different collectors works.
     pub fn repeated_collection_different_collectors(tcs: [TraceCollector; 10]) {
         for i in 0..10 {
@@ -318,3 +987,154 @@ pub(crate) mod test_helpers {
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::{CpuChunk, Mmap, ThreadTrace};
+    use crate::{decode::scan::PSB, Trace};
+    use std::path::PathBuf;
+
+    /// Make the trace of a CPU.
+    fn cpu_trace(bytes: Vec<u8>, gaps: Vec<usize>) -> ThreadTrace {
+        ThreadTrace {
+            pid: 0,
+            tid: 0,
+            bytes,
+            gaps,
+            mmaps: Vec::new(),
+        }
+    }
+
+    fn chunk(cpu: usize, offset: usize, size: usize, time: u64, tid: u32) -> CpuChunk {
+        CpuChunk {
+            cpu,
+            offset,
+            size,
+            time,
+            pid: 1,
+            tid,
+        }
+    }
+
+    /// Check that the traces of CPUs are pulled apart into the traces of threads, with gaps where
+    /// one part doesn't follow on from the last.
+    #[test]
+    fn split_threads() {
+        // Thread 10 runs on CPU 0 (in two parts back to back), moves to CPU 1, and then comes back
+        // to CPU 0 after thread 11 has run there.
+        let mut cpu0 = PSB.to_vec();
+        cpu0.extend([1; 8]);
+        cpu0.extend(PSB);
+        cpu0.extend([2; 8]);
+        cpu0.extend(PSB);
+        cpu0.extend([3; 8]);
+        let mut cpu1 = vec![9; 4];
+        cpu1.extend(PSB);
+        cpu1.extend([4; 8]);
+        let cpus = [cpu_trace(cpu0, vec![]), cpu_trace(cpu1, vec![24])];
+        let psb = PSB.len();
+        let chunks = vec![
+            chunk(0, 0, psb, 1, 10),
+            chunk(0, psb, 8, 2, 10),
+            chunk(1, 0, 4 + psb + 8, 3, 10),
+            chunk(0, psb + 8, psb + 8, 4, 11),
+            chunk(0, 2 * (psb + 8), psb + 8, 5, 10),
+        ];
+        let cpus = cpus.iter().map(|c| c as &dyn Trace).collect::<Vec<_>>();
+        let threads = ThreadTrace::split(&cpus, chunks);
+        assert_eq!(threads.len(), 2);
+
+        let t = &threads[0];
+        assert_eq!((t.pid(), t.tid()), (1, 10));
+        let mut expect = PSB.to_vec();
+        expect.extend([1; 8]);
+        expect.extend([9; 4]);
+        expect.extend(PSB);
+        expect.extend([4; 8]);
+        expect.extend(PSB);
+        expect.extend([3; 8]);
+        assert_eq!(t.bytes(), &expect[..]);
+        // Moving to CPU 1, the data lost there, and coming back to CPU 0.
+        assert_eq!(t.gaps(), &[psb + 8, psb + 8 + 24, 2 * psb + 20]);
+        assert!(t.is_lossy());
+
+        let t = &threads[1];
+        assert_eq!(t.tid(), 11);
+        let mut expect = PSB.to_vec();
+        expect.extend([2; 8]);
+        assert_eq!(t.bytes(), &expect[..]);
+        assert!(t.gaps().is_empty());
+    }
+
+    /// Check that each thread's trace gets the mappings of all CPUs, each placed at the first of
+    /// the thread's parts to end after the parts before the mapping on its CPU.
+    #[test]
+    fn split_mmaps() {
+        let mmap = |path: &str, trace_offset| Mmap {
+            vaddr: 0x1000,
+            len: 0x1000,
+            offset: 0,
+            path: PathBuf::from(path),
+            trace_offset,
+        };
+        let mut cpu0 = cpu_trace([PSB, PSB, PSB].concat(), vec![]);
+        cpu0.mmaps = vec![
+            mmap("/a", 0),
+            mmap("/b", PSB.len()),
+            mmap("/c", 3 * PSB.len()),
+        ];
+        let mut cpu1 = cpu_trace([PSB, PSB].concat(), vec![]);
+        cpu1.mmaps = vec![mmap("/d", PSB.len())];
+        let psb = PSB.len();
+        let chunks = vec![
+            chunk(0, 0, psb, 1, 10),
+            chunk(1, 0, psb, 2, 11),
+            chunk(0, psb, psb, 3, 11),
+            chunk(1, psb, psb, 4, 10),
+            chunk(0, 2 * psb, psb, 5, 10),
+        ];
+        let cpus = [cpu0, cpu1];
+        let cpus = cpus.iter().map(|c| c as &dyn Trace).collect::<Vec<_>>();
+        let threads = ThreadTrace::split(&cpus, chunks);
+        let placed = |t: &ThreadTrace| {
+            t.mmaps()
+                .iter()
+                .map(|m| (m.path.to_str().unwrap().to_owned(), m.trace_offset))
+                .collect::<Vec<_>>()
+        };
+        // Thread 10 runs on CPU 0 before "/b" is made, and then only after "/b" and "/d" are.
+        assert_eq!(threads[0].tid(), 10);
+        assert_eq!(
+            placed(&threads[0]),
+            [
+                ("/a".to_owned(), 0),
+                ("/b".to_owned(), psb),
+                ("/d".to_owned(), psb),
+                ("/c".to_owned(), 3 * psb),
+            ]
+        );
+        // Thread 11 may have run on CPU 1 after "/b" was made on CPU 0, but before "/d" was.
+        assert_eq!(threads[1].tid(), 11);
+        assert_eq!(
+            placed(&threads[1]),
+            [
+                ("/a".to_owned(), 0),
+                ("/b".to_owned(), 0),
+                ("/d".to_owned(), psb),
+                ("/c".to_owned(), 2 * psb),
+            ]
+        );
+    }
+
+    /// Check that a thread's trace starts at its first `PSB`.
+    #[test]
+    fn split_trims_to_psb() {
+        let mut bytes = vec![7; 5];
+        bytes.extend(PSB);
+        let cpus = [cpu_trace(bytes, vec![])];
+        let cpus = cpus.iter().map(|c| c as &dyn Trace).collect::<Vec<_>>();
+        let threads = ThreadTrace::split(&cpus, vec![chunk(0, 0, 3, 1, 5), chunk(0, 3, 18, 2, 5)]);
+        assert_eq!(threads[0].bytes(), &PSB);
+        assert!(threads[0].gaps().is_empty());
+    }
+}
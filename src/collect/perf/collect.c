@@ -22,7 +22,13 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <link.h>
 #include <intel-pt.h>
+#include <zstd.h>
 
 #include "hwtracer_private.h"
 
@@ -34,14 +40,149 @@
 
 #define AUX_BUF_WAKE_RATIO 0.5
 
+// The busy-poll and adaptive drain modes have the kernel publish new AUX data
+// (i.e. update the AUX head) sooner, so that less is left to drain at the end
+// of the session and bursts are noticed before they fill the buffer.
+#define BUSY_POLL_WAKE_RATIO 0.25
+#define ADAPTIVE_WAKE_RATIO 0.125
+
+// The busy-poll drain loop pauses for at most this many `pause` instructions
+// between looks at the buffers. The number doubles each time there's nothing
+// new, from 1.
+#define BUSY_POLL_MAX_PAUSES 1024
+// Once the backoff is at its maximum, the busy-poll loop also yields the CPU,
+// and every this many iterations checks (without blocking) whether the traced
+// thread has exited.
+#define BUSY_POLL_HUP_CHECK_SPINS 1024
+
+// In adaptive mode, new AUX data is left in the buffer until either it is
+// AUX_BUF_WAKE_RATIO full, or at the observed fill rate it would fill up
+// within this time.
+#define ADAPTIVE_HEADROOM_NSECS 10000000 // 1/100 of a second.
+// The weight given to the latest measurement in the fill rate average.
+#define ADAPTIVE_RATE_ALPHA 0.25
+
+// In zero-copy mode, AUX data stays put until the AUX buffer is this full.
+// Then it is copied out and collection continues as normal. The remaining
+// space is headroom for the hardware while we copy.
+#define ZERO_COPY_WAKE_RATIO 0.75
+
+// The packet sequence which makes up a Packet Stream Boundary (PSB) packet.
+#define PSB_PACKET_LEN 16
+static const char psb_packet[PSB_PACKET_LEN] = {
+    0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+    0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+};
+
 #ifndef INFTIM
 #define INFTIM -1
 #endif
 
+// The most events the shared drain thread will take from epoll_wait(2) at once.
+#define DRAIN_MAX_EVENTS 64
+
+// Pooled trace storage is made of chunks of this size. It's a multiple of the
+// (x86_64) huge page size, so that chunks can be backed by huge pages.
+#define STORAGE_CHUNK_SIZE (2 * 1024 * 1024)
+// The virtual address space reserved for each pooled trace, and thus the
+// largest a pooled trace can grow.
+#define STORAGE_RESERVE_SIZE (16ULL * 1024 * 1024 * 1024)
+// Free chunks beyond this many (per pool) have their memory handed back to the
+// kernel, although their memfd offsets are still reused.
+#define STORAGE_POOL_RETAIN 32
+
+// The zstd level used to compress trace data as it is drained. Negative levels
+// trade ratio for speed, and PT data compresses well even so.
+#define COMPRESS_LEVEL -1
+
 /*
  * Stores all information about the collector.
  * Exposed to Rust only as an opaque pointer.
  */
+struct hwt_perf_ctx;
+
+/*
+ * How trace storage is allocated.
+ * Must stay in sync with the Rust-side.
+ */
+enum hwt_perf_storage_kind {
+    hwt_perf_storage_heap,          // One malloc(3)'d buffer, grown by realloc(3).
+    hwt_perf_storage_pooled,        // Chunks from a pool (see `struct chunk_pool`).
+    hwt_perf_storage_pooled_huge,   // As above, but preferring huge pages.
+};
+
+/*
+ * How a collector drains its buffers.
+ * Must stay in sync with the Rust-side.
+ */
+enum hwt_perf_drain_mode {
+    hwt_perf_drain_poll,            // Block in poll(2) until the kernel wakes us.
+    hwt_perf_drain_busy_poll,       // Spin on the buffer heads, without syscalls.
+    hwt_perf_drain_adaptive,        // As poll, but batch copies by fill rate.
+};
+
+/*
+ * The AUX buffer fill rate, as tracked by the adaptive drain mode.
+ */
+struct drain_rate {
+    struct timespec     last_time;          // When we last looked at the head.
+    __u64               last_head;          // The (monotonic) AUX head back then.
+    double              bytes_per_ns;       // Moving average of the fill rate.
+};
+
+/*
+ * A process-wide pool of fixed-size trace storage chunks.
+ *
+ * Chunks are ranges of a memfd, which lets us map them side by side into a
+ * reserved virtual address range: a growing trace gets more chunks mapped
+ * after its existing ones, and its data never moves. When a trace is freed, its
+ * chunks go back to the pool for the next trace.
+ */
+struct chunk_pool {
+    pthread_mutex_t     lock;
+    bool                inited;             // Have we tried to create `fd`?
+    int                 fd;                 // The memfd, or -1.
+    int                 init_errno;         // Why creating `fd` failed.
+    unsigned int        memfd_flags;        // Extra flags for memfd_create(2).
+    off_t               size;               // Current size of `fd`.
+    off_t               *free;              // Offsets of free chunks.
+    size_t              nfree;
+    size_t              free_cap;
+};
+
+// A chunk of trace storage.
+struct storage_chunk {
+    struct chunk_pool   *pool;
+    off_t               off;
+};
+
+/*
+ * The state of pooled trace storage.
+ * Exposed to Rust only as an opaque pointer.
+ */
+struct trace_storage {
+    void                *reserve;           // Reserved range (from mmap(2)).
+    size_t              reserve_size;
+    void                *base;              // `reserve`, chunk-aligned.
+    struct chunk_pool   *pool;              // Where to get more chunks from.
+    struct storage_chunk
+                        *chunks;            // Chunks mapped from `base` onwards.
+    size_t              nchunks;
+    size_t              chunks_cap;
+};
+
+static struct chunk_pool chunk_pools[] = {
+    [hwt_perf_storage_pooled] = {
+        .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .memfd_flags = 0,
+    },
+#ifdef MFD_HUGETLB
+    [hwt_perf_storage_pooled_huge] = {
+        .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1,
+        .memfd_flags = MFD_HUGETLB,
+    },
+#endif
+};
+
 struct hwt_perf_ctx {
     pthread_t           collector_thread;   // Collector thread handle.
     struct hwt_cerror   collector_thread_err;  // Errors from inside the tracer thread.
@@ -51,8 +192,58 @@ struct hwt_perf_ctx {
     size_t              aux_bufsize;        // The size of the AUX buffer's mmap(2).
     void                *base_buf;          // Ptr to the start of the base buffer.
     size_t              base_bufsize;       // The size the base buffer's mmap(2).
+    struct hwt_perf_trace
+                        *trace;             // The trace of the current session.
+    uint64_t            sessions;           // Completed tracing sessions.
+    bool                shared_drain;       // Use the shared drain thread?
+    pthread_mutex_t     drain_lock;         // Held while draining (shared mode).
+    void                *data_tmp;          // Sample scratch space (shared mode).
+    ssize_t             drain_slot;         // Index into `drain_slots`, or -1.
+    bool                drain_failed;       // Shared drain thread gave up on us.
+    bool                zero_copy;          // Leave trace data in the AUX buffer?
+    bool                flight_recorder;    // AUX buffer in overwrite mode?
+    bool                lossy;              // Record gaps rather than failing?
+    enum hwt_perf_drain_mode
+                        drain_mode;         // How the buffers are drained.
+    struct drain_rate   drain_rate;         // For the adaptive drain mode.
+    atomic_bool         stop_requested;     // Tells a busy-polling thread to stop.
+    __u64               open_retries;       // EBUSY retries opening `perf_fd`.
+    int                 cpu;                // The CPU traced, or -1 if just the
+                                            // calling thread.
+    atomic_int          refs;               // References from Rust and from traces.
+    ZSTD_CCtx           *zcctx;             // If non-NULL, compress drained data.
+};
+
+/*
+ * A registration with the shared drain thread.
+ *
+ * The epoll(7) data of a registered context is its slot index and generation,
+ * rather than a pointer, so that an event which is already in flight when a
+ * context is deregistered (and possibly freed) can be recognised as stale.
+ */
+struct drain_slot {
+    struct hwt_perf_ctx *ctx;               // NULL if the slot is free.
+    uint32_t            gen;                // Bumped each time the slot is used.
 };
 
+// State of the shared drain thread. `drain_slots_lock` protects the slots and
+// must be taken before any context's `drain_lock`.
+static pthread_once_t drain_once = PTHREAD_ONCE_INIT;
+static int drain_epoll_fd = -1;
+static int drain_init_errno = 0;
+static pthread_mutex_t drain_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct drain_slot *drain_slots = NULL;
+static size_t drain_nslots = 0;
+
+// Set if we ever see a reused context fail to emit a PSB+ when re-enabled.
+// Once set, no more contexts are reused.
+static atomic_bool reuse_lacks_psb = false;
+
+// The perf "type" for Intel PT, read from sysfs once per process.
+static pthread_once_t pt_type_once = PTHREAD_ONCE_INIT;
+static int pt_type = -1;
+static int pt_type_errno = 0;
+
 /*
  * Passed from Rust to C to configure tracing.
  * Must stay in sync with the Rust-side.
@@ -60,8 +251,41 @@ struct hwt_perf_ctx {
 struct hwt_perf_collector_config {
     size_t      data_bufsize;          // Data buf size (in pages).
     size_t      aux_bufsize;           // AUX buf size (in pages).
+    size_t      min_aux_bufsize;       // Smallest AUX buf size to fall back to.
     size_t      initial_trace_bufsize; // Initial capacity (in bytes) of a
                                        // trace storage buffer.
+    bool        reuse_ctx;             // Reuse contexts between sessions.
+    bool        shared_drain;          // Use the shared drain thread.
+    bool        zero_copy;             // Leave trace data in the AUX buffer.
+    enum hwt_perf_storage_kind
+                storage;               // How to allocate trace storage.
+    bool        flight_recorder;       // Keep only the most recent trace data.
+    bool        lossy;                 // Tolerate lost trace data.
+    enum hwt_perf_drain_mode
+                drain_mode;            // How to drain the buffers.
+    bool        compress;              // Compress trace data as it's drained.
+    bool        record_mmaps;          // Keep the executable mappings made.
+    __u64       pt_config;             // attr.config for the Intel PT event.
+};
+
+/*
+ * Statistics about the collection of a trace.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct hwt_perf_collection_stats {
+    __u64 bytes_drained;            // Bytes copied out of the AUX buffer.
+    __u64 wakeups;                  // Times the buffers were drained.
+    __u64 aux_records;              // PERF_RECORD_AUX records seen.
+    __u64 reallocs;                 // Times the trace storage grew.
+    __u64 realloc_bytes_moved;      // Bytes copied by realloc(3) as it grew.
+    __u64 max_aux_fill;             // Most bytes ever waiting in the AUX buffer.
+    __u64 memcpy_ns;                // Time spent copying out of the AUX buffer.
+    __u64 open_retries;             // EBUSY retries opening the perf event.
+    __u64 stop_ns;                  // Time taken to stop collection.
+    __u64 aux_bufsize;              // The size of the AUX buffer used.
+    __u64 bytes_before_psb;         // Bytes lost because a reused context's
+                                    // trace didn't start with a PSB.
 };
 
 /*
@@ -82,6 +306,77 @@ struct hwt_perf_trace {
     struct hwt_perf_trace_buf buf;
     __u64 len;
     __u64 capacity;
+    struct hwt_perf_ctx *aux_ctx;   // If non-NULL, `buf` points into the AUX
+                                    // buffer of this context.
+    __u64 aux_start;                // AUX head when the session started.
+    bool zero_copy;                 // Data still left in the AUX buffer?
+    struct trace_storage *storage;  // Pooled storage, or NULL if `buf` is from
+                                    // malloc(3) (or the AUX buffer).
+    bool lossy;                     // Record gaps rather than failing?
+    int reenable_fd;                // If not -1, the perf fd to re-enable
+                                    // after a loss. See reenable_after_loss().
+    size_t *gaps;                   // Offsets at which trace data was lost.
+    size_t ngaps;
+    size_t gaps_cap;
+    struct hwt_perf_collection_stats stats;
+    int sink_fd;                    // If not -1, the trace is streamed into
+                                    // this file rather than into `buf`.
+    int sink_pipe[2];               // For splicing into `sink_fd`, or -1s.
+    void *sink_map;                 // The mapping of the finished sink file,
+    __u64 sink_map_len;             // which `buf` points into, or NULL.
+    __u64 published_len;            // Bytes of `buf` which may be read (after
+                                    // an acquire load of this) while the
+                                    // session goes on. See read_aux().
+    ZSTD_CCtx *zcctx;               // If non-NULL, compress data as it's
+                                    // drained, using this. See compress_aux().
+    bool compressed;                // Is `buf` a series of compressed chunks?
+    __u64 raw_len;                  // If so, the length of the uncompressed data.
+    bool per_cpu;                   // Note which thread wrote each part?
+    struct hwt_perf_aux_chunk *chunks;  // The parts, if so (see record_chunk()).
+    size_t nchunks;
+    size_t chunks_cap;
+    struct hwt_perf_mmap *mmaps;    // Executable file mappings made while
+    size_t nmmaps;                  // collecting (see record_mmap()), in
+    size_t mmaps_cap;               // order.
+};
+
+/*
+ * An executable file mapping, from a PERF_RECORD_MMAP2 record.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct hwt_perf_mmap {
+    __u64 addr;
+    __u64 len;
+    __u64 pgoff;                    // The offset into `filename` mapped.
+    char *filename;                 // malloc(3)d.
+    __u64 trace_off;                // How far into the (uncompressed) trace
+                                    // the mapping was made, at the earliest.
+};
+
+/*
+ * A part of a per-CPU trace which was written while one thread was running.
+ * See hwt_perf_init_cpu_collector().
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct hwt_perf_aux_chunk {
+    __u64 offset;                   // Where in the trace the part starts.
+    __u64 size;
+    __u64 time;                     // When the part ended (perf clock).
+    __u32 pid;
+    __u32 tid;
+};
+
+/*
+ * The header of each chunk of a compressed trace, which is followed by one
+ * zstd frame holding `raw_len` bytes of trace.
+ *
+ * Shared with Rust code. Must stay in sync.
+ */
+struct compressed_chunk {
+    __u64 raw_len;
+    __u64 compressed_len;
 };
 
 /*
@@ -97,6 +392,10 @@ struct collector_thread_args {
     struct perf_event_mmap_page
                         *base_header;       // Pointer to the header in the base buffer.
     struct hwt_cerror   *err;               // Errors generated inside the thread.
+    enum hwt_perf_drain_mode
+                        drain_mode;         // How to drain the buffers.
+    struct drain_rate   *rate;              // Fill rate (adaptive mode), or NULL.
+    atomic_bool         *stop_requested;    // Set to stop busy-polling.
 };
 
 // A data buffer sample indicating that new data is available in the AUX
@@ -108,7 +407,35 @@ struct perf_record_aux_sample {
     __u64    aux_size;
     __u64    flags;
     // ...
-    // More variable-sized data follows, but we don't use it.
+    // More variable-sized data follows. Only per-CPU events use it: see
+    // struct perf_sample_id.
+};
+
+// A PERF_RECORD_MMAP2 record. As with `struct perf_record_aux_sample`, we
+// have to define this ourselves.
+struct perf_record_mmap2 {
+    struct perf_event_header header;
+    __u32    pid;
+    __u32    tid;
+    __u64    addr;
+    __u64    len;
+    __u64    pgoff;
+    __u32    maj;                   // Or a build ID, which we don't ask for.
+    __u32    min;
+    __u64    ino;
+    __u64    ino_generation;
+    __u32    prot;
+    __u32    flags;
+    char     filename[];            // NUL-terminated and padded.
+    // A `struct perf_sample_id` may follow.
+};
+
+// The `sample_id` which ends every record other than a sample, given the
+// `sample_type` that open_perf() gives per-CPU events.
+struct perf_sample_id {
+    __u32    pid;
+    __u32    tid;
+    __u64    time;
 };
 
 // The format of the data returned by read(2) on a Perf file descriptor.
@@ -120,19 +447,85 @@ struct read_format {
 
 // Private prototypes.
 static bool handle_sample(void *, struct perf_event_mmap_page *, struct
-                          hwt_perf_trace *, void *, struct hwt_cerror *);
+                          hwt_perf_trace *, void *, struct drain_rate *,
+                          struct hwt_cerror *);
 static bool read_aux(void *, struct perf_event_mmap_page *,
                      struct hwt_perf_trace *, struct hwt_cerror *);
+static bool drain_due(struct drain_rate *, struct perf_event_mmap_page *);
+static bool reenable_after_loss(struct hwt_perf_trace *, struct hwt_cerror *);
+static bool drain_final(void *, struct perf_event_mmap_page *,
+                        struct hwt_perf_trace *, void *, struct hwt_cerror *);
 static bool poll_loop(int, int, struct perf_event_mmap_page *, void *,
-                      struct hwt_perf_trace *, struct hwt_cerror *);
+                      struct hwt_perf_trace *, struct drain_rate *,
+                      struct hwt_cerror *);
+static bool busy_poll_loop(int, int, atomic_bool *,
+                           struct perf_event_mmap_page *, void *,
+                           struct hwt_perf_trace *, struct hwt_cerror *);
 static void *collector_thread(void *);
-static int open_perf(size_t, struct hwt_cerror *);
+static void drain_init(void);
+static void *drain_thread(void *);
+static bool drain_register(struct hwt_perf_ctx *, struct hwt_cerror *);
+static void drain_deregister(struct hwt_perf_ctx *);
+static bool start_shared(struct hwt_perf_ctx *, struct hwt_perf_trace *,
+                         struct hwt_cerror *);
+static bool stop_shared(struct hwt_perf_ctx *, struct hwt_cerror *);
+static void begin_session(struct hwt_perf_ctx *, struct hwt_perf_trace *);
+static bool finish_zero_copy(struct hwt_perf_ctx *, struct hwt_cerror *);
+static bool trace_grow(struct hwt_perf_trace *, __u64, struct hwt_cerror *);
+static void trace_free_buf(struct hwt_perf_trace *);
+static bool sink_write(struct hwt_perf_trace *, void *, size_t,
+                       struct hwt_cerror *);
+static void sink_close(struct hwt_perf_trace *);
+static bool finish_sink(struct hwt_perf_trace *, struct hwt_cerror *);
+static bool pool_get(struct chunk_pool *, off_t *, struct hwt_cerror *);
+static void pool_put(struct chunk_pool *, off_t);
+static bool storage_add_chunk(struct trace_storage *, struct hwt_cerror *);
+static void storage_free(struct trace_storage *);
+static void release_aux_trace(struct hwt_perf_trace *);
+static bool record_gap(struct hwt_perf_trace *, struct hwt_cerror *);
+static bool grow_gaps(struct hwt_perf_trace *, struct hwt_cerror *);
+static bool record_chunk(struct hwt_perf_trace *,
+                         struct perf_record_aux_sample *, struct hwt_cerror *);
+static bool record_mmap(struct hwt_perf_trace *, struct perf_record_mmap2 *,
+                        struct perf_event_mmap_page *, __u64,
+                        struct hwt_cerror *);
+static void free_mmaps(struct hwt_perf_trace *);
+static bool compress_aux(struct hwt_perf_trace *, void *, size_t, void *,
+                         size_t, struct hwt_cerror *);
+static bool snapshot_aux(struct hwt_perf_ctx *, struct hwt_perf_trace *,
+                         struct hwt_cerror *);
+static void read_pt_type(void);
+static int open_perf(struct hwt_perf_collector_config *, int, __u64 *,
+                     struct hwt_cerror *);
+static __u64 elapsed_ns(const struct timespec *);
+static bool trim_to_psb(struct hwt_perf_trace *, bool, struct hwt_cerror *);
+static bool open_buffers(struct hwt_perf_ctx *, struct hwt_perf_collector_config *,
+                         const char *, struct hwt_cerror *);
+static void close_buffers(struct hwt_perf_ctx *);
+static struct hwt_perf_ctx *init_collector(struct hwt_perf_collector_config *,
+                                           const char *, int,
+                                           struct hwt_cerror *);
 
 // Exposed Prototypes.
-struct hwt_perf_ctx *hwt_perf_init_collector(struct hwt_perf_collector_config *, struct hwt_cerror *);
+struct hwt_perf_ctx *hwt_perf_init_collector(struct hwt_perf_collector_config *,
+                                             const char *, struct hwt_cerror *);
+struct hwt_perf_ctx *hwt_perf_init_cpu_collector(struct hwt_perf_collector_config *,
+                                                 const char *, int,
+                                                 struct hwt_cerror *);
 bool hwt_perf_start_collector(struct hwt_perf_ctx *, struct hwt_perf_trace *, struct hwt_cerror *);
 bool hwt_perf_stop_collector(struct hwt_perf_ctx *tr_ctx, struct hwt_cerror *);
+bool hwt_perf_snapshot_collector(struct hwt_perf_ctx *, struct hwt_perf_trace *,
+                                 struct hwt_cerror *);
 bool hwt_perf_free_collector(struct hwt_perf_ctx *tr_ctx, struct hwt_cerror *);
+bool hwt_perf_ctx_reusable(struct hwt_perf_ctx *);
+bool hwt_perf_ctx_busy(struct hwt_perf_ctx *);
+size_t hwt_perf_ctx_aux_bufsize(struct hwt_perf_ctx *);
+bool hwt_perf_init_trace(struct hwt_perf_trace *, size_t,
+                         enum hwt_perf_storage_kind, const char *,
+                         struct hwt_cerror *);
+bool hwt_perf_reset_trace(struct hwt_perf_trace *);
+void hwt_perf_free_trace(struct hwt_perf_trace *);
+bool hwt_perf_symbol_range(const char *, uintptr_t *, size_t *);
 
 
 /*
@@ -140,12 +533,15 @@ bool hwt_perf_free_collector(struct hwt_perf_ctx *tr_ctx, struct hwt_cerror *);
  * from the Perf data buffer and an action is invoked for each depending its
  * type.
  *
+ * If `rate` isn't NULL, new AUX data is only copied out once drain_due() says
+ * so.
+ *
  * Returns true on success, or false otherwise.
  */
 static bool
 handle_sample(void *aux_buf, struct perf_event_mmap_page *hdr,
               struct hwt_perf_trace *trace, void *data_tmp,
-              struct hwt_cerror *err)
+              struct drain_rate *rate, struct hwt_cerror *err)
 {
     // We need to use atomics with orderings to protect against 2 cases.
     //
@@ -185,7 +581,12 @@ handle_sample(void *aux_buf, struct perf_event_mmap_page *hdr,
         data_tmp_end += head;
     }
     atomic_store_explicit((_Atomic __u64 *) &hdr->data_tail, head, memory_order_relaxed);
+    trace->stats.wakeups++;
 
+    // Where the AUX data reported so far ends. The hardware wrote it all
+    // before any record following its AUX record was made.
+    __u64 aux_end = atomic_load_explicit((_Atomic __u64 *) &hdr->aux_tail,
+                                         memory_order_relaxed);
     void *next_sample = data_tmp;
     while (next_sample != data_tmp_end) {
         struct perf_event_header *sample_hdr = next_sample;
@@ -194,20 +595,58 @@ handle_sample(void *aux_buf, struct perf_event_mmap_page *hdr,
         case PERF_RECORD_AUX:
                 // Data was written to the AUX buffer.
                 rec_aux_sample = next_sample;
+                trace->stats.aux_records++;
+                aux_end = rec_aux_sample->aux_offset + rec_aux_sample->aux_size;
+                if (trace->per_cpu && !record_chunk(trace, rec_aux_sample, err)) {
+                    return false;
+                }
                 // Check that the data written into the AUX buffer was not
                 // truncated. If it was, then we didn't read out of the data buffer
                 // quickly/frequently enough.
                 if (rec_aux_sample->flags & PERF_AUX_FLAG_TRUNCATED) {
-                    hwt_set_cerr(err, hwt_cerror_ipt, pte_overflow);
-                    return false;
+                    if (!trace->lossy) {
+                        hwt_set_cerr(err, hwt_cerror_ipt, pte_overflow);
+                        return false;
+                    }
+                    // Keep what we did get, and note that more is missing
+                    // after it. This needs an accurate `trace->len`, so the
+                    // data can't be left in the AUX buffer.
+                    trace->zero_copy = false;
+                    if ((!read_aux(aux_buf, hdr, trace, err)) ||
+                        (!record_gap(trace, err)) ||
+                        (!reenable_after_loss(trace, err)))
+                    {
+                        return false;
+                    }
+                    break;
+                }
+                if ((rate != NULL) && (!drain_due(rate, hdr))) {
+                    break;
                 }
                 if (read_aux(aux_buf, hdr, trace, err) == false) {
                     return false;
                 }
                 break;
             case PERF_RECORD_LOST:
-                hwt_set_cerr(err, hwt_cerror_ipt, pte_overflow);
-                return false;
+                // We may have missed a truncation, so the trace has to be
+                // assumed to have a hole in it.
+                if (!trace->lossy) {
+                    hwt_set_cerr(err, hwt_cerror_ipt, pte_overflow);
+                    return false;
+                }
+                trace->zero_copy = false;
+                if ((!read_aux(aux_buf, hdr, trace, err)) ||
+                    (!record_gap(trace, err)) ||
+                    (!reenable_after_loss(trace, err)))
+                {
+                    return false;
+                }
+                break;
+            case PERF_RECORD_MMAP2:
+                // Code was mapped (only asked for if `record_mmaps` is set).
+                if (!record_mmap(trace, next_sample, hdr, aux_end, err)) {
+                    return false;
+                }
                 break;
             case PERF_RECORD_LOST_SAMPLES:
                 // Shouldn't happen with PT.
@@ -220,6 +659,37 @@ handle_sample(void *aux_buf, struct perf_event_mmap_page *hdr,
     return true;
 }
 
+/*
+ * The kernel disables the event when AUX data is lost, so that whoever drains
+ * it can notice. In lossy mode, once the loss is recorded (and the AUX buffer
+ * emptied), we turn it back on so that the rest of the session is traced.
+ *
+ * hwt_perf_stop_collector() sets `trace->reenable_fd` to -1 before disabling
+ * the event for good, and if that happens at the same time as we re-enable
+ * it, we see it afterwards and undo our re-enabling.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+reenable_after_loss(struct hwt_perf_trace *trace, struct hwt_cerror *err)
+{
+    int fd = atomic_load((_Atomic int *) &trace->reenable_fd);
+    if (fd == -1) {
+        return true; // The session is being stopped.
+    }
+    if (ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        return false;
+    }
+    if ((atomic_load((_Atomic int *) &trace->reenable_fd) == -1) &&
+        (ioctl(fd, PERF_EVENT_IOC_DISABLE, 0) < 0))
+    {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        return false;
+    }
+    return true;
+}
+
 /*
  * Read data out of the AUX buffer.
  *
@@ -230,66 +700,205 @@ read_aux(void *aux_buf, struct perf_event_mmap_page *hdr,
          struct hwt_perf_trace *trace, struct hwt_cerror *err)
 {
     // Use of atomics here for the same reasons as for handle_sample().
-    __u64 head_monotonic =
-            atomic_load_explicit((_Atomic __u64 *) &hdr->aux_head,
-                                 memory_order_acquire);
+    //
+    // Unlike the data buffer's, the AUX buffer's head and tail are both kept
+    // monotonic: the kernel compares them unwrapped to decide if there's room
+    // for more data, so they are only wrapped to index into `aux_buf`.
+    __u64 head = atomic_load_explicit((_Atomic __u64 *) &hdr->aux_head,
+                                      memory_order_acquire);
     __u64 size = hdr->aux_size; // No atomic load. Constant value.
-    __u64 head = head_monotonic % size; // Head must be manually wrapped.
     __u64 tail = atomic_load_explicit((_Atomic __u64 *) &hdr->aux_tail,
-                                 memory_order_relaxed);
+                                      memory_order_relaxed);
 
-    // Figure out how much more space we need in the trace storage buffer.
-    __u64 new_data_size;
-    if (tail <= head) {
-        // No wrap-around.
-        new_data_size = head - tail;
-    } else {
-        // Wrap-around.
-        new_data_size = (size - tail) + head;
+    // In zero-copy mode, leave the data where it is for as long as there's
+    // room for the hardware to keep writing. Once there isn't, we copy out
+    // everything collected so far (the tail hasn't moved since the session
+    // started) and carry on as normal.
+    if (trace->zero_copy) {
+        if (head - trace->aux_start < size * ZERO_COPY_WAKE_RATIO) {
+            return true;
+        }
+        trace->zero_copy = false;
     }
 
-    // Reallocate the trace storage buffer if more space is required.
-    __u64 required_capacity = trace->len + new_data_size;
-    if (required_capacity > trace->capacity) {
-        // Over-allocate to 2x what we need, checking that the result fits in
-        // the size_t argument of realloc(3).
-        if (required_capacity >= SIZE_MAX / 2) {
-            // We would overflow the size_t argument of realloc(3).
-            hwt_set_cerr(err, hwt_cerror_errno, ENOMEM);
+    // Figure out how much more space we need in the trace storage buffer, and
+    // where the new data is. It may wrap around the end of the AUX buffer.
+    __u64 new_data_size = head - tail;
+    if (new_data_size > trace->stats.max_aux_fill) {
+        trace->stats.max_aux_fill = new_data_size;
+    }
+    __u64 off = tail % size;
+    __u64 len1 = (off + new_data_size > size) ? size - off : new_data_size;
+    __u64 len2 = new_data_size - len1;
+
+    struct timespec copy_start;
+    clock_gettime(CLOCK_MONOTONIC, &copy_start);
+
+    // Stream the data straight out of the AUX buffer into the sink file.
+    if (trace->sink_fd != -1) {
+        if ((!sink_write(trace, aux_buf + off, len1, err)) ||
+            (!sink_write(trace, aux_buf, len2, err)))
+        {
             return false;
         }
-        size_t new_capacity = required_capacity * 2;
-        void *new_buf = realloc(trace->buf.p, new_capacity);
-        if (new_buf == NULL) {
-            hwt_set_cerr(err, hwt_cerror_errno, errno);
+        trace->capacity = trace->len;
+        trace->stats.memcpy_ns += elapsed_ns(&copy_start);
+        trace->stats.bytes_drained += new_data_size;
+        atomic_store_explicit((_Atomic __u64 *) &hdr->aux_tail, head, memory_order_release);
+        return true;
+    }
+
+    if (trace->zcctx != NULL) {
+        if (!compress_aux(trace, aux_buf + off, len1, aux_buf, len2, err)) {
             return false;
         }
-        trace->capacity = new_capacity;
-        trace->buf.p = new_buf;
+        trace->stats.memcpy_ns += elapsed_ns(&copy_start);
+        trace->stats.bytes_drained += new_data_size;
+        atomic_store_explicit((_Atomic __u64 *) &hdr->aux_tail, head, memory_order_release);
+        return true;
     }
 
-    // Finally append the new AUX data to the end of the trace storage buffer.
-    if (tail <= head) {
-        memcpy(trace->buf.p + trace->len, aux_buf + tail, head - tail);
-        trace->len += head - tail;
-    } else {
-        memcpy(trace->buf.p + trace->len, aux_buf + tail, size - tail);
-        trace->len += size - tail;
-        memcpy(trace->buf.p + trace->len, aux_buf, head);
-        trace->len += size + head;
+    // Grow the trace storage buffer if more space is required.
+    __u64 required_capacity = trace->len + new_data_size;
+    if ((required_capacity > trace->capacity) &&
+        (!trace_grow(trace, required_capacity, err)))
+    {
+        return false;
     }
+
+    // Finally append the new AUX data to the end of the trace storage buffer.
+    memcpy(trace->buf.p + trace->len, aux_buf + off, len1);
+    memcpy(trace->buf.p + trace->len + len1, aux_buf, len2);
+    trace->len += new_data_size;
+    trace->stats.memcpy_ns += elapsed_ns(&copy_start);
+    trace->stats.bytes_drained += new_data_size;
     atomic_store_explicit((_Atomic __u64 *) &hdr->aux_tail, head, memory_order_release);
+
+    // Let the trace be read as it grows, so that it can be decoded while the
+    // session goes on. That's only safe if its data never moves (as pooled
+    // storage's doesn't), and while the (reallocated) gap list is empty.
+    if ((trace->storage != NULL) && (trace->ngaps == 0)) {
+        atomic_store_explicit((_Atomic __u64 *) &trace->published_len,
+                              trace->len, memory_order_release);
+    }
+    return true;
+}
+
+/*
+ * Compress `len` bytes from `buf`, followed by `len2` bytes from `buf2`, both
+ * in the AUX buffer, onto the end of `trace` as one chunk.
+ *
+ * The data of each drain is a frame of its own, so that the trace can be
+ * decompressed chunk by chunk. The drain thread is mostly idle between
+ * wakeups, so the compression itself costs the traced thread nothing.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+compress_aux(struct hwt_perf_trace *trace, void *buf, size_t len, void *buf2,
+             size_t len2, struct hwt_cerror *err)
+{
+    struct compressed_chunk chunk = { .raw_len = len + len2 };
+    size_t bound = ZSTD_compressBound(len + len2);
+    __u64 required_capacity = trace->len + sizeof(chunk) + bound;
+    if ((required_capacity > trace->capacity) &&
+        (!trace_grow(trace, required_capacity, err)))
+    {
+        return false;
+    }
+
+    ZSTD_CCtx_reset(trace->zcctx, ZSTD_reset_session_only);
+    ZSTD_outBuffer out = { trace->buf.p + trace->len + sizeof(chunk), bound, 0 };
+    ZSTD_inBuffer in[2] = { { buf, len, 0 }, { buf2, len2, 0 } };
+    for (int i = 0; i < 2; i++) {
+        // The output has room for the worst case, so the input is always all
+        // taken, and the frame always ended, in one go. But zstd only
+        // promises that when we ask again until it says it's done.
+        ZSTD_EndDirective mode = (i == 1) ? ZSTD_e_end : ZSTD_e_continue;
+        size_t rem;
+        do {
+            rem = ZSTD_compressStream2(trace->zcctx, &out, &in[i], mode);
+            if (ZSTD_isError(rem)) {
+                hwt_set_cerr(err, hwt_cerror_unknown, 0);
+                return false;
+            }
+        } while ((mode == ZSTD_e_end) ? (rem != 0) : (in[i].pos < in[i].size));
+    }
+
+    chunk.compressed_len = out.pos;
+    memcpy(trace->buf.p + trace->len, &chunk, sizeof(chunk));
+    trace->len += sizeof(chunk) + out.pos;
+    trace->raw_len += chunk.raw_len;
     return true;
 }
 
+/*
+ * Decide whether the new data in the AUX buffer should be copied out now, or
+ * left to accumulate (saving on copies and trace buffer growth), updating our
+ * estimate of the fill rate as we go.
+ *
+ * Used by the adaptive drain mode.
+ */
+static bool
+drain_due(struct drain_rate *rate, struct perf_event_mmap_page *hdr)
+{
+    __u64 head_monotonic =
+            atomic_load_explicit((_Atomic __u64 *) &hdr->aux_head,
+                                 memory_order_acquire);
+    __u64 size = hdr->aux_size; // No atomic load. Constant value.
+    // Both monotonic (see read_aux()).
+    __u64 tail = atomic_load_explicit((_Atomic __u64 *) &hdr->aux_tail,
+                                      memory_order_relaxed);
+    __u64 used = head_monotonic - tail;
+
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == 0) {
+        double nsecs = (double) (now.tv_sec - rate->last_time.tv_sec) * 1e9 +
+            (double) (now.tv_nsec - rate->last_time.tv_nsec);
+        if (nsecs > 0) {
+            double latest = (double) (head_monotonic - rate->last_head) / nsecs;
+            rate->bytes_per_ns = ADAPTIVE_RATE_ALPHA * latest +
+                (1 - ADAPTIVE_RATE_ALPHA) * rate->bytes_per_ns;
+        }
+        rate->last_time = now;
+        rate->last_head = head_monotonic;
+    }
+
+    if (used >= size * AUX_BUF_WAKE_RATIO) {
+        return true;
+    }
+    return (double) (size - used) < rate->bytes_per_ns * ADAPTIVE_HEADROOM_NSECS;
+}
+
+/*
+ * Drain whatever is left in the buffers once the tracing hardware has been
+ * disabled.
+ *
+ * Returns true on success and false otherwise.
+ */
+static bool
+drain_final(void *aux_buf, struct perf_event_mmap_page *hdr,
+            struct hwt_perf_trace *trace, void *data_tmp,
+            struct hwt_cerror *err)
+{
+    // AUX data that was left in the buffer for later (see drain_due()), or
+    // that a busy-polling thread hasn't seen a record for yet, may never be
+    // announced by another PERF_RECORD_AUX, so read the AUX buffer regardless.
+    return handle_sample(aux_buf, hdr, trace, data_tmp, NULL, err) &&
+        read_aux(aux_buf, hdr, trace, err);
+}
+
 /*
  * Take trace data out of the AUX buffer.
  *
+ * `rate` is as for handle_sample().
+ *
  * Returns true on success and false otherwise.
  */
 static bool
 poll_loop(int perf_fd, int stop_fd, struct perf_event_mmap_page *mmap_hdr,
-          void *aux, struct hwt_perf_trace *trace, struct hwt_cerror *err)
+          void *aux, struct hwt_perf_trace *trace, struct drain_rate *rate,
+          struct hwt_cerror *err)
 {
     int n_events = 0;
     bool ret = true;
@@ -329,12 +938,13 @@ poll_loop(int perf_fd, int stop_fd, struct perf_event_mmap_page *mmap_hdr,
                 }
             }
 
-            if (!handle_sample(aux, mmap_hdr, trace, data_tmp, err)) {
-                ret = false;
+            if (pfds[1].revents & POLLHUP) {
+                ret = drain_final(aux, mmap_hdr, trace, data_tmp, err);
                 break;
             }
 
-            if (pfds[1].revents & POLLHUP) {
+            if (!handle_sample(aux, mmap_hdr, trace, data_tmp, rate, err)) {
+                ret = false;
                 break;
             }
         }
@@ -354,12 +964,139 @@ done:
 }
 
 /*
- * Opens the perf file descriptor and returns it.
+ * As poll_loop(), but spinning on the buffer heads instead of waiting for the
+ * kernel to wake us up. This occupies a CPU, but involves no syscalls while
+ * there's data arriving, and the end of the session (signalled by
+ * `stop_requested`) is noticed, and the final data drained, straight away.
+ *
+ * Returns true on success and false otherwise.
+ */
+static bool
+busy_poll_loop(int perf_fd, int stop_fd, atomic_bool *stop_requested,
+               struct perf_event_mmap_page *mmap_hdr, void *aux,
+               struct hwt_perf_trace *trace, struct hwt_cerror *err)
+{
+    bool ret = true;
+    struct pollfd pfds[2] = {
+        {perf_fd,   POLLHUP,    0},
+        {stop_fd,   POLLHUP,    0}
+    };
+
+    // Temporary space for new samples in the data buffer.
+    void *data_tmp = malloc(mmap_hdr->data_size);
+    if (data_tmp == NULL) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        return false;
+    }
+
+    // The sizes are constant and the tails are only written by us.
+    //
+    // New AUX data is spotted by the head moving, rather than by it being
+    // ahead of the tail: in zero-copy mode, read_aux() leaves the tail where it
+    // is for as long as it can, and we mustn't spin on data we've already
+    // seen.
+    __u64 data_size = mmap_hdr->data_size;
+    __u64 last_aux_head = trace->aux_start;
+    size_t pauses = 1, spins = 0;
+    while (!atomic_load_explicit(stop_requested, memory_order_acquire)) {
+        __u64 data_head =
+            atomic_load_explicit((_Atomic __u64 *) &mmap_hdr->data_head,
+                                 memory_order_acquire) % data_size;
+        __u64 aux_head =
+            atomic_load_explicit((_Atomic __u64 *) &mmap_hdr->aux_head,
+                                 memory_order_relaxed);
+        if ((data_head != mmap_hdr->data_tail) || (aux_head != last_aux_head)) {
+            last_aux_head = aux_head;
+            if (!drain_final(aux, mmap_hdr, trace, data_tmp, err)) {
+                ret = false;
+                goto done;
+            }
+            pauses = 1;
+            spins = 0;
+            continue;
+        }
+
+        // Nothing new. Back off.
+        for (size_t i = 0; i < pauses; i++) {
+            __builtin_ia32_pause();
+        }
+        if (pauses < BUSY_POLL_MAX_PAUSES) {
+            pauses *= 2;
+            continue;
+        }
+        sched_yield();
+        if (++spins < BUSY_POLL_HUP_CHECK_SPINS) {
+            continue;
+        }
+        spins = 0;
+        if (poll(pfds, 2, 0) == -1) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            ret = false;
+            goto done;
+        }
+        // The traced thread exited, or we were stopped without
+        // `stop_requested` being set (which shouldn't happen).
+        if ((pfds[0].revents & POLLHUP) || (pfds[1].revents & POLLHUP)) {
+            break;
+        }
+    }
+
+    ret = drain_final(aux, mmap_hdr, trace, data_tmp, err);
+
+done:
+    free(data_tmp);
+    return ret;
+}
+
+/*
+ * Reads the perf "type" for Intel PT from sysfs into `pt_type`.
+ *
+ * Called once via pthread_once(3). On failure `pt_type` is left as -1 and
+ * `pt_type_errno` records why.
+ */
+static void
+read_pt_type(void)
+{
+    FILE *pt_type_file = fopen(SYSFS_PT_TYPE, "r");
+    if (pt_type_file == NULL) {
+        pt_type_errno = errno;
+        return;
+    }
+    char pt_type_str[MAX_PT_TYPE_STR];
+    if (fgets(pt_type_str, sizeof(pt_type_str), pt_type_file) == NULL) {
+        pt_type_errno = errno;
+    } else {
+        pt_type = atoi(pt_type_str);
+    }
+    fclose(pt_type_file);
+}
+
+/*
+ * Returns the number of nanoseconds since `since` (by CLOCK_MONOTONIC), or 0
+ * if the clock can't be read.
+ */
+static __u64
+elapsed_ns(const struct timespec *since)
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        return 0;
+    }
+    return (now.tv_sec - since->tv_sec) * 1000000000ULL + now.tv_nsec - since->tv_nsec;
+}
+
+/*
+ * Opens the perf file descriptor and returns it. The number of times we had
+ * to retry because the device was busy is stored in `retries`.
+ *
+ * The event traces the calling thread. If `cpu` isn't -1, it traces it (and
+ * any threads it goes on to create) only while running on that CPU.
  *
  * Returns a file descriptor, or -1 on error.
  */
 static int
-open_perf(size_t aux_bufsize, struct hwt_cerror *err) {
+open_perf(struct hwt_perf_collector_config *tr_conf, int cpu, __u64 *retries,
+          struct hwt_cerror *err) {
     struct perf_event_attr attr;
     memset(&attr, 0, sizeof(attr));
     attr.size = sizeof(attr);
@@ -368,19 +1105,16 @@ open_perf(size_t aux_bufsize, struct hwt_cerror *err) {
     int ret = -1;
 
     // Get the perf "type" for Intel PT.
-    FILE *pt_type_file = fopen(SYSFS_PT_TYPE, "r");
-    if (pt_type_file == NULL) {
-        hwt_set_cerr(err, hwt_cerror_errno, errno);
-        ret = -1;
-        goto clean;
+    if (pthread_once(&pt_type_once, read_pt_type) != 0) {
+        hwt_set_cerr(err, hwt_cerror_unknown, 0);
+        return -1;
     }
-    char pt_type_str[MAX_PT_TYPE_STR];
-    if (fgets(pt_type_str, sizeof(pt_type_str), pt_type_file) == NULL) {
-        hwt_set_cerr(err, hwt_cerror_errno, errno);
-        ret = -1;
-        goto clean;
+    if (pt_type == -1) {
+        hwt_set_cerr(err, hwt_cerror_errno, pt_type_errno);
+        return -1;
     }
-    attr.type = atoi(pt_type_str);
+    attr.type = pt_type;
+    attr.config = tr_conf->pt_config;
 
     // Exclude the kernel.
     attr.exclude_kernel = 1;
@@ -399,16 +1133,41 @@ open_perf(size_t aux_bufsize, struct hwt_cerror *err) {
     attr.wakeup_watermark = 1;
 
     // Generate a PERF_RECORD_AUX sample when the AUX buffer is almost full.
-    attr.aux_watermark = (size_t) ((double) aux_bufsize * getpagesize()) * AUX_BUF_WAKE_RATIO;
+    double wake_ratio = AUX_BUF_WAKE_RATIO;
+    if (tr_conf->zero_copy) {
+        wake_ratio = ZERO_COPY_WAKE_RATIO;
+    } else if (tr_conf->drain_mode == hwt_perf_drain_busy_poll) {
+        wake_ratio = BUSY_POLL_WAKE_RATIO;
+    } else if (tr_conf->drain_mode == hwt_perf_drain_adaptive) {
+        wake_ratio = ADAPTIVE_WAKE_RATIO;
+    }
+    attr.aux_watermark = (size_t) ((double) tr_conf->aux_bufsize * getpagesize()) * wake_ratio;
+
+    // Report executable mappings (in the newer, more detailed, format).
+    if (tr_conf->record_mmaps) {
+        attr.mmap = 1;
+        attr.mmap2 = 1;
+    }
+
+    // A per-CPU event is inherited by new threads, so that one AUX buffer
+    // collects the traces of every thread which runs on the CPU. Each record
+    // then says which thread it came from (see record_chunk()).
+    if (cpu != -1) {
+        attr.inherit = 1;
+        attr.sample_id_all = 1;
+        attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_TIME;
+    }
 
     // Acquire file descriptor through which to talk to Intel PT. This syscall
     // could return EBUSY, meaning another process or thread has locked the
     // Perf device.
     struct timespec wait_time = {0, OPEN_PERF_WAIT_NSECS};
     pid_t target_tid = syscall(__NR_gettid);
+    *retries = 0;
     for (int tries = MAX_OPEN_PERF_TRIES; tries > 0; tries--) {
-        ret = syscall(SYS_perf_event_open, &attr, target_tid, -1, -1, 0);
+        ret = syscall(SYS_perf_event_open, &attr, target_tid, cpu, -1, 0);
         if ((ret == -1) && (errno == EBUSY)) {
+            (*retries)++;
             nanosleep(&wait_time, NULL); // Doesn't matter if this is interrupted.
         } else {
             break;
@@ -419,22 +1178,232 @@ open_perf(size_t aux_bufsize, struct hwt_cerror *err) {
         hwt_set_cerr(err, hwt_cerror_errno, errno);
     }
 
-clean:
-    if ((pt_type_file != NULL) && (fclose(pt_type_file) == -1)) {
-        hwt_set_cerr(err, hwt_cerror_errno, errno);
-        ret = -1;
-    }
-
     return ret;
 }
 
 /*
- * Set up Intel PT buffers and start a poll() loop for reading out the trace.
+ * Note that trace data was lost at the current end of `trace`.
  *
- * Returns true on success and false otherwise.
+ * Returns true on success or false otherwise.
  */
-static void *
-collector_thread(void *arg)
+static bool
+record_gap(struct hwt_perf_trace *trace, struct hwt_cerror *err)
+{
+    // Gaps are offsets into the uncompressed trace.
+    __u64 off = trace->compressed ? trace->raw_len : trace->len;
+
+    // Back-to-back losses make one gap.
+    if ((trace->ngaps > 0) && (trace->gaps[trace->ngaps - 1] == off)) {
+        return true;
+    }
+    if ((trace->ngaps == trace->gaps_cap) && (!grow_gaps(trace, err))) {
+        return false;
+    }
+    trace->gaps[trace->ngaps++] = off;
+    return true;
+}
+
+/*
+ * Make room for more gaps in `trace`.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+grow_gaps(struct hwt_perf_trace *trace, struct hwt_cerror *err)
+{
+    size_t new_cap = trace->gaps_cap == 0 ? 8 : trace->gaps_cap * 2;
+    size_t *new_gaps = realloc(trace->gaps, new_cap * sizeof(*new_gaps));
+    if (new_gaps == NULL) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        return false;
+    }
+    trace->gaps = new_gaps;
+    trace->gaps_cap = new_cap;
+    return true;
+}
+
+/*
+ * Note which thread wrote the part of a per-CPU trace that the AUX record
+ * `rec` describes, so that the trace can later be split up by thread.
+ *
+ * The kernel ends the current AUX record when a thread is switched out, so
+ * each record's data comes from just one thread.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+record_chunk(struct hwt_perf_trace *trace, struct perf_record_aux_sample *rec,
+             struct hwt_cerror *err)
+{
+    if (rec->aux_size == 0) {
+        return true;
+    }
+    if (rec->header.size < sizeof(*rec) + sizeof(struct perf_sample_id)) {
+        hwt_set_cerr(err, hwt_cerror_unknown, 0);
+        return false;
+    }
+    if (trace->nchunks == trace->chunks_cap) {
+        size_t new_cap = trace->chunks_cap == 0 ? 64 : trace->chunks_cap * 2;
+        struct hwt_perf_aux_chunk *new_chunks =
+            realloc(trace->chunks, new_cap * sizeof(*new_chunks));
+        if (new_chunks == NULL) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            return false;
+        }
+        trace->chunks = new_chunks;
+        trace->chunks_cap = new_cap;
+    }
+
+    // The sample ID is at the very end of the record.
+    struct perf_sample_id id;
+    memcpy(&id, (void *) rec + rec->header.size - sizeof(id), sizeof(id));
+    struct hwt_perf_aux_chunk *chunk = &trace->chunks[trace->nchunks++];
+    chunk->offset = rec->aux_offset - trace->aux_start;
+    chunk->size = rec->aux_size;
+    chunk->time = id.time;
+    chunk->pid = id.pid;
+    chunk->tid = id.tid;
+    return true;
+}
+
+/*
+ * Keep the executable file mapping that the PERF_RECORD_MMAP2 record `rec`
+ * describes with `trace`, so that decoders can find code which was mapped
+ * while the trace was collected.
+ *
+ * Anonymous mappings (e.g. of JIT-compiled code) and special ones like the
+ * VDSO have no file for a decoder to read, so they are skipped.
+ *
+ * `aux_end` is where the AUX data reported before `rec` ends, in the terms of
+ * the AUX buffer (whose meta-data is in `hdr`). The mapping was made after
+ * that data was written, so it is kept as having been made there: the AUX data
+ * not yet drained comes after the data already in `trace`.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+record_mmap(struct hwt_perf_trace *trace, struct perf_record_mmap2 *rec,
+            struct perf_event_mmap_page *hdr, __u64 aux_end,
+            struct hwt_cerror *err)
+{
+    if (rec->header.size <= sizeof(*rec)) {
+        hwt_set_cerr(err, hwt_cerror_unknown, 0);
+        return false;
+    }
+    size_t max_len = rec->header.size - sizeof(*rec);
+    if ((rec->filename[0] != '/') ||
+        (strncmp(rec->filename, "//anon", max_len) == 0))
+    {
+        return true;
+    }
+    if (trace->nmmaps == trace->mmaps_cap) {
+        size_t new_cap = trace->mmaps_cap == 0 ? 8 : trace->mmaps_cap * 2;
+        struct hwt_perf_mmap *new_mmaps =
+            realloc(trace->mmaps, new_cap * sizeof(*new_mmaps));
+        if (new_mmaps == NULL) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            return false;
+        }
+        trace->mmaps = new_mmaps;
+        trace->mmaps_cap = new_cap;
+    }
+    char *filename = strndup(rec->filename, max_len);
+    if (filename == NULL) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        return false;
+    }
+    struct hwt_perf_mmap *m = &trace->mmaps[trace->nmmaps++];
+    m->addr = rec->addr;
+    m->len = rec->len;
+    m->pgoff = rec->pgoff;
+    m->filename = filename;
+    __u64 tail = atomic_load_explicit((_Atomic __u64 *) &hdr->aux_tail,
+                                      memory_order_relaxed);
+    m->trace_off = (trace->compressed ? trace->raw_len : trace->len) +
+                   ((aux_end > tail) ? aux_end - tail : 0);
+    return true;
+}
+
+/*
+ * Forget the mappings kept by record_mmap(), keeping the array for reuse.
+ */
+static void
+free_mmaps(struct hwt_perf_trace *trace)
+{
+    for (size_t i = 0; i < trace->nmmaps; i++) {
+        free(trace->mmaps[i].filename);
+    }
+    trace->nmmaps = 0;
+}
+
+/*
+ * Discard any bytes at the start of `trace` which precede the first PSB
+ * packet, so that the trace is decodable from its first byte.
+ *
+ * If the trace contains no PSB at all, it is emptied.
+ *
+ * If `lost` is true, the discarded bytes are trace that the user expected to
+ * get, so their loss is recorded: as a gap at offset 0, and in the
+ * `bytes_before_psb` statistic.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+trim_to_psb(struct hwt_perf_trace *trace, bool lost, struct hwt_cerror *err)
+{
+    void *psb = memmem(trace->buf.p, trace->len, psb_packet, PSB_PACKET_LEN);
+    __u64 skip = psb == NULL ? trace->len : (__u64) (psb - trace->buf.p);
+    if (skip == 0) {
+        return true;
+    }
+
+    // Gaps in the part discarded go with it. The rest move down.
+    size_t kept = 0;
+    for (size_t i = 0; i < trace->ngaps; i++) {
+        if (trace->gaps[i] > skip) {
+            trace->gaps[kept++] = trace->gaps[i] - skip;
+        }
+    }
+    trace->ngaps = kept;
+    for (size_t i = 0; i < trace->nmmaps; i++) {
+        struct hwt_perf_mmap *m = &trace->mmaps[i];
+        m->trace_off = (m->trace_off > skip) ? m->trace_off - skip : 0;
+    }
+    if (lost) {
+        trace->stats.bytes_before_psb += skip;
+        if ((trace->ngaps == trace->gaps_cap) &&
+            (!grow_gaps(trace, err)))
+        {
+            return false;
+        }
+        memmove(trace->gaps + 1, trace->gaps, trace->ngaps * sizeof(*trace->gaps));
+        trace->gaps[0] = 0;
+        trace->ngaps++;
+    }
+
+    if (psb == NULL) {
+        trace->len = 0;
+        return true;
+    }
+    if ((trace->aux_ctx != NULL) || (trace->sink_map != NULL)) {
+        // We don't own the start of the AUX buffer (or can't write to the
+        // sink file's mapping), so just skip over it.
+        trace->buf.p = psb;
+        trace->capacity -= skip;
+    } else {
+        memmove(trace->buf.p, psb, trace->len - skip);
+    }
+    trace->len -= skip;
+    return true;
+}
+
+/*
+ * Set up Intel PT buffers and start a poll() loop for reading out the trace.
+ *
+ * Returns true on success and false otherwise.
+ */
+static void *
+collector_thread(void *arg)
 {
     struct collector_thread_args *thr_args = (struct collector_thread_args *) arg;
     int sem_posted = false;
@@ -448,6 +1417,9 @@ collector_thread(void *arg)
     void *aux_buf = thr_args->aux_buf;
     struct perf_event_mmap_page *base_header = thr_args->base_header;
     struct hwt_cerror *err = thr_args->err;
+    enum hwt_perf_drain_mode drain_mode = thr_args->drain_mode;
+    struct drain_rate *rate = thr_args->rate;
+    atomic_bool *stop_requested = thr_args->stop_requested;
 
     // Resume the interpreter loop.
     if (sem_post(thr_args->collector_init_sem) != 0) {
@@ -455,56 +1427,709 @@ collector_thread(void *arg)
         ret = false;
         goto clean;
     }
-    sem_posted = true;
-
-    // Start reading out of the AUX buffer.
-    if (!poll_loop(perf_fd, stop_fd_rd, base_header, aux_buf, trace, err)) {
-        ret = false;
-        goto clean;
+    sem_posted = true;
+
+    // Start reading out of the AUX buffer.
+    if (drain_mode == hwt_perf_drain_busy_poll) {
+        ret = busy_poll_loop(perf_fd, stop_fd_rd, stop_requested, base_header,
+                             aux_buf, trace, err);
+    } else {
+        ret = poll_loop(perf_fd, stop_fd_rd, base_header, aux_buf, trace,
+                        rate, err);
+    }
+
+clean:
+    if (!sem_posted) {
+        sem_post(thr_args->collector_init_sem);
+    }
+
+    return (void *) ret;
+}
+
+/*
+ * Start the shared drain thread and its epoll(7) set.
+ *
+ * Called once via pthread_once(3). On failure `drain_epoll_fd` is left as -1
+ * and `drain_init_errno` records why.
+ */
+static void
+drain_init(void)
+{
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        drain_init_errno = errno;
+        return;
+    }
+
+    // The thread lives for as long as the process does, so we detach it.
+    pthread_t thr;
+    pthread_attr_t attr;
+    int rc = pthread_attr_init(&attr);
+    if (rc == 0) {
+        rc = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        drain_epoll_fd = epfd; // Must be visible to the thread.
+        if (rc == 0) {
+            rc = pthread_create(&thr, &attr, drain_thread, NULL);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if (rc != 0) {
+        drain_epoll_fd = -1;
+        drain_init_errno = rc;
+        close(epfd);
+    }
+}
+
+/*
+ * The shared drain thread.
+ *
+ * Services the Perf file descriptors of all contexts registered with
+ * drain_register(), instead of each tracing session having a thread of its
+ * own.
+ */
+static void *
+drain_thread(void *arg)
+{
+    (void) arg;
+    struct epoll_event events[DRAIN_MAX_EVENTS];
+
+    while (1) {
+        int n_events = epoll_wait(drain_epoll_fd, events, DRAIN_MAX_EVENTS, -1);
+        if (n_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            panic("epoll_wait failed: %s", strerror(errno));
+        }
+
+        for (int i = 0; i < n_events; i++) {
+            size_t idx = events[i].data.u64 & UINT32_MAX;
+            uint32_t gen = events[i].data.u64 >> 32;
+
+            // Find out if the context is still registered. If it is, taking
+            // its drain lock before releasing the slots lock means that it
+            // can't be deregistered under our feet.
+            if (pthread_mutex_lock(&drain_slots_lock) != 0) {
+                panic("failed to lock drain slots");
+            }
+            struct hwt_perf_ctx *tr_ctx = NULL;
+            if ((idx < drain_nslots) && (drain_slots[idx].gen == gen)) {
+                tr_ctx = drain_slots[idx].ctx;
+            }
+            if ((tr_ctx != NULL) && (pthread_mutex_lock(&tr_ctx->drain_lock) != 0)) {
+                panic("failed to lock context");
+            }
+            pthread_mutex_unlock(&drain_slots_lock);
+            if (tr_ctx == NULL) {
+                continue; // Stale event.
+            }
+
+            if ((events[i].events & EPOLLIN) && (!tr_ctx->drain_failed)) {
+                // As in poll_loop(), drain the fd, even though we don't use
+                // what we read.
+                struct read_format fd_data;
+                if (read(tr_ctx->perf_fd, &fd_data, sizeof(fd_data)) == -1) {
+                    hwt_set_cerr(&tr_ctx->collector_thread_err, hwt_cerror_errno, errno);
+                    tr_ctx->drain_failed = true;
+                } else if (!handle_sample(tr_ctx->aux_buf, tr_ctx->base_buf,
+                    tr_ctx->trace, tr_ctx->data_tmp,
+                    tr_ctx->drain_mode == hwt_perf_drain_adaptive ? &tr_ctx->drain_rate : NULL,
+                    &tr_ctx->collector_thread_err))
+                {
+                    tr_ctx->drain_failed = true;
+                }
+            }
+
+            // The traced thread exited. Whatever is left is collected when
+            // the session is stopped. We stop watching the fd now, otherwise
+            // we'd be woken up for the hang-up over and over.
+            if ((events[i].events & EPOLLHUP) || tr_ctx->drain_failed) {
+                epoll_ctl(drain_epoll_fd, EPOLL_CTL_DEL, tr_ctx->perf_fd, NULL);
+            }
+            pthread_mutex_unlock(&tr_ctx->drain_lock);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Have the shared drain thread start servicing `tr_ctx`.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+drain_register(struct hwt_perf_ctx *tr_ctx, struct hwt_cerror *err)
+{
+    bool ret = true;
+
+    if (pthread_once(&drain_once, drain_init) != 0) {
+        hwt_set_cerr(err, hwt_cerror_unknown, 0);
+        return false;
+    }
+    if (drain_epoll_fd == -1) {
+        hwt_set_cerr(err, hwt_cerror_errno, drain_init_errno);
+        return false;
+    }
+
+    if (pthread_mutex_lock(&drain_slots_lock) != 0) {
+        hwt_set_cerr(err, hwt_cerror_unknown, 0);
+        return false;
+    }
+
+    // Find a free slot, making more space if there isn't one.
+    size_t idx;
+    for (idx = 0; idx < drain_nslots; idx++) {
+        if (drain_slots[idx].ctx == NULL) {
+            break;
+        }
+    }
+    if (idx == drain_nslots) {
+        size_t new_nslots = (drain_nslots == 0) ? DRAIN_MAX_EVENTS : drain_nslots * 2;
+        struct drain_slot *new_slots = realloc(drain_slots, new_nslots * sizeof(*new_slots));
+        if (new_slots == NULL) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            ret = false;
+            goto clean;
+        }
+        memset(new_slots + drain_nslots, 0, (new_nslots - drain_nslots) * sizeof(*new_slots));
+        drain_slots = new_slots;
+        drain_nslots = new_nslots;
+    }
+
+    struct drain_slot *slot = &drain_slots[idx];
+    slot->gen++;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLHUP;
+    ev.data.u64 = ((uint64_t) slot->gen << 32) | idx;
+    if (epoll_ctl(drain_epoll_fd, EPOLL_CTL_ADD, tr_ctx->perf_fd, &ev) == -1) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        ret = false;
+        goto clean;
+    }
+    slot->ctx = tr_ctx;
+    tr_ctx->drain_slot = idx;
+
+clean:
+    pthread_mutex_unlock(&drain_slots_lock);
+    return ret;
+}
+
+/*
+ * Stop the shared drain thread from servicing `tr_ctx`.
+ *
+ * On return, the drain thread is not (and will not be) using `tr_ctx`.
+ */
+static void
+drain_deregister(struct hwt_perf_ctx *tr_ctx)
+{
+    if (tr_ctx->drain_slot == -1) {
+        return;
+    }
+
+    if (pthread_mutex_lock(&drain_slots_lock) != 0) {
+        panic("failed to lock drain slots");
+    }
+    // Fails harmlessly if the drain thread already stopped watching the fd.
+    epoll_ctl(drain_epoll_fd, EPOLL_CTL_DEL, tr_ctx->perf_fd, NULL);
+    drain_slots[tr_ctx->drain_slot].ctx = NULL;
+    tr_ctx->drain_slot = -1;
+    pthread_mutex_unlock(&drain_slots_lock);
+
+    // Wait for the drain thread to finish with the context, if it was in the
+    // middle of using it.
+    if (pthread_mutex_lock(&tr_ctx->drain_lock) != 0) {
+        panic("failed to lock context");
+    }
+    pthread_mutex_unlock(&tr_ctx->drain_lock);
+}
+
+/*
+ * The shared drain mode counterpart of hwt_perf_start_collector().
+ *
+ * Instead of spawning a collector thread, the context is registered with the
+ * shared drain thread.
+ */
+static bool
+start_shared(struct hwt_perf_ctx *tr_ctx, struct hwt_perf_trace *trace,
+             struct hwt_cerror *err)
+{
+    begin_session(tr_ctx, trace);
+    tr_ctx->drain_failed = false;
+
+    if (!drain_register(tr_ctx, err)) {
+        return false;
+    }
+
+    // Turn on tracing hardware.
+    if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        drain_deregister(tr_ctx);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * The shared drain mode counterpart of the collector thread shutdown in
+ * hwt_perf_stop_collector().
+ *
+ * The tracing hardware must already be disabled. Whatever the drain thread
+ * didn't get to is drained by the calling thread.
+ */
+static bool
+stop_shared(struct hwt_perf_ctx *tr_ctx, struct hwt_cerror *err)
+{
+    drain_deregister(tr_ctx);
+
+    if (!tr_ctx->drain_failed) {
+        if (!drain_final(tr_ctx->aux_buf, tr_ctx->base_buf, tr_ctx->trace,
+            tr_ctx->data_tmp, &tr_ctx->collector_thread_err))
+        {
+            tr_ctx->drain_failed = true;
+        }
+    }
+    if (tr_ctx->drain_failed) {
+        hwt_set_cerr(err, tr_ctx->collector_thread_err.kind, tr_ctx->collector_thread_err.code);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Prepare `tr_ctx` and `trace` for a new tracing session.
+ */
+static void
+begin_session(struct hwt_perf_ctx *tr_ctx, struct hwt_perf_trace *trace)
+{
+    // The collector context contains an error struct for tracking any errors
+    // coming from inside the collector thread. We initialise it to "no
+    // errors".
+    tr_ctx->collector_thread_err.kind = hwt_cerror_unused;
+    tr_ctx->collector_thread_err.code = 0;
+    tr_ctx->trace = trace;
+
+    // Remember where in the AUX buffer this session's data will begin. The
+    // hardware is disabled, so nothing else is touching the head.
+    struct perf_event_mmap_page *hdr = tr_ctx->base_buf;
+    trace->aux_start = atomic_load_explicit((_Atomic __u64 *) &hdr->aux_head,
+                                            memory_order_acquire);
+    trace->zero_copy = tr_ctx->zero_copy;
+    trace->lossy = tr_ctx->lossy;
+    trace->reenable_fd = tr_ctx->lossy ? tr_ctx->perf_fd : -1;
+    trace->zcctx = tr_ctx->zcctx;
+    trace->compressed = tr_ctx->zcctx != NULL;
+    trace->per_cpu = tr_ctx->cpu != -1;
+    memset(&trace->stats, 0, sizeof(trace->stats));
+    trace->stats.open_retries = tr_ctx->open_retries;
+    trace->stats.aux_bufsize = tr_ctx->aux_bufsize;
+
+    // The fill rate estimate carries over from the last session (if any), on
+    // the basis that the same code is probably being traced again.
+    tr_ctx->drain_rate.last_head = trace->aux_start;
+    clock_gettime(CLOCK_MONOTONIC, &tr_ctx->drain_rate.last_time);
+    atomic_store_explicit(&tr_ctx->stop_requested, false, memory_order_relaxed);
+}
+
+/*
+ * If the data of a stopped zero-copy session is still in the AUX buffer,
+ * make the trace refer to it there. The trace then holds a reference to the
+ * context, which it gives up in hwt_perf_release_aux_trace().
+ *
+ * If the data wraps around the end of the AUX buffer, it isn't contiguous, so
+ * it is copied out after all.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+finish_zero_copy(struct hwt_perf_ctx *tr_ctx, struct hwt_cerror *err)
+{
+    struct hwt_perf_trace *trace = tr_ctx->trace;
+    if (!trace->zero_copy) {
+        return true; // Either not zero-copy, or we already had to copy.
+    }
+
+    struct perf_event_mmap_page *hdr = tr_ctx->base_buf;
+    __u64 head = atomic_load_explicit((_Atomic __u64 *) &hdr->aux_head,
+                                      memory_order_acquire);
+    __u64 size = hdr->aux_size;
+    __u64 start = trace->aux_start % size;
+    __u64 len = head - trace->aux_start;
+    if (start + len > size) {
+        trace->zero_copy = false;
+        return read_aux(tr_ctx->aux_buf, hdr, trace, err);
+    }
+
+    trace_free_buf(trace);
+    trace->buf.p = tr_ctx->aux_buf + start;
+    trace->len = trace->capacity = len;
+    trace->aux_ctx = tr_ctx;
+    trace->zero_copy = false;
+    atomic_fetch_add(&tr_ctx->refs, 1);
+    return true;
+}
+
+/*
+ * Make room for at least `required` bytes in a trace's storage buffer,
+ * preserving its contents.
+ *
+ * Pooled storage grows by mapping more chunks in place, so existing data is
+ * never copied. Heap storage is over-allocated to 2x what we need.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+trace_grow(struct hwt_perf_trace *trace, __u64 required, struct hwt_cerror *err)
+{
+    if (trace->storage != NULL) {
+        struct trace_storage *stor = trace->storage;
+        while (trace->capacity < required) {
+            if (!storage_add_chunk(stor, err)) {
+                return false;
+            }
+            trace->capacity = stor->nchunks * STORAGE_CHUNK_SIZE;
+            trace->stats.reallocs++;
+        }
+        return true;
+    }
+
+    // Check that the result fits in the size_t argument of realloc(3).
+    if (required >= SIZE_MAX / 2) {
+        hwt_set_cerr(err, hwt_cerror_errno, ENOMEM);
+        return false;
+    }
+    size_t new_capacity = required * 2;
+    void *new_buf = realloc(trace->buf.p, new_capacity);
+    if (new_buf == NULL) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        return false;
+    }
+    trace->stats.reallocs++;
+    if (new_buf != trace->buf.p) {
+        trace->stats.realloc_bytes_moved += trace->len;
+    }
+    trace->capacity = new_capacity;
+    trace->buf.p = new_buf;
+    return true;
+}
+
+/*
+ * Free a trace's storage buffer (but not AUX buffer data).
+ */
+static void
+trace_free_buf(struct hwt_perf_trace *trace)
+{
+    if (trace->sink_map != NULL) {
+        munmap(trace->sink_map, trace->sink_map_len);
+        trace->sink_map = NULL;
+    } else if (trace->storage != NULL) {
+        storage_free(trace->storage);
+        trace->storage = NULL;
+    } else {
+        free(trace->buf.p);
+    }
+    sink_close(trace);
+    trace->buf.p = NULL;
+    trace->len = trace->capacity = 0;
+}
+
+/*
+ * Append `len` bytes from `buf`, which is in the AUX buffer, to the sink file
+ * of `trace`.
+ *
+ * The data is vmsplice(2)d into a pipe and spliced from there into the file,
+ * so it never passes through a buffer of ours. If the kernel won't splice
+ * from the AUX mapping, we fall back to write(2)ing straight from it.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+sink_write(struct hwt_perf_trace *trace, void *buf, size_t len,
+           struct hwt_cerror *err)
+{
+    while (len > 0) {
+        ssize_t n;
+        if (trace->sink_pipe[1] != -1) {
+            struct iovec iov = {buf, len};
+            n = vmsplice(trace->sink_pipe[1], &iov, 1, 0);
+            if ((n == -1) && (errno != EINTR)) {
+                close(trace->sink_pipe[0]);
+                close(trace->sink_pipe[1]);
+                trace->sink_pipe[0] = trace->sink_pipe[1] = -1;
+                continue;
+            }
+            // The pipe refers to the AUX buffer's pages, so it must be empty
+            // before the caller lets the hardware reuse them.
+            for (ssize_t left = n; left > 0;) {
+                ssize_t m = splice(trace->sink_pipe[0], NULL, trace->sink_fd,
+                                   NULL, left, SPLICE_F_MOVE);
+                if (m == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    hwt_set_cerr(err, hwt_cerror_errno, errno);
+                    return false;
+                }
+                left -= m;
+            }
+        } else {
+            n = write(trace->sink_fd, buf, len);
+            if ((n == -1) && (errno != EINTR)) {
+                hwt_set_cerr(err, hwt_cerror_errno, errno);
+                return false;
+            }
+        }
+        if (n > 0) {
+            buf += n;
+            len -= n;
+            trace->len += n;
+        }
+    }
+    return true;
+}
+
+/*
+ * Close the sink file descriptors of `trace` (if any).
+ */
+static void
+sink_close(struct hwt_perf_trace *trace)
+{
+    int *fds[] = {&trace->sink_fd, &trace->sink_pipe[0], &trace->sink_pipe[1]};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] != -1) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+/*
+ * Once a sink trace is complete, map its file so that `buf` refers to the
+ * trace data as usual. The file is anonymous, so it goes away once unmapped.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+finish_sink(struct hwt_perf_trace *trace, struct hwt_cerror *err)
+{
+    if (trace->sink_fd == -1) {
+        return true;
+    }
+    if (trace->len > 0) {
+        void *map = mmap(NULL, trace->len, PROT_READ, MAP_SHARED, trace->sink_fd, 0);
+        if (map == MAP_FAILED) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            return false;
+        }
+        trace->buf.p = trace->sink_map = map;
+        trace->capacity = trace->sink_map_len = trace->len;
+    }
+    sink_close(trace);
+    return true;
+}
+
+/*
+ * Get a free chunk from `pool`, creating the pool's memfd on first use.
+ *
+ * Returns true (and puts the chunk's offset in `*off`) on success or false
+ * otherwise.
+ */
+static bool
+pool_get(struct chunk_pool *pool, off_t *off, struct hwt_cerror *err)
+{
+    bool ret = true;
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->inited) {
+        pool->fd = memfd_create("hwtracer_trace", MFD_CLOEXEC | pool->memfd_flags);
+        if (pool->fd == -1) {
+            pool->init_errno = errno;
+        }
+        pool->inited = true;
+    }
+    if (pool->fd == -1) {
+        hwt_set_cerr(err, hwt_cerror_errno, pool->init_errno);
+        ret = false;
+        goto done;
+    }
+
+    if (pool->nfree > 0) {
+        *off = pool->free[--pool->nfree];
+        goto done;
+    }
+    // Make sure there's space to put the chunk back later, so that
+    // pool_put() can't fail.
+    if (pool->free_cap == pool->nfree) {
+        size_t new_cap = pool->free_cap == 0 ? 64 : pool->free_cap * 2;
+        off_t *new_free = realloc(pool->free, new_cap * sizeof(*new_free));
+        if (new_free == NULL) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            ret = false;
+            goto done;
+        }
+        pool->free = new_free;
+        pool->free_cap = new_cap;
+    }
+    if (ftruncate(pool->fd, pool->size + STORAGE_CHUNK_SIZE) == -1) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        ret = false;
+        goto done;
+    }
+    *off = pool->size;
+    pool->size += STORAGE_CHUNK_SIZE;
+
+done:
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+/*
+ * Give a chunk back to `pool`. If the pool already has plenty of free chunks,
+ * the chunk's memory is released, but its offset is still reused later.
+ */
+static void
+pool_put(struct chunk_pool *pool, off_t off)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nfree >= STORAGE_POOL_RETAIN) {
+        // Failure just means we hang on to the memory.
+        fallocate(pool->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  off, STORAGE_CHUNK_SIZE);
+    }
+    pool->free[pool->nfree++] = off;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Map one more chunk onto the end of `stor`.
+ *
+ * If huge pages were asked for but can't be had, we quietly fall back to
+ * normal pages.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+storage_add_chunk(struct trace_storage *stor, struct hwt_cerror *err)
+{
+    if ((stor->nchunks + 1) * STORAGE_CHUNK_SIZE >
+        stor->reserve_size - STORAGE_CHUNK_SIZE)
+    {
+        hwt_set_cerr(err, hwt_cerror_errno, ENOMEM);
+        return false;
+    }
+    if (stor->nchunks == stor->chunks_cap) {
+        size_t new_cap = stor->chunks_cap == 0 ? 8 : stor->chunks_cap * 2;
+        struct storage_chunk *new_chunks =
+            realloc(stor->chunks, new_cap * sizeof(*new_chunks));
+        if (new_chunks == NULL) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            return false;
+        }
+        stor->chunks = new_chunks;
+        stor->chunks_cap = new_cap;
     }
 
-clean:
-    if (!sem_posted) {
-        sem_post(thr_args->collector_init_sem);
+    void *addr = stor->base + stor->nchunks * STORAGE_CHUNK_SIZE;
+    struct chunk_pool *pool = stor->pool;
+    for (;;) {
+        off_t off;
+        // No point in reporting huge page trouble if we can fall back.
+        struct hwt_cerror pool_err = {hwt_cerror_unused, 0};
+        bool got = pool_get(pool, &off, &pool_err);
+        if (got) {
+            void *p = mmap(addr, STORAGE_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_FIXED, pool->fd, off);
+            if (p != MAP_FAILED) {
+                stor->chunks[stor->nchunks++] = (struct storage_chunk) {pool, off};
+                return true;
+            }
+            pool_err.kind = hwt_cerror_errno;
+            pool_err.code = errno;
+            pool_put(pool, off);
+        }
+        if (pool == &chunk_pools[hwt_perf_storage_pooled]) {
+            hwt_set_cerr(err, pool_err.kind, pool_err.code);
+            return false;
+        }
+        pool = stor->pool = &chunk_pools[hwt_perf_storage_pooled];
     }
-
-    return (void *) ret;
 }
 
 /*
- * --------------------------------------
- * Functions exposed to the outside world
- * --------------------------------------
+ * Unmap all of `stor`, return its chunks to their pools, and free it.
  */
+static void
+storage_free(struct trace_storage *stor)
+{
+    // Unmapping the reservation also unmaps the chunks mapped into it.
+    munmap(stor->reserve, stor->reserve_size);
+    for (size_t i = 0; i < stor->nchunks; i++) {
+        pool_put(stor->chunks[i].pool, stor->chunks[i].off);
+    }
+    free(stor->chunks);
+    free(stor);
+}
 
 /*
- * Initialise a collector context.
+ * Copy the whole AUX buffer of a flight recorder, oldest data first, into
+ * `trace`, and then cut the result back to the first PSB so that decoders can
+ * sync from the start. The tracing hardware must be disabled.
+ *
+ * If the hardware hasn't yet been all the way round the buffer, the oldest
+ * part is still zeroed: that's PAD packets, which the cut then removes.
+ *
+ * Returns true on success or false otherwise.
  */
-struct hwt_perf_ctx *
-hwt_perf_init_collector(struct hwt_perf_collector_config *tr_conf, struct hwt_cerror *err)
+static bool
+snapshot_aux(struct hwt_perf_ctx *tr_ctx, struct hwt_perf_trace *trace,
+             struct hwt_cerror *err)
 {
-    struct hwt_perf_ctx *tr_ctx = NULL;
-    bool failing = false;
-
-    // Allocate and initialise collector context.
-    tr_ctx = malloc(sizeof(*tr_ctx));
-    if (tr_ctx == NULL) {
-        hwt_set_cerr(err, hwt_cerror_errno, errno);
-        failing = true;
-        goto clean;
+    struct perf_event_mmap_page *hdr = tr_ctx->base_buf;
+    __u64 size = hdr->aux_size;
+    __u64 head = atomic_load_explicit((_Atomic __u64 *) &hdr->aux_head,
+                                      memory_order_acquire) % size;
+
+    trace->len = 0;
+    if ((trace->capacity < size) && (!trace_grow(trace, size, err))) {
+        return false;
     }
+    struct timespec copy_start;
+    clock_gettime(CLOCK_MONOTONIC, &copy_start);
+    memcpy(trace->buf.p, tr_ctx->aux_buf + head, size - head);
+    memcpy(trace->buf.p + size - head, tr_ctx->aux_buf, head);
+    trace->stats.memcpy_ns += elapsed_ns(&copy_start);
+    trace->stats.bytes_drained += size;
+    trace->len = size;
+    // The overwritten start of the buffer is expected to be cut off.
+    return trim_to_psb(trace, false, err);
+}
 
-    // Set default values.
-    memset(tr_ctx, 0, sizeof(*tr_ctx));
-    tr_ctx->stop_fds[0] = tr_ctx->stop_fds[1] = -1;
-    tr_ctx->perf_fd = -1;
-
+/*
+ * Open perf for the collector `tr_ctx` and map its buffers, as configured by
+ * `conf`.
+ *
+ * On failure, whatever was set up is left in `tr_ctx` for close_buffers() or
+ * hwt_perf_free_collector() to undo.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+open_buffers(struct hwt_perf_ctx *tr_ctx, struct hwt_perf_collector_config *conf,
+             const char *addr_filter, struct hwt_cerror *err)
+{
     // Obtain a file descriptor through which to speak to perf.
-    tr_ctx->perf_fd = open_perf(tr_conf->aux_bufsize, err);
+    tr_ctx->perf_fd = open_perf(conf, tr_ctx->cpu, &tr_ctx->open_retries, err);
     if (tr_ctx->perf_fd == -1) {
         hwt_set_cerr(err, hwt_cerror_errno, errno);
-        failing = true;
-        goto clean;
+        return false;
+    }
+
+    if ((addr_filter != NULL) &&
+        (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_SET_FILTER, addr_filter) < 0))
+    {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        return false;
     }
 
     // Allocate mmap(2) buffers for speaking to perf.
@@ -529,31 +2154,152 @@ hwt_perf_init_collector(struct hwt_perf_collector_config *tr_conf, struct hwt_ce
     // Data buffer is preceded by one management page (the header), hence `1 +
     // data_bufsize'.
     int page_size = getpagesize();
-    tr_ctx->base_bufsize = (1 + tr_conf->data_bufsize) * page_size;
+    tr_ctx->base_bufsize = (1 + conf->data_bufsize) * page_size;
     tr_ctx->base_buf = mmap(NULL, tr_ctx->base_bufsize, PROT_WRITE, MAP_SHARED, tr_ctx->perf_fd, 0);
     if (tr_ctx->base_buf == MAP_FAILED) {
+        tr_ctx->base_buf = NULL;
         hwt_set_cerr(err, hwt_cerror_errno, errno);
-        failing = true;
-        goto clean;
+        return false;
     }
 
     // Populate the header part of the base buffer.
     struct perf_event_mmap_page *base_header = tr_ctx->base_buf;
     base_header->aux_offset = base_header->data_offset + base_header->data_size;
     base_header->aux_size = tr_ctx->aux_bufsize = \
-                            tr_conf->aux_bufsize * page_size;
+                            conf->aux_bufsize * page_size;
 
     // Allocate the AUX buffer.
     //
-    // Mapped R/W so as to have a saturating ring buffer.
-    tr_ctx->aux_buf = mmap(NULL, base_header->aux_size, PROT_READ | PROT_WRITE,
+    // Mapped R/W so as to have a saturating ring buffer, unless we are a
+    // flight recorder, in which case mapping it read-only puts it in overwrite
+    // mode: the hardware keeps going round the buffer, and we never drain it.
+    int aux_prot = conf->flight_recorder ? PROT_READ : PROT_READ | PROT_WRITE;
+    tr_ctx->aux_buf = mmap(NULL, base_header->aux_size, aux_prot,
         MAP_SHARED, tr_ctx->perf_fd, base_header->aux_offset);
     if (tr_ctx->aux_buf == MAP_FAILED) {
+        // Don't let close_buffers() or hwt_perf_free_collector() try to
+        // unmap MAP_FAILED.
+        tr_ctx->aux_buf = NULL;
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Undo open_buffers().
+ */
+static void
+close_buffers(struct hwt_perf_ctx *tr_ctx)
+{
+    if (tr_ctx->aux_buf != NULL) {
+        munmap(tr_ctx->aux_buf, tr_ctx->aux_bufsize);
+        tr_ctx->aux_buf = NULL;
+    }
+    if (tr_ctx->base_buf != NULL) {
+        munmap(tr_ctx->base_buf, tr_ctx->base_bufsize);
+        tr_ctx->base_buf = NULL;
+    }
+    if (tr_ctx->perf_fd >= 0) {
+        close(tr_ctx->perf_fd);
+        tr_ctx->perf_fd = -1;
+    }
+}
+
+/*
+ * --------------------------------------
+ * Functions exposed to the outside world
+ * --------------------------------------
+ */
+
+/*
+ * Initialise a collector context. See hwt_perf_init_collector() and
+ * hwt_perf_init_cpu_collector().
+ */
+static struct hwt_perf_ctx *
+init_collector(struct hwt_perf_collector_config *tr_conf,
+               const char *addr_filter, int cpu, struct hwt_cerror *err)
+{
+    struct hwt_perf_ctx *tr_ctx = NULL;
+    bool failing = false;
+
+    // Allocate and initialise collector context.
+    tr_ctx = malloc(sizeof(*tr_ctx));
+    if (tr_ctx == NULL) {
         hwt_set_cerr(err, hwt_cerror_errno, errno);
         failing = true;
         goto clean;
     }
 
+    // Set default values.
+    memset(tr_ctx, 0, sizeof(*tr_ctx));
+    tr_ctx->stop_fds[0] = tr_ctx->stop_fds[1] = -1;
+    tr_ctx->perf_fd = -1;
+    tr_ctx->drain_slot = -1;
+    tr_ctx->cpu = cpu;
+    tr_ctx->shared_drain = tr_conf->shared_drain;
+    tr_ctx->zero_copy = tr_conf->zero_copy;
+    tr_ctx->flight_recorder = tr_conf->flight_recorder;
+    tr_ctx->lossy = tr_conf->lossy;
+    tr_ctx->drain_mode = tr_conf->drain_mode;
+    atomic_init(&tr_ctx->stop_requested, false);
+    atomic_init(&tr_ctx->refs, 1);
+    int rc = pthread_mutex_init(&tr_ctx->drain_lock, NULL);
+    if (rc != 0) {
+        // Nothing else to clean up, and the mutex must not be destroyed.
+        hwt_set_cerr(err, hwt_cerror_errno, rc);
+        free(tr_ctx);
+        return NULL;
+    }
+
+    if (tr_conf->compress) {
+        tr_ctx->zcctx = ZSTD_createCCtx();
+        if (tr_ctx->zcctx == NULL) {
+            hwt_set_cerr(err, hwt_cerror_errno, ENOMEM);
+            failing = true;
+            goto clean;
+        }
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(tr_ctx->zcctx,
+            ZSTD_c_compressionLevel, COMPRESS_LEVEL)))
+        {
+            hwt_set_cerr(err, hwt_cerror_unknown, 0);
+            failing = true;
+            goto clean;
+        }
+    }
+
+    // If the kernel won't let us lock as much AUX buffer memory as we asked
+    // for, try again with smaller buffers, down to `min_aux_bufsize` pages.
+    // Perf is opened afresh each time, as the wakeup watermark is set when it
+    // is opened and depends upon the buffer size.
+    struct hwt_perf_collector_config conf = *tr_conf;
+    while (!open_buffers(tr_ctx, &conf, addr_filter, err)) {
+        bool aux_refused = (tr_ctx->base_buf != NULL) &&
+            (tr_ctx->aux_buf == NULL) && (err->kind == hwt_cerror_errno) &&
+            ((err->code == ENOMEM) || (err->code == EPERM));
+        if (!aux_refused || (conf.aux_bufsize / 2 < conf.min_aux_bufsize)) {
+            failing = true;
+            goto clean;
+        }
+        close_buffers(tr_ctx);
+        conf.aux_bufsize /= 2;
+        err->kind = hwt_cerror_unused;
+        err->code = 0;
+    }
+
+    // In shared drain mode, samples are copied out of the data buffer into
+    // scratch space which lives as long as the context.
+    if (tr_ctx->shared_drain) {
+        struct perf_event_mmap_page *base_header = tr_ctx->base_buf;
+        tr_ctx->data_tmp = malloc(base_header->data_size);
+        if (tr_ctx->data_tmp == NULL) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            failing = true;
+            goto clean;
+        }
+    }
+
 clean:
     if (failing && (tr_ctx != NULL)) {
         hwt_perf_free_collector(tr_ctx, err);
@@ -562,13 +2308,54 @@ clean:
     return tr_ctx;
 }
 
+/*
+ * Initialise a collector context.
+ *
+ * If `addr_filter` isn't NULL, it is applied with PERF_EVENT_IOC_SET_FILTER,
+ * so that only the code it describes is traced.
+ */
+struct hwt_perf_ctx *
+hwt_perf_init_collector(struct hwt_perf_collector_config *tr_conf,
+                        const char *addr_filter, struct hwt_cerror *err)
+{
+    return init_collector(tr_conf, addr_filter, -1, err);
+}
+
+/*
+ * Initialise a collector context which traces the calling thread, and every
+ * thread that it (or any thread so traced) creates after this returns, while
+ * they run on `cpu`. One such context per CPU traces a whole group of threads,
+ * with one AUX buffer per CPU rather than per thread. Threads which already
+ * exist (other than the calling thread) aren't traced.
+ *
+ * The trace of the CPU interleaves the traces of the threads which ran on it.
+ * The trace's `chunks` say which thread wrote which part (see record_chunk()).
+ *
+ * Contexts made this way can only be started in shared drain mode, and can't
+ * be reused.
+ */
+struct hwt_perf_ctx *
+hwt_perf_init_cpu_collector(struct hwt_perf_collector_config *tr_conf,
+                            const char *addr_filter, int cpu,
+                            struct hwt_cerror *err)
+{
+    if ((!tr_conf->shared_drain) || tr_conf->reuse_ctx || tr_conf->zero_copy ||
+        tr_conf->flight_recorder || tr_conf->compress)
+    {
+        hwt_set_cerr(err, hwt_cerror_unknown, 0);
+        return NULL;
+    }
+    return init_collector(tr_conf, addr_filter, cpu, err);
+}
+
 /*
  * Turn on Intel PT.
  *
- * `trace_bufsize` is the starting capacity of the trace buffer.
+ * The trace is written into `trace`, whose buffer may be realloc(3)d.
  *
- * The trace is written into `*trace_buf` which may be realloc(3)d. The trace
- * length is written into `*trace_len`.
+ * `tr_ctx` may be a fresh context from hwt_perf_init_collector(), or one that
+ * has already been through one or more start/stop cycles (see
+ * hwt_perf_ctx_reusable()).
  *
  * Returns true on success or false otherwise.
  */
@@ -578,6 +2365,20 @@ hwt_perf_start_collector(struct hwt_perf_ctx *tr_ctx, struct hwt_perf_trace *tra
     int clean_sem = 0, clean_thread = 0;
     int ret = true;
 
+    if (tr_ctx->shared_drain) {
+        return start_shared(tr_ctx, trace, err);
+    }
+
+    // A flight recorder has nothing to drain, so there's no collector thread.
+    if (tr_ctx->flight_recorder) {
+        begin_session(tr_ctx, trace);
+        if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            return false;
+        }
+        return true;
+    }
+
     // A pipe to signal the trace thread to stop.
     //
     // It has to be a pipe becuase it needs to be used in a poll(6) loop later.
@@ -596,10 +2397,7 @@ hwt_perf_start_collector(struct hwt_perf_ctx *tr_ctx, struct hwt_perf_trace *tra
     }
     clean_sem = 1;
 
-    // The collector context contains an error struct for tracking any errors
-    // coming from inside the thread. We initialise it to "no errors".
-    tr_ctx->collector_thread_err.kind = hwt_cerror_unused;
-    tr_ctx->collector_thread_err.code = 0;
+    begin_session(tr_ctx, trace);
 
     // Build the arguments struct for the collector thread.
     struct collector_thread_args thr_args = {
@@ -610,6 +2408,9 @@ hwt_perf_start_collector(struct hwt_perf_ctx *tr_ctx, struct hwt_perf_trace *tra
         tr_ctx->aux_buf,
         tr_ctx->base_buf, // The header is the first region in the base buf.
         &tr_ctx->collector_thread_err,
+        tr_ctx->drain_mode,
+        tr_ctx->drain_mode == hwt_perf_drain_adaptive ? &tr_ctx->drain_rate : NULL,
+        &tr_ctx->stop_requested,
     };
 
     // Spawn a thread to deal with copying out of the PT AUX buffer.
@@ -647,6 +2448,7 @@ clean:
 
     if (!ret) {
         if (clean_thread) {
+            atomic_store_explicit(&tr_ctx->stop_requested, true, memory_order_release);
             close(tr_ctx->stop_fds[1]); // signals thread to stop.
             tr_ctx->stop_fds[1] = -1;
             pthread_join(tr_ctx->collector_thread, NULL);
@@ -670,14 +2472,27 @@ bool
 hwt_perf_stop_collector(struct hwt_perf_ctx *tr_ctx, struct hwt_cerror *err)
 {
     int ret = true;
+    struct timespec stop_start;
+    clock_gettime(CLOCK_MONOTONIC, &stop_start);
 
-    // Turn off tracer hardware.
+    // Turn off tracer hardware, and stop the drain thread turning it back on.
+    atomic_store((_Atomic int *) &tr_ctx->trace->reenable_fd, -1);
     if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_DISABLE, 0) < 0) {
         hwt_set_cerr(err, hwt_cerror_errno, errno);
         ret = false;
     }
 
+    if (tr_ctx->shared_drain) {
+        ret = stop_shared(tr_ctx, err) && ret;
+        goto check_psb;
+    }
+    if (tr_ctx->flight_recorder) {
+        ret = ret && snapshot_aux(tr_ctx, tr_ctx->trace, err);
+        goto check_psb;
+    }
+
     // Signal poll loop to end.
+    atomic_store_explicit(&tr_ctx->stop_requested, true, memory_order_release);
     if (close(tr_ctx->stop_fds[1]) == -1) {
         hwt_set_cerr(err, hwt_cerror_errno, errno);
         ret = false;
@@ -702,11 +2517,275 @@ hwt_perf_stop_collector(struct hwt_perf_ctx *tr_ctx, struct hwt_cerror *err)
     }
     tr_ctx->stop_fds[0] = -1;
 
+check_psb:
+    if (ret && !finish_zero_copy(tr_ctx, err)) {
+        ret = false;
+    }
+    if (ret && !finish_sink(tr_ctx->trace, err)) {
+        ret = false;
+    }
+
+    // A fresh perf file descriptor always gives us a trace starting with a
+    // PSB+ sequence, but we can't rely upon the hardware doing the same when
+    // a reused context is re-enabled, and there's no way to make it. If it
+    // didn't, cut the trace back to the first PSB so that decoders can still
+    // sync from the first byte, record the loss of what came before as a gap
+    // (see trim_to_psb()), and stop reusing contexts from now on.
+    if (ret && (tr_ctx->sessions > 0) && (tr_ctx->trace->len > 0) &&
+        ((tr_ctx->trace->len < PSB_PACKET_LEN) ||
+         (memcmp(tr_ctx->trace->buf.p, psb_packet, PSB_PACKET_LEN) != 0)))
+    {
+        atomic_store(&reuse_lacks_psb, true);
+        if (!trim_to_psb(tr_ctx->trace, true, err)) {
+            ret = false;
+        }
+    }
+    tr_ctx->trace->stats.stop_ns = elapsed_ns(&stop_start);
+    tr_ctx->trace->zcctx = NULL;
+    tr_ctx->trace = NULL;
+    tr_ctx->sessions++;
+
+    return ret;
+}
+
+/*
+ * Take a snapshot of the most recent trace data of a running flight recorder,
+ * storing it in `trace`, without ending the tracing session.
+ *
+ * The hardware has to be briefly turned off, both so that the trace doesn't
+ * change under our feet and so that the kernel updates the AUX head. Output
+ * to the data buffer is paused meanwhile, so as not to fill it with records
+ * about our own toggling.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool
+hwt_perf_snapshot_collector(struct hwt_perf_ctx *tr_ctx,
+                            struct hwt_perf_trace *trace,
+                            struct hwt_cerror *err)
+{
+    if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 1) < 0) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        return false;
+    }
+    bool ret = true;
+    if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_DISABLE, 0) < 0) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        ret = false;
+    } else {
+        ret = snapshot_aux(tr_ctx, trace, err);
+        if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            ret = false;
+        }
+    }
+    if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 0) < 0) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        ret = false;
+    }
     return ret;
 }
 
 /*
- * Clean up and free a hwt_perf_ctx and its contents.
+ * Indicates if a stopped context can be handed to hwt_perf_start_collector()
+ * again, thus avoiding the cost of hwt_perf_init_collector().
+ */
+bool
+hwt_perf_ctx_reusable(struct hwt_perf_ctx *tr_ctx) {
+    (void) tr_ctx; // Currently a process-wide property.
+    return !atomic_load(&reuse_lacks_psb);
+}
+
+/*
+ * Indicates if a (stopped) context's AUX buffer is still in use by a
+ * zero-copy trace, in which case the context can't start a new session yet.
+ */
+bool
+hwt_perf_ctx_busy(struct hwt_perf_ctx *tr_ctx) {
+    return atomic_load(&tr_ctx->refs) > 1;
+}
+
+/*
+ * The size (in pages) of a context's AUX buffer, which may be smaller than
+ * configured if the kernel refused the configured size.
+ */
+size_t
+hwt_perf_ctx_aux_bufsize(struct hwt_perf_ctx *tr_ctx) {
+    return tr_ctx->aux_bufsize / getpagesize();
+}
+
+/*
+ * Called when a trace referring to AUX buffer data (see finish_zero_copy())
+ * is no longer needed.
+ *
+ * The data is handed back to the kernel, and the trace's reference on the
+ * collector context is dropped. This may be the last reference, in which case
+ * the context is freed.
+ */
+static void
+release_aux_trace(struct hwt_perf_trace *trace) {
+    struct hwt_perf_ctx *tr_ctx = trace->aux_ctx;
+    struct perf_event_mmap_page *hdr = tr_ctx->base_buf;
+
+    // The context's session is over, so the head doesn't move. Like the head,
+    // the tail is monotonic (see read_aux()).
+    __u64 head = atomic_load_explicit((_Atomic __u64 *) &hdr->aux_head,
+                                      memory_order_acquire);
+    atomic_store_explicit((_Atomic __u64 *) &hdr->aux_tail, head, memory_order_release);
+    trace->aux_ctx = NULL;
+    trace->buf.p = NULL;
+
+    struct hwt_cerror err = {hwt_cerror_unused, 0};
+    hwt_perf_free_collector(tr_ctx, &err);
+}
+
+/*
+ * Set up new, empty trace storage able to hold at least `capacity` bytes.
+ *
+ * If `sink_dir` isn't NULL, the trace is instead streamed into an anonymous
+ * file in that directory as it is collected (see sink_write()), and
+ * `capacity` and `kind` are ignored.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool
+hwt_perf_init_trace(struct hwt_perf_trace *trace, size_t capacity,
+                    enum hwt_perf_storage_kind kind, const char *sink_dir,
+                    struct hwt_cerror *err)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->sink_fd = trace->sink_pipe[0] = trace->sink_pipe[1] = -1;
+    if (sink_dir != NULL) {
+        trace->sink_fd = open(sink_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (trace->sink_fd == -1) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            return false;
+        }
+        // Without a pipe, we'd just write(2) instead.
+        if (pipe2(trace->sink_pipe, O_CLOEXEC) == -1) {
+            trace->sink_pipe[0] = trace->sink_pipe[1] = -1;
+        }
+        return true;
+    }
+    if (kind == hwt_perf_storage_heap) {
+        trace->buf.p = malloc(capacity);
+        if (trace->buf.p == NULL) {
+            hwt_set_cerr(err, hwt_cerror_errno, errno);
+            return false;
+        }
+        trace->capacity = capacity;
+        return true;
+    }
+
+    struct trace_storage *stor = calloc(1, sizeof(*stor));
+    if (stor == NULL) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        return false;
+    }
+#ifdef MFD_HUGETLB
+    stor->pool = &chunk_pools[kind];
+#else
+    stor->pool = &chunk_pools[hwt_perf_storage_pooled];
+#endif
+
+    // Reserve address space for the trace to grow into. The extra chunk lets
+    // us align the base, which huge page mappings require.
+    stor->reserve_size = STORAGE_RESERVE_SIZE + STORAGE_CHUNK_SIZE;
+    stor->reserve = mmap(NULL, stor->reserve_size, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stor->reserve == MAP_FAILED) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        free(stor);
+        return false;
+    }
+    stor->base = (void *) (((uintptr_t) stor->reserve + STORAGE_CHUNK_SIZE - 1) &
+                           ~((uintptr_t) STORAGE_CHUNK_SIZE - 1));
+    trace->storage = stor;
+    trace->buf.p = stor->base;
+    if (!trace_grow(trace, capacity > 0 ? capacity : 1, err)) {
+        trace_free_buf(trace);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Find the address and size of the dynamic symbol `name`.
+ *
+ * Returns true on success or false if there's no such symbol (or its size is
+ * unknown).
+ */
+bool
+hwt_perf_symbol_range(const char *name, uintptr_t *start, size_t *size)
+{
+    void *addr = dlsym(RTLD_DEFAULT, name);
+    if (addr == NULL) {
+        return false;
+    }
+    Dl_info info;
+    const ElfW(Sym) *sym = NULL;
+    if ((dladdr1(addr, &info, (void **) &sym, RTLD_DL_SYMENT) == 0) ||
+        (sym == NULL) || (sym->st_size == 0))
+    {
+        return false;
+    }
+    *start = (uintptr_t) addr;
+    *size = sym->st_size;
+    return true;
+}
+
+/*
+ * Empty a finished trace, keeping its storage buffer (and list of gaps) so
+ * that another session can collect into it without allocating.
+ *
+ * Returns false if the trace has no storage of its own to keep (its data is
+ * in the AUX buffer or in a sink file), in which case it is left alone.
+ */
+bool
+hwt_perf_reset_trace(struct hwt_perf_trace *trace)
+{
+    if ((trace->aux_ctx != NULL) || (trace->sink_fd != -1) ||
+        (trace->sink_map != NULL))
+    {
+        return false;
+    }
+    trace->len = 0;
+    trace->ngaps = 0;
+    trace->published_len = 0;
+    trace->compressed = false;
+    trace->raw_len = 0;
+    trace->nchunks = 0;
+    free_mmaps(trace);
+    return true;
+}
+
+/*
+ * Free a trace's storage, wherever it came from. This may be called from any
+ * thread.
+ */
+void
+hwt_perf_free_trace(struct hwt_perf_trace *trace)
+{
+    if (trace->aux_ctx != NULL) {
+        release_aux_trace(trace);
+    } else {
+        trace_free_buf(trace);
+    }
+    free(trace->gaps);
+    trace->gaps = NULL;
+    trace->ngaps = trace->gaps_cap = 0;
+    free(trace->chunks);
+    trace->chunks = NULL;
+    trace->nchunks = trace->chunks_cap = 0;
+    free_mmaps(trace);
+    free(trace->mmaps);
+    trace->mmaps = NULL;
+    trace->mmaps_cap = 0;
+}
+
+/*
+ * Drop a reference to a hwt_perf_ctx. If it was the last reference, clean up
+ * and free the context and its contents.
  *
  * Returns true on success or false otherwise.
  */
@@ -714,6 +2793,14 @@ bool
 hwt_perf_free_collector(struct hwt_perf_ctx *tr_ctx, struct hwt_cerror *err) {
     int ret = true;
 
+    // A zero-copy trace may still be using the AUX buffer.
+    if (atomic_fetch_sub(&tr_ctx->refs, 1) > 1) {
+        return true;
+    }
+
+    // Must happen before the buffers are unmapped.
+    drain_deregister(tr_ctx);
+
     if ((tr_ctx->aux_buf) &&
         (munmap(tr_ctx->aux_buf, tr_ctx->aux_bufsize) == -1)) {
         hwt_set_cerr(err, hwt_cerror_errno, errno);
@@ -726,6 +2813,7 @@ hwt_perf_free_collector(struct hwt_perf_ctx *tr_ctx, struct hwt_cerror *err) {
     }
     if (tr_ctx->stop_fds[1] != -1) {
         // If the write end of the pipe is still open, the thread is still running.
+        atomic_store_explicit(&tr_ctx->stop_requested, true, memory_order_release);
         close(tr_ctx->stop_fds[1]); // signals thread to stop.
         if (pthread_join(tr_ctx->collector_thread, NULL) != 0) {
             hwt_set_cerr(err, hwt_cerror_errno, errno);
@@ -739,6 +2827,11 @@ hwt_perf_free_collector(struct hwt_perf_ctx *tr_ctx, struct hwt_cerror *err) {
         close(tr_ctx->perf_fd);
         tr_ctx->perf_fd = -1;
     }
+    if (tr_ctx->data_tmp != NULL) {
+        free(tr_ctx->data_tmp);
+    }
+    ZSTD_freeCCtx(tr_ctx->zcctx); // Accepts NULL.
+    pthread_mutex_destroy(&tr_ctx->drain_lock);
     if (tr_ctx != NULL) {
         free(tr_ctx);
     }
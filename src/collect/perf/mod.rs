@@ -1,18 +1,47 @@
 //! The Linux Perf trace collector.
 
-use super::PerfCollectorConfig;
+use super::{
+    AddrFilter, CollectionStats, CpuChunk, CpuCollection, LiveTrace, Mmap, PerfCollectorConfig,
+    PerfDrainMode, PerfTraceStorage, ThreadTrace, TraceSink, TraceStorage,
+};
 use crate::{
     c_errors::PerfPTCError,
     collect::{ThreadTraceCollector, TraceCollectorImpl},
     errors::HWTracerError,
     Trace,
 };
-use libc::{c_void, free, geteuid, malloc, size_t};
-use std::{convert::TryFrom, fs::File, io::Read, ptr, slice};
+use libc::{
+    c_char, c_int, c_void, geteuid, size_t, sysconf, ENODEV, ENOMEM, PF_X, PT_LOAD,
+    _SC_NPROCESSORS_CONF, _SC_PAGESIZE,
+};
+use std::{
+    cell::RefCell,
+    convert::TryFrom,
+    env,
+    ffi::{CStr, CString, OsStr},
+    fs::{self, File},
+    io::Read,
+    mem,
+    os::unix::ffi::OsStrExt,
+    path::PathBuf,
+    ptr, slice,
+    sync::{atomic::AtomicU64, Arc, Mutex, OnceLock},
+};
+
+mod pt_config;
 
+// The C code never sees the Rust-only fields at the end of `PerfTrace`.
+#[allow(improper_ctypes)]
 extern "C" {
     fn hwt_perf_init_collector(
-        conf: *const PerfCollectorConfig,
+        conf: *const PerfCConfig,
+        addr_filter: *const c_char,
+        err: *mut PerfPTCError,
+    ) -> *mut c_void;
+    fn hwt_perf_init_cpu_collector(
+        conf: *const PerfCConfig,
+        addr_filter: *const c_char,
+        cpu: c_int,
         err: *mut PerfPTCError,
     ) -> *mut c_void;
     fn hwt_perf_start_collector(
@@ -21,19 +50,182 @@ extern "C" {
         err: *mut PerfPTCError,
     ) -> bool;
     fn hwt_perf_stop_collector(tr_ctx: *mut c_void, err: *mut PerfPTCError) -> bool;
+    fn hwt_perf_snapshot_collector(
+        tr_ctx: *mut c_void,
+        trace: *mut PerfTrace,
+        err: *mut PerfPTCError,
+    ) -> bool;
     fn hwt_perf_free_collector(tr_ctx: *mut c_void, err: *mut PerfPTCError) -> bool;
+    fn hwt_perf_ctx_reusable(tr_ctx: *mut c_void) -> bool;
+    fn hwt_perf_ctx_busy(tr_ctx: *mut c_void) -> bool;
+    fn hwt_perf_ctx_aux_bufsize(tr_ctx: *mut c_void) -> size_t;
+    fn hwt_perf_init_trace(
+        trace: *mut PerfTrace,
+        capacity: size_t,
+        storage: PerfTraceStorage,
+        sink_dir: *const c_char,
+        err: *mut PerfPTCError,
+    ) -> bool;
+    fn hwt_perf_reset_trace(trace: *mut PerfTrace) -> bool;
+    fn hwt_perf_free_trace(trace: *mut PerfTrace);
+    fn hwt_perf_symbol_range(name: *const c_char, start: *mut usize, size: *mut usize) -> bool;
 }
 
 const PERF_PERMS_PATH: &str = "/proc/sys/kernel/perf_event_paranoid";
+const NR_ADDR_FILTERS_PATH: &str = "/sys/bus/event_source/devices/intel_pt/nr_addr_filters";
+
+/// The maximum number of idle contexts that a thread's `PerfCtxPool` will hold on to.
+const PERF_CTX_POOL_MAX: usize = 4;
+
+thread_local! {
+    /// Idle collector contexts, kept for reuse by later tracing sessions on this thread.
+    ///
+    /// This has to be per-thread because a Perf file descriptor traces only the thread which
+    /// opened it.
+    static PERF_CTX_POOL: RefCell<PerfCtxPool> = RefCell::new(PerfCtxPool::new());
+}
+
+/// A pool of stopped (but otherwise fully set up) C-level collector contexts.
+struct PerfCtxPool {
+    /// Idle contexts and the configurations (and address filters) they were initialised with.
+    ctxs: Vec<(PerfCConfig, Option<Arc<CString>>, *mut c_void)>,
+}
+
+impl PerfCtxPool {
+    fn new() -> Self {
+        Self { ctxs: Vec::new() }
+    }
+
+    /// Take an idle context initialised with `config` and `filter`, if there is one. Contexts
+    /// whose AUX buffer is still borrowed by a zero-copy trace are skipped.
+    fn take(&mut self, config: &PerfCConfig, filter: &Option<Arc<CString>>) -> Option<*mut c_void> {
+        let idx = self.ctxs.iter().position(|(c, f, ctx)| {
+            c == config && f == filter && !unsafe { hwt_perf_ctx_busy(*ctx) }
+        })?;
+        Some(self.ctxs.swap_remove(idx).2)
+    }
+
+    /// Give a stopped context back to the pool, freeing it if the pool is full.
+    fn put(&mut self, config: PerfCConfig, filter: Option<Arc<CString>>, ctx: *mut c_void) {
+        if self.ctxs.len() < PERF_CTX_POOL_MAX {
+            self.ctxs.push((config, filter, ctx));
+        } else {
+            let mut cerr = PerfPTCError::new();
+            unsafe { hwt_perf_free_collector(ctx, &mut cerr) };
+        }
+    }
+}
+
+impl Drop for PerfCtxPool {
+    fn drop(&mut self) {
+        for (_, _, ctx) in self.ctxs.drain(..) {
+            let mut cerr = PerfPTCError::new();
+            unsafe { hwt_perf_free_collector(ctx, &mut cerr) };
+        }
+    }
+}
+
+/// The parts of a [PerfCollectorConfig] that the C code needs, with the Intel PT options already
+/// validated and encoded into `pt_config`.
+///
+// Must stay in sync with the C code.
+#[derive(Clone, Debug, PartialEq, Eq)]
+#[repr(C)]
+struct PerfCConfig {
+    data_bufsize: size_t,
+    aux_bufsize: size_t,
+    /// At most `aux_bufsize`.
+    min_aux_bufsize: size_t,
+    initial_trace_bufsize: size_t,
+    reuse_ctx: bool,
+    shared_drain: bool,
+    zero_copy: bool,
+    storage: PerfTraceStorage,
+    flight_recorder: bool,
+    lossy: bool,
+    drain_mode: PerfDrainMode,
+    compress: bool,
+    record_mmaps: bool,
+    /// The `attr.config` for the Intel PT event.
+    pt_config: u64,
+}
+
+impl PerfCConfig {
+    fn new(config: &PerfCollectorConfig) -> Result<Self, HWTracerError> {
+        Ok(Self {
+            data_bufsize: config.data_bufsize,
+            aux_bufsize: config.aux_bufsize,
+            min_aux_bufsize: config.min_aux_bufsize.min(config.aux_bufsize),
+            initial_trace_bufsize: config.initial_trace_bufsize,
+            reuse_ctx: config.reuse_ctx,
+            shared_drain: config.shared_drain,
+            zero_copy: config.zero_copy,
+            storage: config.storage,
+            flight_recorder: config.flight_recorder,
+            lossy: config.lossy,
+            drain_mode: config.drain_mode,
+            compress: config.compress,
+            record_mmaps: config.record_mmaps,
+            pt_config: pt_config::pt_config(config)?,
+        })
+    }
+}
 
 /// The configuration for a Linux Perf collector.
 #[derive(Debug)]
 pub(crate) struct PerfTraceCollector {
-    config: PerfCollectorConfig,
+    config: PerfCConfig,
+    /// The resolved address filters, in the form `PERF_EVENT_IOC_SET_FILTER` expects.
+    addr_filter: Option<Arc<CString>>,
+    /// The directory to stream traces into, if any.
+    sink_dir: Option<CString>,
+    /// The AUX buffer memory shared by this collector's thread collectors, if limited.
+    aux_budget: Option<Arc<AuxBudget>>,
+}
+
+/// AUX buffer memory shared between thread collectors.
+#[derive(Debug)]
+struct AuxBudget {
+    /// The most pages that may be mapped at once.
+    limit: size_t,
+    /// The pages mapped (or about to be) now.
+    used: Mutex<size_t>,
+}
+
+impl AuxBudget {
+    fn new(limit: size_t) -> Self {
+        Self {
+            limit,
+            used: Mutex::new(0),
+        }
+    }
+
+    /// Reserve the largest power of 2 pages that is at most `want` (itself a power of 2), at least
+    /// `min`, and fits in what's left. Returns `None` if nothing fits.
+    fn reserve(&self, want: size_t, min: size_t) -> Option<size_t> {
+        let mut used = self.used.lock().unwrap();
+        let mut pages = want;
+        while pages > self.limit - *used {
+            pages /= 2;
+        }
+        if pages < min || pages == 0 {
+            return None;
+        }
+        *used += pages;
+        Some(pages)
+    }
+
+    /// Give back pages reserved by [Self::reserve].
+    fn release(&self, pages: size_t) {
+        *self.used.lock().unwrap() -= pages;
+    }
 }
 
 impl PerfTraceCollector {
-    pub(super) fn new(config: PerfCollectorConfig) -> Result<Self, HWTracerError>
+    pub(super) fn new(
+        config: PerfCollectorConfig,
+        addr_filters: &[AddrFilter],
+    ) -> Result<Self, HWTracerError>
     where
         Self: Sized,
     {
@@ -51,6 +243,67 @@ impl PerfTraceCollector {
                 "aux_bufsize must be a positive power of 2",
             )));
         }
+        if !power_of_2(config.min_aux_bufsize) {
+            return Err(HWTracerError::BadConfig(String::from(
+                "min_aux_bufsize must be a positive power of 2",
+            )));
+        }
+        if let Some(budget) = config.aux_budget {
+            if config.reuse_ctx {
+                return Err(HWTracerError::BadConfig(String::from(
+                    "aux_budget can't be combined with reuse_ctx",
+                )));
+            }
+            if budget < config.min_aux_bufsize.min(config.aux_bufsize) {
+                return Err(HWTracerError::BadConfig(String::from(
+                    "aux_budget must be at least min_aux_bufsize (or aux_bufsize, if smaller)",
+                )));
+            }
+        }
+        if config.flight_recorder && (config.reuse_ctx || config.shared_drain || config.zero_copy) {
+            return Err(HWTracerError::BadConfig(String::from(
+                "flight_recorder can't be combined with reuse_ctx, shared_drain or zero_copy",
+            )));
+        }
+        if config.flight_recorder && config.drain_mode != PerfDrainMode::Poll {
+            return Err(HWTracerError::BadConfig(String::from(
+                "a flight_recorder is never drained, so drain_mode must be Poll",
+            )));
+        }
+        if config.flight_recorder && config.record_mmaps {
+            return Err(HWTracerError::BadConfig(String::from(
+                "a flight_recorder is never drained, so can't record_mmaps",
+            )));
+        }
+        if config.shared_drain && config.drain_mode == PerfDrainMode::BusyPoll {
+            return Err(HWTracerError::BadConfig(String::from(
+                "drain_mode BusyPoll can't be combined with shared_drain",
+            )));
+        }
+        if config.compress
+            && (config.zero_copy
+                || config.flight_recorder
+                || config.reuse_ctx
+                || config.sink != TraceSink::Memory)
+        {
+            return Err(HWTracerError::BadConfig(String::from(
+                "compress can't be combined with zero_copy, flight_recorder, reuse_ctx or a \
+                 Directory sink",
+            )));
+        }
+        let sink_dir = match config.sink {
+            TraceSink::Memory => None,
+            TraceSink::Directory(ref dir) => {
+                if config.zero_copy || config.flight_recorder {
+                    return Err(HWTracerError::BadConfig(String::from(
+                        "a Directory sink can't be combined with zero_copy or flight_recorder",
+                    )));
+                }
+                Some(CString::new(dir.as_os_str().as_bytes()).map_err(|_| {
+                    HWTracerError::BadConfig(format!("bad sink directory: {}", dir.display()))
+                })?)
+            }
+        };
 
         // Check we have permissions to collect a PT trace using perf.
         //
@@ -72,53 +325,407 @@ impl PerfTraceCollector {
             }
         }
 
-        Ok(Self { config })
+        let addr_filter = resolve_addr_filters(addr_filters)?.map(Arc::new);
+        Ok(Self {
+            config: PerfCConfig::new(&config)?,
+            addr_filter,
+            sink_dir,
+            aux_budget: config.aux_budget.map(|b| Arc::new(AuxBudget::new(b))),
+        })
     }
 }
 
+/// Resolve `filters` into a Perf address filter string, checking that the hardware supports
+/// enough filters. Returns `None` if there are no filters.
+fn resolve_addr_filters(filters: &[AddrFilter]) -> Result<Option<CString>, HWTracerError> {
+    if filters.is_empty() {
+        return Ok(None);
+    }
+
+    let exe = env::current_exe()?;
+    let mut entries = Vec::new();
+    for filter in filters {
+        let (start, size) = match filter {
+            AddrFilter::Range { start, size } => (*start, *size),
+            AddrFilter::Symbol(name) => {
+                let c_name = CString::new(name.as_str())
+                    .map_err(|_| HWTracerError::BadConfig(format!("bad symbol name: {}", name)))?;
+                let (mut start, mut size) = (0, 0);
+                if !unsafe { hwt_perf_symbol_range(c_name.as_ptr(), &mut start, &mut size) } {
+                    return Err(HWTracerError::BadConfig(format!(
+                        "can't find symbol: {}",
+                        name
+                    )));
+                }
+                (start, size)
+            }
+            AddrFilter::Object(path) => {
+                let path = fs::canonicalize(path)?;
+                let mut found = false;
+                for obj in phdrs::objects() {
+                    let obj_path = match obj.name().to_str().unwrap() {
+                        "" => exe.clone(),
+                        name => match fs::canonicalize(name) {
+                            Ok(p) => p,
+                            Err(_) => continue, // e.g. the VDSO.
+                        },
+                    };
+                    if obj_path != path {
+                        continue;
+                    }
+                    for hdr in obj.iter_phdrs() {
+                        if hdr.type_() == PT_LOAD && hdr.flags() & PF_X != 0 {
+                            entries.push(format!(
+                                "filter 0x{:x}/0x{:x}@{}",
+                                hdr.offset(),
+                                hdr.filesz(),
+                                path.display()
+                            ));
+                        }
+                    }
+                    found = true;
+                    break;
+                }
+                if !found {
+                    return Err(HWTracerError::BadConfig(format!(
+                        "object not loaded: {}",
+                        path.display()
+                    )));
+                }
+                continue;
+            }
+        };
+        entries.push(range_filter(&exe, start, size)?);
+    }
+
+    let max = fs::read_to_string(NR_ADDR_FILTERS_PATH)
+        .ok()
+        .and_then(|s| s.trim().parse::<usize>().ok())
+        .unwrap_or(0);
+    if entries.len() > max {
+        return Err(HWTracerError::BadConfig(format!(
+            "{} address filters needed, but the hardware supports {}",
+            entries.len(),
+            max
+        )));
+    }
+    Ok(Some(CString::new(entries.join(",")).unwrap()))
+}
+
+/// Make a Perf address filter entry for the `size` bytes of code from virtual address `start`.
+fn range_filter(exe: &std::path::Path, start: usize, size: usize) -> Result<String, HWTracerError> {
+    let (start, size) = (start as u64, size as u64);
+    for obj in phdrs::objects() {
+        for hdr in obj.iter_phdrs() {
+            if hdr.type_() != PT_LOAD || hdr.flags() & PF_X == 0 {
+                continue;
+            }
+            let seg_start = obj.addr() + hdr.vaddr();
+            if start < seg_start || start >= seg_start + hdr.memsz() {
+                continue;
+            }
+            if start + size > seg_start + hdr.memsz() {
+                return Err(HWTracerError::BadConfig(format!(
+                    "address range 0x{:x}/0x{:x} spans more than one segment",
+                    start, size
+                )));
+            }
+            let path = match obj.name().to_str().unwrap() {
+                "" => exe.to_owned(),
+                name => fs::canonicalize(name).map_err(|_| {
+                    HWTracerError::BadConfig(format!("can't filter on code in {}", name))
+                })?,
+            };
+            return Ok(format!(
+                "filter 0x{:x}/0x{:x}@{}",
+                start - seg_start + hdr.offset(),
+                size,
+                path.display()
+            ));
+        }
+    }
+    Err(HWTracerError::BadConfig(format!(
+        "address 0x{:x} isn't in any loaded code",
+        start
+    )))
+}
+
 impl TraceCollectorImpl for PerfTraceCollector {
     unsafe fn thread_collector(&self) -> Box<dyn ThreadTraceCollector> {
-        Box::new(PerfThreadTraceCollector::new(self.config.clone()))
+        let mut tc = PerfThreadTraceCollector::new(self.config.clone(), self.addr_filter.clone());
+        tc.sink_dir = self.sink_dir.clone();
+        tc.aux_budget = self.aux_budget.clone();
+        Box::new(tc)
+    }
+
+    fn cpu_collector(&self) -> Result<Box<dyn CpuCollection>, HWTracerError> {
+        let c = &self.config;
+        if c.reuse_ctx
+            || c.zero_copy
+            || c.flight_recorder
+            || c.compress
+            || self.aux_budget.is_some()
+            || self.sink_dir.is_some()
+            || c.drain_mode == PerfDrainMode::BusyPoll
+        {
+            return Err(HWTracerError::BadConfig(String::from(
+                "per-CPU collection can't be combined with reuse_ctx, zero_copy, flight_recorder, \
+                 compress, aux_budget, a Directory sink or drain_mode BusyPoll",
+            )));
+        }
+        // One drain thread for all the CPUs.
+        let mut config = self.config.clone();
+        config.shared_drain = true;
+        let addr_filter = self
+            .addr_filter
+            .as_ref()
+            .map_or(ptr::null(), |f| f.as_ptr());
+
+        let mut col = Box::new(PerfCpuCollection { cpus: Vec::new() });
+        for cpu in 0..c_int::try_from(unsafe { sysconf(_SC_NPROCESSORS_CONF) }).unwrap() {
+            let mut cerr = PerfPTCError::new();
+            let ctx = unsafe {
+                hwt_perf_init_cpu_collector(
+                    &config as *const PerfCConfig,
+                    addr_filter,
+                    cpu,
+                    &mut cerr,
+                )
+            };
+            if ctx.is_null() {
+                match HWTracerError::from(cerr) {
+                    // Nothing runs on an offline CPU.
+                    HWTracerError::Errno(ENODEV) => continue,
+                    e => return Err(e),
+                }
+            }
+            // Boxed so that it doesn't move while the C code writes to it.
+            let trace = match PerfTrace::new(config.initial_trace_bufsize, config.storage, None) {
+                Ok(trace) => Box::new(trace),
+                Err(e) => {
+                    let mut cerr = PerfPTCError::new();
+                    unsafe { hwt_perf_free_collector(ctx, &mut cerr) };
+                    return Err(e);
+                }
+            };
+            col.cpus.push((ctx, trace));
+        }
+        // Start the CPUs once all are set up, so that no thread is traced on only some of them.
+        for (ctx, trace) in &mut col.cpus {
+            let mut cerr = PerfPTCError::new();
+            if !unsafe { hwt_perf_start_collector(*ctx, &mut **trace, &mut cerr) } {
+                return Err(cerr.into());
+            }
+        }
+        Ok(col)
+    }
+}
+
+/// A [CpuCollection] with one Perf event (and AUX buffer) per CPU.
+struct PerfCpuCollection {
+    /// Opaque C pointers to the collector context of each online CPU, and the traces they collect
+    /// into.
+    cpus: Vec<(*mut c_void, Box<PerfTrace>)>,
+}
+
+impl PerfCpuCollection {
+    /// Free the collector contexts, stopping any which are still collecting.
+    fn free_ctxs(&mut self) -> Result<(), HWTracerError> {
+        let mut res = Ok(());
+        for (ctx, _) in &mut self.cpus {
+            if ctx.is_null() {
+                continue;
+            }
+            let mut cerr = PerfPTCError::new();
+            if !unsafe { hwt_perf_free_collector(*ctx, &mut cerr) } && res.is_ok() {
+                res = Err(cerr.into());
+            }
+            *ctx = ptr::null_mut();
+        }
+        res
+    }
+}
+
+impl CpuCollection for PerfCpuCollection {
+    fn stop(mut self: Box<Self>) -> Result<Vec<ThreadTrace>, HWTracerError> {
+        // Stop every CPU, even if one fails, so that none is left collecting.
+        let mut res: Result<(), HWTracerError> = Ok(());
+        for (ctx, _) in &self.cpus {
+            let mut cerr = PerfPTCError::new();
+            if !unsafe { hwt_perf_stop_collector(*ctx, &mut cerr) } && res.is_ok() {
+                res = Err(cerr.into());
+            }
+        }
+        let freed = self.free_ctxs();
+        res?;
+        freed?;
+
+        let mut chunks = Vec::new();
+        for (cpu, (_, trace)) in self.cpus.iter().enumerate() {
+            chunks.extend(trace.chunks().iter().map(|c| CpuChunk {
+                cpu,
+                offset: usize::try_from(c.offset).unwrap(),
+                size: usize::try_from(c.size).unwrap(),
+                time: c.time,
+                pid: c.pid,
+                tid: c.tid,
+            }));
+        }
+        let traces = self
+            .cpus
+            .iter()
+            .map(|(_, trace)| &**trace as &dyn Trace)
+            .collect::<Vec<_>>();
+        Ok(ThreadTrace::split(&traces, chunks))
+    }
+}
+
+impl Drop for PerfCpuCollection {
+    fn drop(&mut self) {
+        // The traces mustn't be freed while a context might still write to them.
+        let _ = self.free_ctxs();
     }
 }
 
 /// A collector that uses the Linux Perf interface to Intel Processor Trace.
 pub struct PerfThreadTraceCollector {
     // The configuration for this collector.
-    config: PerfCollectorConfig,
+    config: PerfCConfig,
+    // The address filter string to apply, if any. Shared, so that pooling contexts doesn't copy it.
+    addr_filter: Option<Arc<CString>>,
+    // The directory to stream traces into, if any.
+    sink_dir: Option<CString>,
     // Opaque C pointer representing the collector context.
     ctx: *mut c_void,
     // The trace currently being collected, or `None`.
     trace: Option<Box<PerfTrace>>,
+    // An emptied trace handed back by the user, to collect the next trace into.
+    spare: Option<Box<PerfTrace>>,
+    // The AUX buffer memory shared with the collector's other threads, if limited.
+    aux_budget: Option<Arc<AuxBudget>>,
+    // The pages of `aux_budget` held by `ctx`.
+    aux_reserved: size_t,
+    // How full (in bytes) the AUX buffer got in recent sessions, or 0 if we don't know yet. Each
+    // session counts for half as much as the one after it.
+    aux_fill: u64,
 }
 
 impl PerfThreadTraceCollector {
-    fn new(config: PerfCollectorConfig) -> Self {
+    fn new(config: PerfCConfig, addr_filter: Option<Arc<CString>>) -> Self {
         Self {
             config,
+            addr_filter,
+            sink_dir: None,
             ctx: ptr::null_mut(),
             trace: None,
+            spare: None,
+            aux_budget: None,
+            aux_reserved: 0,
+            aux_fill: 0,
+        }
+    }
+
+    /// How many pages of AUX buffer to ask for when the collector has a budget.
+    fn aux_bufsize_wanted(&self) -> size_t {
+        let (min, max) = (self.config.min_aux_bufsize, self.config.aux_bufsize);
+        // A flight recorder is always full.
+        if self.aux_fill == 0 || self.config.flight_recorder {
+            return max;
+        }
+        // Buffers are mostly drained when half full, so aim for that to be the fullest they get.
+        let page_size = u64::try_from(unsafe { sysconf(_SC_PAGESIZE) }).unwrap();
+        let pages = size_t::try_from((self.aux_fill * 2).div_ceil(page_size)).unwrap_or(max);
+        pages.next_power_of_two().clamp(min, max)
+    }
+
+    /// Note how full the AUX buffer of the session that collected `trace` got.
+    fn record_aux_fill(&mut self, trace: &PerfTrace) {
+        let mut fill = trace.stats.max_aux_fill;
+        if trace.ngaps > 0 {
+            // Data was lost, so the buffer wasn't big enough.
+            fill = trace.stats.aux_bufsize;
+        }
+        self.aux_fill = fill.max(self.aux_fill / 2);
+    }
+
+    /// Free the collector context.
+    fn free_ctx(&mut self) -> Result<(), HWTracerError> {
+        let mut cerr = PerfPTCError::new();
+        let ok = unsafe { hwt_perf_free_collector(self.ctx, &mut cerr) };
+        self.ctx = ptr::null_mut();
+        if let Some(budget) = &self.aux_budget {
+            budget.release(mem::take(&mut self.aux_reserved));
+        }
+        if !ok {
+            return Err(cerr.into());
+        }
+        Ok(())
+    }
+
+    /// Give the (stopped) collector context back to the pool if we are reusing contexts and it
+    /// can be reused, or free it otherwise.
+    fn release_ctx(&mut self) -> Result<(), HWTracerError> {
+        if self.config.reuse_ctx && unsafe { hwt_perf_ctx_reusable(self.ctx) } {
+            let (config, filter, ctx) = (self.config.clone(), self.addr_filter.clone(), self.ctx);
+            PERF_CTX_POOL.with(|pool| pool.borrow_mut().put(config, filter, ctx));
+            self.ctx = ptr::null_mut();
+            Ok(())
+        } else {
+            self.free_ctx()
         }
     }
 }
 
 impl Default for PerfThreadTraceCollector {
     fn default() -> Self {
-        PerfThreadTraceCollector::new(PerfCollectorConfig::default())
+        // The default configuration has no Intel PT options to validate.
+        let config = PerfCConfig::new(&PerfCollectorConfig::default()).unwrap();
+        PerfThreadTraceCollector::new(config, None)
     }
 }
 
 impl ThreadTraceCollector for PerfThreadTraceCollector {
     fn start_collector(&mut self) -> Result<(), HWTracerError> {
-        // At the time of writing, we have to use a fresh Perf file descriptor to ensure traces
-        // start with a `PSB+` packet sequence. This is required for correct instruction-level and
-        // block-level decoding. Therefore we have to re-initialise for each new tracing session.
-        let mut cerr = PerfPTCError::new();
-        self.ctx = unsafe {
-            hwt_perf_init_collector(&self.config as *const PerfCollectorConfig, &mut cerr)
+        // A fresh Perf file descriptor is guaranteed to give us a trace starting with a `PSB+`
+        // packet sequence, which is required for correct instruction-level and block-level
+        // decoding. Unless asked to reuse contexts, we therefore re-initialise for each new
+        // tracing session. If we are reusing contexts, the C code takes care of the `PSB+`.
+        self.ctx = if self.config.reuse_ctx {
+            PERF_CTX_POOL
+                .with(|pool| pool.borrow_mut().take(&self.config, &self.addr_filter))
+                .unwrap_or(ptr::null_mut())
+        } else {
+            ptr::null_mut()
         };
         if self.ctx.is_null() {
-            return Err(cerr.into());
+            let mut config = self.config.clone();
+            if let Some(budget) = &self.aux_budget {
+                config.aux_bufsize = budget
+                    .reserve(self.aux_bufsize_wanted(), config.min_aux_bufsize)
+                    .ok_or(HWTracerError::Errno(ENOMEM))?;
+                self.aux_reserved = config.aux_bufsize;
+            }
+            let mut cerr = PerfPTCError::new();
+            let addr_filter = self
+                .addr_filter
+                .as_ref()
+                .map_or(ptr::null(), |f| f.as_ptr());
+            self.ctx = unsafe {
+                hwt_perf_init_collector(&config as *const PerfCConfig, addr_filter, &mut cerr)
+            };
+            if let Some(budget) = &self.aux_budget {
+                // The C code may have had to settle for a smaller buffer, or none at all.
+                let got = if self.ctx.is_null() {
+                    0
+                } else {
+                    unsafe { hwt_perf_ctx_aux_bufsize(self.ctx) }
+                };
+                budget.release(self.aux_reserved - got);
+                self.aux_reserved = got;
+            }
+            if self.ctx.is_null() {
+                return Err(cerr.into());
+            }
         }
 
         // It is essential we box the trace now to stop it from moving. If it were to move, then
@@ -126,9 +733,25 @@ impl ThreadTraceCollector for PerfThreadTraceCollector {
         // `stop_collector` needs to return a Box<Tracer> anyway, so it's no big deal.
         //
         // Note that the C code will mutate the trace's members directly.
-        let mut trace = Box::new(PerfTrace::new(self.config.initial_trace_bufsize)?);
+        let mut trace = match self.spare.take() {
+            Some(trace) => trace,
+            None => match PerfTrace::new(
+                self.config.initial_trace_bufsize,
+                self.config.storage,
+                self.sink_dir.as_deref(),
+            ) {
+                Ok(trace) => Box::new(trace),
+                Err(e) => {
+                    // The context hasn't been used, so it can go back to the pool.
+                    let _ = self.release_ctx();
+                    return Err(e);
+                }
+            },
+        };
         let mut cerr = PerfPTCError::new();
         if !unsafe { hwt_perf_start_collector(self.ctx, &mut *trace, &mut cerr) } {
+            // As in `stop_collector`, don't risk reusing the context.
+            let _ = self.free_ctx();
             return Err(cerr.into());
         }
         self.trace = Some(trace);
@@ -139,22 +762,71 @@ impl ThreadTraceCollector for PerfThreadTraceCollector {
         let mut cerr = PerfPTCError::new();
         let rc = unsafe { hwt_perf_stop_collector(self.ctx, &mut cerr) };
         if !rc {
+            // Don't risk reusing a context that failed to stop cleanly.
+            let _ = self.free_ctx();
             return Err(cerr.into());
         }
 
-        let mut cerr = PerfPTCError::new();
-        if !unsafe { hwt_perf_free_collector(self.ctx, &mut cerr) } {
-            return Err(cerr.into());
-        }
-        self.ctx = ptr::null_mut();
+        self.release_ctx()?;
 
         let ret = self.trace.take().unwrap();
-        self.trace = None;
+        if self.aux_budget.is_some() {
+            self.record_aux_fill(&ret);
+        }
         Ok(ret as Box<dyn Trace>)
     }
+
+    fn recycle(&mut self, storage: TraceStorage) {
+        let mut trace = storage.perf;
+        // Traces streamed to a file or left in the AUX buffer have no storage of their own to
+        // reuse, and a trace from another collector may have the wrong kind.
+        if self.sink_dir.is_some()
+            || trace.storage_kind != self.config.storage
+            || !unsafe { hwt_perf_reset_trace(&mut *trace) }
+        {
+            return;
+        }
+        trace.decompressed = OnceLock::new();
+        trace.mmap_list = OnceLock::new();
+        self.spare = Some(trace);
+    }
+
+    fn live_trace(&self) -> Option<LiveTrace> {
+        // The C code only publishes the trace as it grows if its data never moves.
+        if self.config.storage == PerfTraceStorage::Heap
+            || self.sink_dir.is_some()
+            || self.config.zero_copy
+            || self.config.flight_recorder
+            || self.config.compress
+        {
+            return None;
+        }
+        let trace = self.trace.as_ref()?;
+        // SAFETY: The trace is boxed, so these stay put until it is dropped, which can't happen
+        // before the collector is stopped.
+        Some(unsafe { LiveTrace::new(&trace.buf.0, &trace.published_len) })
+    }
+
+    fn snapshot_collector(&mut self) -> Result<Box<dyn Trace>, HWTracerError> {
+        if !self.config.flight_recorder {
+            return Err(HWTracerError::BadConfig(String::from(
+                "snapshots require flight_recorder",
+            )));
+        }
+        let mut trace = Box::new(PerfTrace::new(
+            self.config.initial_trace_bufsize,
+            self.config.storage,
+            None,
+        )?);
+        let mut cerr = PerfPTCError::new();
+        if !unsafe { hwt_perf_snapshot_collector(self.ctx, &mut *trace, &mut cerr) } {
+            return Err(cerr.into());
+        }
+        Ok(trace as Box<dyn Trace>)
+    }
 }
 
-/// A wrapper around a manually malloc/free'd buffer for holding an Intel PT trace. We've split
+/// A wrapper around a manually managed buffer for holding an Intel PT trace. We've split
 /// this out from PerfTrace so that we can mark just this raw pointer as `unsafe Send`.
 #[repr(C)]
 #[derive(Debug)]
@@ -177,23 +849,230 @@ pub struct PerfTrace {
     len: u64,
     /// `buf`'s allocation size (in bytes), <= `len`.
     capacity: u64,
+    /// If non-null, `buf` points into the AUX buffer of this (opaque) collector context, rather
+    /// than to memory we allocated.
+    aux_ctx: *mut c_void,
+    /// The AUX buffer head at the start of the tracing session. Only used by C.
+    aux_start: u64,
+    /// Is the trace data still (only) in the AUX buffer? Only used by C.
+    zero_copy: bool,
+    /// Opaque C pointer to pooled storage backing `buf`, or null.
+    storage: *mut c_void,
+    /// Was this trace collected in lossy mode?
+    lossy: bool,
+    /// The perf fd to re-enable after data is lost, or -1. Only used by C.
+    reenable_fd: c_int,
+    /// The offsets at which trace data was lost (`ngaps` of them, `gaps_cap` allocated).
+    gaps: *mut usize,
+    ngaps: usize,
+    gaps_cap: usize,
+    /// Statistics about the collection of the trace, filled in by C.
+    stats: CollectionStats,
+    /// While the trace is being streamed to a file: the file, and a pipe to splice through. -1 if
+    /// unused. Only used by C.
+    sink_fd: c_int,
+    sink_pipe: [c_int; 2],
+    /// The mapping of a finished streamed trace, which `buf` points into, or null.
+    sink_map: *mut c_void,
+    sink_map_len: u64,
+    /// How many bytes of `buf` can be read while the trace is still being collected. Only written
+    /// by C.
+    published_len: AtomicU64,
+    /// The compression context used while the trace is collected. Only used by C.
+    zcctx: *mut c_void,
+    /// Is `buf` a series of compressed chunks (see [CompressedChunk])?
+    compressed: bool,
+    /// If so, the length of the uncompressed trace (in bytes).
+    raw_len: u64,
+    /// Was the trace collected per CPU? If so, `chunks` says which thread wrote which part of it
+    /// (`nchunks` of them, `chunks_cap` allocated).
+    per_cpu: bool,
+    chunks: *mut PerfAuxChunk,
+    nchunks: usize,
+    chunks_cap: usize,
+    /// The executable file mappings made while collecting, in order (`nmmaps` of them,
+    /// `mmaps_cap` allocated).
+    mmaps: *mut PerfMmap,
+    nmmaps: usize,
+    mmaps_cap: usize,
+    /// The uncompressed trace, made when it's first needed. This and what follows are Rust-only,
+    /// so must come last.
+    decompressed: OnceLock<Vec<u8>>,
+    /// `mmaps`, made when they are first needed.
+    mmap_list: OnceLock<Vec<Mmap>>,
+    /// The kind of storage the trace was made with.
+    storage_kind: PerfTraceStorage,
+}
+
+/// A part of a per-CPU trace which was written while one thread was running.
+///
+// Must stay in sync with the C code.
+#[repr(C)]
+#[derive(Debug)]
+struct PerfAuxChunk {
+    offset: u64,
+    size: u64,
+    /// When the part ended, by the Perf clock.
+    time: u64,
+    pid: u32,
+    tid: u32,
+}
+
+/// An executable file mapping made while a trace was collected.
+///
+// Must stay in sync with the C code.
+#[repr(C)]
+#[derive(Debug)]
+struct PerfMmap {
+    addr: u64,
+    len: u64,
+    pgoff: u64,
+    filename: *mut c_char,
+    trace_off: u64,
+}
+
+/// The header of each chunk of a compressed trace, which is followed by one zstd frame of
+/// `raw_len` bytes.
+///
+// Must stay in sync with the C code.
+#[repr(C)]
+struct CompressedChunk {
+    raw_len: u64,
+    compressed_len: u64,
 }
 
 impl PerfTrace {
-    /// Makes a new trace, initially allocating the specified number of bytes for the PT trace
-    /// packet buffer.
+    /// Makes a new trace, initially allocating (at least) the specified number of bytes for the PT
+    /// trace packet buffer from the specified kind of storage. If `sink_dir` is given, the trace is
+    /// instead streamed into a file in that directory.
     ///
     /// The allocation is automatically freed by Rust when the struct falls out of scope.
-    pub(crate) fn new(capacity: size_t) -> Result<Self, HWTracerError> {
-        let buf = unsafe { malloc(capacity) as *mut u8 };
-        if buf.is_null() {
-            return Err(HWTracerError::Unknown);
-        }
-        Ok(Self {
-            buf: PerfTraceBuf(buf),
+    pub(crate) fn new(
+        capacity: size_t,
+        storage: PerfTraceStorage,
+        sink_dir: Option<&CStr>,
+    ) -> Result<Self, HWTracerError> {
+        let mut trace = Self {
+            buf: PerfTraceBuf(ptr::null_mut()),
             len: 0,
-            capacity: capacity as u64,
-        })
+            capacity: 0,
+            aux_ctx: ptr::null_mut(),
+            aux_start: 0,
+            zero_copy: false,
+            storage: ptr::null_mut(),
+            lossy: false,
+            reenable_fd: -1,
+            gaps: ptr::null_mut(),
+            ngaps: 0,
+            gaps_cap: 0,
+            stats: CollectionStats::default(),
+            sink_fd: -1,
+            sink_pipe: [-1, -1],
+            sink_map: ptr::null_mut(),
+            sink_map_len: 0,
+            published_len: AtomicU64::new(0),
+            zcctx: ptr::null_mut(),
+            compressed: false,
+            raw_len: 0,
+            per_cpu: false,
+            chunks: ptr::null_mut(),
+            nchunks: 0,
+            chunks_cap: 0,
+            mmaps: ptr::null_mut(),
+            nmmaps: 0,
+            mmaps_cap: 0,
+            decompressed: OnceLock::new(),
+            mmap_list: OnceLock::new(),
+            storage_kind: storage,
+        };
+        let sink_dir = sink_dir.map_or(ptr::null(), |d| d.as_ptr());
+        let mut cerr = PerfPTCError::new();
+        if !unsafe { hwt_perf_init_trace(&mut trace, capacity, storage, sink_dir, &mut cerr) } {
+            // The C code has already cleaned up. Don't free twice.
+            std::mem::forget(trace);
+            return Err(cerr.into());
+        }
+        Ok(trace)
+    }
+
+    /// The bytes of `buf`, which may be compressed.
+    fn stored_bytes(&self) -> &[u8] {
+        // An empty trace may have no buffer at all.
+        if self.len == 0 {
+            return &[];
+        }
+        unsafe { slice::from_raw_parts(self.buf.0, usize::try_from(self.len).unwrap()) }
+    }
+
+    /// Which thread wrote which part of a per-CPU trace.
+    fn chunks(&self) -> &[PerfAuxChunk] {
+        if self.nchunks == 0 {
+            &[]
+        } else {
+            unsafe { slice::from_raw_parts(self.chunks, self.nchunks) }
+        }
+    }
+
+    /// Decompress a compressed trace. If a chunk can't be decompressed, the trace is cut short
+    /// before it: decoding it chunk by chunk (see [Trace::frames]) reports the error.
+    fn decompress(&self) -> Vec<u8> {
+        let mut raw = Vec::with_capacity(usize::try_from(self.raw_len).unwrap());
+        for frame in (CompressedFrames {
+            stored: self.stored_bytes(),
+        }) {
+            match frame {
+                Ok(f) => raw.extend_from_slice(&f),
+                Err(_) => break,
+            }
+        }
+        raw
+    }
+}
+
+/// Iterates over the decompressed chunks of a compressed trace.
+struct CompressedFrames<'a> {
+    /// The chunks yet to be decompressed.
+    stored: &'a [u8],
+}
+
+impl<'a> Iterator for CompressedFrames<'a> {
+    type Item = Result<Vec<u8>, HWTracerError>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.stored.is_empty() {
+            return None;
+        }
+        let bad = || HWTracerError::TraceParseError("corrupt compressed trace chunk".to_owned());
+        let stored = mem::take(&mut self.stored);
+        if stored.len() < mem::size_of::<CompressedChunk>() {
+            return Some(Err(bad()));
+        }
+        // The C code wrote the headers unaligned.
+        let chunk = unsafe { ptr::read_unaligned(stored.as_ptr() as *const CompressedChunk) };
+        let (raw_len, frame_len) = match (
+            usize::try_from(chunk.raw_len),
+            usize::try_from(chunk.compressed_len),
+        ) {
+            (Ok(r), Ok(f)) if f <= stored.len() - mem::size_of::<CompressedChunk>() => (r, f),
+            _ => return Some(Err(bad())),
+        };
+        let frame = &stored[mem::size_of::<CompressedChunk>()..][..frame_len];
+        let mut raw = Vec::with_capacity(raw_len);
+        let got = unsafe {
+            zstd_sys::ZSTD_decompress(
+                raw.as_mut_ptr() as *mut c_void,
+                raw_len,
+                frame.as_ptr() as *const c_void,
+                frame.len(),
+            )
+        };
+        // Errors are returned as (huge) error codes, so can't be mistaken for the right length.
+        if got != raw_len {
+            return Some(Err(bad()));
+        }
+        unsafe { raw.set_len(raw_len) };
+        self.stored = &stored[mem::size_of::<CompressedChunk>() + frame_len..];
+        Some(Ok(raw))
     }
 }
 
@@ -203,18 +1082,75 @@ impl Trace for PerfTrace {
     fn to_file(&self, file: &mut File) {
         use std::io::prelude::*;
 
-        let slice = unsafe { slice::from_raw_parts(self.buf.0 as *const u8, self.len as usize) };
-        file.write_all(slice).unwrap();
+        file.write_all(self.bytes()).unwrap();
     }
 
-    /// Return the raw bytes of the trace.
+    /// Return the raw bytes of the trace, decompressing them first (once) if need be. Decoders
+    /// don't need them all at once (see [Trace::frames]), so usually never do so.
     fn bytes(&self) -> &[u8] {
-        unsafe { slice::from_raw_parts(self.buf.0, usize::try_from(self.len).unwrap()) }
+        if self.compressed {
+            return self.decompressed.get_or_init(|| self.decompress());
+        }
+        self.stored_bytes()
     }
 
     /// Return the length of the trace, in bytes.
     fn len(&self) -> usize {
-        usize::try_from(self.len).unwrap()
+        usize::try_from(if self.compressed {
+            self.raw_len
+        } else {
+            self.len
+        })
+        .unwrap()
+    }
+
+    fn gaps(&self) -> &[usize] {
+        if self.ngaps == 0 {
+            &[]
+        } else {
+            unsafe { slice::from_raw_parts(self.gaps, self.ngaps) }
+        }
+    }
+
+    fn is_lossy(&self) -> bool {
+        self.lossy
+    }
+
+    fn frames(&self) -> Option<Box<dyn Iterator<Item = Result<Vec<u8>, HWTracerError>> + '_>> {
+        if !self.compressed {
+            return None;
+        }
+        Some(Box::new(CompressedFrames {
+            stored: self.stored_bytes(),
+        }))
+    }
+
+    fn collection_stats(&self) -> Option<&CollectionStats> {
+        Some(&self.stats)
+    }
+
+    fn mmaps(&self) -> &[Mmap] {
+        self.mmap_list.get_or_init(|| {
+            if self.nmmaps == 0 {
+                return Vec::new();
+            }
+            unsafe { slice::from_raw_parts(self.mmaps, self.nmmaps) }
+                .iter()
+                .map(|m| Mmap {
+                    vaddr: m.addr,
+                    len: m.len,
+                    offset: m.pgoff,
+                    path: PathBuf::from(OsStr::from_bytes(
+                        unsafe { CStr::from_ptr(m.filename) }.to_bytes(),
+                    )),
+                    trace_offset: usize::try_from(m.trace_off).unwrap(),
+                })
+                .collect()
+        })
+    }
+
+    fn into_storage(self: Box<Self>) -> Option<TraceStorage> {
+        Some(TraceStorage { perf: self })
     }
 
     #[cfg(test)]
@@ -225,23 +1161,28 @@ impl Trace for PerfTrace {
 
 impl Drop for PerfTrace {
     fn drop(&mut self) {
-        if !self.buf.0.is_null() {
-            unsafe { free(self.buf.0 as *mut c_void) };
-        }
+        unsafe { hwt_perf_free_trace(self) };
     }
 }
 
 #[cfg(test)]
 mod tests {
-    use super::{PerfCollectorConfig, PerfThreadTraceCollector};
+    use super::{
+        AuxBudget, CompressedFrames, PerfCConfig, PerfCollectorConfig, PerfDrainMode,
+        PerfThreadTraceCollector, PerfTraceStorage, TraceSink,
+    };
     use crate::{
         collect::{
-            test_helpers, ThreadTraceCollector, TraceCollector, TraceCollectorBuilder,
+            test_helpers, AddrFilter, ThreadTraceCollector, TraceCollector, TraceCollectorBuilder,
             TraceCollectorConfig, TraceCollectorKind,
         },
+        decode::TraceDecoderBuilder,
         errors::HWTracerError,
         test_helpers::work_loop,
+        Trace,
     };
+    use std::{ffi::CString, fs, os::unix::ffi::OsStringExt, sync::Arc, thread};
+    use tempfile::TempDir;
 
     fn mk_collector() -> TraceCollector {
         TraceCollectorBuilder::new()
@@ -260,6 +1201,27 @@ mod tests {
         test_helpers::repeated_collection(mk_collector());
     }
 
+    #[test]
+    fn recycled_collection() {
+        test_helpers::recycled_collection(mk_collector());
+
+        // A trace from another collector is reused only if its storage is of the right kind.
+        let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+        match bldr.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                ppt_conf.storage = PerfTraceStorage::Heap;
+            }
+        }
+        let heap_tc = bldr.build().unwrap();
+        let tc = mk_collector();
+        let heap_trace = test_helpers::trace_closure(&heap_tc, || work_loop(500));
+        let heap_buf = heap_trace.bytes().as_ptr();
+        tc.recycle_trace(heap_trace);
+        let trace = test_helpers::trace_closure(&tc, || work_loop(500));
+        assert_ne!(trace.bytes().as_ptr(), heap_buf);
+        assert_ne!(trace.len(), 0);
+    }
+
     #[test]
     pub fn repeated_collection_different_collectors() {
         let tcs = [
@@ -303,7 +1265,9 @@ mod tests {
         let start_bufsize = 512;
         let mut config = PerfCollectorConfig::default();
         config.initial_trace_bufsize = start_bufsize;
-        let mut tracer = PerfThreadTraceCollector::new(config);
+        // Pooled storage would start out bigger than the trace.
+        config.storage = PerfTraceStorage::Heap;
+        let mut tracer = PerfThreadTraceCollector::new(PerfCConfig::new(&config).unwrap(), None);
 
         tracer.start_collector().unwrap();
         let res = work_loop(10000);
@@ -313,6 +1277,724 @@ mod tests {
         assert!(trace.capacity() > start_bufsize);
     }
 
+    /// Check that pooled storage grows chunk by chunk, without moving what's already collected,
+    /// and that the data is appended intact across the chunk boundaries.
+    #[test]
+    fn pooled_storage_growth() {
+        const CHUNK_SIZE: usize = 2 * 1024 * 1024;
+        let mut config = PerfCollectorConfig::default();
+        config.storage = PerfTraceStorage::Pooled;
+        let mut tracer = PerfThreadTraceCollector::new(PerfCConfig::new(&config).unwrap(), None);
+
+        let mut iters = 100000;
+        let trace = loop {
+            tracer.start_collector().unwrap();
+            println!("{}", work_loop(iters));
+            let trace = tracer.stop_collector().unwrap();
+            if trace.len() > 2 * CHUNK_SIZE || iters >= 10_000_000 {
+                break trace;
+            }
+            iters *= 4;
+        };
+        assert!(trace.len() > 2 * CHUNK_SIZE);
+        assert_eq!(trace.capacity() % CHUNK_SIZE, 0);
+        let stats = trace.collection_stats().unwrap();
+        assert!(stats.reallocs > 0);
+        assert_eq!(stats.realloc_bytes_moved, 0);
+
+        // Each chunk carries on where the last left off, so there are PSBs throughout, and the
+        // trace decodes from start to end.
+        let bytes = trace.bytes();
+        for chunk in bytes.chunks_exact(CHUNK_SIZE) {
+            assert!(chunk.windows(2).any(|w| w == [0x02, 0x82]));
+        }
+        let mut blocks = Vec::new();
+        TraceDecoderBuilder::new()
+            .build()
+            .unwrap()
+            .decode_into(&*trace, &mut blocks)
+            .unwrap();
+        assert!(!blocks.is_empty());
+    }
+
+    /// Check that reused contexts give the same kind of traces as fresh ones: non-empty and
+    /// starting with a PSB packet.
+    #[test]
+    fn reuse_ctx() {
+        let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+        match bldr.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => ppt_conf.reuse_ctx = true,
+        }
+        let tc = bldr.build().unwrap();
+        for _ in 0..10 {
+            let trace = test_helpers::trace_closure(&tc, || work_loop(500));
+            assert_ne!(trace.len(), 0);
+            assert_eq!(&trace.bytes()[..2], &[0x02, 0x82]);
+            // If the hardware didn't start the trace with a PSB, the loss isn't hidden.
+            let lost = trace.collection_stats().unwrap().bytes_before_psb;
+            assert_eq!(lost != 0, trace.gaps().first() == Some(&0));
+        }
+    }
+
+    /// Check that collection via the shared drain thread works, including when several threads are
+    /// being traced at once.
+    #[test]
+    fn shared_drain() {
+        let mk = || {
+            let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+            match bldr.config() {
+                TraceCollectorConfig::Perf(ref mut ppt_conf) => ppt_conf.shared_drain = true,
+            }
+            bldr.build().unwrap()
+        };
+        test_helpers::basic_collection(mk());
+        test_helpers::repeated_collection(mk());
+        test_helpers::concurrent_collection(mk());
+    }
+
+    /// Check that a trace streamed into a file looks like one collected into memory, and that the
+    /// file doesn't outlive the trace.
+    #[test]
+    fn directory_sink() {
+        let dir = TempDir::new().unwrap();
+        let mk = || {
+            let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+            match bldr.config() {
+                TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                    ppt_conf.sink = TraceSink::Directory(dir.path().to_owned());
+                }
+            }
+            bldr.build().unwrap()
+        };
+        test_helpers::basic_collection(mk());
+        test_helpers::repeated_collection(mk());
+        test_helpers::concurrent_collection(mk());
+
+        let tc = mk();
+        let trace = test_helpers::trace_closure(&tc, || work_loop(10000));
+        assert_eq!(&trace.bytes()[..2], &[0x02, 0x82]);
+        assert_eq!(
+            trace.collection_stats().unwrap().bytes_drained,
+            trace.len() as u64
+        );
+        // The file is anonymous.
+        assert_eq!(fs::read_dir(dir.path()).unwrap().count(), 0);
+
+        let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+        match bldr.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                ppt_conf.sink = TraceSink::Directory(dir.path().to_owned());
+                ppt_conf.zero_copy = true;
+            }
+        }
+        match bldr.build() {
+            Err(HWTracerError::BadConfig(s)) => assert_eq!(
+                s,
+                "a Directory sink can't be combined with zero_copy or flight_recorder"
+            ),
+            _ => panic!(),
+        }
+    }
+
+    /// Check that when the trace storage can't be made, the collector context doesn't outlive the
+    /// failed start.
+    #[test]
+    fn start_failure_releases_ctx() {
+        let dir = TempDir::new().unwrap();
+        let missing = CString::new(dir.path().join("missing").into_os_string().into_vec()).unwrap();
+        for reuse_ctx in [false, true] {
+            let mut config = PerfCollectorConfig::default();
+            config.reuse_ctx = reuse_ctx;
+            let mut tracer =
+                PerfThreadTraceCollector::new(PerfCConfig::new(&config).unwrap(), None);
+            tracer.sink_dir = Some(missing.clone());
+            for _ in 0..3 {
+                assert!(tracer.start_collector().is_err());
+                assert!(tracer.ctx.is_null());
+            }
+        }
+    }
+
+    /// Check that a failed start gives back the AUX budget it reserved.
+    #[test]
+    fn start_failure_releases_aux_budget() {
+        let dir = TempDir::new().unwrap();
+        let missing = CString::new(dir.path().join("missing").into_os_string().into_vec()).unwrap();
+        let budget = Arc::new(AuxBudget::new(1024));
+        let mut tracer = PerfThreadTraceCollector::new(
+            PerfCConfig::new(&PerfCollectorConfig::default()).unwrap(),
+            None,
+        );
+        tracer.aux_budget = Some(Arc::clone(&budget));
+        tracer.sink_dir = Some(missing);
+        for _ in 0..3 {
+            assert!(tracer.start_collector().is_err());
+            assert_eq!(tracer.aux_reserved, 0);
+            assert_eq!(*budget.used.lock().unwrap(), 0);
+        }
+
+        // And that the budget can then be used in full.
+        tracer.sink_dir = None;
+        tracer.start_collector().unwrap();
+        println!("{}", work_loop(10));
+        tracer.stop_collector().unwrap();
+        assert_eq!(*budget.used.lock().unwrap(), 0);
+    }
+
+    /// Check that the collection statistics add up.
+    #[test]
+    fn collection_stats() {
+        let mut config = PerfCollectorConfig::default();
+        config.initial_trace_bufsize = 512;
+        config.storage = PerfTraceStorage::Heap;
+        let mut tracer = PerfThreadTraceCollector::new(PerfCConfig::new(&config).unwrap(), None);
+        tracer.start_collector().unwrap();
+        let res = work_loop(10000);
+        let trace = tracer.stop_collector().unwrap();
+        println!("res: {}", res); // Stop over-optimisation.
+        let stats = trace.collection_stats().unwrap();
+        // Bytes discarded from before the first PSB are counted as drained.
+        assert!(stats.bytes_drained >= trace.len() as u64);
+        assert!(stats.bytes_drained > 0);
+        assert!(stats.wakeups > 0);
+        assert!(stats.aux_records > 0);
+        // The trace didn't fit in the initial buffer.
+        assert!(stats.reallocs > 0);
+        assert!(stats.max_aux_fill > 0);
+        assert!(stats.max_aux_fill <= stats.bytes_drained);
+        assert!(stats.stop_ns > 0);
+    }
+
+    /// Check that collection works in the non-default drain modes, including with the shared drain
+    /// thread where that's allowed.
+    #[test]
+    fn drain_modes() {
+        let mk = |drain_mode, shared_drain| {
+            let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+            match bldr.config() {
+                TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                    ppt_conf.drain_mode = drain_mode;
+                    ppt_conf.shared_drain = shared_drain;
+                }
+            }
+            bldr.build()
+        };
+        for (drain_mode, shared_drain) in [
+            (PerfDrainMode::BusyPoll, false),
+            (PerfDrainMode::Adaptive, false),
+            (PerfDrainMode::Adaptive, true),
+        ] {
+            test_helpers::basic_collection(mk(drain_mode, shared_drain).unwrap());
+            test_helpers::repeated_collection(mk(drain_mode, shared_drain).unwrap());
+            test_helpers::concurrent_collection(mk(drain_mode, shared_drain).unwrap());
+        }
+        match mk(PerfDrainMode::BusyPoll, true) {
+            Err(HWTracerError::BadConfig(s)) => {
+                assert_eq!(s, "drain_mode BusyPoll can't be combined with shared_drain")
+            }
+            _ => panic!(),
+        }
+    }
+
+    /// Check that all kinds of trace storage give the same kind of traces, including when they have
+    /// to grow.
+    #[test]
+    fn trace_storage() {
+        for storage in [
+            PerfTraceStorage::Heap,
+            PerfTraceStorage::Pooled,
+            PerfTraceStorage::PooledHugePages,
+        ] {
+            let mut config = PerfCollectorConfig::default();
+            config.initial_trace_bufsize = 512;
+            config.storage = storage;
+            let mut tracer =
+                PerfThreadTraceCollector::new(PerfCConfig::new(&config).unwrap(), None);
+            for _ in 0..3 {
+                tracer.start_collector().unwrap();
+                let res = work_loop(10000);
+                let trace = tracer.stop_collector().unwrap();
+                println!("res: {}", res); // Stop over-optimisation.
+                assert!(trace.capacity() >= trace.len());
+                assert_eq!(&trace.bytes()[..2], &[0x02, 0x82]);
+            }
+        }
+    }
+
+    /// Check that zero-copy traces look like normal ones, and that they may outlive (and be dropped
+    /// on a different thread to) the collector context that they borrow from.
+    #[test]
+    fn zero_copy() {
+        let mk = |reuse_ctx| {
+            let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+            match bldr.config() {
+                TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                    ppt_conf.zero_copy = true;
+                    ppt_conf.reuse_ctx = reuse_ctx;
+                }
+            }
+            bldr.build().unwrap()
+        };
+        for reuse_ctx in [false, true] {
+            let tc = mk(reuse_ctx);
+            let mut traces = Vec::new();
+            for _ in 0..5 {
+                let trace = test_helpers::trace_closure(&tc, || work_loop(500));
+                assert_ne!(trace.len(), 0);
+                assert_eq!(&trace.bytes()[..2], &[0x02, 0x82]);
+                traces.push(trace);
+            }
+            thread::spawn(move || drop(traces)).join().unwrap();
+        }
+    }
+
+    /// Check that a busy-polling drain thread doesn't spin on zero-copy data it has already seen.
+    #[test]
+    fn zero_copy_busy_poll() {
+        let mut config = PerfCollectorConfig::default();
+        config.zero_copy = true;
+        config.drain_mode = PerfDrainMode::BusyPoll;
+        let mut tracer = PerfThreadTraceCollector::new(PerfCConfig::new(&config).unwrap(), None);
+        tracer.start_collector().unwrap();
+        let res = work_loop(10000);
+        let trace = tracer.stop_collector().unwrap();
+        println!("res: {}", res); // Stop over-optimisation.
+        assert_eq!(&trace.bytes()[..2], &[0x02, 0x82]);
+        // The buffers are only looked at when something new arrives, which is announced by a
+        // record (or is picked up by the final drain).
+        let stats = trace.collection_stats().unwrap();
+        assert!(stats.wakeups <= 2 * stats.aux_records + 2);
+    }
+
+    /// Check that once a zero-copy trace is dropped, the AUX buffer it borrowed is handed back in
+    /// full, so that later sessions on the reused context (which here each fill most of a small
+    /// AUX buffer) neither see stale data nor find the buffer already full.
+    #[test]
+    fn zero_copy_release_reused() {
+        let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+        match bldr.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                ppt_conf.zero_copy = true;
+                ppt_conf.reuse_ctx = true;
+                ppt_conf.aux_bufsize = 8;
+            }
+        }
+        let tc = bldr.build().unwrap();
+        for _ in 0..10 {
+            let trace = test_helpers::trace_closure(&tc, || work_loop(10000));
+            assert_ne!(trace.len(), 0);
+            assert_eq!(&trace.bytes()[..2], &[0x02, 0x82]);
+            drop(trace);
+        }
+    }
+
+    /// Check that a zero-copy session which fills most of the AUX buffer falls back to copying.
+    #[test]
+    fn zero_copy_spill() {
+        let mut config = PerfCollectorConfig::default();
+        config.zero_copy = true;
+        config.aux_bufsize = 8;
+        config.initial_trace_bufsize = 512;
+        let mut tracer = PerfThreadTraceCollector::new(PerfCConfig::new(&config).unwrap(), None);
+
+        tracer.start_collector().unwrap();
+        let res = work_loop(10000);
+        let trace = tracer.stop_collector().unwrap();
+
+        println!("res: {}", res); // Stop over-optimisation.
+        assert!(trace.capacity() > 512);
+        assert_eq!(&trace.bytes()[..2], &[0x02, 0x82]);
+    }
+
+    fn mk_flight_recorder() -> TraceCollector {
+        let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+        match bldr.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                ppt_conf.flight_recorder = true;
+                ppt_conf.aux_bufsize = 64;
+            }
+        }
+        bldr.build().unwrap()
+    }
+
+    /// Check that a flight recorder keeps (only) recent trace data, starting with a PSB, both in
+    /// snapshots and when stopped.
+    #[test]
+    fn flight_recorder() {
+        let tc = mk_flight_recorder();
+        let aux_size = 64 * unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+        tc.start_thread_collector().unwrap();
+        for _ in 0..3 {
+            println!("res: {}", work_loop(10000)); // Stop over-optimisation.
+            let snap = tc.snapshot_thread_collector().unwrap();
+            assert_ne!(snap.len(), 0);
+            assert!(snap.len() <= aux_size);
+            assert_eq!(&snap.bytes()[..2], &[0x02, 0x82]);
+        }
+        let trace = tc.stop_thread_collector().unwrap();
+        assert_ne!(trace.len(), 0);
+        assert!(trace.len() <= aux_size);
+        assert_eq!(&trace.bytes()[..2], &[0x02, 0x82]);
+
+        test_helpers::repeated_collection(mk_flight_recorder());
+        test_helpers::concurrent_collection(mk_flight_recorder());
+    }
+
+    /// Check that snapshots are refused unless the collector is a flight recorder.
+    #[test]
+    fn snapshot_needs_flight_recorder() {
+        let tc = mk_collector();
+        match tc.snapshot_thread_collector() {
+            Err(HWTracerError::AlreadyStopped) => (),
+            _ => panic!(),
+        }
+        tc.start_thread_collector().unwrap();
+        match tc.snapshot_thread_collector() {
+            Err(HWTracerError::BadConfig(s)) => assert_eq!(s, "snapshots require flight_recorder"),
+            _ => panic!(),
+        }
+        tc.stop_thread_collector().unwrap();
+    }
+
+    /// Check that tracing can be restricted to the main executable.
+    #[test]
+    fn addr_filter_object() {
+        let exe = std::env::current_exe().unwrap();
+        let tc = match TraceCollectorBuilder::new()
+            .kind(TraceCollectorKind::Perf)
+            .addr_filter(AddrFilter::Object(exe))
+            .build()
+        {
+            Ok(tc) => tc,
+            Err(HWTracerError::BadConfig(s)) if s.contains("the hardware supports") => return,
+            Err(e) => panic!("{}", e),
+        };
+        test_helpers::basic_collection(tc);
+    }
+
+    /// Check that asking for more filters than the hardware supports causes an error.
+    #[test]
+    fn addr_filter_too_many() {
+        let start = work_loop as usize;
+        let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+        for _ in 0..64 {
+            bldr = bldr.addr_filter(AddrFilter::Range { start, size: 1 });
+        }
+        match bldr.build() {
+            Err(HWTracerError::BadConfig(s)) => {
+                assert!(s.starts_with("64 address filters needed"))
+            }
+            _ => panic!(),
+        }
+    }
+
+    /// Check that filtering on an unknown symbol causes an error.
+    #[test]
+    fn addr_filter_bad_symbol() {
+        let res = TraceCollectorBuilder::new()
+            .kind(TraceCollectorKind::Perf)
+            .addr_filter(AddrFilter::Symbol("__hwtracer_no_such_symbol".into()))
+            .build();
+        match res {
+            Err(HWTracerError::BadConfig(s)) => {
+                assert_eq!(s, "can't find symbol: __hwtracer_no_such_symbol")
+            }
+            _ => panic!(),
+        }
+    }
+
+    /// Check that traces can be collected with non-default packet options.
+    #[test]
+    fn pt_options() {
+        let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+        match bldr.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                ppt_conf.tsc = Some(false);
+                ppt_conf.noretcomp = Some(true);
+            }
+        }
+        test_helpers::basic_collection(bldr.build().unwrap());
+    }
+
+    /// Check that a lossy collector with a tiny AUX buffer gives a trace (with gaps) instead of an
+    /// error, that the gaps are in range, and that collection carries on after data is lost.
+    #[test]
+    fn lossy() {
+        let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+        match bldr.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                ppt_conf.lossy = true;
+                ppt_conf.aux_bufsize = 1;
+            }
+        }
+        let tc = bldr.build().unwrap();
+        let trace = test_helpers::trace_closure(&tc, || work_loop(50000));
+        assert!(trace.is_lossy());
+        assert_ne!(trace.len(), 0);
+        let gaps = trace.gaps();
+        assert!(!gaps.is_empty());
+        assert!(gaps.windows(2).all(|w| w[0] < w[1]));
+        assert!(gaps.iter().all(|g| *g <= trace.len()));
+        // The kernel disables the event when data is lost, so this shows that it was re-enabled.
+        assert!(*gaps.last().unwrap() < trace.len());
+
+        let mut blocks = Vec::new();
+        TraceDecoderBuilder::new()
+            .build()
+            .unwrap()
+            .decode_into(&*trace, &mut blocks)
+            .unwrap();
+        let first_gap = blocks.iter().position(|b| b.is_gap()).unwrap();
+        assert!(blocks[first_gap..].iter().any(|b| !b.is_gap()));
+    }
+
+    /// Check that chunks of a compressed trace which can't be decompressed are errors.
+    #[test]
+    fn compressed_frames_bad() {
+        let chunk = |raw_len: u64, compressed_len: u64| {
+            let mut c = raw_len.to_ne_bytes().to_vec();
+            c.extend_from_slice(&compressed_len.to_ne_bytes());
+            c
+        };
+        let mut not_zstd = chunk(4, 0);
+        not_zstd.extend_from_slice(&[0; 4]);
+        for stored in [
+            chunk(4, 0)[..10].to_vec(),
+            chunk(4, 100),
+            chunk(4, u64::MAX),
+            not_zstd,
+        ] {
+            let mut frames = CompressedFrames { stored: &stored };
+            assert!(matches!(
+                frames.next(),
+                Some(Err(HWTracerError::TraceParseError(_)))
+            ));
+            assert!(frames.next().is_none());
+        }
+    }
+
+    /// Check that a compressed trace, drained many times over, reads back as a normal trace.
+    #[test]
+    fn compress() {
+        let mut config = PerfCollectorConfig::default();
+        config.compress = true;
+        config.aux_bufsize = 8;
+        for storage in [PerfTraceStorage::Heap, PerfTraceStorage::Pooled] {
+            config.storage = storage;
+            let mut tracer =
+                PerfThreadTraceCollector::new(PerfCConfig::new(&config).unwrap(), None);
+            tracer.start_collector().unwrap();
+            let res = work_loop(100000);
+            let trace = tracer.stop_collector().unwrap();
+            println!("res: {}", res); // Stop over-optimisation.
+            let stats = trace.collection_stats().unwrap();
+            assert!(stats.wakeups > 1);
+            assert_eq!(stats.bytes_drained, trace.len() as u64);
+            assert_eq!(trace.bytes().len(), trace.len());
+            assert_eq!(&trace.bytes()[..2], &[0x02, 0x82]);
+
+            let mut blocks = Vec::new();
+            TraceDecoderBuilder::new()
+                .build()
+                .unwrap()
+                .decode_into(&*trace, &mut blocks)
+                .unwrap();
+            assert!(!blocks.is_empty());
+
+            // The decompressed frames make up the trace.
+            let frames = trace
+                .frames()
+                .unwrap()
+                .collect::<Result<Vec<_>, _>>()
+                .unwrap();
+            assert!(frames.len() > 1);
+            assert_eq!(frames.concat(), trace.bytes());
+        }
+
+        let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+        match bldr.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                ppt_conf.compress = true;
+                ppt_conf.zero_copy = true;
+            }
+        }
+        match bldr.build() {
+            Err(HWTracerError::BadConfig(s)) => assert_eq!(
+                s,
+                "compress can't be combined with zero_copy, flight_recorder, reuse_ctx or a \
+                 Directory sink"
+            ),
+            _ => panic!(),
+        }
+    }
+
+    #[test]
+    fn aux_budget_reserve() {
+        let budget = AuxBudget::new(96);
+        assert_eq!(budget.reserve(64, 8), Some(64));
+        // Only 32 pages are left.
+        assert_eq!(budget.reserve(64, 8), Some(32));
+        assert_eq!(budget.reserve(64, 8), None);
+        budget.release(32);
+        assert_eq!(budget.reserve(16, 8), Some(16));
+        assert_eq!(budget.reserve(16, 32), None);
+        budget.release(64);
+        assert_eq!(budget.reserve(128, 1), Some(64));
+    }
+
+    /// Check that with an AUX budget, buffers are sized to what threads need, and that threads
+    /// together stay within the budget.
+    #[test]
+    fn aux_budget() {
+        let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as u64;
+        let mk = |budget| {
+            let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+            match bldr.config() {
+                TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                    ppt_conf.aux_bufsize = 1024;
+                    ppt_conf.min_aux_bufsize = 16;
+                    ppt_conf.aux_budget = Some(budget);
+                }
+            }
+            bldr.build()
+        };
+
+        // Knowing nothing, the first session gets the biggest buffer. Later sessions which trace
+        // little get less.
+        let tc = mk(1024).unwrap();
+        let sizes = (0..3)
+            .map(|_| {
+                let trace = test_helpers::trace_closure(&tc, || work_loop(10));
+                trace.collection_stats().unwrap().aux_bufsize
+            })
+            .collect::<Vec<_>>();
+        assert_eq!(sizes[0], 1024 * page_size);
+        assert!(sizes[2] < sizes[0]);
+        assert!(sizes[2] >= 16 * page_size);
+
+        // Threads share the budget.
+        let tc = mk(1024).unwrap();
+        tc.start_thread_collector().unwrap();
+        thread::scope(|s| {
+            s.spawn(|| {
+                assert!(matches!(
+                    tc.start_thread_collector(),
+                    Err(HWTracerError::Errno(libc::ENOMEM))
+                ));
+            });
+        });
+        println!("{}", work_loop(10));
+        tc.stop_thread_collector().unwrap();
+        test_helpers::concurrent_collection(mk(2048).unwrap());
+
+        match mk(8) {
+            Err(HWTracerError::BadConfig(s)) => assert_eq!(
+                s,
+                "aux_budget must be at least min_aux_bufsize (or aux_bufsize, if smaller)"
+            ),
+            _ => panic!(),
+        }
+    }
+
+    /// Check that executable mappings made while collecting are kept with the trace, and that the
+    /// trace still decodes with them.
+    #[test]
+    fn record_mmaps() {
+        use std::os::unix::io::AsRawFd;
+
+        let mut config = PerfCollectorConfig::default();
+        config.record_mmaps = true;
+        let mut tracer = PerfThreadTraceCollector::new(PerfCConfig::new(&config).unwrap(), None);
+        let exe = std::env::current_exe().unwrap();
+        let file = fs::File::open(&exe).unwrap();
+        tracer.start_collector().unwrap();
+        let addr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                4096,
+                libc::PROT_READ | libc::PROT_EXEC,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        println!("{}", work_loop(500));
+        let trace = tracer.stop_collector().unwrap();
+        assert_ne!(addr, libc::MAP_FAILED);
+        unsafe { libc::munmap(addr, 4096) };
+
+        let m = trace
+            .mmaps()
+            .iter()
+            .find(|m| m.vaddr == addr as u64)
+            .unwrap();
+        assert_eq!((m.len, m.offset), (4096, 0));
+        assert_eq!(m.path, exe);
+        assert!(m.trace_offset <= trace.len());
+        let mut blocks = Vec::new();
+        TraceDecoderBuilder::new()
+            .build()
+            .unwrap()
+            .decode_into(&*trace, &mut blocks)
+            .unwrap();
+        assert!(!blocks.is_empty());
+
+        // Nothing is recorded unless asked for.
+        let tc = mk_collector();
+        let trace = test_helpers::trace_closure(&tc, || work_loop(500));
+        assert!(trace.mmaps().is_empty());
+    }
+
+    /// Check that collecting per CPU gives a trace of each thread created while collecting, as
+    /// well as of the thread that started collecting.
+    #[test]
+    fn per_cpu() {
+        let tc = mk_collector();
+        let col = tc.start_cpu_collector().unwrap();
+        let tids = thread::scope(|s| {
+            let hndls = (0..3)
+                .map(|_| {
+                    s.spawn(|| {
+                        println!("{}", work_loop(5000));
+                        unsafe { libc::syscall(libc::SYS_gettid) as u32 }
+                    })
+                })
+                .collect::<Vec<_>>();
+            println!("{}", work_loop(5000));
+            hndls
+                .into_iter()
+                .map(|h| h.join().unwrap())
+                .collect::<Vec<_>>()
+        });
+        let threads = col.stop().unwrap();
+
+        let me = unsafe { libc::syscall(libc::SYS_gettid) as u32 };
+        let mine = threads.iter().find(|t| t.tid() == me).unwrap();
+        assert_ne!(mine.len(), 0);
+        let dec = TraceDecoderBuilder::new().build().unwrap();
+        for t in &threads {
+            assert!(t.tid() == me || tids.contains(&t.tid()));
+            assert_eq!(t.pid(), std::process::id());
+            if t.len() > 0 {
+                assert_eq!(&t.bytes()[..2], &[0x02, 0x82]);
+                let mut blocks = Vec::new();
+                dec.decode_into(t, &mut blocks).unwrap();
+            }
+        }
+
+        // Normal collection still works afterwards.
+        test_helpers::basic_collection(tc);
+
+        let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+        match bldr.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => ppt_conf.reuse_ctx = true,
+        }
+        match bldr.build().unwrap().start_cpu_collector() {
+            Err(HWTracerError::BadConfig(s)) => assert!(s.starts_with("per-CPU collection")),
+            _ => panic!(),
+        }
+    }
+
     /// Check that an invalid data buffer size causes an error.
     #[test]
     fn test_config_bad_data_bufsize() {
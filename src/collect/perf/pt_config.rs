@@ -0,0 +1,254 @@
+//! Turning the Intel PT options of a `PerfCollectorConfig` into a Perf `attr.config` value.
+
+use crate::{collect::PerfCollectorConfig, errors::HWTracerError};
+use std::{fs, path::Path};
+
+/// Where the kernel describes the Intel PT PMU: `caps/` says what the hardware can do and
+/// `format/` says where each option lives in `attr.config`.
+const PT_SYSFS_PATH: &str = "/sys/bus/event_source/devices/intel_pt";
+
+/// Compute the `attr.config` value for the Intel PT options in `config`, checking that the
+/// hardware and kernel support them.
+///
+/// If no options are set, this is 0, which gets the kernel's defaults (branch tracing only).
+pub(super) fn pt_config(config: &PerfCollectorConfig) -> Result<u64, HWTracerError> {
+    pt_config_from(Path::new(PT_SYSFS_PATH), config)
+}
+
+fn pt_config_from(sysfs: &Path, config: &PerfCollectorConfig) -> Result<u64, HWTracerError> {
+    let any_set = config.psb_period.is_some()
+        || config.noretcomp.is_some()
+        || config.branch.is_some()
+        || config.tsc.is_some()
+        || config.mtc.is_some()
+        || config.mtc_period.is_some()
+        || config.cyc.is_some()
+        || config.cyc_thresh.is_some();
+    if !any_set {
+        return Ok(0);
+    }
+
+    let mut bits = PtConfig { sysfs, config: 0 };
+    // The `pt` bit tells the kernel that we are in charge: without it, branch tracing is forced
+    // on regardless of the `branch` bit.
+    bits.set("pt", 1)?;
+    bits.set_flag("branch", config.branch.unwrap_or(true))?;
+    bits.set_flag("noretcomp", config.noretcomp.unwrap_or(false))?;
+    bits.set_flag("tsc", config.tsc.unwrap_or(false))?;
+
+    if let Some(period) = config.psb_period {
+        bits.require_cap("psb_cyc", "psb_period")?;
+        bits.require_in_mask("psb_periods", "psb_period", period)?;
+        bits.set("psb_period", u64::from(period))?;
+    }
+
+    let mtc = config.mtc.unwrap_or(false);
+    if mtc {
+        bits.require_cap("mtc", "mtc")?;
+        bits.set("mtc", 1)?;
+    }
+    if let Some(period) = config.mtc_period {
+        if !mtc {
+            return Err(HWTracerError::BadConfig("mtc_period requires mtc".into()));
+        }
+        bits.require_in_mask("mtc_periods", "mtc_period", period)?;
+        bits.set("mtc_period", u64::from(period))?;
+    }
+
+    let cyc = config.cyc.unwrap_or(false);
+    if cyc {
+        bits.require_cap("psb_cyc", "cyc")?;
+        bits.set("cyc", 1)?;
+    }
+    if let Some(thresh) = config.cyc_thresh {
+        if !cyc {
+            return Err(HWTracerError::BadConfig("cyc_thresh requires cyc".into()));
+        }
+        bits.require_in_mask("cycle_thresholds", "cyc_thresh", thresh)?;
+        bits.set("cyc_thresh", u64::from(thresh))?;
+    }
+
+    Ok(bits.config)
+}
+
+/// An `attr.config` value under construction.
+struct PtConfig<'a> {
+    sysfs: &'a Path,
+    config: u64,
+}
+
+impl PtConfig<'_> {
+    /// Read a `caps/` file, which holds a (hex) number.
+    fn cap(&self, cap: &str) -> Option<u64> {
+        let s = fs::read_to_string(self.sysfs.join("caps").join(cap)).ok()?;
+        u64::from_str_radix(s.trim(), 16).ok()
+    }
+
+    /// Check that the hardware has the boolean capability `cap`, needed for `option`.
+    fn require_cap(&self, cap: &str, option: &str) -> Result<(), HWTracerError> {
+        match self.cap(cap) {
+            Some(v) if v != 0 => Ok(()),
+            _ => Err(HWTracerError::BadConfig(format!(
+                "{} not supported by hardware",
+                option
+            ))),
+        }
+    }
+
+    /// Check that bit `val` is set in the capability bitmask `cap`, which lists the valid values
+    /// of `option`.
+    fn require_in_mask(&self, cap: &str, option: &str, val: u8) -> Result<(), HWTracerError> {
+        match self.cap(cap) {
+            Some(mask) if val < 64 && mask & (1 << val) != 0 => Ok(()),
+            _ => Err(HWTracerError::BadConfig(format!(
+                "{}={} not supported by hardware",
+                option, val
+            ))),
+        }
+    }
+
+    /// Find the bit range of `field` in `attr.config`, from its `format/` file. The file contains
+    /// something like `config:14-17`, or `config:10` for a single bit.
+    fn field(&self, field: &str) -> Result<(u32, u32), HWTracerError> {
+        let unsupported = || HWTracerError::BadConfig(format!("{} not supported by kernel", field));
+        let s =
+            fs::read_to_string(self.sysfs.join("format").join(field)).map_err(|_| unsupported())?;
+        let bits = s.trim().strip_prefix("config:").ok_or_else(unsupported)?;
+        let (lo, hi) = bits.split_once('-').unwrap_or((bits, bits));
+        match (lo.parse::<u32>(), hi.parse::<u32>()) {
+            (Ok(lo), Ok(hi)) if lo <= hi && hi < 64 => Ok((lo, hi)),
+            _ => Err(unsupported()),
+        }
+    }
+
+    /// Put `val` into `field`.
+    fn set(&mut self, field: &str, val: u64) -> Result<(), HWTracerError> {
+        let (lo, hi) = self.field(field)?;
+        let width = hi - lo + 1;
+        if width < 64 && val >> width != 0 {
+            return Err(HWTracerError::BadConfig(format!(
+                "{}={} out of range",
+                field, val
+            )));
+        }
+        self.config |= val << lo;
+        Ok(())
+    }
+
+    /// Set the single-bit `field` if `on`. Fields which are off needn't exist.
+    fn set_flag(&mut self, field: &str, on: bool) -> Result<(), HWTracerError> {
+        if on {
+            self.set(field, 1)
+        } else {
+            Ok(())
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::pt_config_from;
+    use crate::{collect::PerfCollectorConfig, errors::HWTracerError};
+    use std::fs;
+    use tempfile::TempDir;
+
+    /// Make a fake sysfs directory for a PMU resembling a recent Intel CPU.
+    fn mk_sysfs() -> TempDir {
+        let dir = TempDir::new().unwrap();
+        let caps = [
+            ("psb_cyc", "1"),
+            ("psb_periods", "3f"),
+            ("mtc", "1"),
+            ("mtc_periods", "249"),
+            ("cycle_thresholds", "3fff"),
+        ];
+        let formats = [
+            ("pt", "config:0"),
+            ("cyc", "config:1"),
+            ("mtc", "config:9"),
+            ("tsc", "config:10"),
+            ("noretcomp", "config:11"),
+            ("branch", "config:13"),
+            ("mtc_period", "config:14-17"),
+            ("cyc_thresh", "config:19-22"),
+            ("psb_period", "config:24-27"),
+        ];
+        for (sub, files) in [("caps", &caps[..]), ("format", &formats[..])] {
+            fs::create_dir(dir.path().join(sub)).unwrap();
+            for (name, contents) in files {
+                fs::write(dir.path().join(sub).join(name), format!("{}\n", contents)).unwrap();
+            }
+        }
+        dir
+    }
+
+    #[test]
+    fn defaults() {
+        let sysfs = mk_sysfs();
+        let config = PerfCollectorConfig::default();
+        assert_eq!(pt_config_from(sysfs.path(), &config).unwrap(), 0);
+    }
+
+    #[test]
+    fn options() {
+        let sysfs = mk_sysfs();
+        let mut config = PerfCollectorConfig::default();
+        config.tsc = Some(false);
+        assert_eq!(
+            pt_config_from(sysfs.path(), &config).unwrap(),
+            (1 << 0) | (1 << 13)
+        );
+
+        config.psb_period = Some(2);
+        config.noretcomp = Some(true);
+        config.mtc = Some(true);
+        config.mtc_period = Some(3);
+        config.cyc = Some(true);
+        config.cyc_thresh = Some(1);
+        assert_eq!(
+            pt_config_from(sysfs.path(), &config).unwrap(),
+            (1 << 0)
+                | (1 << 1)
+                | (1 << 9)
+                | (1 << 11)
+                | (1 << 13)
+                | (3 << 14)
+                | (1 << 19)
+                | (2 << 24)
+        );
+
+        config.branch = Some(false);
+        assert_eq!(
+            pt_config_from(sysfs.path(), &config).unwrap() & (1 << 13),
+            0
+        );
+    }
+
+    #[test]
+    fn unsupported() {
+        let sysfs = mk_sysfs();
+        let mut config = PerfCollectorConfig::default();
+        config.psb_period = Some(7);
+        match pt_config_from(sysfs.path(), &config) {
+            Err(HWTracerError::BadConfig(s)) => {
+                assert_eq!(s, "psb_period=7 not supported by hardware")
+            }
+            _ => panic!(),
+        }
+
+        let mut config = PerfCollectorConfig::default();
+        config.mtc_period = Some(3);
+        match pt_config_from(sysfs.path(), &config) {
+            Err(HWTracerError::BadConfig(s)) => assert_eq!(s, "mtc_period requires mtc"),
+            _ => panic!(),
+        }
+
+        fs::remove_file(sysfs.path().join("format").join("noretcomp")).unwrap();
+        let mut config = PerfCollectorConfig::default();
+        config.noretcomp = Some(true);
+        match pt_config_from(sysfs.path(), &config) {
+            Err(HWTracerError::BadConfig(s)) => assert_eq!(s, "noretcomp not supported by kernel"),
+            _ => panic!(),
+        }
+    }
+}
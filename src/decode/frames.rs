@@ -0,0 +1,225 @@
+//! Decoding a trace which comes in frames (see [Trace::frames]), such as a compressed one, without
+//! making all of its bytes at once.
+//!
+//! Frames needn't start at `PSB`s, so they are joined up in a window onto the trace, which is
+//! decoded a chunk (from one `PSB` to a later one) at a time once it holds enough, as in
+//! [stream](super::stream) decoding. The window then moves on past the chunk. Chunks are decoded
+//! and stitched together as in [parallel](super::parallel) decoding.
+
+use crate::{
+    decode::{
+        parallel::{self, Chunk, Chunked},
+        scan::{find_psb, PSB},
+        TraceDecoder,
+    },
+    errors::HWTracerError,
+    Block, Trace,
+};
+
+/// Don't decode less than this many bytes at a time, unless the trace ends.
+const MIN_FRAMES_CHUNK: usize = 1024 * 1024;
+
+/// A trace with frames being decoded a chunk at a time.
+pub(super) struct Windows<'t, D: ?Sized> {
+    decoder: &'t D,
+    trace: &'t dyn Trace,
+    frames: Box<dyn Iterator<Item = Result<Vec<u8>, HWTracerError>> + 't>,
+    /// Set once all frames have been taken.
+    frames_done: bool,
+    /// The least number of bytes to decode at a time.
+    min: usize,
+    /// The bytes of the trace from `base` (0 or the offset of a `PSB`) that have been made so far.
+    window: Vec<u8>,
+    base: usize,
+    /// How far into `window` we have looked for `PSB`s.
+    scanned: usize,
+    /// The offset in `window` of the last `PSB` found after its start, if any.
+    last_psb: Option<usize>,
+    /// The blocks decoded but not yet handed on.
+    blocks: Vec<Block>,
+}
+
+impl<'t, D: TraceDecoder + ?Sized> Windows<'t, D> {
+    /// Decode `trace` with `decoder` frame by frame, or return `None` if `trace` has no frames.
+    pub(super) fn new(decoder: &'t D, trace: &'t dyn Trace) -> Option<Self> {
+        Self::with_min(decoder, trace, MIN_FRAMES_CHUNK)
+    }
+
+    /// Like [Windows::new], decoding at least `min` bytes at a time.
+    fn with_min(decoder: &'t D, trace: &'t dyn Trace, min: usize) -> Option<Self> {
+        Some(Self {
+            decoder,
+            trace,
+            frames: trace.frames()?,
+            frames_done: false,
+            min,
+            window: Vec::new(),
+            base: 0,
+            scanned: 0,
+            last_psb: None,
+            blocks: Vec::new(),
+        })
+    }
+
+    /// Look for `PSB`s in the part of the window not yet scanned.
+    fn scan(&mut self) {
+        while let Some(off) = find_psb(&self.window, self.scanned) {
+            if off > 0 {
+                self.last_psb = Some(off);
+            }
+            self.scanned = off + PSB.len();
+        }
+        // A PSB may straddle the end of the window.
+        self.scanned = self
+            .scanned
+            .max(self.window.len().saturating_sub(PSB.len() - 1));
+    }
+}
+
+impl<'t, D: TraceDecoder + ?Sized> Chunked for Windows<'t, D> {
+    fn decode_next(&mut self) -> Result<bool, HWTracerError> {
+        if self.frames_done {
+            return Ok(false);
+        }
+        // Take frames until the window holds a chunk worth decoding, or the trace ends.
+        let end = loop {
+            if let Some(end) = self.last_psb.filter(|&e| e >= self.min) {
+                break end;
+            }
+            match self.frames.next() {
+                Some(frame) => {
+                    self.window.extend_from_slice(&frame?);
+                    self.scan();
+                }
+                None => {
+                    self.frames_done = true;
+                    break self.window.len();
+                }
+            }
+        };
+        let mut got = Vec::new();
+        let chunk = Chunk::from_bytes(self.trace, &self.window[..end], self.base);
+        self.decoder.decode_into(&chunk, &mut got)?;
+        parallel::append_at(self.trace, self.base, &self.window, &mut self.blocks, got);
+
+        self.window.drain(..end);
+        self.base += end;
+        self.scanned = self.scanned.saturating_sub(end);
+        self.last_psb = None;
+        Ok(true)
+    }
+
+    fn blocks(&mut self) -> &mut Vec<Block> {
+        &mut self.blocks
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Windows;
+    use crate::{
+        collect::{test_helpers::trace_closure, TraceCollectorBuilder},
+        decode::{
+            parallel::{self, Chunked},
+            scan::find_psb,
+            TraceDecoderBuilder,
+        },
+        errors::HWTracerError,
+        test_helpers::work_loop,
+        Trace,
+    };
+    use std::{fs::File, io::Write};
+
+    /// A trace which hands out its bytes in frames of `frame_len` bytes.
+    #[derive(Debug)]
+    struct FramedTrace {
+        bytes: Vec<u8>,
+        frame_len: usize,
+        /// If set, the frame at this index can't be made.
+        bad_frame: Option<usize>,
+    }
+
+    impl Trace for FramedTrace {
+        fn bytes(&self) -> &[u8] {
+            &self.bytes
+        }
+
+        fn capacity(&self) -> usize {
+            self.bytes.len()
+        }
+
+        fn len(&self) -> usize {
+            self.bytes.len()
+        }
+
+        fn frames(&self) -> Option<Box<dyn Iterator<Item = Result<Vec<u8>, HWTracerError>> + '_>> {
+            let bad_frame = self.bad_frame;
+            Some(Box::new(self.bytes.chunks(self.frame_len).enumerate().map(
+                move |(i, f)| match bad_frame {
+                    Some(bad) if bad == i => {
+                        Err(HWTracerError::TraceParseError("bad frame".to_owned()))
+                    }
+                    _ => Ok(f.to_vec()),
+                },
+            )))
+        }
+
+        fn to_file(&self, file: &mut File) {
+            file.write_all(&self.bytes).unwrap();
+        }
+    }
+
+    /// Check that decoding frame by frame, however the frames and chunks fall, gives the same
+    /// blocks as decoding the whole trace at once.
+    #[test]
+    fn matches_whole() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(3000));
+        let dec = TraceDecoderBuilder::new().build().unwrap();
+        let mut expect = Vec::new();
+        dec.decode_into(&*trace, &mut expect).unwrap();
+
+        for (frame_len, min) in [(trace.len() + 1, 1), (4096, 1), (1000, 16 * 1024), (7, 1)] {
+            let framed = FramedTrace {
+                bytes: trace.bytes().to_vec(),
+                frame_len,
+                bad_frame: None,
+            };
+            let mut got = Vec::new();
+            let windows = Windows::with_min(&*dec, &framed, min).unwrap();
+            parallel::decode_chunked(windows, |bs| got.extend(bs)).unwrap();
+            assert_eq!(got, expect);
+
+            // Decoders do the same when given the trace.
+            let mut got = Vec::new();
+            dec.decode_into(&framed, &mut got).unwrap();
+            assert_eq!(got, expect);
+        }
+    }
+
+    /// Check that a frame which can't be made is an error, after the blocks decoded before it.
+    #[test]
+    fn bad_frame() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(3000));
+        // Spoil the frame after the one holding the second PSB, so that there is a chunk before it.
+        let psb = find_psb(trace.bytes(), 1).unwrap();
+        let dec = TraceDecoderBuilder::new().build().unwrap();
+        let framed = FramedTrace {
+            bytes: trace.bytes().to_vec(),
+            frame_len: 1024,
+            bad_frame: Some(psb / 1024 + 1),
+        };
+        let mut windows = Windows::with_min(&*dec, &framed, 1).unwrap();
+        let mut nblocks = 0;
+        let err = loop {
+            match windows.decode_next() {
+                Ok(true) => nblocks += windows.take_final(false).count(),
+                Ok(false) => panic!(),
+                Err(e) => break e,
+            }
+        };
+        assert!(matches!(err, HWTracerError::TraceParseError(_)));
+        assert!(nblocks + windows.take_final(true).count() > 0);
+    }
+}
@@ -0,0 +1,318 @@
+//! A decoder which decodes with the YkPT decoder, falling back to the libipt decoder for those
+//! parts of a trace that the YkPT decoder can't handle.
+//!
+//! Decoders can start at any `PSB`, so when the YkPT decoder fails, the segment of the trace
+//! between the `PSB`s either side of where it failed is decoded by libipt, and the YkPT decoder
+//! carries on from the `PSB` after. The blocks of the parts are stitched together as in
+//! [parallel](super::parallel) decoding.
+//!
+//! In lossy traces, the YkPT decoder would report what it can't handle as gaps. So it decodes
+//! strictly, leaving it to the libipt decoder to decide what is really lost.
+//!
+//! Falling back means going back over blocks already decoded, so the trace is decoded in ranges of
+//! [RANGE_SIZE] bytes, each starting at a `PSB`, and the blocks of a range are handed on once the
+//! range after it has been stitched to them. So only a range's worth of blocks is ever held at
+//! once.
+
+use crate::{
+    decode::{
+        frames::Windows,
+        libipt::LibIPTTraceDecoder,
+        mapped::Segments,
+        parallel::{self, Chunk, Chunked, ChunkedBlocks},
+        scan::PsbIndex,
+        ykpt::YkPTTraceDecoder,
+        ImageSource, TraceDecoder,
+    },
+    errors::HWTracerError,
+    Block, BlockTrace, Trace,
+};
+use std::{cell::OnceCell, path::PathBuf, vec};
+
+/// How many bytes of trace make up a range (see the module docs), give or take the distance to
+/// the next `PSB`.
+const RANGE_SIZE: usize = 1024 * 1024;
+
+pub(crate) struct HybridTraceDecoder {
+    ykpt: YkPTTraceDecoder,
+    libipt: LibIPTTraceDecoder,
+}
+
+impl HybridTraceDecoder {
+    pub(crate) fn with_config(image_source: ImageSource, code_cache: Option<PathBuf>) -> Self {
+        Self {
+            ykpt: YkPTTraceDecoder::with_code_cache(code_cache),
+            libipt: LibIPTTraceDecoder::with_image_source(image_source),
+        }
+    }
+
+    /// Decode the part of `trace` from `start`, which is 0 or the offset of a `PSB`, to `end`,
+    /// appending its blocks to `blocks`.
+    fn decode_range(
+        &self,
+        trace: &dyn Trace,
+        psbs: &OnceCell<PsbIndex>,
+        mut start: usize,
+        end: usize,
+        blocks: &mut Vec<Block>,
+    ) -> Result<(), HWTracerError> {
+        while start < end {
+            let mut got = Vec::new();
+            let failed_at = match self
+                .ykpt
+                .decode_until_error(&Chunk::new(trace, start, end).strict(), &mut got)
+            {
+                Ok(()) => {
+                    parallel::append(trace, start, blocks, got);
+                    return Ok(());
+                }
+                Err((HWTracerError::TraceParseError(_), off)) => start + off,
+                Err((e, _)) => return Err(e),
+            };
+
+            // Only index the trace once we need to: usually we never do.
+            let index = psbs.get_or_init(|| PsbIndex::new(trace.bytes()));
+            let seg_start = index
+                .at_or_before(failed_at.min(end - 1))
+                .filter(|&s| s > start)
+                .unwrap_or(start);
+            let seg_end = index
+                .at_or_after(failed_at + 1)
+                .filter(|&e| e < end)
+                .unwrap_or(end);
+            if seg_start > start {
+                // The YkPT decoder got this far before, so it should again. If not, this falls
+                // back on the libipt decoder for a smaller part.
+                self.decode_range(trace, psbs, start, seg_start, blocks)?;
+            }
+            let mut got = Vec::new();
+            self.libipt
+                .decode_into(&Chunk::new(trace, seg_start, seg_end), &mut got)?;
+            parallel::append(trace, seg_start, blocks, got);
+            start = seg_end;
+        }
+        Ok(())
+    }
+}
+
+/// A trace being decoded range by range.
+struct Ranges<'t> {
+    decoder: &'t HybridTraceDecoder,
+    trace: &'t dyn Trace,
+    psbs: OnceCell<PsbIndex>,
+    /// The offsets at which the ranges start.
+    starts: Vec<usize>,
+    /// The index in `starts` of the next range to decode.
+    next: usize,
+    /// The blocks decoded but not yet handed on. These start out empty for each trace, so that
+    /// stitching never looks at blocks from an earlier trace.
+    blocks: Vec<Block>,
+}
+
+impl<'t> Ranges<'t> {
+    /// Decode `trace` in ranges of at least `size` bytes.
+    fn new(decoder: &'t HybridTraceDecoder, trace: &'t dyn Trace, size: usize) -> Self {
+        let psbs = OnceCell::new();
+        let starts =
+            parallel::starts_every(psbs.get_or_init(|| PsbIndex::new(trace.bytes())), size);
+        Self {
+            decoder,
+            trace,
+            psbs,
+            starts,
+            next: 0,
+            blocks: Vec::new(),
+        }
+    }
+}
+
+impl<'t> Chunked for Ranges<'t> {
+    fn decode_next(&mut self) -> Result<bool, HWTracerError> {
+        let Some(&start) = self.starts.get(self.next) else {
+            return Ok(false);
+        };
+        self.next += 1;
+        let end = self
+            .starts
+            .get(self.next)
+            .copied()
+            .unwrap_or(self.trace.bytes().len());
+        self.decoder
+            .decode_range(self.trace, &self.psbs, start, end, &mut self.blocks)?;
+        Ok(true)
+    }
+
+    fn blocks(&mut self) -> &mut Vec<Block> {
+        &mut self.blocks
+    }
+}
+
+impl TraceDecoder for HybridTraceDecoder {
+    fn new() -> Self {
+        Self::with_config(ImageSource::Files, None)
+    }
+
+    fn iter_blocks<'t>(
+        &'t self,
+        trace: &'t dyn Trace,
+    ) -> Box<dyn Iterator<Item = Result<Block, HWTracerError>> + '_> {
+        if let Some(w) = Windows::new(self, trace) {
+            return Box::new(ChunkedBlocks::new(w));
+        }
+        if let Some(s) = Segments::new(self, trace) {
+            return Box::new(ChunkedBlocks::new(s));
+        }
+        Box::new(ChunkedBlocks::new(Ranges::new(self, trace, RANGE_SIZE)))
+    }
+
+    fn decode_into(&self, trace: &dyn Trace, blocks: &mut Vec<Block>) -> Result<(), HWTracerError> {
+        if let Some(w) = Windows::new(self, trace) {
+            return parallel::decode_chunked(w, |bs| blocks.extend(bs));
+        }
+        if let Some(s) = Segments::new(self, trace) {
+            return parallel::decode_chunked(s, |bs| blocks.extend(bs));
+        }
+        parallel::decode_chunked(Ranges::new(self, trace, RANGE_SIZE), |bs| blocks.extend(bs))
+    }
+
+    fn decode_block_trace(
+        &self,
+        trace: &dyn Trace,
+        blocks: &mut BlockTrace,
+    ) -> Result<(), HWTracerError> {
+        let sink = |bs: vec::Drain<'_, Block>| {
+            for b in bs {
+                blocks.push(b);
+            }
+        };
+        if let Some(w) = Windows::new(self, trace) {
+            return parallel::decode_chunked(w, sink);
+        }
+        if let Some(s) = Segments::new(self, trace) {
+            return parallel::decode_chunked(s, sink);
+        }
+        parallel::decode_chunked(Ranges::new(self, trace, RANGE_SIZE), sink)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{HybridTraceDecoder, Ranges};
+    use crate::decode::parallel::Chunked;
+    use crate::{
+        collect::{test_helpers::trace_closure, TraceCollectorBuilder},
+        decode::{
+            scan::PsbIndex, test_helpers, TraceDecoder, TraceDecoderBuilder, TraceDecoderKind,
+        },
+        test_helpers::work_loop,
+        Block, Trace,
+    };
+    use std::{cell::OnceCell, fs::File, io::Write};
+
+    /// A trace made up from bytes.
+    #[derive(Debug)]
+    struct BytesTrace(Vec<u8>);
+
+    impl Trace for BytesTrace {
+        fn bytes(&self) -> &[u8] {
+            &self.0
+        }
+
+        fn capacity(&self) -> usize {
+            self.0.len()
+        }
+
+        fn len(&self) -> usize {
+            self.0.len()
+        }
+
+        fn to_file(&self, file: &mut File) {
+            file.write_all(&self.0).unwrap();
+        }
+    }
+
+    fn decode(kind: TraceDecoderKind, trace: &dyn Trace) -> Result<Vec<Block>, ()> {
+        let mut blocks = Vec::new();
+        TraceDecoderBuilder::new()
+            .kind(kind)
+            .build()
+            .unwrap()
+            .decode_into(trace, &mut blocks)
+            .map_err(|_| ())?;
+        Ok(blocks)
+    }
+
+    #[test]
+    fn ten_times_as_many_blocks() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        test_helpers::ten_times_as_many_blocks(tc, TraceDecoderKind::Auto);
+    }
+
+    #[test]
+    fn decode_into_matches_iter() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        test_helpers::decode_into_matches_iter(tc, TraceDecoderKind::Auto);
+    }
+
+    #[test]
+    fn block_trace_matches_decode_into() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        test_helpers::block_trace_matches_decode_into(tc, TraceDecoderKind::Auto);
+    }
+
+    /// Check that the parts of a trace which the YkPT decoder can't handle are decoded by libipt.
+    #[test]
+    fn falls_back() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(3000));
+        let mut bytes = trace.bytes().to_vec();
+        let psbs = PsbIndex::new(&bytes).offsets().to_vec();
+        assert!(psbs.len() > 3);
+
+        // The YkPT decoder doesn't know about MNT packets, but libipt skips them. Put one after the
+        // PSB+ of the first PSB, and one after a PSB further on.
+        for &psb in [psbs[0], psbs[psbs.len() / 2]].iter().rev() {
+            let psbend = psb
+                + bytes[psb..]
+                    .windows(2)
+                    .position(|w| w == [0x02, 0x23])
+                    .unwrap()
+                + 2;
+            bytes.splice(psbend..psbend, [0x02, 0xc3, 0x88, 1, 2, 3, 4, 5, 6, 7, 8]);
+        }
+        let bad = BytesTrace(bytes);
+        assert!(decode(TraceDecoderKind::YkPT, &bad).is_err());
+
+        let expect = decode(TraceDecoderKind::LibIPT, &*trace).unwrap();
+        assert_eq!(decode(TraceDecoderKind::LibIPT, &bad).unwrap(), expect);
+        assert_eq!(decode(TraceDecoderKind::Auto, &bad).unwrap(), expect);
+        assert_eq!(decode(TraceDecoderKind::Auto, &*trace).unwrap(), expect);
+    }
+
+    /// Check that decoding range by range, however small the ranges, gives the blocks of the whole
+    /// trace decoded at once.
+    #[test]
+    fn ranges() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(3000));
+        let dec = HybridTraceDecoder::new();
+        let mut expect = Vec::new();
+        dec.decode_range(
+            &*trace,
+            &OnceCell::new(),
+            0,
+            trace.bytes().len(),
+            &mut expect,
+        )
+        .unwrap();
+
+        let mut ranges = Ranges::new(&dec, &*trace, 1);
+        assert!(ranges.starts.len() > 3);
+        let mut got = Vec::new();
+        while ranges.decode_next().unwrap() {
+            got.extend(ranges.take_final(false));
+        }
+        got.extend(ranges.take_final(true));
+        assert_eq!(got, expect);
+    }
+}
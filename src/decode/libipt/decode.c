@@ -9,33 +9,139 @@
 #include <link.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <hwtracer_util.h>
 
 #include "hwtracer_private.h"
 
 #define VDSO_NAME "linux-vdso.so.1"
+#define VDSO_TEMPLATE "hwtracer-vdso-XXXXXX"
+
+/*
+ * A libipt image of the code of the current process, shared by all decoders
+ * in the process.
+ *
+ * Building the image means walking the loaded objects and (the first time)
+ * dumping the VDSO to disk, which can cost more than decoding a short trace,
+ * so it is only rebuilt when the dynamic linker reports that objects have
+ * been loaded or unloaded since. Each decoder gets its own copy of the image,
+ * which is cheap, since the sections themselves are shared through the
+ * section cache, which lives as long as the process.
+ *
+ * Everything here is protected by `self_image_lock`.
+ */
+struct self_image {
+    struct pt_image *image;                 // NULL until first built.
+    struct pt_image_section_cache *iscache;
+    unsigned long long adds, subs;          // dlpi_adds/dlpi_subs when built.
+    int vdso_fd;                            // The VDSO dump, or -1.
+    char vdso_filename[PATH_MAX];           // How libipt can open `vdso_fd`.
+};
+
+static pthread_mutex_t self_image_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct self_image self_image = {NULL, NULL, 0, 0, -1, {0}};
+
+/*
+ * Where a decoder gets the code it needs to follow the trace from.
+ * Must stay in sync with the Rust-side.
+ */
+enum hwt_ipt_image_source {
+    hwt_ipt_image_files,        // The on-disk objects (see `self_image`).
+    hwt_ipt_image_memory,       // The live address space (see read_self_mem()).
+};
+
+/*
+ * The identity of a CPU, as libipt's `struct pt_cpu` has it.
+ * Must stay in sync with `CpuId` on the Rust-side.
+ */
+struct hwt_ipt_cpu {
+    uint32_t vendor;
+    uint16_t family;
+    uint8_t model;
+    uint8_t stepping;
+};
+
+/*
+ * A code segment of a saved image: either `size` bytes from `offset` into the
+ * file `filename`, or, if `filename` is NULL, the `size` bytes at `code`.
+ * Must stay in sync with the Rust-side.
+ */
+struct hwt_ipt_saved_section {
+    const char *filename;
+    const uint8_t *code;
+    uint64_t offset, size, vaddr;
+};
+
+/*
+ * The CPU and code that a trace loaded from a trace file was collected with.
+ * Must stay in sync with the Rust-side.
+ */
+struct hwt_ipt_saved_image {
+    struct hwt_ipt_cpu cpu;
+    const struct hwt_ipt_saved_section *sections;
+    size_t nsections;
+};
+
+/*
+ * The readable, executable mappings of the current process, as last read
+ * from /proc/self/maps, sorted by address. Protected by `exec_maps_lock`.
+ */
+struct exec_map {
+    uint64_t start, end;
+};
+static pthread_rwlock_t exec_maps_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct exec_map *exec_maps = NULL;
+static size_t exec_maps_len = 0;
+
+/*
+ * A basic block, as found by hwt_ipt_next_blocks().
+ * Must stay in sync with `Block` on the Rust-side.
+ */
+struct hwt_ipt_block {
+    uint64_t first_instr;
+    uint64_t last_instr;
+};
 
 struct load_self_image_args {
     struct pt_image *image;
-    int vdso_fd;
-    char *vdso_filename;
+    struct self_image *self;
     struct hwt_cerror *err;
     const char *current_exe;
-    struct  pt_image_section_cache *iscache;
 };
 
 // Private prototypes.
 static bool handle_events(struct pt_block_decoder *, int *, struct hwt_cerror *);
+static bool self_image_get(struct pt_image *, const char *, struct hwt_cerror *);
+static int dl_generation_cb(struct dl_phdr_info *, size_t, void *);
+static bool dump_vdso(struct self_image *, uint64_t, size_t, struct hwt_cerror *);
 static bool load_self_image(struct load_self_image_args *);
 static int load_self_image_cb(struct dl_phdr_info *, size_t, void *);
 static bool block_is_terminated(struct pt_block *);
+static int read_self_mem(uint8_t *, size_t, const struct pt_asid *, uint64_t, void *);
+static bool load_saved_image(struct pt_image *, const struct hwt_ipt_saved_image *,
+                             struct hwt_cerror *);
+static int read_saved_code(uint8_t *, size_t, const struct pt_asid *, uint64_t, void *);
+static bool add_mapped_sections(struct pt_image *, const struct hwt_ipt_saved_section *,
+                                size_t, struct hwt_cerror *);
+static bool exec_maps_find(uint64_t, size_t *);
+static void exec_maps_refresh(void);
 
 // Public prototypes.
-void *hwt_ipt_init_block_decoder(void *, uint64_t, int, char *, int *,
-                                 struct hwt_cerror *, const char *);
+bool hwt_ipt_dump_vdso(int, uint64_t, size_t, struct hwt_cerror *);
+void *hwt_ipt_init_block_decoder(void *, uint64_t, enum hwt_ipt_image_source,
+                                 const struct hwt_ipt_saved_image *,
+                                 const struct hwt_ipt_saved_section *, size_t,
+                                 int *, struct hwt_cerror *, const char *);
 bool hwt_ipt_next_block(struct pt_block_decoder *, int *, uint64_t *,
                         uint64_t *, struct hwt_cerror *);
+bool hwt_ipt_next_blocks(struct pt_block_decoder *, int *,
+                         struct hwt_ipt_block *, size_t, size_t *,
+                         struct hwt_cerror *);
 void hwt_ipt_free_block_decoder(struct pt_block_decoder *);
 
 /*
@@ -60,16 +166,69 @@ hwt_ipt_dump_vdso(int fd, uint64_t vaddr, size_t len, struct hwt_cerror *err)
     return true;
 }
 
+/*
+ * Dump the VDSO code, starting at `vaddr` and of size `len`, into an
+ * anonymous temp file, recording in `self` how libipt can open it.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+dump_vdso(struct self_image *self, uint64_t vaddr, size_t len,
+          struct hwt_cerror *err)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    if ((tmpdir == NULL) || (*tmpdir == '\0')) {
+        tmpdir = "/tmp";
+    }
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", tmpdir, VDSO_TEMPLATE) >= (int) sizeof(path)) {
+        hwt_set_cerr(err, hwt_cerror_errno, ENAMETOOLONG);
+        return false;
+    }
+    // The file is unlinked straight away, so that it can't outlive us.
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        return false;
+    }
+    unlink(path);
+
+    if (!hwt_ipt_dump_vdso(fd, vaddr, len, err)) {
+        close(fd);
+        return false;
+    }
+    if (fsync(fd) == -1) {
+        hwt_set_cerr(err, hwt_cerror_errno, errno);
+        close(fd);
+        return false;
+    }
+
+    self->vdso_fd = fd;
+    snprintf(self->vdso_filename, sizeof(self->vdso_filename),
+             "/proc/self/fd/%d", fd);
+    return true;
+}
+
 /*
  * Get ready to retrieve the basic blocks from a PT trace using the code of the
  * current process for control flow recovery.
  *
  * Accepts a raw buffer `buf` of length `len`.
  *
- * `vdso_fd` is an open file descriptor for the filename `vdso_filename`. This
- * is where the VDSO code will be written. libipt will read this file lazily,
- * so it's up to the caller to make sure this file lives long enough for their
- * purposes.
+ * `image_source` says where the code is read from: either the objects on disk
+ * (via a shared image, see `struct self_image`), or straight out of our own
+ * address space, which also covers code that has no backing file (e.g. code
+ * emitted by a JIT). Either way, the code must not have changed since it was
+ * traced.
+ *
+ * If `saved` isn't NULL, the trace was collected by another process (perhaps
+ * on another machine), and the CPU and code it was collected with are taken
+ * from `saved` instead. `saved` must outlive the decoder.
+ *
+ * `mapped` holds the `nmapped` file sections of the code which was mapped
+ * while the trace was collected, up to its end, in the order it was mapped. Unless the code is
+ * read from memory, these are added on top of the image (see
+ * add_mapped_sections()).
  *
  * `current_exe` is an absolute path to an on-disk executable from which to
  * load the main executable's (i.e. not a shared library's) code.
@@ -80,9 +239,12 @@ hwt_ipt_dump_vdso(int fd, uint64_t vaddr, size_t len, struct hwt_cerror *err)
  * Returns a pointer to a configured libipt block decoder or NULL on error.
  */
 void *
-hwt_ipt_init_block_decoder(void *buf, uint64_t len, int vdso_fd, char *vdso_filename,
-                           int *decoder_status, struct hwt_cerror *err,
-                           const char *current_exe) {
+hwt_ipt_init_block_decoder(void *buf, uint64_t len,
+                           enum hwt_ipt_image_source image_source,
+                           const struct hwt_ipt_saved_image *saved,
+                           const struct hwt_ipt_saved_section *mapped,
+                           size_t nmapped, int *decoder_status,
+                           struct hwt_cerror *err, const char *current_exe) {
     bool failing = false;
 
     // Make a block decoder configuration.
@@ -94,13 +256,21 @@ hwt_ipt_init_block_decoder(void *buf, uint64_t len, int vdso_fd, char *vdso_file
     config.flags.variant.block.end_on_call = 1;
     config.flags.variant.block.end_on_jump = 1;
 
-    // Decode for the current CPU.
+    // Decode for the CPU that the trace was collected on.
     struct pt_block_decoder *decoder = NULL;
-    int rv = pt_cpu_read(&config.cpu);
-    if (rv != pte_ok) {
-        hwt_set_cerr(err, hwt_cerror_ipt, -rv);
-        failing = true;
-        goto clean;
+    int rv = pte_ok;
+    if (saved != NULL) {
+        config.cpu.vendor = (enum pt_cpu_vendor) saved->cpu.vendor;
+        config.cpu.family = saved->cpu.family;
+        config.cpu.model = saved->cpu.model;
+        config.cpu.stepping = saved->cpu.stepping;
+    } else {
+        rv = pt_cpu_read(&config.cpu);
+        if (rv != pte_ok) {
+            hwt_set_cerr(err, hwt_cerror_ipt, -rv);
+            failing = true;
+            goto clean;
+        }
     }
 
     // Work around CPU bugs.
@@ -133,32 +303,28 @@ hwt_ipt_init_block_decoder(void *buf, uint64_t len, int vdso_fd, char *vdso_file
         goto clean;
     }
 
-    // Build and load a memory image from which to recover control flow.
-    struct pt_image *image = pt_image_alloc(NULL);
-    if (image == NULL) {
-        hwt_set_cerr(err, hwt_cerror_unknown, 0);
-        failing = true;
-        goto clean;
-    }
-
-    // Use image cache to speed up decoding.
-    struct pt_image_section_cache *iscache = pt_iscache_alloc(NULL);
-    if(iscache == NULL) {
-        hwt_set_cerr(err, hwt_cerror_unknown, 0);
-        failing = true;
-        goto clean;
-    }
-
-    struct load_self_image_args load_args = {image, vdso_fd, vdso_filename,
-                                             err, current_exe, iscache};
-    if (!load_self_image(&load_args)) {
+    // Load the decoder's own image (which it frees along with itself) with
+    // the code from which to recover control flow.
+    struct pt_image *image = pt_blk_get_image(decoder);
+    if (saved != NULL) {
+        if (!load_saved_image(image, saved, err)) {
+            failing = true;
+            goto clean;
+        }
+    } else if (image_source == hwt_ipt_image_memory) {
+        rv = pt_image_set_callback(image, read_self_mem, NULL);
+        if (rv < 0) {
+            hwt_set_cerr(err, hwt_cerror_ipt, -rv);
+            failing = true;
+            goto clean;
+        }
+    } else if (!self_image_get(image, current_exe, err)) {
         failing = true;
         goto clean;
     }
-
-    rv = pt_blk_set_image(decoder, image);
-    if (rv < 0) {
-        hwt_set_cerr(err, hwt_cerror_ipt, -rv);
+    if ((image_source != hwt_ipt_image_memory) &&
+        (!add_mapped_sections(image, mapped, nmapped, err)))
+    {
         failing = true;
         goto clean;
     }
@@ -186,6 +352,12 @@ clean:
 bool
 hwt_ipt_next_block(struct pt_block_decoder *decoder, int *decoder_status,
         uint64_t *first_instr, uint64_t *last_instr, struct hwt_cerror *err) {
+    // The decoder found no PSB to sync to, so there's nothing to decode.
+    if (*decoder_status == -pte_eos) {
+        *first_instr = 0;
+        return true;
+    }
+
     // If there are events pending, look at those first.
     if (handle_events(decoder, decoder_status, err) != true) {
         // handle_events will have already called hwt_set_cerr().
@@ -261,6 +433,37 @@ hwt_ipt_next_block(struct pt_block_decoder *decoder, int *decoder_status,
     return true;
 }
 
+/*
+ * Like hwt_ipt_next_block(), but finds up to `cap` blocks at once, storing
+ * them in `out` and their number in `*n`. This saves a call from Rust for
+ * each block.
+ *
+ * If `*n` is less than `cap` on success, the end of the instruction stream
+ * has been reached.
+ *
+ * Returns true on success or false otherwise. Upon failure, the `*n` blocks
+ * found before the error are still valid.
+ */
+bool
+hwt_ipt_next_blocks(struct pt_block_decoder *decoder, int *decoder_status,
+                    struct hwt_ipt_block *out, size_t cap, size_t *n,
+                    struct hwt_cerror *err) {
+    *n = 0;
+    while (*n < cap) {
+        struct hwt_ipt_block *blk = &out[*n];
+        if (!hwt_ipt_next_block(decoder, decoder_status, &blk->first_instr,
+                                &blk->last_instr, err))
+        {
+            return false;
+        }
+        if (blk->first_instr == 0) {
+            break; // End of stream.
+        }
+        (*n)++;
+    }
+    return true;
+}
+
 /*
  * Given a decoder and pointer to the decoder status, handle any pending events in
  * the PT packet stream and update the decoder status.
@@ -387,23 +590,93 @@ block_is_terminated(struct pt_block *blk)
 }
 
 /*
- * Loads the libipt image `image` with the code of the current process.
+ * Load `image` with (a copy of) the shared image of the current process,
+ * first (re)building the shared image if it is missing or out of date.
  *
  * Returns true on success or false otherwise.
  */
 static bool
-load_self_image(struct load_self_image_args *args)
+self_image_get(struct pt_image *image, const char *current_exe,
+               struct hwt_cerror *err)
 {
-    if (dl_iterate_phdr(load_self_image_cb, args) != 0) {
+    bool ret = true;
+    if (pthread_mutex_lock(&self_image_lock) != 0) {
+        hwt_set_cerr(err, hwt_cerror_unknown, 0);
         return false;
     }
 
-    if (fsync(args->vdso_fd) == -1) {
-        hwt_set_cerr(args->err, hwt_cerror_errno, errno);
-        return false;
+    unsigned long long gen[2] = {0, 0};
+    dl_iterate_phdr(dl_generation_cb, gen);
+    if ((self_image.image == NULL) ||
+        (gen[0] != self_image.adds) || (gen[1] != self_image.subs))
+    {
+        if (self_image.iscache == NULL) {
+            self_image.iscache = pt_iscache_alloc(NULL);
+            if (self_image.iscache == NULL) {
+                hwt_set_cerr(err, hwt_cerror_unknown, 0);
+                ret = false;
+                goto done;
+            }
+        }
+
+        // Decoders have their own copies, so the old image can go. Sections
+        // of objects which are still loaded are found again in the cache.
+        struct pt_image *new_image = pt_image_alloc(NULL);
+        if (new_image == NULL) {
+            hwt_set_cerr(err, hwt_cerror_unknown, 0);
+            ret = false;
+            goto done;
+        }
+        struct load_self_image_args load_args = {new_image, &self_image, err,
+                                                 current_exe};
+        if (!load_self_image(&load_args)) {
+            pt_image_free(new_image);
+            ret = false;
+            goto done;
+        }
+        pt_image_free(self_image.image);
+        self_image.image = new_image;
+        self_image.adds = gen[0];
+        self_image.subs = gen[1];
     }
 
-    return true;
+    int rv = pt_image_copy(image, self_image.image);
+    if (rv < 0) {
+        hwt_set_cerr(err, hwt_cerror_ipt, -rv);
+        ret = false;
+    }
+
+done:
+    pthread_mutex_unlock(&self_image_lock);
+    return ret;
+}
+
+/*
+ * A dl_iterate_phdr(3) callback which copies the dynamic linker's counts of
+ * loaded and unloaded objects into the two-element array `data`, then stops.
+ * The counts stay zero if this libc doesn't provide them, in which case the
+ * shared image is never rebuilt.
+ */
+static int
+dl_generation_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+    unsigned long long *gen = data;
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        gen[0] = info->dlpi_adds;
+        gen[1] = info->dlpi_subs;
+    }
+    return 1;
+}
+
+/*
+ * Loads the libipt image `image` with the code of the current process.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+load_self_image(struct load_self_image_args *args)
+{
+    return dl_iterate_phdr(load_self_image_cb, args) == 0;
 }
 
 /*
@@ -448,27 +721,32 @@ load_self_image_cb(struct dl_phdr_info *info, size_t size, void *data)
         // but rather it is a set of pages shared with the kernel.
         //
         // XXX Since libipt currently requires us to load from a file, we have
-        // to dump the VDSO to disk and have libipt load it back in.
+        // to dump the VDSO to disk and have libipt load it back in. The VDSO
+        // never changes, so this only happens once.
         //
         // Discussion on adding libipt support for loading from memory here:
         // https://github.com/01org/processor-trace/issues/37
         if (vdso) {
-            int rv = hwt_ipt_dump_vdso(args->vdso_fd, vaddr, phdr.p_filesz, err);
-            if (!rv) {
+            if ((args->self->vdso_fd == -1) &&
+                (!dump_vdso(args->self, vaddr, phdr.p_filesz, err)))
+            {
                 return 1;
             }
-            filename = args->vdso_filename;
+            filename = args->self->vdso_filename;
             offset = 0;
         } else {
             offset = phdr.p_offset;
         }
 
-        int isid = pt_iscache_add_file(args->iscache, filename, offset, phdr.p_filesz, vaddr);
+        // The cache hands back the existing section if it already has it.
+        int isid = pt_iscache_add_file(args->self->iscache, filename, offset,
+                                       phdr.p_filesz, vaddr);
         if (isid < 0) {
+            hwt_set_cerr(err, hwt_cerror_ipt, -isid);
             return 1;
         }
 
-        int rv = pt_image_add_cached(args->image, args->iscache, isid, NULL);
+        int rv = pt_image_add_cached(args->image, args->self->iscache, isid, NULL);
         if (rv < 0) {
             hwt_set_cerr(err, hwt_cerror_ipt, -rv);
             return 1;
@@ -479,7 +757,214 @@ load_self_image_cb(struct dl_phdr_info *info, size_t size, void *data)
 }
 
 /*
- * Free a block decoder and its image.
+ * A libipt read memory callback which copies code straight out of our own
+ * address space: up to `size` bytes at `ip` into `buffer`.
+ *
+ * Only readable, executable mappings are read from, so that a bogus IP can't
+ * crash us. If `ip` isn't in one that we know of, the mappings are re-read in
+ * case the code was mapped since we last looked.
+ *
+ * Returns the number of bytes read or a negative libipt error code.
+ */
+static int
+read_self_mem(uint8_t *buffer, size_t size, const struct pt_asid *asid,
+              uint64_t ip, void *context)
+{
+    (void) asid; // Unused. We only decode our own process.
+    (void) context;
+
+    size_t avail = 0;
+    if (!exec_maps_find(ip, &avail)) {
+        exec_maps_refresh();
+        if (!exec_maps_find(ip, &avail)) {
+            return -pte_nomap;
+        }
+    }
+    if (size > avail) {
+        size = avail;
+    }
+    if (size > INT_MAX) {
+        size = INT_MAX;
+    }
+    memcpy(buffer, (void *) ip, size);
+    return size;
+}
+
+/*
+ * Loads the libipt image `image` with the code of the saved image `saved`.
+ * Sections with files are added to the image. The rest of the code is read by
+ * read_saved_code(), which libipt only calls for addresses not in a section.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+load_saved_image(struct pt_image *image, const struct hwt_ipt_saved_image *saved,
+                 struct hwt_cerror *err)
+{
+    for (size_t i = 0; i < saved->nsections; i++) {
+        const struct hwt_ipt_saved_section *sec = &saved->sections[i];
+        if (sec->filename == NULL) {
+            continue;
+        }
+        int rv = pt_image_add_file(image, sec->filename, sec->offset, sec->size,
+                                   NULL, sec->vaddr);
+        if (rv < 0) {
+            hwt_set_cerr(err, hwt_cerror_ipt, -rv);
+            return false;
+        }
+    }
+
+    // The context is cast back to const in read_saved_code().
+    int rv = pt_image_set_callback(image, read_saved_code, (void *) saved);
+    if (rv < 0) {
+        hwt_set_cerr(err, hwt_cerror_ipt, -rv);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Adds the `nmapped` sections `mapped`, of code mapped while a trace was
+ * collected, to `image`. The code may since have been unmapped or replaced, so
+ * it isn't necessarily in the image already. libipt drops the parts of
+ * existing sections which a new one overlaps, so adding the sections in the
+ * order the code was mapped leaves the image as it was at the end of the trace.
+ * The caller cuts traces where code was mapped, and only passes the sections
+ * mapped before the end of the part being decoded, so that is how the image was
+ * for all of it.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+add_mapped_sections(struct pt_image *image,
+                    const struct hwt_ipt_saved_section *mapped,
+                    size_t nmapped, struct hwt_cerror *err)
+{
+    for (size_t i = 0; i < nmapped; i++) {
+        const struct hwt_ipt_saved_section *sec = &mapped[i];
+        int rv = pt_image_add_file(image, sec->filename, sec->offset, sec->size,
+                                   NULL, sec->vaddr);
+        if (rv < 0) {
+            hwt_set_cerr(err, hwt_cerror_ipt, -rv);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * A libipt read memory callback which copies code stored in the saved image
+ * `context`: up to `size` bytes at `ip` into `buffer`.
+ *
+ * Returns the number of bytes read or a negative libipt error code.
+ */
+static int
+read_saved_code(uint8_t *buffer, size_t size, const struct pt_asid *asid,
+                uint64_t ip, void *context)
+{
+    (void) asid; // Unused. A trace file holds the code of one process.
+
+    const struct hwt_ipt_saved_image *saved = context;
+    for (size_t i = 0; i < saved->nsections; i++) {
+        const struct hwt_ipt_saved_section *sec = &saved->sections[i];
+        if ((sec->filename != NULL) || (ip < sec->vaddr) ||
+            (ip - sec->vaddr >= sec->size))
+        {
+            continue;
+        }
+        uint64_t avail = sec->size - (ip - sec->vaddr);
+        if (size > avail) {
+            size = avail;
+        }
+        if (size > INT_MAX) {
+            size = INT_MAX;
+        }
+        memcpy(buffer, sec->code + (ip - sec->vaddr), size);
+        return size;
+    }
+    return -pte_nomap;
+}
+
+/*
+ * Look for the mapping containing `ip`. If there is one, set `*avail` to the
+ * number of bytes from `ip` to its end.
+ *
+ * Returns true if `ip` is mapped, or false otherwise. The mapping is
+ * considered to remain readable after we return.
+ */
+static bool
+exec_maps_find(uint64_t ip, size_t *avail)
+{
+    bool found = false;
+    pthread_rwlock_rdlock(&exec_maps_lock);
+    size_t lo = 0, hi = exec_maps_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ip < exec_maps[mid].start) {
+            hi = mid;
+        } else if (ip >= exec_maps[mid].end) {
+            lo = mid + 1;
+        } else {
+            *avail = exec_maps[mid].end - ip;
+            found = true;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&exec_maps_lock);
+    return found;
+}
+
+/*
+ * Re-read the readable, executable mappings of the current process. On
+ * failure the old mappings are kept.
+ */
+static void
+exec_maps_refresh(void)
+{
+    FILE *f = fopen("/proc/self/maps", "r");
+    if (f == NULL) {
+        return;
+    }
+
+    struct exec_map *maps = NULL;
+    size_t len = 0, cap = 0;
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        uint64_t start, end;
+        char perms[5];
+        if (sscanf(line, "%" SCNx64 "-%" SCNx64 " %4s", &start, &end, perms) != 3) {
+            continue;
+        }
+        // A line longer than our buffer is read in instalments. The remains
+        // don't parse as a mapping, so are skipped above.
+        if ((perms[0] != 'r') || (perms[2] != 'x')) {
+            continue;
+        }
+        if (len == cap) {
+            size_t new_cap = cap == 0 ? 64 : cap * 2;
+            struct exec_map *new_maps = realloc(maps, new_cap * sizeof(*maps));
+            if (new_maps == NULL) {
+                free(maps);
+                fclose(f);
+                return;
+            }
+            maps = new_maps;
+            cap = new_cap;
+        }
+        // The kernel lists mappings in address order.
+        maps[len++] = (struct exec_map) {start, end};
+    }
+    fclose(f);
+
+    pthread_rwlock_wrlock(&exec_maps_lock);
+    free(exec_maps);
+    exec_maps = maps;
+    exec_maps_len = len;
+    pthread_rwlock_unlock(&exec_maps_lock);
+}
+
+/*
+ * Free a block decoder and its (copy of the) image.
  */
 void
 hwt_ipt_free_block_decoder(struct pt_block_decoder *decoder) {
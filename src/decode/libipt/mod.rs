@@ -1,26 +1,46 @@
 //! The libipt trace decoder.
 
-use crate::{c_errors::PerfPTCError, decode::TraceDecoder, errors::HWTracerError, Block, Trace};
-use libc::{c_char, c_int, c_void};
-use std::{convert::TryFrom, env, ffi::CString, os::fd::AsRawFd, ptr};
-use tempfile::NamedTempFile;
+use crate::{
+    c_errors::PerfPTCError,
+    collect::Mmap,
+    decode::{
+        frames::Windows,
+        mapped::{mapped, Segments},
+        parallel::{self, ChunkedBlocks},
+        scan::find_psb,
+        ImageSource, TraceDecoder,
+    },
+    errors::HWTracerError,
+    trace_file::{self, CpuId, TraceImage},
+    Block, Trace,
+};
+use libc::{c_char, c_int, c_void, size_t};
+use std::{
+    collections::HashMap, convert::TryFrom, ffi::CString, os::unix::ffi::OsStrExt, path::Path, ptr,
+};
+
+/// How many blocks to ask libipt for in each call to `hwt_ipt_next_blocks()`.
+const BATCH_SIZE: usize = 1024;
 
 extern "C" {
     // decode.c
     fn hwt_ipt_init_block_decoder(
         buf: *const c_void,
         len: u64,
-        vdso_fd: c_int,
-        vdso_filename: *const c_char,
+        image_source: ImageSource,
+        saved: *const CSavedImage,
+        mapped: *const CSavedSection,
+        nmapped: size_t,
         decoder_status: *mut c_int,
         err: *mut PerfPTCError,
         current_exe: *const c_char,
     ) -> *mut c_void;
-    fn hwt_ipt_next_block(
+    fn hwt_ipt_next_blocks(
         decoder: *mut c_void,
         decoder_status: *mut c_int,
-        addr: *mut u64,
-        len: *mut u64,
+        out: *mut Block,
+        cap: size_t,
+        n: *mut size_t,
         err: *mut PerfPTCError,
     ) -> bool;
     fn hwt_ipt_free_block_decoder(decoder: *mut c_void);
@@ -30,25 +50,172 @@ extern "C" {
     pub(crate) fn pt_errstr(error_code: c_int) -> *const c_char;
 }
 
-pub(crate) struct LibIPTTraceDecoder {}
+/// A code segment of a [TraceImage], as the C code wants it.
+///
+// Must stay in sync with the C code.
+#[repr(C)]
+struct CSavedSection {
+    /// The file to read the code from, or null if the code is at `code`.
+    filename: *const c_char,
+    code: *const u8,
+    offset: u64,
+    size: u64,
+    vaddr: u64,
+}
+
+// Must stay in sync with the C code.
+#[repr(C)]
+struct CSavedImage {
+    cpu: CpuId,
+    sections: *const CSavedSection,
+    nsections: size_t,
+}
+
+/// A [TraceImage] as the C code wants it. The pointers in it point into the image, which must
+/// outlive it.
+///
+/// Code is only read from an object's file if the file's build-id is the one recorded for the
+/// object (or none was recorded): the file may have been rebuilt since the trace was collected.
+/// Code that can't be read leaves a hole in the image, which the decoder reports if the trace goes
+/// there.
+struct SavedImage {
+    c: Box<CSavedImage>,
+    _sections: Vec<CSavedSection>,
+    _filenames: Vec<CString>,
+}
+
+impl SavedImage {
+    fn new(image: &TraceImage) -> Result<Self, HWTracerError> {
+        let mut filenames = Vec::new();
+        let mut sections = Vec::new();
+        // An object has many segments, so only check its file once.
+        let mut file_ids = HashMap::<&Path, Option<Vec<u8>>>::new();
+        for obj in &image.objects {
+            let filename = match &obj.path {
+                Some(p)
+                    if obj.build_id.is_none()
+                        || *file_ids
+                            .entry(p)
+                            .or_insert_with(|| trace_file::file_build_id(p))
+                            == obj.build_id =>
+                {
+                    let c = CString::new(p.as_os_str().as_bytes())?;
+                    let ptr = c.as_ptr();
+                    filenames.push(c);
+                    ptr
+                }
+                _ => ptr::null(),
+            };
+            let code = obj.code.as_ref().map_or(ptr::null(), |c| c.as_ptr());
+            if filename.is_null() && code.is_null() {
+                continue; // We have no way to get at this code.
+            }
+            let size = match &obj.code {
+                Some(c) if filename.is_null() => obj.size.min(c.len() as u64),
+                _ => obj.size,
+            };
+            sections.push(CSavedSection {
+                filename,
+                code,
+                offset: obj.offset,
+                size,
+                vaddr: obj.vaddr,
+            });
+        }
+        let c = Box::new(CSavedImage {
+            cpu: image.cpu,
+            sections: sections.as_ptr(),
+            nsections: sections.len(),
+        });
+        Ok(Self {
+            c,
+            _sections: sections,
+            _filenames: filenames,
+        })
+    }
+}
+
+/// The [Trace::mmaps] of a trace (those to decode it with: see [mapped]) as sections for the C
+/// code. As with [SavedImage], the pointers point into this.
+struct MappedSections {
+    sections: Vec<CSavedSection>,
+    _filenames: Vec<CString>,
+}
+
+impl MappedSections {
+    fn new<'a>(mmaps: impl Iterator<Item = &'a Mmap>) -> Result<Self, HWTracerError> {
+        let mut filenames = Vec::new();
+        let mut sections = Vec::new();
+        for m in mmaps {
+            // A file that has since been deleted (or renamed) can't be read.
+            if !m.path.exists() {
+                continue;
+            }
+            let c = CString::new(m.path.as_os_str().as_bytes())?;
+            sections.push(CSavedSection {
+                filename: c.as_ptr(),
+                code: ptr::null(),
+                offset: m.offset,
+                size: m.len,
+                vaddr: m.vaddr,
+            });
+            filenames.push(c);
+        }
+        Ok(Self {
+            sections,
+            _filenames: filenames,
+        })
+    }
+}
+
+pub(crate) struct LibIPTTraceDecoder {
+    /// Where to read the code of the process from.
+    image_source: ImageSource,
+}
+
+impl LibIPTTraceDecoder {
+    pub(crate) fn with_image_source(image_source: ImageSource) -> Self {
+        Self { image_source }
+    }
+
+    /// Cut `trace` where code was mapped (see [Segments]), unless code is read from memory, in
+    /// which case mappings aren't used.
+    fn segments<'t>(&'t self, trace: &'t dyn Trace) -> Option<Segments<'t, Self>> {
+        if self.image_source == ImageSource::Memory {
+            return None;
+        }
+        Segments::new(self, trace)
+    }
+}
 
 impl TraceDecoder for LibIPTTraceDecoder {
     fn new() -> Self {
-        Self {}
+        Self::with_image_source(ImageSource::Files)
     }
 
     fn iter_blocks<'t>(
         &'t self,
         trace: &'t dyn Trace,
     ) -> Box<dyn Iterator<Item = Result<Block, HWTracerError>> + '_> {
-        let itr = LibIPTBlockIterator {
-            decoder: ptr::null_mut(),
-            decoder_status: 0,
-            vdso_tempfile: None,
-            trace,
-            errored: false,
-        };
-        Box::new(itr)
+        if let Some(w) = Windows::new(self, trace) {
+            return Box::new(ChunkedBlocks::new(w));
+        }
+        if let Some(s) = self.segments(trace) {
+            return Box::new(ChunkedBlocks::new(s));
+        }
+        Box::new(LibIPTBlockIterator::new(self.image_source, trace))
+    }
+
+    fn decode_into(&self, trace: &dyn Trace, blocks: &mut Vec<Block>) -> Result<(), HWTracerError> {
+        if let Some(w) = Windows::new(self, trace) {
+            return parallel::decode_chunked(w, |bs| blocks.extend(bs));
+        }
+        if let Some(s) = self.segments(trace) {
+            return parallel::decode_chunked(s, |bs| blocks.extend(bs));
+        }
+        let mut itr = LibIPTBlockIterator::new(self.image_source, trace);
+        while itr.fill(blocks)? {}
+        Ok(())
     }
 }
 
@@ -58,51 +225,162 @@ struct LibIPTBlockIterator<'t> {
     decoder: *mut c_void,
     /// Stores the current libipt-level status of the above decoder.
     decoder_status: c_int,
-    /// VDSO code (stored temporarily).
-    #[allow(dead_code)]
-    // Rust doesn't know that this exists only to keep the file long enough.
-    vdso_tempfile: Option<NamedTempFile>,
+    /// Where to read the code of the process from.
+    image_source: ImageSource,
+    /// The image of the trace, if it records one, once the first decoder has been initialised.
+    saved: Option<SavedImage>,
+    /// The trace's [Trace::mmaps], once the first decoder has been initialised.
+    mapped: Option<MappedSections>,
     /// The trace we are iterating over.
     trace: &'t dyn Trace,
-    /// Set to true when an error has occured.
-    errored: bool,
+    /// The trace's gaps split it into segments, each decoded separately. This is the index of the
+    /// one being decoded.
+    segment: usize,
+    /// Set to true when an error has occured, or the end of the trace has been reached.
+    done: bool,
+    /// Blocks decoded, but not yet yielded by the iterator.
+    buf: Vec<Block>,
+    /// The index of the next block of `buf` to yield.
+    buf_pos: usize,
+    /// An error to yield once `buf` has been exhausted.
+    pending_err: Option<HWTracerError>,
 }
 
 impl<'t> LibIPTBlockIterator<'t> {
-    /// Initialise the block decoder.
+    fn new(image_source: ImageSource, trace: &'t dyn Trace) -> Self {
+        Self {
+            decoder: ptr::null_mut(),
+            decoder_status: 0,
+            image_source,
+            saved: None,
+            mapped: None,
+            trace,
+            segment: 0,
+            done: false,
+            buf: Vec::new(),
+            buf_pos: 0,
+            pending_err: None,
+        }
+    }
+
+    /// Returns the byte range of the trace making up the current segment.
+    ///
+    /// Segments after a gap start at their first PSB, found by our (vectorised) scanner rather
+    /// than by the byte-at-a-time search in libipt's `pt_blk_sync_forward()`.
+    fn segment_range(&self) -> (usize, usize) {
+        let gaps = self.trace.gaps();
+        let end = gaps.get(self.segment).copied().unwrap_or(self.trace.len());
+        let start = if self.segment == 0 {
+            0
+        } else {
+            find_psb(&self.trace.bytes()[..end], gaps[self.segment - 1]).unwrap_or(end)
+        };
+        (start, end)
+    }
+
+    /// Move on to the next segment, returning `false` if there isn't one.
+    fn next_segment(&mut self) -> bool {
+        if self.segment == self.trace.gaps().len() {
+            return false;
+        }
+        unsafe { hwt_ipt_free_block_decoder(self.decoder) };
+        self.decoder = ptr::null_mut();
+        self.decoder_status = 0;
+        self.segment += 1;
+        true
+    }
+
+    /// Initialise the block decoder for the current segment.
+    ///
+    /// When reading code from files, the decoder's image of the process's code is copied from one
+    /// cached by the C code for the whole process, which is only rebuilt when objects are loaded or
+    /// unloaded. Traces which record their own image (see [Trace::image]) are decoded with that
+    /// instead. Either way, the code mapped while the trace was collected (see [Trace::mmaps]) is
+    /// added on top, in the order it was mapped. The trace has been cut where code was mapped (see
+    /// [Segments]), so what it adds up to is the code as it was for all of the trace.
     fn init_decoder(&mut self) -> Result<(), HWTracerError> {
-        // Make a temp file for the C code to write the VDSO code into.
-        //
-        // We have to do this because libipt lazily reads the code from the files you load into the
-        // image. We store it into `self` to ensure the file lives as long as the iterator.
-        let vdso_tempfile = NamedTempFile::new()?;
-        // File name of a NamedTempFile should always be valid UTF-8, unwrap() below can't fail.
-        let vdso_filename = CString::new(vdso_tempfile.path().to_str().unwrap())?;
+        if let (None, Some(image)) = (&self.saved, self.trace.image()) {
+            self.saved = Some(SavedImage::new(image)?);
+        }
+        if self.mapped.is_none() {
+            self.mapped = Some(MappedSections::new(mapped(self.trace))?);
+        }
+        let mapped = &self.mapped.as_ref().unwrap().sections;
+        let saved = self
+            .saved
+            .as_ref()
+            .map_or(ptr::null(), |s| &*s.c as *const CSavedImage);
+        let (start, end) = self.segment_range();
+        let exe = CString::new(trace_file::current_exe()?.as_os_str().as_bytes())?;
         let mut cerr = PerfPTCError::new();
         let decoder = unsafe {
             hwt_ipt_init_block_decoder(
-                self.trace.bytes().as_ptr() as *const c_void,
-                u64::try_from(self.trace.len()).unwrap(),
-                vdso_tempfile.as_raw_fd(),
-                vdso_filename.as_ptr(),
+                self.trace.bytes()[start..].as_ptr() as *const c_void,
+                u64::try_from(end - start).unwrap(),
+                self.image_source,
+                saved,
+                mapped.as_ptr(),
+                mapped.len(),
                 &mut self.decoder_status,
                 &mut cerr,
-                // FIXME: current_exe() isn't reliable. We should find another way to do this.
-                CString::new(env::current_exe().unwrap().to_str().unwrap())
-                    .unwrap()
-                    .as_c_str()
-                    .as_ptr() as *const c_char,
+                exe.as_ptr(),
             )
         };
         if decoder.is_null() {
             return Err(cerr.into());
         }
 
-        vdso_tempfile.as_file().sync_all()?;
         self.decoder = decoder;
-        self.vdso_tempfile = Some(vdso_tempfile);
         Ok(())
     }
+
+    /// Decode a batch of blocks, appending them to `out`. Returns `false` once the end of the
+    /// trace has been reached. On error, `out` holds those blocks decoded before the error.
+    fn fill(&mut self, out: &mut Vec<Block>) -> Result<bool, HWTracerError> {
+        // Lazily initialise the block decoder.
+        if self.decoder.is_null() {
+            self.init_decoder()?;
+        }
+
+        out.reserve(BATCH_SIZE);
+        let mut n = 0;
+        let mut cerr = PerfPTCError::new();
+        let rv = unsafe {
+            hwt_ipt_next_blocks(
+                self.decoder,
+                &mut self.decoder_status,
+                out.as_mut_ptr().add(out.len()),
+                BATCH_SIZE,
+                &mut n,
+                &mut cerr,
+            )
+        };
+        // SAFETY: `hwt_ipt_next_blocks()` initialised `n` blocks of the spare capacity, even on
+        // error.
+        unsafe { out.set_len(out.len() + n) };
+        if !rv {
+            let err = HWTracerError::from(cerr);
+            if self.trace.is_lossy() {
+                // After an overflow libipt carries on by itself from the next packet carrying an
+                // IP. Anything else means the segment is broken (e.g. it was cut short in the
+                // middle of a packet), so we skip to the next segment and sync from its first PSB.
+                if matches!(err, HWTracerError::HWBufferOverflow) || self.next_segment() {
+                    out.push(Block::new_gap());
+                    return Ok(true);
+                }
+            }
+            return Err(err);
+        }
+        if n < BATCH_SIZE {
+            // End of the segment.
+            if self.next_segment() {
+                out.push(Block::new_gap());
+            } else {
+                return Ok(false); // End of packet stream.
+            }
+        }
+        Ok(true)
+    }
 }
 
 impl<'t> Drop for LibIPTBlockIterator<'t> {
@@ -115,53 +393,45 @@ impl<'t> Iterator for LibIPTBlockIterator<'t> {
     type Item = Result<Block, HWTracerError>;
 
     fn next(&mut self) -> Option<Self::Item> {
-        // There was an error in a previous iteration.
-        if self.errored {
-            return None;
-        }
-
-        // Lazily initialise the block decoder.
-        if self.decoder.is_null() {
-            if let Err(e) = self.init_decoder() {
-                self.errored = true;
+        loop {
+            if let Some(b) = self.buf.get(self.buf_pos) {
+                self.buf_pos += 1;
+                return Some(Ok(*b));
+            }
+            if let Some(e) = self.pending_err.take() {
                 return Some(Err(e));
             }
-        }
+            if self.done {
+                return None;
+            }
 
-        let mut first_instr = 0;
-        let mut last_instr = 0;
-        let mut cerr = PerfPTCError::new();
-        let rv = unsafe {
-            hwt_ipt_next_block(
-                self.decoder,
-                &mut self.decoder_status,
-                &mut first_instr,
-                &mut last_instr,
-                &mut cerr,
-            )
-        };
-        if !rv {
-            self.errored = true; // This iterator is unusable now.
-            return Some(Err(HWTracerError::from(cerr)));
-        }
-        if first_instr == 0 {
-            None // End of packet stream.
-        } else {
-            Some(Ok(Block::new(first_instr, last_instr)))
+            self.buf.clear();
+            self.buf_pos = 0;
+            let mut buf = std::mem::take(&mut self.buf);
+            match self.fill(&mut buf) {
+                Ok(more) => self.done = !more,
+                Err(e) => {
+                    self.done = true; // This iterator is unusable now.
+                    self.pending_err = Some(e);
+                }
+            }
+            self.buf = buf;
         }
     }
 }
 
 #[cfg(test)]
 mod tests {
-    use super::{LibIPTBlockIterator, PerfPTCError};
+    use super::{ImageSource, LibIPTBlockIterator, PerfPTCError, SavedImage};
     use crate::{
         collect::{
-            perf::PerfTrace, test_helpers::trace_closure, TraceCollector, TraceCollectorBuilder,
+            perf::PerfTrace, test_helpers::trace_closure, PerfTraceStorage, TraceCollector,
+            TraceCollectorBuilder,
         },
-        decode::{test_helpers, TraceDecoderKind},
+        decode::{test_helpers, TraceDecoderBuilder, TraceDecoderKind},
         errors::HWTracerError,
         test_helpers::work_loop,
+        trace_file::TraceImage,
         Block, Trace,
     };
     use libc::{c_int, size_t, PF_X, PT_LOAD};
@@ -366,13 +636,19 @@ mod tests {
     #[test]
     fn error_stops_block_iter() {
         // A zero-sized trace will lead to an error.
-        let trace = PerfTrace::new(0).unwrap();
+        let trace = PerfTrace::new(0, PerfTraceStorage::Heap, None).unwrap();
         let mut itr = LibIPTBlockIterator {
             decoder: ptr::null_mut(),
             decoder_status: 0,
-            vdso_tempfile: None,
+            image_source: ImageSource::Files,
+            saved: None,
+            mapped: None,
             trace: &trace,
-            errored: false,
+            segment: 0,
+            done: false,
+            buf: Vec::new(),
+            buf_pos: 0,
+            pending_err: None,
         };
 
         // First we expect a libipt error.
@@ -393,4 +669,90 @@ mod tests {
         let tc = TraceCollectorBuilder::new().build().unwrap();
         test_helpers::ten_times_as_many_blocks(tc, TraceDecoderKind::LibIPT);
     }
+
+    /// Check that decoders built from the cached image of the process see the same blocks as the
+    /// decoder that built it.
+    #[test]
+    fn cached_image() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(100));
+        let decode = || {
+            let dec = TraceDecoderBuilder::new()
+                .kind(TraceDecoderKind::LibIPT)
+                .build()
+                .unwrap();
+            dec.iter_blocks(&*trace)
+                .map(|b| b.unwrap().first_instr())
+                .collect::<Vec<_>>()
+        };
+        let expect = decode();
+        assert!(!expect.is_empty());
+        for _ in 0..3 {
+            assert_eq!(decode(), expect);
+        }
+    }
+
+    /// Check that code isn't read from a file whose build-id isn't the one recorded in the image.
+    #[test]
+    fn saved_image_checks_build_ids() {
+        let mut image = TraceImage::current().unwrap();
+        let nsections = SavedImage::new(&image).unwrap().c.nsections;
+        assert_eq!(nsections, image.objects.len());
+
+        let path = image
+            .objects
+            .iter()
+            .find(|o| o.build_id.is_some())
+            .and_then(|o| o.path.clone())
+            .unwrap();
+        let mut nchanged = 0;
+        for obj in image
+            .objects
+            .iter_mut()
+            .filter(|o| o.path == Some(path.clone()))
+        {
+            obj.build_id = Some(vec![0xde, 0xad]);
+            nchanged += 1;
+        }
+        let saved = SavedImage::new(&image).unwrap();
+        assert_eq!(saved.c.nsections, nsections - nchanged);
+        let nfiles = image.objects.iter().filter(|o| o.path.is_some()).count();
+        assert_eq!(saved._filenames.len(), nfiles - nchanged);
+    }
+
+    /// Check that reading code from memory gives the same blocks as reading it from files.
+    #[test]
+    fn image_from_memory() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(100));
+        let decode = |image_source| {
+            let dec = TraceDecoderBuilder::new()
+                .kind(TraceDecoderKind::LibIPT)
+                .image_source(image_source)
+                .build()
+                .unwrap();
+            dec.iter_blocks(&*trace)
+                .map(|b| b.unwrap().first_instr())
+                .collect::<Vec<_>>()
+        };
+        assert_eq!(decode(ImageSource::Memory), decode(ImageSource::Files));
+    }
+
+    #[test]
+    fn decode_into_matches_iter() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        test_helpers::decode_into_matches_iter(tc, TraceDecoderKind::LibIPT);
+    }
+
+    #[test]
+    fn block_trace_matches_decode_into() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        test_helpers::block_trace_matches_decode_into(tc, TraceDecoderKind::LibIPT);
+    }
+
+    #[test]
+    fn parallel_matches_serial() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        test_helpers::parallel_matches_serial(tc, TraceDecoderKind::LibIPT);
+    }
 }
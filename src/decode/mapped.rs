@@ -0,0 +1,215 @@
+//! Decoding a trace during which code was mapped (see [Trace::mmaps]).
+//!
+//! Code mapped part way through a trace may replace code traced before it was mapped, so no one
+//! picture of the code is right for the whole trace. The trace is cut into parts at the `PSB` at
+//! or before each point at which code was mapped, and each part is decoded on its own, with the
+//! code mapped before the part ends (see [mapped]). The blocks of the parts are stitched together
+//! as in [parallel](super::parallel) decoding.
+
+use crate::{
+    collect::Mmap,
+    decode::{
+        parallel::{self, Chunk, Chunked},
+        scan::PsbIndex,
+        TraceDecoder,
+    },
+    errors::HWTracerError,
+    Block, Trace,
+};
+
+/// The mappings to decode `trace` with, once it has been cut into parts (see [Segments]): those
+/// made before it ends, in the order they were made.
+pub(super) fn mapped<'t>(trace: &'t dyn Trace) -> impl Iterator<Item = &'t Mmap> {
+    let len = trace.len();
+    trace.mmaps().iter().filter(move |m| m.trace_offset < len)
+}
+
+/// A trace being decoded part by part.
+pub(super) struct Segments<'t, D: ?Sized> {
+    decoder: &'t D,
+    trace: &'t dyn Trace,
+    /// The offsets at which the parts start.
+    starts: Vec<usize>,
+    /// The index in `starts` of the next part to decode.
+    next: usize,
+    /// The blocks decoded but not yet handed on.
+    blocks: Vec<Block>,
+}
+
+impl<'t, D: TraceDecoder + ?Sized> Segments<'t, D> {
+    /// Decode `trace` with `decoder` part by part, or return `None` if no code was mapped part way
+    /// through it, so that it is all one part.
+    pub(super) fn new(decoder: &'t D, trace: &'t dyn Trace) -> Option<Self> {
+        if !mapped(trace).any(|m| m.trace_offset > 0) {
+            return None;
+        }
+        let psbs = PsbIndex::new(trace.bytes());
+        let mut starts = vec![0];
+        starts.extend(mapped(trace).filter_map(|m| psbs.at_or_before(m.trace_offset)));
+        starts.sort_unstable();
+        starts.dedup();
+        if starts.len() == 1 {
+            return None;
+        }
+        Some(Self {
+            decoder,
+            trace,
+            starts,
+            next: 0,
+            blocks: Vec::new(),
+        })
+    }
+}
+
+impl<'t, D: TraceDecoder + ?Sized> Chunked for Segments<'t, D> {
+    fn decode_next(&mut self) -> Result<bool, HWTracerError> {
+        let Some(&start) = self.starts.get(self.next) else {
+            return Ok(false);
+        };
+        self.next += 1;
+        let end = self
+            .starts
+            .get(self.next)
+            .copied()
+            .unwrap_or(self.trace.bytes().len());
+        let mut got = Vec::new();
+        let res = self
+            .decoder
+            .decode_into(&Chunk::new(self.trace, start, end), &mut got);
+        // On error, the blocks decoded before it are still handed on.
+        parallel::append(self.trace, start, &mut self.blocks, got);
+        res.map(|_| true)
+    }
+
+    fn blocks(&mut self) -> &mut Vec<Block> {
+        &mut self.blocks
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{mapped, Segments};
+    use crate::{
+        collect::{test_helpers::trace_closure, Mmap, TraceCollectorBuilder},
+        decode::{
+            parallel::{self, Chunk},
+            scan::{find_psb, PSB},
+            TraceDecoderBuilder,
+        },
+        test_helpers::work_loop,
+        Trace,
+    };
+    use std::{fs::File, io::Write, path::PathBuf};
+
+    /// A trace with mappings.
+    #[derive(Debug)]
+    struct MappedTrace {
+        bytes: Vec<u8>,
+        mmaps: Vec<Mmap>,
+    }
+
+    impl Trace for MappedTrace {
+        fn bytes(&self) -> &[u8] {
+            &self.bytes
+        }
+
+        fn capacity(&self) -> usize {
+            self.bytes.len()
+        }
+
+        fn len(&self) -> usize {
+            self.bytes.len()
+        }
+
+        fn mmaps(&self) -> &[Mmap] {
+            &self.mmaps
+        }
+
+        fn to_file(&self, file: &mut File) {
+            file.write_all(&self.bytes).unwrap();
+        }
+    }
+
+    fn mmap(path: &str, trace_offset: usize) -> Mmap {
+        Mmap {
+            vaddr: 0x1000,
+            len: 0x1000,
+            offset: 0,
+            path: PathBuf::from(path),
+            trace_offset,
+        }
+    }
+
+    /// Check that a trace is cut at the `PSB` at or before each mapping, and that each part is
+    /// decoded with the mappings made before it ends.
+    #[test]
+    fn parts() {
+        let mut bytes = PSB.to_vec();
+        bytes.extend([0; 16]);
+        bytes.extend(PSB);
+        bytes.extend([0; 16]);
+        bytes.extend(PSB);
+        bytes.extend([0; 16]);
+        let psb2 = PSB.len() + 16;
+        let psb3 = 2 * psb2;
+        let len = bytes.len();
+        let trace = MappedTrace {
+            bytes,
+            mmaps: vec![
+                mmap("/a", 0),
+                mmap("/b", 4),
+                mmap("/c", psb2 + 4),
+                mmap("/d", psb2 + 8),
+                mmap("/e", len),
+            ],
+        };
+        let dec = TraceDecoderBuilder::new().build().unwrap();
+        let segs = Segments::new(&*dec, &trace).unwrap();
+        assert_eq!(segs.starts, vec![0, psb2]);
+
+        let paths = |start, end| {
+            let chunk = Chunk::new(&trace, start, end);
+            mapped(&chunk)
+                .map(|m| m.path.to_str().unwrap().to_owned())
+                .collect::<Vec<_>>()
+        };
+        assert_eq!(paths(0, psb2), ["/a", "/b"]);
+        assert_eq!(paths(psb2, len), ["/a", "/b", "/c", "/d"]);
+        // Once cut, a part is decoded as a whole.
+        assert!(Segments::new(&*dec, &Chunk::new(&trace, 0, psb2)).is_none());
+        assert!(Segments::new(&*dec, &Chunk::new(&trace, psb2, len)).is_none());
+        assert!(Segments::new(&*dec, &Chunk::new(&trace, psb2, psb3)).is_none());
+
+        // Without code mapped part way through, there's only one part.
+        let trace = MappedTrace {
+            bytes: trace.bytes,
+            mmaps: vec![mmap("/a", 0), mmap("/e", len)],
+        };
+        assert!(Segments::new(&*dec, &trace).is_none());
+    }
+
+    /// Check that decoding part by part gives the same blocks as decoding the whole trace at once,
+    /// when the mappings change none of the code.
+    #[test]
+    fn matches_whole() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(3000));
+        let dec = TraceDecoderBuilder::new().build().unwrap();
+        let mut expect = Vec::new();
+        dec.decode_into(&*trace, &mut expect).unwrap();
+
+        let psb = find_psb(trace.bytes(), 1).unwrap();
+        let mapped = MappedTrace {
+            bytes: trace.bytes().to_vec(),
+            mmaps: vec![mmap("/nonexistent", psb + 1)],
+        };
+        let mut got = Vec::new();
+        let segs = Segments::new(&*dec, &mapped).unwrap();
+        parallel::decode_chunked(segs, |bs| got.extend(bs)).unwrap();
+        assert_eq!(got, expect);
+
+        let mut got = Vec::new();
+        dec.decode_into(&mapped, &mut got).unwrap();
+        assert_eq!(got, expect);
+    }
+}
@@ -1,6 +1,7 @@
 //! Trace decoders.
 
-use crate::{errors::HWTracerError, Block, Trace};
+use crate::{errors::HWTracerError, Block, BlockTrace, Trace};
+use std::{path::PathBuf, vec};
 use strum::IntoEnumIterator;
 use strum_macros::EnumIter;
 
@@ -9,6 +10,17 @@ pub(crate) mod libipt;
 #[cfg(decoder_libipt)]
 use libipt::LibIPTTraceDecoder;
 
+mod frames;
+use frames::Windows;
+#[cfg(all(decoder_ykpt, decoder_libipt))]
+mod hybrid;
+#[cfg(all(decoder_ykpt, decoder_libipt))]
+use hybrid::HybridTraceDecoder;
+mod mapped;
+use mapped::Segments;
+mod parallel;
+pub(crate) mod scan;
+pub(crate) mod stream;
 #[cfg(decoder_ykpt)]
 mod ykpt;
 #[cfg(decoder_ykpt)]
@@ -18,6 +30,9 @@ use ykpt::YkPTTraceDecoder;
 pub enum TraceDecoderKind {
     LibIPT,
     YkPT,
+    /// The YkPT decoder, except that parts of a trace it can't decode are decoded by the libipt
+    /// decoder instead. Both decoders must be compiled in.
+    Auto,
 }
 
 impl TraceDecoderKind {
@@ -46,11 +61,33 @@ impl TraceDecoderKind {
                 #[cfg(not(decoder_ykpt))]
                 return Err(HWTracerError::DecoderUnavailable(Self::YkPT));
             }
+            Self::Auto => {
+                #[cfg(all(decoder_ykpt, decoder_libipt))]
+                return Ok(());
+                #[cfg(not(all(decoder_ykpt, decoder_libipt)))]
+                return Err(HWTracerError::DecoderUnavailable(Self::Auto));
+            }
         }
     }
 }
 
-pub trait TraceDecoder {
+/// Where a decoder reads the code it needs to follow a trace from.
+///
+/// Either way, the code must be that of the current process and must not have changed since it was
+/// traced.
+///
+// Must stay in sync with the C code.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+#[repr(C)]
+pub enum ImageSource {
+    /// The executable and shared objects on disk (the VDSO is dumped to a temporary file).
+    Files,
+    /// The live address space of the process, without any disk I/O. This also covers code with no
+    /// backing file, such as that emitted by a JIT.
+    Memory,
+}
+
+pub trait TraceDecoder: Send + Sync {
     /// Create the trace decoder.
     fn new() -> Self
     where
@@ -61,10 +98,70 @@ pub trait TraceDecoder {
         &'t self,
         trace: &'t dyn Trace,
     ) -> Box<dyn Iterator<Item = Result<Block, HWTracerError>> + '_>;
+
+    /// Decode the blocks of the trace, appending them to `blocks`.
+    ///
+    /// This gives the same blocks as [TraceDecoder::iter_blocks], but decoders may implement it
+    /// more cheaply by decoding many blocks at a time. Reusing `blocks` across traces avoids
+    /// reallocating it. On error, `blocks` holds those blocks decoded before the error.
+    fn decode_into(&self, trace: &dyn Trace, blocks: &mut Vec<Block>) -> Result<(), HWTracerError> {
+        if let Some(w) = Windows::new(self, trace) {
+            return parallel::decode_chunked(w, |bs| blocks.extend(bs));
+        }
+        if let Some(s) = Segments::new(self, trace) {
+            return parallel::decode_chunked(s, |bs| blocks.extend(bs));
+        }
+        for b in self.iter_blocks(trace) {
+            blocks.push(b?);
+        }
+        Ok(())
+    }
+
+    /// Decode the blocks of the trace, appending them to the compact `blocks` (see [BlockTrace]).
+    ///
+    /// Unlike [TraceDecoder::decode_into], this never holds all of the blocks uncompressed. On
+    /// error, `blocks` holds those blocks decoded before the error.
+    fn decode_block_trace(
+        &self,
+        trace: &dyn Trace,
+        blocks: &mut BlockTrace,
+    ) -> Result<(), HWTracerError> {
+        let sink = |bs: vec::Drain<'_, Block>| {
+            for b in bs {
+                blocks.push(b);
+            }
+        };
+        if let Some(w) = Windows::new(self, trace) {
+            return parallel::decode_chunked(w, sink);
+        }
+        if let Some(s) = Segments::new(self, trace) {
+            return parallel::decode_chunked(s, sink);
+        }
+        for b in self.iter_blocks(trace) {
+            blocks.push(b?);
+        }
+        Ok(())
+    }
+
+    /// Decode the blocks of the trace on up to `nthreads` threads, appending them to `blocks`.
+    ///
+    /// The trace is cut into chunks at `PSB` packets, each decoded by its own decoder, and the
+    /// blocks of the chunks are stitched back together in order. Small traces are decoded on the
+    /// calling thread. On error, `blocks` is left as it was.
+    fn decode_parallel(
+        &self,
+        trace: &dyn Trace,
+        nthreads: usize,
+        blocks: &mut Vec<Block>,
+    ) -> Result<(), HWTracerError> {
+        parallel::decode(self, trace, nthreads, blocks)
+    }
 }
 
 pub struct TraceDecoderBuilder {
     kind: TraceDecoderKind,
+    image_source: ImageSource,
+    code_cache: Option<PathBuf>,
 }
 
 impl TraceDecoderBuilder {
@@ -72,6 +169,8 @@ impl TraceDecoderBuilder {
     pub fn new() -> Self {
         Self {
             kind: TraceDecoderKind::default_for_platform().unwrap(),
+            image_source: ImageSource::Files,
+            code_cache: None,
         }
     }
 
@@ -81,6 +180,23 @@ impl TraceDecoderBuilder {
         self
     }
 
+    /// Select where the decoder reads code from. Only the libipt decoder (and so the libipt part of
+    /// the [TraceDecoderKind::Auto] decoder) can read from files: the others always use the live
+    /// address space.
+    pub fn image_source(mut self, image_source: ImageSource) -> Self {
+        self.image_source = image_source;
+        self
+    }
+
+    /// Cache what the decoder learns about the code of the process in the directory `dir`, so that
+    /// decoders in later processes running the same code can start up faster. The directory is
+    /// created if need be. Only the YkPT decoder (on its own or as part of the
+    /// [TraceDecoderKind::Auto] decoder) uses this: the libipt decoder always reads code afresh.
+    pub fn code_cache(mut self, dir: impl Into<PathBuf>) -> Self {
+        self.code_cache = Some(dir.into());
+        self
+    }
+
     /// Build the trace decoder.
     ///
     /// An error is returned if the requested decoder is inappropriate for the platform or the
@@ -90,16 +206,27 @@ impl TraceDecoderBuilder {
         match self.kind {
             TraceDecoderKind::LibIPT => {
                 #[cfg(decoder_libipt)]
-                return Ok(Box::new(LibIPTTraceDecoder::new()));
+                return Ok(Box::new(LibIPTTraceDecoder::with_image_source(
+                    self.image_source,
+                )));
                 #[cfg(not(decoder_libipt))]
                 return Err(HWTracerError::DecoderUnavailable(self.kind));
             }
             TraceDecoderKind::YkPT => {
                 #[cfg(decoder_ykpt)]
-                return Ok(Box::new(YkPTTraceDecoder::new()));
+                return Ok(Box::new(YkPTTraceDecoder::with_code_cache(self.code_cache)));
                 #[cfg(not(decoder_ykpt))]
                 return Err(HWTracerError::DecoderUnavailable(self.kind));
             }
+            TraceDecoderKind::Auto => {
+                #[cfg(all(decoder_ykpt, decoder_libipt))]
+                return Ok(Box::new(HybridTraceDecoder::with_config(
+                    self.image_source,
+                    self.code_cache,
+                )));
+                #[cfg(not(all(decoder_ykpt, decoder_libipt)))]
+                return Err(HWTracerError::DecoderUnavailable(self.kind));
+            }
         }
     }
 }
@@ -111,7 +238,7 @@ mod test_helpers {
     use crate::{
         collect::{test_helpers::trace_closure, TraceCollector},
         test_helpers::work_loop,
-        Block, Trace,
+        Block, BlockTrace, Trace,
     };
     use std::slice::Iter;
 
@@ -160,4 +287,61 @@ mod test_helpers {
         // we trace either side of the loop itself. On a smallish trace, that will be significant.
         assert!(ct2 > ct1 * 8);
     }
+
+    /// Check that decoding into a vector gives the same blocks as iterating.
+    pub fn decode_into_matches_iter(mut tc: TraceCollector, decoder_kind: TraceDecoderKind) {
+        let trace = trace_closure(&mut tc, || work_loop(500));
+        let dec = TraceDecoderBuilder::new()
+            .kind(decoder_kind)
+            .build()
+            .unwrap();
+
+        let expect = dec
+            .iter_blocks(&*trace)
+            .collect::<Result<Vec<_>, _>>()
+            .unwrap();
+        let mut got = Vec::new();
+        dec.decode_into(&*trace, &mut got).unwrap();
+        assert_eq!(got, expect);
+
+        // Decoding again appends.
+        dec.decode_into(&*trace, &mut got).unwrap();
+        assert_eq!(got.len(), expect.len() * 2);
+        assert_eq!(&got[expect.len()..], &expect[..]);
+    }
+
+    /// Check that decoding into a [BlockTrace] gives the same blocks as decoding into a vector.
+    pub fn block_trace_matches_decode_into(mut tc: TraceCollector, decoder_kind: TraceDecoderKind) {
+        let trace = trace_closure(&mut tc, || work_loop(3000));
+        let dec = TraceDecoderBuilder::new()
+            .kind(decoder_kind)
+            .build()
+            .unwrap();
+
+        let mut expect = Vec::new();
+        dec.decode_into(&*trace, &mut expect).unwrap();
+        let mut got = BlockTrace::new();
+        dec.decode_block_trace(&*trace, &mut got).unwrap();
+        assert_eq!(got.len(), expect.len());
+        assert_eq!(got.iter().collect::<Vec<_>>(), expect);
+        // The trace is mostly the same loop over and over.
+        assert!(got.encoded_len() * 5 < expect.len() * std::mem::size_of::<Block>());
+    }
+
+    /// Check that decoding on many threads gives the same blocks as decoding on one.
+    pub fn parallel_matches_serial(mut tc: TraceCollector, decoder_kind: TraceDecoderKind) {
+        let trace = trace_closure(&mut tc, || work_loop(100000));
+        let dec = TraceDecoderBuilder::new()
+            .kind(decoder_kind)
+            .build()
+            .unwrap();
+
+        let mut expect = Vec::new();
+        dec.decode_into(&*trace, &mut expect).unwrap();
+        for nthreads in [1, 2, 8] {
+            let mut got = Vec::new();
+            dec.decode_parallel(&*trace, nthreads, &mut got).unwrap();
+            assert_eq!(got, expect);
+        }
+    }
 }
@@ -0,0 +1,450 @@
+//! Decoding a trace on many threads at once.
+//!
+//! A decoder can start from any `PSB` packet, so the trace is cut into chunks at `PSB`s and each
+//! chunk is decoded as a trace of its own. The blocks of each chunk are then stitched back
+//! together in order.
+
+use crate::{
+    collect::Mmap,
+    decode::{
+        scan::{psb_fup, PsbIndex},
+        TraceDecoder,
+    },
+    errors::HWTracerError,
+    trace_file::TraceImage,
+    Block, Trace,
+};
+#[cfg(test)]
+use std::{fs::File, io::Write};
+use std::{
+    sync::atomic::{AtomicUsize, Ordering},
+    thread, vec,
+};
+
+/// Chunks are at least this many bytes long, so that decoding one is worth the decoder set up.
+const MIN_CHUNK_SIZE: usize = 1024 * 1024;
+
+/// How many chunks to make per thread, so that threads which finish early can take on more work.
+const CHUNKS_PER_THREAD: usize = 4;
+
+/// How far back from the end of a chunk's blocks to look for the block that the next chunk starts
+/// part way into.
+pub(super) const STITCH_WINDOW: usize = 256;
+
+/// A slice of a trace starting at a `PSB`, which can be decoded on its own.
+#[derive(Debug)]
+pub(super) struct Chunk<'t> {
+    bytes: &'t [u8],
+    /// The gaps falling inside this chunk, relative to its start.
+    gaps: Vec<usize>,
+    lossy: bool,
+    /// The mappings of the trace, their offsets made relative to the start of this chunk (those
+    /// made before it starts being at 0).
+    mmaps: Vec<Mmap>,
+    image: Option<&'t TraceImage>,
+}
+
+impl<'t> Chunk<'t> {
+    /// The bytes of `trace` from `start`, which must be 0 or the offset of a `PSB`, to `end`.
+    pub(super) fn new(trace: &'t dyn Trace, start: usize, end: usize) -> Self {
+        Self::from_bytes(trace, &trace.bytes()[start..end], start)
+    }
+
+    /// Like [Chunk::new], for the chunk of `trace` whose bytes, from `start`, are `bytes`.
+    pub(super) fn from_bytes(trace: &'t dyn Trace, bytes: &'t [u8], start: usize) -> Self {
+        let end = start + bytes.len();
+        Self {
+            bytes,
+            gaps: trace
+                .gaps()
+                .iter()
+                .filter(|&&g| g > start && g < end)
+                .map(|g| g - start)
+                .collect(),
+            lossy: trace.is_lossy(),
+            mmaps: trace
+                .mmaps()
+                .iter()
+                .map(|m| Mmap {
+                    trace_offset: m.trace_offset.saturating_sub(start),
+                    ..m.clone()
+                })
+                .collect(),
+            image: trace.image(),
+        }
+    }
+
+    /// Make the chunk not lossy, so that decoders report unparseable data as errors.
+    #[cfg(all(decoder_ykpt, decoder_libipt))]
+    pub(super) fn strict(mut self) -> Self {
+        self.lossy = false;
+        self
+    }
+}
+
+impl<'t> Trace for Chunk<'t> {
+    fn bytes(&self) -> &[u8] {
+        self.bytes
+    }
+
+    #[cfg(test)]
+    fn capacity(&self) -> usize {
+        self.bytes.len()
+    }
+
+    fn len(&self) -> usize {
+        self.bytes.len()
+    }
+
+    fn gaps(&self) -> &[usize] {
+        &self.gaps
+    }
+
+    fn is_lossy(&self) -> bool {
+        self.lossy
+    }
+
+    fn mmaps(&self) -> &[Mmap] {
+        &self.mmaps
+    }
+
+    fn image(&self) -> Option<&TraceImage> {
+        self.image
+    }
+
+    #[cfg(test)]
+    fn to_file(&self, file: &mut File) {
+        file.write_all(self.bytes).unwrap();
+    }
+}
+
+/// Choose the offsets at which to cut a trace of `len` bytes, with PSBs indexed by `psbs`, so as
+/// to keep `nthreads` busy. The first is always 0.
+fn chunk_starts(len: usize, psbs: &PsbIndex, nthreads: usize) -> Vec<usize> {
+    starts_every(
+        psbs,
+        (len / (nthreads * CHUNKS_PER_THREAD)).max(MIN_CHUNK_SIZE),
+    )
+}
+
+/// Choose the offsets at which to cut a trace with PSBs indexed by `psbs` into parts of at least
+/// `size` bytes. The first is always 0.
+pub(super) fn starts_every(psbs: &PsbIndex, size: usize) -> Vec<usize> {
+    let mut starts = vec![0];
+    let mut from = size;
+    while let Some(off) = psbs.at_or_after(from) {
+        starts.push(off);
+        from = off + size;
+    }
+    starts
+}
+
+/// Append the blocks of the chunk `next` to those of the chunk before it, `blocks`. `fup` is the
+/// IP of the `FUP` in the `PSB+` that `next` starts with, if it has one.
+///
+/// The decoder of the earlier chunk runs on from the last packet it has until it reaches a branch
+/// whose outcome it doesn't know. When the later chunk's `PSB+` has a `FUP`, its decoder starts
+/// from that IP, which may lie part way through a block. So the later chunk's first block may be
+/// the tail end of the block containing the `FUP` IP, and the blocks the earlier decoder ran on
+/// to after it are found again at the start of the later chunk. We trim this overlap away only
+/// when the earlier chunk ends in exactly that shape: a block containing the `FUP` IP and ending
+/// where the later chunk's first block does, followed by nothing but a prefix of the later
+/// chunk's blocks. Without a `FUP` (the later chunk starts with a `TIP.PGE`) nothing was run on to,
+/// and any match would be a real, earlier, run of the same blocks, as in a loop.
+pub(super) fn stitch(blocks: &mut Vec<Block>, next: Vec<Block>, fup: Option<u64>) {
+    if let (Some(fup), Some(first)) = (fup, next.first()) {
+        if !first.is_gap() {
+            let window = blocks.len().saturating_sub(STITCH_WINDOW);
+            let overlaps = |i: usize| {
+                let b = &blocks[i];
+                let ran_on = &blocks[i + 1..];
+                !b.is_gap()
+                    && (b.first_instr()..=b.last_instr()).contains(&fup)
+                    && b.last_instr() == first.last_instr()
+                    && ran_on.len() < next.len()
+                    && ran_on == &next[1..=ran_on.len()]
+            };
+            if let Some(i) = (window..blocks.len()).rev().find(|&i| overlaps(i)) {
+                blocks.truncate(i + 1);
+                blocks.extend_from_slice(&next[1..]);
+                return;
+            }
+        }
+    }
+    blocks.extend(next);
+}
+
+/// Append `chunk_blocks`, the blocks of the chunk of `trace` starting at `start`, to `blocks`, the
+/// blocks of the chunks before it.
+pub(super) fn append(
+    trace: &dyn Trace,
+    start: usize,
+    blocks: &mut Vec<Block>,
+    chunk_blocks: Vec<Block>,
+) {
+    append_at(trace, start, &trace.bytes()[start..], blocks, chunk_blocks);
+}
+
+/// Like [append], for a chunk whose bytes (from `start`) begin with `bytes`.
+pub(super) fn append_at(
+    trace: &dyn Trace,
+    start: usize,
+    bytes: &[u8],
+    blocks: &mut Vec<Block>,
+    chunk_blocks: Vec<Block>,
+) {
+    if start > 0 && trace.gaps().contains(&start) {
+        // Data was lost right where the chunk starts, so there's nothing to stitch.
+        blocks.push(Block::new_gap());
+        blocks.extend(chunk_blocks);
+    } else {
+        let fup = if start > 0 { psb_fup(bytes, 0) } else { None };
+        stitch(blocks, chunk_blocks, fup);
+    }
+}
+
+/// A trace being decoded a chunk at a time, each chunk appended (see [append]) to the blocks before
+/// it.
+pub(super) trait Chunked {
+    /// Decode the next chunk. Returns `false` if there are none left.
+    fn decode_next(&mut self) -> Result<bool, HWTracerError>;
+
+    /// The blocks decoded but not yet handed on.
+    fn blocks(&mut self) -> &mut Vec<Block>;
+
+    /// Take the blocks which appending the next chunk can no longer trim: all of them if `done`.
+    fn take_final(&mut self, done: bool) -> vec::Drain<'_, Block> {
+        let keep = if done { 0 } else { STITCH_WINDOW };
+        let blocks = self.blocks();
+        blocks.drain(..blocks.len().saturating_sub(keep))
+    }
+}
+
+/// Decode all of `chunks`, handing the blocks to `sink` chunk by chunk. On error, all blocks
+/// decoded before the error are handed on first.
+pub(super) fn decode_chunked(
+    mut chunks: impl Chunked,
+    mut sink: impl FnMut(vec::Drain<'_, Block>),
+) -> Result<(), HWTracerError> {
+    loop {
+        let res = chunks.decode_next();
+        let done = !matches!(res, Ok(true));
+        sink(chunks.take_final(done));
+        if done {
+            return res.map(|_| ());
+        }
+    }
+}
+
+/// Iterates over the blocks of a [Chunked] trace as they are decoded.
+pub(super) struct ChunkedBlocks<C> {
+    chunks: C,
+    /// The blocks of the last chunk decoded, still to be yielded.
+    ready: vec::IntoIter<Block>,
+    /// Set once the last chunk has been decoded, or an error occurred.
+    done: bool,
+    /// The error to yield once `ready` is empty, if any.
+    err: Option<HWTracerError>,
+}
+
+impl<C: Chunked> ChunkedBlocks<C> {
+    pub(super) fn new(chunks: C) -> Self {
+        Self {
+            chunks,
+            ready: Vec::new().into_iter(),
+            done: false,
+            err: None,
+        }
+    }
+}
+
+impl<C: Chunked> Iterator for ChunkedBlocks<C> {
+    type Item = Result<Block, HWTracerError>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        loop {
+            if let Some(b) = self.ready.next() {
+                return Some(Ok(b));
+            }
+            if self.done {
+                return self.err.take().map(Err);
+            }
+            let res = self.chunks.decode_next();
+            self.done = !matches!(res, Ok(true));
+            self.err = res.err();
+            self.ready = self
+                .chunks
+                .take_final(self.done)
+                .collect::<Vec<_>>()
+                .into_iter();
+        }
+    }
+}
+
+/// Decode `trace` with `decoder` on up to `nthreads` threads, appending its blocks to `blocks`.
+/// See [TraceDecoder::decode_parallel].
+pub(super) fn decode<D: TraceDecoder + ?Sized>(
+    decoder: &D,
+    trace: &dyn Trace,
+    nthreads: usize,
+    blocks: &mut Vec<Block>,
+) -> Result<(), HWTracerError> {
+    let bytes = trace.bytes();
+    let starts = chunk_starts(bytes.len(), &PsbIndex::new(bytes), nthreads.max(1));
+    if nthreads <= 1 || starts.len() == 1 {
+        return decoder.decode_into(trace, blocks);
+    }
+
+    let chunks = starts
+        .iter()
+        .enumerate()
+        .map(|(i, &start)| {
+            Chunk::new(
+                trace,
+                start,
+                starts.get(i + 1).copied().unwrap_or(bytes.len()),
+            )
+        })
+        .collect::<Vec<_>>();
+
+    // Threads take the next undecoded chunk until there are none left. Errors can't be sent between
+    // threads, so a failed chunk is decoded again below to get its error.
+    let next_chunk = AtomicUsize::new(0);
+    let mut decoded: Vec<Option<Vec<Block>>> = (0..chunks.len()).map(|_| None).collect();
+    thread::scope(|s| {
+        let workers = (0..nthreads.min(chunks.len()))
+            .map(|_| {
+                s.spawn(|| {
+                    let mut done = Vec::new();
+                    loop {
+                        let i = next_chunk.fetch_add(1, Ordering::Relaxed);
+                        let Some(chunk) = chunks.get(i) else {
+                            break;
+                        };
+                        let mut chunk_blocks = Vec::new();
+                        if decoder.decode_into(chunk, &mut chunk_blocks).is_err() {
+                            break;
+                        }
+                        done.push((i, chunk_blocks));
+                    }
+                    done
+                })
+            })
+            .collect::<Vec<_>>();
+        for w in workers {
+            for (i, chunk_blocks) in w.join().unwrap() {
+                decoded[i] = Some(chunk_blocks);
+            }
+        }
+    });
+
+    let mut all = Vec::new();
+    for (i, chunk_blocks) in decoded.into_iter().enumerate() {
+        let chunk_blocks = match chunk_blocks {
+            Some(b) => b,
+            None => {
+                let mut b = Vec::new();
+                decoder.decode_into(&chunks[i], &mut b)?;
+                b
+            }
+        };
+        append(trace, starts[i], &mut all, chunk_blocks);
+    }
+    blocks.extend(all);
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{chunk_starts, stitch, MIN_CHUNK_SIZE};
+    use crate::{
+        decode::scan::{PsbIndex, PSB},
+        Block,
+    };
+
+    #[test]
+    fn chunks() {
+        let mut bytes = vec![0; MIN_CHUNK_SIZE * 3];
+        for off in [10, MIN_CHUNK_SIZE + 7, MIN_CHUNK_SIZE * 2 + 20] {
+            bytes[off..off + PSB.len()].copy_from_slice(&PSB);
+        }
+        let psbs = PsbIndex::new(&bytes);
+        assert_eq!(
+            chunk_starts(bytes.len(), &psbs, 8),
+            vec![0, MIN_CHUNK_SIZE + 7, MIN_CHUNK_SIZE * 2 + 20]
+        );
+        assert_eq!(
+            chunk_starts(MIN_CHUNK_SIZE, &PsbIndex::new(&bytes[..MIN_CHUNK_SIZE]), 8),
+            vec![0]
+        );
+    }
+
+    #[test]
+    fn stitch_overlap() {
+        let mut blocks = vec![
+            Block::new(0x10, 0x18),
+            Block::new(0x20, 0x2c),
+            Block::new(0x40, 0x48),
+        ];
+        // The next chunk starts part way into the block at 0x20.
+        stitch(
+            &mut blocks,
+            vec![
+                Block::new(0x24, 0x2c),
+                Block::new(0x40, 0x48),
+                Block::new(0x50, 0x58),
+            ],
+            Some(0x24),
+        );
+        assert_eq!(
+            blocks,
+            vec![
+                Block::new(0x10, 0x18),
+                Block::new(0x20, 0x2c),
+                Block::new(0x40, 0x48),
+                Block::new(0x50, 0x58)
+            ]
+        );
+
+        // No overlap.
+        stitch(&mut blocks, vec![Block::new(0x60, 0x68)], Some(0x60));
+        assert_eq!(blocks.len(), 5);
+        assert_eq!(blocks[4], Block::new(0x60, 0x68));
+
+        // Gaps are never merged.
+        stitch(
+            &mut blocks,
+            vec![Block::new_gap(), Block::new(0x60, 0x68)],
+            None,
+        );
+        assert_eq!(blocks.len(), 7);
+        assert!(blocks[5].is_gap());
+    }
+
+    #[test]
+    fn stitch_loop_at_tip_pge() {
+        // The earlier chunk goes round a loop of two blocks, then tracing is disabled.
+        let body = [Block::new(0x20, 0x2c), Block::new(0x40, 0x48)];
+        let mut blocks = vec![Block::new(0x10, 0x18)];
+        for _ in 0..3 {
+            blocks.extend_from_slice(&body);
+        }
+        let before = blocks.clone();
+
+        // The next chunk's PSB+ has no FUP: tracing resumes with a TIP.PGE at the loop head and
+        // goes round twice more. None of it was seen before, though it matches what was.
+        let next = [&body[..], &body[..]].concat();
+        stitch(&mut blocks, next.clone(), None);
+        assert_eq!(blocks, [&before[..], &next[..]].concat());
+
+        // With a FUP in the loop body but blocks after it that the next chunk doesn't start
+        // with, this is a real repeat, not an overlap, so nothing is trimmed either.
+        let mut blocks = before.clone();
+        let next = vec![Block::new(0x24, 0x2c), Block::new(0x60, 0x68)];
+        blocks.push(Block::new(0x20, 0x2c));
+        blocks.push(Block::new(0x50, 0x58));
+        let before = blocks.clone();
+        stitch(&mut blocks, next.clone(), Some(0x24));
+        assert_eq!(blocks, [&before[..], &next[..]].concat());
+    }
+}
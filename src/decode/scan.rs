@@ -0,0 +1,323 @@
+//! Fast scanning of raw trace bytes for PSB and PAD packets, and a look into the `PSB+` sequences
+//! they start.
+//!
+//! On x86_64 the scanners use AVX2 where the CPU has it, and SSE2 (which all x86_64 CPUs have)
+//! otherwise. Elsewhere they fall back to scalar code.
+
+#[cfg(target_arch = "x86_64")]
+use std::arch::x86_64::*;
+
+/// A Packet Stream Boundary (PSB) packet.
+pub(crate) const PSB: [u8; 16] = [
+    0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+];
+
+/// Returns the offset of the first PSB at or after `from` in `bytes`.
+pub(crate) fn find_psb(bytes: &[u8], mut from: usize) -> Option<usize> {
+    loop {
+        // A PSB starts with the first `02 82` pair of a run of eight.
+        let off = find_psb_pair(bytes, from)?;
+        match bytes.get(off..off + PSB.len()) {
+            Some(b) if b == PSB => return Some(off),
+            Some(_) => from = off + 1,
+            None => return None, // There's no room for a PSB after this.
+        }
+    }
+}
+
+/// Returns the IP of the `FUP` in the `PSB+` sequence starting at `psb`, or `None` if there isn't
+/// one (as when tracing was disabled at the time, in which case the trace carries on with a
+/// `TIP.PGE` after the sequence) or the sequence can't be read.
+pub(crate) fn psb_fup(bytes: &[u8], psb: usize) -> Option<u64> {
+    let mut off = psb + PSB.len();
+    loop {
+        let len = match *bytes.get(off..off + 2)? {
+            [0x00, _] => 1,                                             // PAD.
+            [0x19, _] => 8,                                             // TSC.
+            [0x59, _] => 2,                                             // MTC.
+            [0x99, _] => 2,                                             // MODE.
+            [0x02, 0x23] => return None,                                // PSBEND.
+            [0x02, 0x03] => 4,                                          // CBR.
+            [0x02, 0x43] => 8,                                          // PIP.
+            [0x02, 0x73] => 7,                                          // TMA.
+            [0x02, 0xc8] => 7,                                          // VMCS.
+            [b, _] if b & 0x1f == 0x1d => return fup_ip(&bytes[off..]), // FUP.
+            _ => return None,
+        };
+        off += len;
+    }
+}
+
+/// Returns the IP of the `FUP` packet at the start of `pkt`, coming straight after a `PSB` (which
+/// makes the last IP 0), or `None` if it has none.
+fn fup_ip(pkt: &[u8]) -> Option<u64> {
+    let (n, sext) = match pkt[0] >> 5 {
+        0b001 => (2, false),
+        0b010 => (4, false),
+        0b011 => (6, true),
+        0b100 => (6, false),
+        0b110 => (8, false),
+        _ => return None, // Suppressed, or reserved.
+    };
+    let mut ip = [0; 8];
+    ip[..n].copy_from_slice(pkt.get(1..1 + n)?);
+    let ip = u64::from_le_bytes(ip);
+    if sext && ip & (1 << 47) != 0 {
+        Some(ip | 0xffff_0000_0000_0000)
+    } else {
+        Some(ip)
+    }
+}
+
+/// Returns the offset of the first non-PAD (i.e. non-zero) byte at or after `from` in `bytes`, or
+/// `bytes.len()` if there isn't one.
+pub(crate) fn skip_pads(bytes: &[u8], from: usize) -> usize {
+    #[cfg(target_arch = "x86_64")]
+    {
+        if is_x86_feature_detected!("avx2") {
+            unsafe { skip_pads_avx2(bytes, from) }
+        } else {
+            unsafe { skip_pads_sse2(bytes, from) }
+        }
+    }
+    #[cfg(not(target_arch = "x86_64"))]
+    skip_pads_scalar(bytes, from)
+}
+
+/// The offsets of all the PSB packets of a trace, so that decoding can start at any of them
+/// without scanning the trace again.
+///
+/// A PSB resets IP compression and the PSB+ sequence it starts restates the IP (if tracing is
+/// enabled) and the execution mode. So decoders need no state from earlier in the trace to start
+/// at a PSB, and the offsets are all there is to index.
+pub(crate) struct PsbIndex {
+    offsets: Vec<usize>,
+}
+
+impl PsbIndex {
+    pub(crate) fn new(bytes: &[u8]) -> Self {
+        let mut offsets = Vec::new();
+        let mut from = 0;
+        while let Some(off) = find_psb(bytes, from) {
+            offsets.push(off);
+            from = off + PSB.len();
+        }
+        Self { offsets }
+    }
+
+    /// Returns the offsets of the PSBs, in ascending order.
+    #[cfg(test)]
+    pub(crate) fn offsets(&self) -> &[usize] {
+        &self.offsets
+    }
+
+    /// Returns the offset of the last PSB at or before `offset`.
+    #[cfg(all(decoder_ykpt, decoder_libipt))]
+    pub(crate) fn at_or_before(&self, offset: usize) -> Option<usize> {
+        let i = self.offsets.partition_point(|&o| o <= offset);
+        i.checked_sub(1).map(|i| self.offsets[i])
+    }
+
+    /// Returns the offset of the first PSB at or after `offset`.
+    pub(crate) fn at_or_after(&self, offset: usize) -> Option<usize> {
+        let i = self.offsets.partition_point(|&o| o < offset);
+        self.offsets.get(i).copied()
+    }
+}
+
+/// Returns the offset of the first `02 82` byte pair at or after `from` in `bytes`.
+fn find_psb_pair(bytes: &[u8], from: usize) -> Option<usize> {
+    #[cfg(target_arch = "x86_64")]
+    {
+        if is_x86_feature_detected!("avx2") {
+            unsafe { find_psb_pair_avx2(bytes, from) }
+        } else {
+            unsafe { find_psb_pair_sse2(bytes, from) }
+        }
+    }
+    #[cfg(not(target_arch = "x86_64"))]
+    find_psb_pair_scalar(bytes, from)
+}
+
+fn find_psb_pair_scalar(bytes: &[u8], from: usize) -> Option<usize> {
+    bytes
+        .get(from..)?
+        .windows(2)
+        .position(|w| w == [0x02, 0x82])
+        .map(|off| from + off)
+}
+
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "sse2")]
+unsafe fn find_psb_pair_sse2(bytes: &[u8], from: usize) -> Option<usize> {
+    let first = _mm_set1_epi8(0x02);
+    let second = _mm_set1_epi8(0x82u8 as i8);
+    let mut i = from;
+    // Each step checks the 16 pairs starting in `bytes[i..i + 16]`.
+    while i + 17 <= bytes.len() {
+        let a = _mm_loadu_si128(bytes.as_ptr().add(i) as *const __m128i);
+        let b = _mm_loadu_si128(bytes.as_ptr().add(i + 1) as *const __m128i);
+        let hits = _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, second));
+        let mask = _mm_movemask_epi8(hits);
+        if mask != 0 {
+            return Some(i + mask.trailing_zeros() as usize);
+        }
+        i += 16;
+    }
+    find_psb_pair_scalar(bytes, i)
+}
+
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "avx2")]
+unsafe fn find_psb_pair_avx2(bytes: &[u8], from: usize) -> Option<usize> {
+    let first = _mm256_set1_epi8(0x02);
+    let second = _mm256_set1_epi8(0x82u8 as i8);
+    let mut i = from;
+    // Each step checks the 32 pairs starting in `bytes[i..i + 32]`.
+    while i + 33 <= bytes.len() {
+        let a = _mm256_loadu_si256(bytes.as_ptr().add(i) as *const __m256i);
+        let b = _mm256_loadu_si256(bytes.as_ptr().add(i + 1) as *const __m256i);
+        let hits = _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, second));
+        let mask = _mm256_movemask_epi8(hits);
+        if mask != 0 {
+            return Some(i + mask.trailing_zeros() as usize);
+        }
+        i += 32;
+    }
+    find_psb_pair_sse2(bytes, i)
+}
+
+fn skip_pads_scalar(bytes: &[u8], from: usize) -> usize {
+    bytes
+        .get(from..)
+        .and_then(|b| b.iter().position(|&b| b != 0))
+        .map_or(bytes.len(), |off| from + off)
+}
+
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "sse2")]
+unsafe fn skip_pads_sse2(bytes: &[u8], from: usize) -> usize {
+    let zero = _mm_setzero_si128();
+    let mut i = from;
+    while i + 16 <= bytes.len() {
+        let v = _mm_loadu_si128(bytes.as_ptr().add(i) as *const __m128i);
+        let pads = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) as u32;
+        if pads != 0xffff {
+            return i + (!pads).trailing_zeros() as usize;
+        }
+        i += 16;
+    }
+    skip_pads_scalar(bytes, i)
+}
+
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "avx2")]
+unsafe fn skip_pads_avx2(bytes: &[u8], from: usize) -> usize {
+    let zero = _mm256_setzero_si256();
+    let mut i = from;
+    while i + 32 <= bytes.len() {
+        let v = _mm256_loadu_si256(bytes.as_ptr().add(i) as *const __m256i);
+        let pads = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) as u32;
+        if pads != 0xffffffff {
+            return i + (!pads).trailing_zeros() as usize;
+        }
+        i += 32;
+    }
+    skip_pads_sse2(bytes, i)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Make some bytes containing PSBs at `psbs`, and no stray `02 82` pairs.
+    fn bytes_with_psbs(len: usize, psbs: &[usize]) -> Vec<u8> {
+        let mut bytes = (0..len).map(|i| (i % 251) as u8 | 0x1).collect::<Vec<_>>();
+        for &off in psbs {
+            bytes[off..off + PSB.len()].copy_from_slice(&PSB);
+        }
+        bytes
+    }
+
+    #[test]
+    fn find_psbs() {
+        let psbs = [0, 33, 100, 1000, 1999 - PSB.len()];
+        let bytes = bytes_with_psbs(1999, &psbs);
+        // Check every (mis)alignment against the obvious implementation.
+        for from in 0..bytes.len() + 2 {
+            let expect = bytes
+                .get(from..)
+                .and_then(|b| b.windows(PSB.len()).position(|w| w == PSB))
+                .map(|off| from + off);
+            assert_eq!(find_psb(&bytes, from), expect, "from {}", from);
+        }
+        assert_eq!(PsbIndex::new(&bytes).offsets(), &psbs);
+
+        // A truncated PSB isn't a PSB.
+        assert_eq!(find_psb(&PSB[..15], 0), None);
+        // Nor is a run of pairs starting part way into a PSB.
+        assert_eq!(find_psb(&bytes_with_psbs(64, &[10]), 12), None);
+    }
+
+    #[test]
+    fn psb_index() {
+        let idx = PsbIndex::new(&bytes_with_psbs(500, &[20, 200, 400]));
+        assert_eq!(idx.at_or_after(0), Some(20));
+        assert_eq!(idx.at_or_after(20), Some(20));
+        assert_eq!(idx.at_or_after(21), Some(200));
+        assert_eq!(idx.at_or_after(400), Some(400));
+        assert_eq!(idx.at_or_after(401), None);
+        #[cfg(all(decoder_ykpt, decoder_libipt))]
+        {
+            assert_eq!(idx.at_or_before(19), None);
+            assert_eq!(idx.at_or_before(20), Some(20));
+            assert_eq!(idx.at_or_before(199), Some(20));
+            assert_eq!(idx.at_or_before(1000), Some(400));
+        }
+    }
+
+    #[test]
+    fn psb_plus_fup() {
+        let psbend = [0x02, 0x23];
+        let cbr = [0x02, 0x03, 0x20, 0x00];
+        let mode = [0x99, 0x01];
+        let fup = [0x7d, 0x10, 0x32, 0x54, 0x76, 0x98, 0x7f]; // 6 bytes, sign extended.
+        let psb_plus = |body: &[&[u8]]| {
+            let mut bytes = vec![0x11, 0x22];
+            bytes.extend_from_slice(&PSB);
+            for b in body {
+                bytes.extend_from_slice(b);
+            }
+            bytes
+        };
+        assert_eq!(
+            psb_fup(&psb_plus(&[&cbr, &mode, &[0x00], &fup, &psbend]), 2),
+            Some(0x7f98_7654_3210)
+        );
+        let high = [0x7d, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80];
+        assert_eq!(
+            psb_fup(&psb_plus(&[&high, &psbend]), 2),
+            Some(0xffff_8000_0000_0000)
+        );
+        // Tracing was disabled.
+        assert_eq!(psb_fup(&psb_plus(&[&cbr, &mode, &psbend]), 2), None);
+        // Truncated, or not a PSB+.
+        assert_eq!(psb_fup(&psb_plus(&[&cbr, &fup[..3]]), 2), None);
+        assert_eq!(psb_fup(&psb_plus(&[&[0x0f, 0x0f], &fup]), 2), None);
+    }
+
+    #[test]
+    fn skip_pad_runs() {
+        let mut bytes = vec![0; 300];
+        for last in [0, 1, 15, 16, 17, 31, 32, 33, 100, 299] {
+            bytes[last] = 0x99;
+            for from in 0..=last {
+                assert_eq!(skip_pads(&bytes, from), last);
+                assert_eq!(skip_pads_scalar(&bytes, from), last);
+            }
+            bytes[last] = 0;
+        }
+        assert_eq!(skip_pads(&bytes, 0), bytes.len());
+        assert_eq!(skip_pads(&bytes, 1000), bytes.len());
+    }
+}
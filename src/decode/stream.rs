@@ -0,0 +1,284 @@
+//! Decoding a trace while it is still being collected.
+//!
+//! A consumer thread watches the part of the trace that the collector has drained so far, and
+//! decodes it a chunk (from one `PSB` to a later one) at a time, sending the blocks on as it goes.
+//! By the time collection stops, only the part of the trace after the last chunk is left to
+//! decode. Chunks are decoded and stitched together as in [parallel](super::parallel) decoding.
+
+use crate::{
+    collect::LiveTrace,
+    decode::{
+        parallel::{self, Chunk},
+        scan::{find_psb, PSB},
+        TraceDecoder,
+    },
+    errors::HWTracerError,
+    Block, Trace,
+};
+use std::{
+    collections::VecDeque,
+    mem,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        mpsc::{channel, Receiver, Sender},
+        Arc,
+    },
+    thread::{self, JoinHandle},
+    time::Duration,
+};
+#[cfg(test)]
+use std::{fs::File, io::Write};
+
+/// Don't bother decoding less than this many bytes at a time.
+const MIN_STREAM_CHUNK: usize = 64 * 1024;
+
+/// Decode (where the `PSB`s allow) at most this many bytes at a time, so that stopping never waits
+/// long for the consumer to finish a chunk.
+const MAX_STREAM_CHUNK: usize = 4 * 1024 * 1024;
+
+/// How long the consumer waits for more data when there's not enough to decode.
+const POLL_INTERVAL: Duration = Duration::from_millis(1);
+
+/// Blocks are held back from being sent until this many later blocks have been decoded, as the
+/// next chunk may overlap them (see [parallel::stitch]).
+const HOLD_BACK: usize = parallel::STITCH_WINDOW;
+
+/// The bytes of a trace read so far.
+#[derive(Debug)]
+struct Published<'a>(&'a [u8]);
+
+impl<'a> Trace for Published<'a> {
+    fn bytes(&self) -> &[u8] {
+        self.0
+    }
+
+    #[cfg(test)]
+    fn capacity(&self) -> usize {
+        self.0.len()
+    }
+
+    fn len(&self) -> usize {
+        self.0.len()
+    }
+
+    #[cfg(test)]
+    fn to_file(&self, file: &mut File) {
+        file.write_all(self.0).unwrap();
+    }
+}
+
+/// How far the consumer got.
+struct Progress {
+    /// The offset of the first `PSB` of the trace, once seen.
+    first_psb: Option<usize>,
+    /// Where the part of the trace yet to be decoded starts: 0 or the offset of a `PSB`.
+    start: usize,
+    /// Blocks decoded but not yet sent.
+    held: Vec<Block>,
+    sender: Sender<Vec<Block>>,
+}
+
+impl Progress {
+    /// Send all but the last [HOLD_BACK] held blocks.
+    fn send_settled(&mut self) {
+        if self.held.len() > HOLD_BACK {
+            let rest = self.held.split_off(self.held.len() - HOLD_BACK);
+            // If nobody is listening, there's nobody to tell.
+            let _ = self.sender.send(mem::replace(&mut self.held, rest));
+        }
+    }
+}
+
+/// Decodes a trace as it is collected.
+pub(crate) struct Consumer {
+    decoder: Arc<dyn TraceDecoder>,
+    stop: Arc<AtomicBool>,
+    thread: JoinHandle<Progress>,
+}
+
+impl Consumer {
+    /// Start decoding `live` with `decoder`. Blocks are sent on the returned channel in batches.
+    pub(crate) fn start(
+        decoder: Box<dyn TraceDecoder>,
+        live: LiveTrace,
+    ) -> (Self, Receiver<Vec<Block>>) {
+        let (sender, receiver) = channel();
+        let decoder = Arc::<dyn TraceDecoder>::from(decoder);
+        let stop = Arc::new(AtomicBool::new(false));
+        let thread = {
+            let (decoder, stop) = (Arc::clone(&decoder), Arc::clone(&stop));
+            thread::spawn(move || consume(&*decoder, live, &stop, sender))
+        };
+        let consumer = Self {
+            decoder,
+            stop,
+            thread,
+        };
+        (consumer, receiver)
+    }
+
+    /// Stop the consumer and wait for it to finish the chunk it is decoding, after which the
+    /// collector can be stopped. The rest of the trace is then decoded by [Tail::decode].
+    pub(crate) fn join(self) -> Tail {
+        self.stop.store(true, Ordering::Release);
+        self.thread.thread().unpark();
+        Tail {
+            decoder: self.decoder,
+            progress: self.thread.join().unwrap(),
+        }
+    }
+}
+
+/// The part of a trace that the consumer didn't decode.
+pub(crate) struct Tail {
+    decoder: Arc<dyn TraceDecoder>,
+    progress: Progress,
+}
+
+impl Tail {
+    /// Decode the rest of the finished `trace` and send the last of its blocks.
+    pub(crate) fn decode(self, trace: &dyn Trace) -> Result<(), HWTracerError> {
+        let mut p = self.progress;
+        let bytes = trace.bytes();
+        // When it stops, the collector may have cut the start of the trace back to its first PSB.
+        let start = match p.first_psb {
+            Some(first) if p.start > 0 => p.start - first + find_psb(bytes, 0).unwrap_or(first),
+            _ => 0,
+        };
+        let mut blocks = Vec::new();
+        self.decoder
+            .decode_into(&Chunk::new(trace, start, bytes.len()), &mut blocks)?;
+        parallel::append(trace, start, &mut p.held, blocks);
+        let _ = p.sender.send(p.held);
+        Ok(())
+    }
+}
+
+/// The body of the consumer thread: decode `live` until told to `stop`.
+fn consume(
+    decoder: &dyn TraceDecoder,
+    live: LiveTrace,
+    stop: &AtomicBool,
+    sender: Sender<Vec<Block>>,
+) -> Progress {
+    let mut p = Progress {
+        first_psb: None,
+        start: 0,
+        held: Vec::new(),
+        sender,
+    };
+    // The PSBs after `p.start` found so far, and how far we have looked for them.
+    let mut psbs = VecDeque::new();
+    let mut scanned = 0;
+    while !stop.load(Ordering::Acquire) {
+        // SAFETY: The collector can't be stopped until we have been.
+        let bytes = unsafe { live.bytes() };
+        while let Some(off) = find_psb(bytes, scanned) {
+            psbs.push_back(off);
+            scanned = off + PSB.len();
+        }
+        // A PSB may straddle the end of what we can read so far.
+        scanned = scanned.max(bytes.len().saturating_sub(PSB.len() - 1));
+        if p.first_psb.is_none() {
+            p.first_psb = psbs.front().copied();
+        }
+
+        while psbs.front().map_or(false, |&off| off <= p.start) {
+            psbs.pop_front();
+        }
+        let end = psbs
+            .iter()
+            .take_while(|&&off| off - p.start <= MAX_STREAM_CHUNK)
+            .last()
+            .or_else(|| psbs.front())
+            .copied();
+        match end {
+            Some(end) if end - p.start >= MIN_STREAM_CHUNK => {
+                let published = Published(bytes);
+                let mut blocks = Vec::new();
+                if decoder
+                    .decode_into(&Chunk::new(&published, p.start, end), &mut blocks)
+                    .is_err()
+                {
+                    // Errors can't be sent between threads, so leave this chunk to be decoded
+                    // again once collection stops, when the error can be returned.
+                    break;
+                }
+                parallel::append(&published, p.start, &mut p.held, blocks);
+                p.start = end;
+                p.send_settled();
+            }
+            _ => thread::park_timeout(POLL_INTERVAL),
+        }
+    }
+    p
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::{
+        collect::{
+            test_helpers::trace_closure, PerfDrainMode, PerfTraceStorage, TraceCollectorBuilder,
+            TraceCollectorConfig,
+        },
+        decode::{TraceDecoderBuilder, TraceDecoderKind},
+        errors::HWTracerError,
+        test_helpers::work_loop,
+    };
+
+    /// Check that decoding while collecting gives the same blocks as decoding afterwards.
+    #[test]
+    fn matches_decode_after() {
+        let mut builder = TraceCollectorBuilder::new();
+        match builder.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                // Drain often, so that there is plenty to decode before collection stops.
+                ppt_conf.aux_bufsize = 1024;
+                ppt_conf.drain_mode = PerfDrainMode::Adaptive;
+                ppt_conf.storage = PerfTraceStorage::Pooled;
+            }
+        }
+        let tc = builder.build().unwrap();
+        let dec = || {
+            TraceDecoderBuilder::new()
+                .kind(TraceDecoderKind::YkPT)
+                .build()
+                .unwrap()
+        };
+
+        for iters in [10, 100000] {
+            let blocks = tc.start_thread_collector_streaming(dec()).unwrap();
+            println!("{}", work_loop(iters));
+            let trace = tc.stop_thread_collector().unwrap();
+            let got = blocks.into_iter().flatten().collect::<Vec<_>>();
+
+            let mut expect = Vec::new();
+            dec().decode_into(&*trace, &mut expect).unwrap();
+            assert_eq!(got, expect);
+        }
+
+        // Normal collection still works afterwards.
+        assert_ne!(trace_closure(&tc, || work_loop(10)).len(), 0);
+    }
+
+    /// Check that collectors which can't be read while collecting refuse to stream.
+    #[test]
+    fn heap_storage_refused() {
+        let mut builder = TraceCollectorBuilder::new();
+        match builder.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => {
+                ppt_conf.storage = PerfTraceStorage::Heap;
+            }
+        }
+        let tc = builder.build().unwrap();
+        let dec = TraceDecoderBuilder::new().build().unwrap();
+        assert!(matches!(
+            tc.start_thread_collector_streaming(dec),
+            Err(HWTracerError::BadConfig(_))
+        ));
+        assert!(matches!(
+            tc.stop_thread_collector(),
+            Err(HWTracerError::AlreadyStopped)
+        ));
+    }
+}
@@ -0,0 +1,404 @@
+//! Finding the basic blocks of the code of the current process.
+
+use super::code_cache::SegmentCache;
+use crate::{collect::Mmap, errors::HWTracerError, trace_file};
+use iced_x86::{Decoder, DecoderOptions, FlowControl, Instruction, Mnemonic};
+use libc::{c_int, c_void, dl_iterate_phdr, dl_phdr_info, size_t, PF_X, PT_LOAD};
+use std::{
+    cell::OnceCell,
+    collections::HashMap,
+    convert::TryFrom,
+    fs::File,
+    os::unix::fs::FileExt,
+    path::{Path, PathBuf},
+    slice,
+};
+
+/// A segment's cache file is only rewritten part way through the life of a [Code] once this many
+/// blocks have been found in the segment since it was last written. The rest are written when the
+/// [Code] is dropped.
+pub(super) const PERSIST_BATCH: usize = 1024;
+
+/// How the block ending at a branch instruction is left, according to the branch instruction.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub(super) enum Exit {
+    /// A direct jump to the given address.
+    Jump(u64),
+    /// A conditional (direct) jump to the given address, which falls through otherwise. The trace
+    /// says which (a TNT bit).
+    CondJump(u64),
+    /// A direct call to the given address.
+    Call(u64),
+    /// An indirect jump. The trace gives the target (a TIP packet).
+    IndirectJump,
+    /// An indirect call. The trace gives the target (a TIP packet).
+    IndirectCall,
+    /// A return. The trace gives the target, unless the return was compressed (in which case a
+    /// taken TNT bit says the target is the one pushed by the matching call).
+    Return,
+    /// A far transfer, such as a system call. When (as is usual) the destination isn't traced,
+    /// tracing is disabled (a TIP.PGD packet).
+    Far,
+}
+
+/// A basic block, as found by disassembling the code (recall that in hwtracer, blocks end at any
+/// control transfer instruction).
+#[derive(Clone, Copy, Debug)]
+pub(super) struct StaticBlock {
+    /// Virtual address of the start of the last instruction in this block.
+    pub(super) last_instr: u64,
+    /// Virtual address of the instruction after the last one of the block (the fall through and
+    /// return address).
+    pub(super) next_ip: u64,
+    /// How the block is left.
+    pub(super) exit: Exit,
+}
+
+/// A loadable and executable segment of an object in our address space.
+struct CodeSegment {
+    start: u64,
+    end: u64,
+    /// The on-disk cache of this segment's blocks, if we are caching and its object has a
+    /// build-id.
+    cache: Option<SegmentCache>,
+}
+
+/// Code mapped from a file while a trace was collected (see [crate::Trace::mmaps]), which may
+/// since have been unmapped or replaced.
+struct MappedSegment {
+    mmap: Mmap,
+    /// The code, read from the file when first needed. `None` if the file can't be read.
+    code: OnceCell<Option<Vec<u8>>>,
+}
+
+impl MappedSegment {
+    fn contains(&self, ip: u64) -> bool {
+        ip >= self.mmap.vaddr && ip - self.mmap.vaddr < self.mmap.len
+    }
+
+    /// Get the code of the segment, or `None` if its file can't be read.
+    fn code(&self) -> Option<&[u8]> {
+        self.code
+            .get_or_init(|| {
+                let m = &self.mmap;
+                let file = File::open(&m.path).ok()?;
+                // The end of the mapping's last page may lie past the end of the file.
+                let avail = file
+                    .metadata()
+                    .ok()?
+                    .len()
+                    .checked_sub(m.offset)?
+                    .min(m.len);
+                let mut code = vec![0; usize::try_from(avail).ok()?];
+                file.read_exact_at(&mut code, m.offset).ok()?;
+                Some(code)
+            })
+            .as_deref()
+    }
+}
+
+/// Reads blocks out of the code of the current process, remembering those found before.
+///
+/// A `Code` is meant to be kept from one decode to the next, so that each decode needn't find the
+/// code afresh and can reuse the blocks found by those before it. They are only forgotten when
+/// objects are loaded or unloaded (see [Code::refresh]).
+///
+/// Code mapped while a trace was collected (see [Code::set_mapped]) is read from its files instead,
+/// as what is there now may be something else.
+pub(super) struct Code {
+    /// Where to cache blocks across processes, if anywhere.
+    cache_dir: Option<PathBuf>,
+    /// The `dlpi_adds` and `dlpi_subs` counts of objects loaded and unloaded when `segments` was
+    /// found.
+    generation: (u64, u64),
+    /// The code segments of the objects loaded in our address space, sorted by address.
+    segments: Vec<CodeSegment>,
+    /// Blocks found so far, indexed by the address of their first instruction.
+    blocks: HashMap<u64, StaticBlock>,
+    /// The code mapped while the trace being decoded was collected, in the order it was mapped.
+    mapped: Vec<MappedSegment>,
+    /// Blocks found so far in `mapped`, as for `blocks`.
+    mapped_blocks: HashMap<u64, StaticBlock>,
+}
+
+impl Code {
+    /// Find the code of the current process. If `cache_dir` is given, blocks are cached there
+    /// across processes (see [code_cache]).
+    pub(super) fn new(cache_dir: Option<&Path>) -> Self {
+        let mut code = Self {
+            cache_dir: cache_dir.map(Path::to_owned),
+            generation: (0, 0),
+            segments: Vec::new(),
+            blocks: HashMap::new(),
+            mapped: Vec::new(),
+            mapped_blocks: HashMap::new(),
+        };
+        code.find_segments();
+        code
+    }
+
+    /// Bring our picture of the code up to date, if objects have been loaded or unloaded since it
+    /// was made. Blocks found before then are forgotten, as their code may no longer be there.
+    pub(super) fn refresh(&mut self) {
+        if dl_generation() != self.generation {
+            self.persist(0);
+            self.blocks.clear();
+            self.find_segments();
+        }
+    }
+
+    /// Use the code mapped from files by `mmaps`, in the order given, in place of whatever is now
+    /// at the same addresses. The blocks found in it are kept for as long as the same code is
+    /// mapped.
+    pub(super) fn set_mapped<'a>(&mut self, mmaps: impl Iterator<Item = &'a Mmap>) {
+        let mmaps = mmaps.collect::<Vec<_>>();
+        if mmaps.len() == self.mapped.len()
+            && mmaps.iter().zip(&self.mapped).all(|(m, s)| **m == s.mmap)
+        {
+            return;
+        }
+        self.mapped = mmaps
+            .into_iter()
+            .map(|m| MappedSegment {
+                mmap: m.clone(),
+                code: OnceCell::new(),
+            })
+            .collect();
+        self.mapped_blocks.clear();
+    }
+
+    /// Returns the code mapped at `ip` by [Code::set_mapped], if its file can be read. Where code
+    /// was mapped more than once, the last mapping wins.
+    fn mapped_at(&self, ip: u64) -> Option<&[u8]> {
+        let s = self.mapped.iter().rev().find(|s| s.contains(ip))?;
+        s.code()?.get(usize::try_from(ip - s.mmap.vaddr).ok()?..)
+    }
+
+    /// Find the code segments of the objects loaded in our address space.
+    fn find_segments(&mut self) {
+        // Read the generation first, so that objects loaded while we look cause another refresh.
+        self.generation = dl_generation();
+        let cache_dir = self.cache_dir.as_deref();
+        let mut segments = Vec::new();
+        for obj in phdrs::objects() {
+            let build_id = cache_dir.and_then(|_| trace_file::build_id(&obj));
+            for hdr in obj.iter_phdrs() {
+                if hdr.type_() != PT_LOAD || hdr.flags() & PF_X == 0 {
+                    continue; // Only look at loadable and executable segments.
+                }
+                let start = obj.addr() + hdr.vaddr();
+                let cache = match (cache_dir, &build_id) {
+                    (Some(dir), Some(id)) => Some(SegmentCache::new(dir, id, hdr.offset())),
+                    _ => None,
+                };
+                segments.push(CodeSegment {
+                    start,
+                    end: start + hdr.memsz(),
+                    cache,
+                });
+            }
+        }
+        segments.sort_unstable_by_key(|s| s.start);
+        self.segments = segments;
+    }
+
+    /// Write out the caches of those segments in which at least `min` blocks have been found since
+    /// their caches were last written.
+    pub(super) fn persist(&mut self, min: usize) {
+        for c in self.segments.iter_mut().filter_map(|s| s.cache.as_mut()) {
+            if c.unpersisted() >= min {
+                c.persist();
+            }
+        }
+    }
+
+    /// Returns how many blocks have been found so far.
+    #[cfg(test)]
+    pub(super) fn len(&self) -> usize {
+        self.blocks.len()
+    }
+
+    /// Returns the index of the code segment containing `ip`.
+    fn segment_of(&self, ip: u64) -> Option<usize> {
+        let i = self
+            .segments
+            .partition_point(|s| s.start <= ip)
+            .checked_sub(1)?;
+        if ip < self.segments[i].end {
+            Some(i)
+        } else {
+            None
+        }
+    }
+
+    /// Get the code from `ip` to the end of the code segment containing it.
+    fn code_at(&self, ip: u64) -> Result<&[u8], HWTracerError> {
+        if let Some(code) = self.mapped_at(ip) {
+            return Ok(code);
+        }
+        match self.segment_of(ip).map(|i| &self.segments[i]) {
+            // SAFETY: The segment is mapped for as long as its object stays loaded, which it must
+            // for the trace to be decoded at all.
+            Some(s) => Ok(unsafe { slice::from_raw_parts(ip as *const u8, (s.end - ip) as usize) }),
+            _ => Err(HWTracerError::TraceParseError(format!(
+                "no code at 0x{:x}",
+                ip
+            ))),
+        }
+    }
+
+    /// Returns the block starting at `ip`.
+    pub(super) fn block_at(&mut self, ip: u64) -> Result<StaticBlock, HWTracerError> {
+        if self.mapped_at(ip).is_some() {
+            if let Some(b) = self.mapped_blocks.get(&ip) {
+                return Ok(*b);
+            }
+            // The code isn't that of a loaded object, so its blocks aren't cached on disk.
+            let b = self.disassemble(ip)?;
+            self.mapped_blocks.insert(ip, b);
+            return Ok(b);
+        }
+        if let Some(b) = self.blocks.get(&ip) {
+            return Ok(*b);
+        }
+        let seg = self.segment_of(ip);
+        let cached = seg.and_then(|i| {
+            let s = &mut self.segments[i];
+            let (base, end) = (s.start, s.end);
+            s.cache.as_mut()?.get(base, end, ip)
+        });
+        let b = match cached {
+            Some(b) => b,
+            None => {
+                let b = self.disassemble(ip)?;
+                if let Some(s) = seg.map(|i| &mut self.segments[i]) {
+                    if let Some(c) = s.cache.as_mut() {
+                        c.insert(s.start, ip, &b);
+                    }
+                }
+                b
+            }
+        };
+        self.blocks.insert(ip, b);
+        Ok(b)
+    }
+
+    /// Returns `true` if `stop` is the address of one of the instructions of the block starting at
+    /// `ip`.
+    pub(super) fn block_contains(&mut self, ip: u64, stop: u64) -> Result<bool, HWTracerError> {
+        let b = self.block_at(ip)?;
+        if stop < ip || stop > b.last_instr {
+            return Ok(false);
+        }
+        // `stop` lies inside the block, but it might be in the middle of an instruction.
+        let mut dec = Decoder::with_ip(64, self.code_at(ip)?, ip, DecoderOptions::NONE);
+        let mut pos = ip;
+        while pos < stop {
+            pos = dec.decode().next_ip();
+        }
+        Ok(pos == stop)
+    }
+
+    /// Disassemble the block starting at `ip`.
+    fn disassemble(&self, ip: u64) -> Result<StaticBlock, HWTracerError> {
+        let mut dec = Decoder::with_ip(64, self.code_at(ip)?, ip, DecoderOptions::NONE);
+        let mut instr = Instruction::default();
+        loop {
+            dec.decode_out(&mut instr);
+            if instr.is_invalid() {
+                return Err(HWTracerError::TraceParseError(format!(
+                    "invalid instruction at 0x{:x}",
+                    instr.ip()
+                )));
+            }
+            let exit = match (instr.mnemonic(), instr.flow_control()) {
+                (Mnemonic::Syscall | Mnemonic::Sysenter, _) => Some(Exit::Far),
+                (_, FlowControl::Next | FlowControl::XbeginXabortXend) => None,
+                (_, FlowControl::UnconditionalBranch) => {
+                    Some(Exit::Jump(instr.near_branch_target()))
+                }
+                (_, FlowControl::ConditionalBranch) => {
+                    Some(Exit::CondJump(instr.near_branch_target()))
+                }
+                (_, FlowControl::Call) => Some(Exit::Call(instr.near_branch_target())),
+                (_, FlowControl::IndirectBranch) => Some(Exit::IndirectJump),
+                (_, FlowControl::IndirectCall) => Some(Exit::IndirectCall),
+                (_, FlowControl::Return) => Some(Exit::Return),
+                (_, FlowControl::Interrupt) => Some(Exit::Far),
+                (_, FlowControl::Exception) => {
+                    return Err(HWTracerError::TraceParseError(format!(
+                        "unexpected exception at 0x{:x}",
+                        instr.ip()
+                    )))
+                }
+            };
+            if let Some(exit) = exit {
+                return Ok(StaticBlock {
+                    last_instr: instr.ip(),
+                    next_ip: instr.next_ip(),
+                    exit,
+                });
+            }
+        }
+    }
+}
+
+impl Drop for Code {
+    fn drop(&mut self) {
+        self.persist(0);
+    }
+}
+
+/// Returns the `dlpi_adds` and `dlpi_subs` counts of the objects loaded and unloaded by the
+/// dynamic linker. When neither has changed, the same objects are loaded.
+fn dl_generation() -> (u64, u64) {
+    extern "C" fn cb(info: *mut dl_phdr_info, _size: size_t, data: *mut c_void) -> c_int {
+        // SAFETY: We are called with a valid `info` and the `data` passed below.
+        unsafe {
+            *(data as *mut (u64, u64)) = ((*info).dlpi_adds, (*info).dlpi_subs);
+        }
+        1 // The counts are the same for every object, so stop at the first.
+    }
+    let mut gen = (0u64, 0u64);
+    unsafe { dl_iterate_phdr(Some(cb), &mut gen as *mut _ as *mut c_void) };
+    gen
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Code, Exit};
+    use crate::collect::Mmap;
+    use std::fs;
+
+    /// Check that code mapped while a trace was collected is read from its file, with the last
+    /// mapping of an address winning, and forgotten once it isn't mapped.
+    #[test]
+    fn mapped() {
+        let dir = tempfile::tempdir().unwrap();
+        let (a, b) = (dir.path().join("a"), dir.path().join("b"));
+        fs::write(&a, [0x90, 0x90, 0xc3]).unwrap(); // nop; nop; ret
+        fs::write(&b, [0x90, 0xcc, 0xc3, 0xc3]).unwrap(); // nop; int3; ret; ret
+                                                          // Nothing is loaded this low down, and the mappings run past the ends of the files.
+        let mmap = |path: &std::path::Path, offset| Mmap {
+            vaddr: 0x1000,
+            len: 0x1000,
+            offset,
+            path: path.to_owned(),
+            trace_offset: 0,
+        };
+        let mut code = Code::new(None);
+        assert!(code.block_at(0x1000).is_err());
+
+        code.set_mapped([mmap(&a, 0)].iter());
+        let blk = code.block_at(0x1000).unwrap();
+        assert_eq!((blk.last_instr, blk.exit), (0x1002, Exit::Return));
+        assert!(code.block_contains(0x1000, 0x1001).unwrap());
+
+        code.set_mapped([mmap(&a, 0), mmap(&b, 2)].iter());
+        let blk = code.block_at(0x1000).unwrap();
+        assert_eq!((blk.last_instr, blk.exit), (0x1000, Exit::Return));
+
+        code.set_mapped([].iter());
+        assert!(code.block_at(0x1000).is_err());
+    }
+}
@@ -0,0 +1,372 @@
+//! An on-disk cache of the blocks found in the code of each object, so that a decoder in a freshly
+//! started process needn't disassemble code that an earlier process already did.
+//!
+//! There is one cache file per code segment, named after the ELF build-id of the segment's object
+//! and the file offset of the segment, so a cache is only ever used with the code it was made
+//! from. A file is a [Header] followed by a table of [Record]s sorted by address. Files are
+//! `mmap`ed and searched in place, so opening one is cheap however big it is. Addresses are stored
+//! relative to the start of the segment, as objects may be loaded at different addresses each run.
+//!
+//! The cache is only ever an optimisation: files which can't be read or written are ignored.
+
+use super::code::{Exit, StaticBlock};
+use libc::{c_void, MAP_FAILED, MAP_PRIVATE, PROT_READ};
+use std::{
+    fs::{self, File},
+    io::Write,
+    mem::size_of,
+    os::unix::io::AsRawFd,
+    path::{Path, PathBuf},
+    ptr, slice,
+};
+use tempfile::NamedTempFile;
+
+/// Identifies (the version of) the file format.
+const MAGIC: [u8; 8] = *b"HWTYKBC1";
+
+#[repr(C)]
+struct Header {
+    magic: [u8; 8],
+    /// The number of records following the header.
+    len: u64,
+}
+
+/// A block, with its addresses relative to the start of its segment.
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct Record {
+    start: u64,
+    last_instr: u64,
+    next_ip: u64,
+    /// Which [Exit] this is: its index in the declaration order of the variants.
+    exit: u64,
+    /// The target of a direct branch. Targets may lie outside of the segment, so this may wrap.
+    target: u64,
+}
+
+impl Record {
+    fn new(base: u64, start: u64, b: &StaticBlock) -> Self {
+        let (exit, target) = match b.exit {
+            Exit::Jump(t) => (0, t),
+            Exit::CondJump(t) => (1, t),
+            Exit::Call(t) => (2, t),
+            Exit::IndirectJump => (3, base),
+            Exit::IndirectCall => (4, base),
+            Exit::Return => (5, base),
+            Exit::Far => (6, base),
+        };
+        Self {
+            start: start - base,
+            last_instr: b.last_instr - base,
+            next_ip: b.next_ip - base,
+            exit,
+            target: target.wrapping_sub(base),
+        }
+    }
+
+    /// Returns the block, for a segment spanning `base..end`, or `None` if the record is corrupt
+    /// (including if the block doesn't lie within the segment).
+    fn block(&self, base: u64, end: u64) -> Option<StaticBlock> {
+        let start = base.checked_add(self.start)?;
+        let last_instr = base.checked_add(self.last_instr)?;
+        let next_ip = base.checked_add(self.next_ip)?;
+        if start > last_instr || last_instr >= next_ip || next_ip > end {
+            return None;
+        }
+        let target = base.wrapping_add(self.target);
+        let exit = match self.exit {
+            0 => Exit::Jump(target),
+            1 => Exit::CondJump(target),
+            2 => Exit::Call(target),
+            3 => Exit::IndirectJump,
+            4 => Exit::IndirectCall,
+            5 => Exit::Return,
+            6 => Exit::Far,
+            _ => return None,
+        };
+        Some(StaticBlock {
+            last_instr,
+            next_ip,
+            exit,
+        })
+    }
+
+    fn to_bytes(self) -> [u8; size_of::<Record>()] {
+        let mut bytes = [0; size_of::<Record>()];
+        let fields = [
+            self.start,
+            self.last_instr,
+            self.next_ip,
+            self.exit,
+            self.target,
+        ];
+        for (chunk, f) in bytes.chunks_exact_mut(size_of::<u64>()).zip(fields) {
+            chunk.copy_from_slice(&f.to_ne_bytes());
+        }
+        bytes
+    }
+}
+
+/// A cache file mapped into memory.
+struct Mapping {
+    addr: *mut c_void,
+    len: usize,
+}
+
+impl Mapping {
+    /// Map the cache file at `path`, or return `None` if it doesn't exist or isn't valid.
+    fn open(path: &Path) -> Option<Self> {
+        let file = File::open(path).ok()?;
+        let len = file.metadata().ok()?.len() as usize;
+        if len < size_of::<Header>() {
+            return None;
+        }
+        let addr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                PROT_READ,
+                MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if addr == MAP_FAILED {
+            return None;
+        }
+        let m = Self { addr, len };
+        // SAFETY: The mapping is page aligned and at least as big as the header.
+        let hdr = unsafe { &*(addr as *const Header) };
+        let nrecs = (len - size_of::<Header>()) / size_of::<Record>();
+        if hdr.magic != MAGIC
+            || (len - size_of::<Header>()) % size_of::<Record>() != 0
+            || hdr.len != nrecs as u64
+        {
+            return None;
+        }
+        Some(m)
+    }
+
+    fn records(&self) -> &[Record] {
+        // SAFETY: `open` checked that the records fill the rest of the mapping. The header is a
+        // multiple of the records' alignment in size, so they are aligned.
+        unsafe {
+            slice::from_raw_parts(
+                (self.addr as *const u8).add(size_of::<Header>()) as *const Record,
+                (self.len - size_of::<Header>()) / size_of::<Record>(),
+            )
+        }
+    }
+}
+
+// SAFETY: The mapping is private and only ever read, so can be used from any thread.
+unsafe impl Send for Mapping {}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.addr, self.len) };
+    }
+}
+
+/// The cache of the blocks of one code segment.
+pub(super) struct SegmentCache {
+    path: PathBuf,
+    /// The cache file, mapped on first use. `None` if it has yet to be mapped.
+    mapping: Option<Option<Mapping>>,
+    /// Blocks found since the cache file was mapped.
+    new: Vec<Record>,
+}
+
+impl SegmentCache {
+    /// Create the cache of the segment at file offset `offset` of the object with build-id
+    /// `build_id`, kept in the directory `dir`.
+    pub(super) fn new(dir: &Path, build_id: &[u8], offset: u64) -> Self {
+        let mut name = build_id
+            .iter()
+            .map(|b| format!("{:02x}", b))
+            .collect::<String>();
+        name.push_str(&format!("-{:x}.blocks", offset));
+        Self {
+            path: dir.join(name),
+            mapping: None,
+            new: Vec::new(),
+        }
+    }
+
+    fn records(&mut self) -> &[Record] {
+        let path = &self.path;
+        match self.mapping.get_or_insert_with(|| Mapping::open(path)) {
+            Some(m) => m.records(),
+            None => &[],
+        }
+    }
+
+    /// Returns the cached block starting at `ip`, for a segment spanning `base..end`.
+    pub(super) fn get(&mut self, base: u64, end: u64, ip: u64) -> Option<StaticBlock> {
+        let recs = self.records();
+        let start = ip - base;
+        let i = recs.binary_search_by_key(&start, |r| r.start).ok()?;
+        recs[i].block(base, end)
+    }
+
+    /// Returns how many blocks have been added since the cache file was last written.
+    pub(super) fn unpersisted(&self) -> usize {
+        self.new.len()
+    }
+
+    /// Add the block `b` starting at `ip`, for a segment starting at `base`. It is written out by
+    /// [SegmentCache::persist].
+    pub(super) fn insert(&mut self, base: u64, ip: u64, b: &StaticBlock) {
+        self.new.push(Record::new(base, ip, b));
+    }
+
+    /// Write the cache file afresh if blocks have been added to it. The file is replaced
+    /// atomically, so other processes either see the old file or the new one.
+    pub(super) fn persist(&mut self) {
+        if self.new.is_empty() {
+            return;
+        }
+        let mut recs = self.records().to_vec();
+        recs.append(&mut self.new);
+        recs.sort_unstable_by_key(|r| r.start);
+        recs.dedup_by_key(|r| r.start);
+
+        let mut bytes = Vec::with_capacity(size_of::<Header>() + recs.len() * size_of::<Record>());
+        bytes.extend(MAGIC);
+        bytes.extend((recs.len() as u64).to_ne_bytes());
+        for r in recs {
+            bytes.extend(r.to_bytes());
+        }
+        let dir = self.path.parent().unwrap();
+        let _ = fs::create_dir_all(dir)
+            .and_then(|_| NamedTempFile::new_in(dir))
+            .and_then(|mut f| {
+                f.write_all(&bytes)?;
+                f.persist(&self.path).map_err(|e| e.error)?;
+                Ok(())
+            });
+        // The old mapping lacks the blocks just written, so map the new file when next needed.
+        self.mapping = None;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Record, SegmentCache, MAGIC};
+    use crate::decode::ykpt::code::{Exit, StaticBlock};
+    use std::fs;
+
+    #[test]
+    fn round_trip() {
+        let dir = tempfile::tempdir().unwrap();
+        let base = 0x40_0000;
+        let blocks = [
+            (base + 0x10, base + 0x18, Exit::CondJump(base + 0x40)),
+            (base + 0x20, base + 0x24, Exit::Call(0x1000)), // Below the segment.
+            (base, base + 0x8, Exit::Return),
+            (base + 0x40, base + 0x50, Exit::Far),
+        ];
+        let mut cache = SegmentCache::new(dir.path(), &[0xab, 0x01], 0x2000);
+        assert!(cache.get(base, base + 0x1000, base + 0x10).is_none());
+        for (ip, last_instr, exit) in blocks {
+            let b = StaticBlock {
+                last_instr,
+                next_ip: last_instr + 2,
+                exit,
+            };
+            cache.insert(base, ip, &b);
+        }
+        cache.persist();
+        assert!(dir.path().join("ab01-2000.blocks").exists());
+
+        // Another process may load the object elsewhere.
+        let base2 = 0x7f00_0000_0000;
+        let mut cache = SegmentCache::new(dir.path(), &[0xab, 0x01], 0x2000);
+        for (ip, last_instr, exit) in blocks {
+            let b = cache.get(base2, base2 + 0x1000, ip - base + base2).unwrap();
+            assert_eq!(b.last_instr, last_instr - base + base2);
+            assert_eq!(b.next_ip, last_instr - base + base2 + 2);
+            let moved = |t: u64| t.wrapping_sub(base).wrapping_add(base2);
+            match (exit, b.exit) {
+                (Exit::CondJump(t), Exit::CondJump(t2)) | (Exit::Call(t), Exit::Call(t2)) => {
+                    assert_eq!(moved(t), t2)
+                }
+                (e, e2) => assert_eq!(e, e2),
+            }
+        }
+        assert!(cache.get(base2, base2 + 0x1000, base2 + 0x14).is_none());
+
+        // New blocks are merged with the old.
+        let b = StaticBlock {
+            last_instr: base2 + 0x60,
+            next_ip: base2 + 0x61,
+            exit: Exit::IndirectJump,
+        };
+        cache.insert(base2, base2 + 0x5c, &b);
+        cache.persist();
+        let mut cache = SegmentCache::new(dir.path(), &[0xab, 0x01], 0x2000);
+        assert_eq!(cache.records().len(), blocks.len() + 1);
+        assert!(cache.get(base, base + 0x1000, base + 0x5c).is_some());
+    }
+
+    #[test]
+    fn bad_files_ignored() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("ff-0.blocks");
+        let rec = Record {
+            start: 0,
+            last_instr: 4,
+            next_ip: 5,
+            exit: 99,
+            target: 0,
+        };
+        let mut bytes = MAGIC.to_vec();
+        bytes.extend(1u64.to_ne_bytes());
+        bytes.extend(rec.to_bytes());
+
+        // Truncated.
+        fs::write(&path, &bytes[..bytes.len() - 1]).unwrap();
+        assert!(SegmentCache::new(dir.path(), &[0xff], 0)
+            .records()
+            .is_empty());
+        // Wrong magic.
+        bytes[0] ^= 1;
+        fs::write(&path, &bytes).unwrap();
+        assert!(SegmentCache::new(dir.path(), &[0xff], 0)
+            .records()
+            .is_empty());
+        // A corrupt record.
+        bytes[0] ^= 1;
+        fs::write(&path, &bytes).unwrap();
+        let mut cache = SegmentCache::new(dir.path(), &[0xff], 0);
+        assert_eq!(cache.records().len(), 1);
+        assert!(cache.get(0x1000, 0x2000, 0x1000).is_none());
+    }
+
+    #[test]
+    fn out_of_range_records_ignored() {
+        let ok = Record {
+            start: 0x10,
+            last_instr: 0x14,
+            next_ip: 0x16,
+            exit: 5,
+            target: 0,
+        };
+        assert!(ok.block(0x1000, 0x1016).is_some());
+        // Running past the end of the segment.
+        assert!(ok.block(0x1000, 0x1015).is_none());
+        // Overflowing the address space.
+        assert!(ok.block(u64::MAX - 0x14, u64::MAX).is_none());
+        // Ending before it starts.
+        let backwards = Record {
+            last_instr: 0x8,
+            ..ok
+        };
+        assert!(backwards.block(0x1000, 0x2000).is_none());
+        let empty = Record {
+            next_ip: 0x14,
+            ..ok
+        };
+        assert!(empty.block(0x1000, 0x2000).is_none());
+    }
+}
@@ -1,61 +1,539 @@
 //! The Yk PT trace decoder.
 
-use crate::{decode::TraceDecoder, errors::HWTracerError, Block, Trace};
+use crate::{
+    decode::{
+        frames::Windows,
+        mapped::{mapped, Segments},
+        parallel::ChunkedBlocks,
+        TraceDecoder,
+    },
+    errors::HWTracerError,
+    Block, Trace,
+};
+use std::{path::PathBuf, sync::Mutex};
 
+mod code;
+use code::{Code, Exit, StaticBlock, PERSIST_BATCH};
+mod code_cache;
 mod packet_parser;
-use packet_parser::PacketParser;
+use packet_parser::{packets::Packet, PacketParser};
 
-pub(crate) struct YkPTTraceDecoder {}
+/// The most calls the hardware remembers for return compression. Returns from calls made before
+/// that aren't compressed.
+const RET_STACK_MAX: usize = 64;
+
+pub(crate) struct YkPTTraceDecoder {
+    /// Where to cache the blocks found in the code, if anywhere.
+    code_cache: Option<PathBuf>,
+    /// The code of the process, with the blocks found in it so far, for later decodes to take up.
+    /// Each decode takes one for as long as it runs, so decodes running at the same time (e.g. on
+    /// the threads of [TraceDecoder::decode_parallel]) don't contend for them: there are as many
+    /// as the most decodes there have been at once.
+    codes: Mutex<Vec<Code>>,
+}
+
+impl YkPTTraceDecoder {
+    pub(crate) fn with_code_cache(code_cache: Option<PathBuf>) -> Self {
+        Self {
+            code_cache,
+            codes: Mutex::new(Vec::new()),
+        }
+    }
+
+    /// Take a [Code] for a decode, up to date with the objects now loaded.
+    fn take_code(&self) -> Code {
+        match self.codes.lock().unwrap().pop() {
+            Some(mut code) => {
+                code.refresh();
+                code
+            }
+            None => Code::new(self.code_cache.as_deref()),
+        }
+    }
+
+    /// Give back a [Code] taken by [YkPTTraceDecoder::take_code].
+    fn give_code(&self, mut code: Code) {
+        code.persist(PERSIST_BATCH);
+        self.codes.lock().unwrap().push(code);
+    }
+
+    /// Decode the blocks of the trace, appending them to `blocks`, like
+    /// [TraceDecoder::decode_into]. On error, also returns the offset into the trace the parser
+    /// had reached, so that the caller can decode that part of the trace some other way. Code
+    /// mustn't be mapped part way through the trace (see [Segments]).
+    #[cfg(decoder_libipt)]
+    pub(crate) fn decode_until_error(
+        &self,
+        trace: &dyn Trace,
+        blocks: &mut Vec<Block>,
+    ) -> Result<(), (HWTracerError, usize)> {
+        let mut itr = YkPTBlockIterator::new(self, trace);
+        while let Some(b) = itr.next() {
+            blocks.push(b.map_err(|e| (e, itr.parser.offset()))?);
+        }
+        Ok(())
+    }
+}
 
 impl TraceDecoder for YkPTTraceDecoder {
     fn new() -> Self {
-        Self {}
+        Self::with_code_cache(None)
     }
 
     fn iter_blocks<'t>(
         &'t self,
         trace: &'t dyn Trace,
     ) -> Box<dyn Iterator<Item = Result<Block, HWTracerError>> + '_> {
-        let itr = YkPTBlockIterator {
-            errored: false,
-            parser: PacketParser::new(trace.bytes()),
-        };
-        Box::new(itr)
+        if let Some(w) = Windows::new(self, trace) {
+            return Box::new(ChunkedBlocks::new(w));
+        }
+        if let Some(s) = Segments::new(self, trace) {
+            return Box::new(ChunkedBlocks::new(s));
+        }
+        Box::new(YkPTBlockIterator::new(self, trace))
     }
 }
 
 /// Iterate over the blocks of an Intel PT trace using the fast Yk PT decoder.
+///
+/// Blocks are found by following the code of the current process from each IP the trace gives,
+/// using TNT packets to decide conditional branches (and compressed returns) and TIP packets to
+/// find the targets of indirect branches.
 struct YkPTBlockIterator<'t> {
+    /// The decoder we belong to, to which we give back `code` when done.
+    decoder: &'t YkPTTraceDecoder,
     /// Set to true when an error has occured.
     errored: bool,
     /// PT packet iterator.
     parser: PacketParser<'t>,
+    /// If `true`, errors are reported as gaps, after which decoding resumes where it can.
+    lossy: bool,
+    /// The code of the process. Only `None` once we have been dropped.
+    code: Option<Code>,
+    /// The next packet bearing on control flow, if we have looked ahead at it.
+    peeked: Option<Packet>,
+    /// Are we inside a PSB+ sequence?
+    in_psb_plus: bool,
+    /// Set when the parser reported a gap, until the gap has been yielded. Until then, the trace
+    /// appears to have ended.
+    at_gap: bool,
+    /// The address of the next instruction to execute, or `None` if tracing is disabled or we
+    /// don't know where we are.
+    ip: Option<u64>,
+    /// Where the current block started, if tracing was disabled part way through it (e.g. by an
+    /// interrupt). As in the libipt decoder, the block is reported as one once it ends.
+    block_start: Option<u64>,
+    /// The last block we yielded, if we have yet to find out where it goes.
+    pending_exit: Option<StaticBlock>,
+    /// Branch decisions not yet consumed, the oldest in the most significant of the low `ntnts`
+    /// bits.
+    tnts: u64,
+    ntnts: u32,
+    /// The return addresses of the calls seen, for compressed returns.
+    ret_stack: Vec<u64>,
+}
+
+impl<'t> YkPTBlockIterator<'t> {
+    fn new(decoder: &'t YkPTTraceDecoder, trace: &'t dyn Trace) -> Self {
+        let mut code = decoder.take_code();
+        code.set_mapped(mapped(trace));
+        Self {
+            decoder,
+            errored: false,
+            parser: PacketParser::new_lossy(trace.bytes(), trace.gaps(), trace.is_lossy()),
+            lossy: trace.is_lossy(),
+            code: Some(code),
+            peeked: None,
+            in_psb_plus: false,
+            at_gap: false,
+            ip: None,
+            block_start: None,
+            pending_exit: None,
+            tnts: 0,
+            ntnts: 0,
+            ret_stack: Vec::new(),
+        }
+    }
+
+    fn code(&mut self) -> &mut Code {
+        self.code.as_mut().unwrap()
+    }
+
+    /// Get the next packet bearing on control flow, skipping the others. Returns `None` at the end
+    /// of the trace, or at a gap.
+    fn next_packet(&mut self) -> Result<Option<Packet>, HWTracerError> {
+        if let Some(pkt) = self.peeked.take() {
+            return Ok(Some(pkt));
+        }
+        while !self.at_gap {
+            let pkt = match self.parser.next() {
+                Some(pkt) => pkt?,
+                None => break,
+            };
+            match pkt {
+                Packet::PSB(_) => self.in_psb_plus = true,
+                Packet::PSBEND(_) => self.in_psb_plus = false,
+                Packet::FUP(..) if self.in_psb_plus => {
+                    // The IP at which the PSB+ was emitted. We already know it, unless we are
+                    // (re)starting from this PSB+.
+                    if self.ip.is_none() {
+                        self.ip = pkt.target_ip().map(|ip| ip as u64);
+                    }
+                }
+                Packet::PAD(_)
+                | Packet::CBR(_)
+                | Packet::MODE(_)
+                | Packet::CYC(_)
+                | Packet::TSC(_)
+                | Packet::MTC(_)
+                | Packet::TMA(_) => (),
+                Packet::OVF(_) => return Err(HWTracerError::HWBufferOverflow),
+                Packet::Gap => self.at_gap = true,
+                _ => return Ok(Some(pkt)),
+            }
+        }
+        Ok(None)
+    }
+
+    /// Look at the next packet bearing on control flow, without consuming it.
+    fn peek_packet(&mut self) -> Result<Option<&Packet>, HWTracerError> {
+        if self.peeked.is_none() {
+            self.peeked = self.next_packet()?;
+        }
+        Ok(self.peeked.as_ref())
+    }
+
+    /// Take the next branch decision (`true` for taken) from the trace, or `None` if the next
+    /// packet isn't a TNT.
+    fn take_tnt(&mut self) -> Result<Option<bool>, HWTracerError> {
+        while self.ntnts == 0 {
+            if self.peeked.is_none() {
+                // The fast path: take a batch of decisions without going through `Packet`s.
+                let (tnts, ntnts) = self.parser.take_tnts();
+                if ntnts > 0 {
+                    self.tnts = tnts;
+                    self.ntnts = ntnts;
+                    break;
+                }
+            }
+            let (tnts, ntnts) = match self.peek_packet()? {
+                Some(Packet::ShortTNT(p)) => p.tnts(),
+                Some(Packet::LongTNT(p)) => p.tnts(),
+                _ => return Ok(None),
+            };
+            self.peeked = None;
+            self.tnts = tnts;
+            self.ntnts = ntnts;
+        }
+        self.ntnts -= 1;
+        Ok(Some(self.tnts >> self.ntnts & 1 == 1))
+    }
+
+    /// Take the target of an indirect transfer from the trace. Returns `None` if tracing was
+    /// disabled instead.
+    fn take_tip(&mut self, ip: u64) -> Result<Option<u64>, HWTracerError> {
+        match self.next_packet()? {
+            Some(pkt @ Packet::TIP(..)) => Ok(pkt.target_ip().map(|ip| ip as u64)),
+            Some(Packet::TIPPGD(..)) | None => Ok(None),
+            Some(pkt) => Err(desync("TIP", ip, &pkt)),
+        }
+    }
+
+    /// Remember the return address of a call.
+    fn push_ret(&mut self, ret: u64) {
+        if self.ret_stack.len() == RET_STACK_MAX {
+            self.ret_stack.remove(0);
+        }
+        self.ret_stack.push(ret);
+    }
+
+    /// Find out where execution goes after the block `b`, reading the trace if need be.
+    fn follow(&mut self, b: StaticBlock) -> Result<(), HWTracerError> {
+        if !matches!(b.exit, Exit::Jump(_) | Exit::Call(_)) && self.peek_packet()?.is_none() {
+            // The trace ends (or has a gap) before it says.
+            self.ip = None;
+            return Ok(());
+        }
+        self.ip = match b.exit {
+            Exit::Jump(target) => Some(target),
+            Exit::CondJump(target) => match self.take_tnt()? {
+                Some(true) => Some(target),
+                Some(false) => Some(b.next_ip),
+                None => return Err(self.desync_peeked("TNT", b.last_instr)),
+            },
+            Exit::Call(target) => {
+                self.push_ret(b.next_ip);
+                Some(target)
+            }
+            Exit::IndirectCall => {
+                self.push_ret(b.next_ip);
+                self.take_tip(b.last_instr)?
+            }
+            Exit::IndirectJump | Exit::Far => self.take_tip(b.last_instr)?,
+            Exit::Return => match self.take_tnt()? {
+                Some(true) => match self.ret_stack.pop() {
+                    Some(ret) => Some(ret),
+                    None => {
+                        return Err(HWTracerError::TraceParseError(format!(
+                            "compressed return at 0x{:x} without a call",
+                            b.last_instr
+                        )))
+                    }
+                },
+                Some(false) => {
+                    return Err(HWTracerError::TraceParseError(format!(
+                        "return at 0x{:x} not taken",
+                        b.last_instr
+                    )))
+                }
+                None => self.take_tip(b.last_instr)?,
+            },
+        };
+        Ok(())
+    }
+
+    /// Forget where we are, after data was lost.
+    fn reset(&mut self) {
+        self.ip = None;
+        self.block_start = None;
+        self.pending_exit = None;
+        self.ntnts = 0;
+        self.ret_stack.clear();
+    }
+
+    /// An error for when the trace doesn't contain the expected next packet.
+    fn desync_peeked(&mut self, expected: &str, ip: u64) -> HWTracerError {
+        match self.peeked.take() {
+            Some(pkt) => desync(expected, ip, &pkt),
+            None => HWTracerError::TraceParseError(format!("expected {} at 0x{:x}", expected, ip)),
+        }
+    }
+
+    /// Find the next block.
+    fn bind(&mut self) -> Result<Option<Block>, HWTracerError> {
+        loop {
+            if let Some(b) = self.pending_exit.take() {
+                self.follow(b)?;
+            }
+
+            let ip = match self.ip {
+                Some(ip) => ip,
+                None => {
+                    // Tracing is disabled, or we don't know where we are: find where it resumes.
+                    match self.next_packet()? {
+                        Some(pkt @ Packet::TIPPGE(..)) => {
+                            self.ip = pkt.target_ip().map(|ip| ip as u64);
+                        }
+                        Some(pkt @ Packet::FUP(..)) => {
+                            // Tracing resumes after an overflow, unless this is an asynchronous
+                            // event disabling it.
+                            if let Some(Packet::TIPPGD(..)) = self.peek_packet()? {
+                                self.peeked = None;
+                            } else {
+                                self.ip = pkt.target_ip().map(|ip| ip as u64);
+                            }
+                        }
+                        Some(_) => (), // Control flow from somewhere we don't know.
+                        None if self.at_gap => {
+                            self.at_gap = false;
+                            self.reset();
+                            return Ok(Some(Block::new_gap()));
+                        }
+                        None => return Ok(None),
+                    }
+                    continue;
+                }
+            };
+
+            // An asynchronous event (e.g. an interrupt) may stop execution part way through the
+            // block, in which case the trace has a FUP before any further TNT.
+            if self.ntnts == 0 {
+                let fup = match self.peek_packet()? {
+                    Some(pkt @ Packet::FUP(..)) => pkt.target_ip().map(|ip| ip as u64),
+                    _ => None,
+                };
+                if let Some(fup) = fup {
+                    if self.code().block_contains(ip, fup)? {
+                        self.peeked = None;
+                        self.block_start.get_or_insert(ip);
+                        // Execution resumes at the TIP, if it is traced.
+                        self.ip = self.take_tip(fup)?;
+                        continue;
+                    }
+                }
+            }
+
+            let b = self.code().block_at(ip)?;
+            self.pending_exit = Some(b);
+            let first_instr = self.block_start.take().unwrap_or(ip);
+            return Ok(Some(Block::new(first_instr, b.last_instr)));
+        }
+    }
+}
+
+/// An error for when the trace has `pkt` where `expected` should be, when at `ip`.
+fn desync(expected: &str, ip: u64, pkt: &Packet) -> HWTracerError {
+    HWTracerError::TraceParseError(format!(
+        "expected {} at 0x{:x}, but got {:?}",
+        expected,
+        ip,
+        pkt.kind()
+    ))
 }
 
 impl<'t> Iterator for YkPTBlockIterator<'t> {
     type Item = Result<Block, HWTracerError>;
 
     fn next(&mut self) -> Option<Self::Item> {
-        if !self.errored {
-            // FIXME: For now this is dummy code to prevent dead-code warnings. Later block binding
-            // logic will go here.
-            self.parser.next().unwrap().unwrap();
+        if self.errored {
+            return None;
+        }
+        match self.bind() {
+            Ok(b) => b.map(Ok),
+            Err(_) if self.lossy => {
+                // Treat it like lost data: start afresh from wherever the trace next tells us
+                // where we are.
+                self.reset();
+                Some(Ok(Block::new_gap()))
+            }
+            Err(e) => {
+                self.errored = true;
+                Some(Err(e))
+            }
+        }
+    }
+}
+
+impl<'t> Drop for YkPTBlockIterator<'t> {
+    fn drop(&mut self) {
+        if let Some(code) = self.code.take() {
+            self.decoder.give_code(code);
         }
-        None
     }
 }
 
 #[cfg(test)]
 mod tests {
     use crate::{
-        collect::TraceCollectorBuilder,
-        decode::{test_helpers, TraceDecoderKind},
+        collect::{test_helpers::trace_closure, TraceCollectorBuilder},
+        decode::{test_helpers, TraceDecoderBuilder, TraceDecoderKind},
+        test_helpers::work_loop,
     };
 
-    #[ignore] // FIXME
     #[test]
     fn ten_times_as_many_blocks() {
         let tc = TraceCollectorBuilder::new().build().unwrap();
         test_helpers::ten_times_as_many_blocks(tc, TraceDecoderKind::YkPT);
     }
+
+    /// Check that we find exactly the same blocks as the libipt decoder.
+    #[cfg(decoder_libipt)]
+    #[test]
+    fn versus_libipt() {
+        use libc::{clock_gettime, timespec, CLOCK_MONOTONIC};
+
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let traces = [
+            trace_closure(&tc, || work_loop(0)),
+            trace_closure(&tc, || work_loop(10)),
+            trace_closure(&tc, || work_loop(3000)),
+            // clock_gettime(2) is in the VDSO.
+            trace_closure(&tc, || {
+                let mut tv = timespec {
+                    tv_sec: 0,
+                    tv_nsec: 0,
+                };
+                for _ in 1..100 {
+                    assert_eq!(unsafe { clock_gettime(CLOCK_MONOTONIC, &mut tv) }, 0);
+                }
+                tv.tv_sec as u64
+            }),
+        ];
+        for trace in traces {
+            let mut expect = Vec::new();
+            TraceDecoderBuilder::new()
+                .kind(TraceDecoderKind::LibIPT)
+                .build()
+                .unwrap()
+                .decode_into(&*trace, &mut expect)
+                .unwrap();
+            let mut got = Vec::new();
+            TraceDecoderBuilder::new()
+                .kind(TraceDecoderKind::YkPT)
+                .build()
+                .unwrap()
+                .decode_into(&*trace, &mut got)
+                .unwrap();
+            assert_eq!(got, expect);
+        }
+    }
+
+    #[test]
+    fn decode_into_matches_iter() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        test_helpers::decode_into_matches_iter(tc, TraceDecoderKind::YkPT);
+    }
+
+    #[test]
+    fn block_trace_matches_decode_into() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        test_helpers::block_trace_matches_decode_into(tc, TraceDecoderKind::YkPT);
+    }
+
+    #[test]
+    fn parallel_matches_serial() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        test_helpers::parallel_matches_serial(tc, TraceDecoderKind::YkPT);
+    }
+
+    /// Check that decoding with a warm code cache gives the same blocks as decoding without one.
+    #[test]
+    fn code_cache() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(100));
+        let dir = tempfile::tempdir().unwrap();
+        let decode = |cache: bool| {
+            let mut builder = TraceDecoderBuilder::new().kind(TraceDecoderKind::YkPT);
+            if cache {
+                builder = builder.code_cache(dir.path());
+            }
+            let mut blocks = Vec::new();
+            builder
+                .build()
+                .unwrap()
+                .decode_into(&*trace, &mut blocks)
+                .unwrap();
+            blocks
+        };
+        let expect = decode(false);
+        assert_eq!(decode(true), expect);
+        assert!(std::fs::read_dir(dir.path()).unwrap().next().is_some());
+        assert_eq!(decode(true), expect);
+    }
+
+    /// Check that the blocks found by one decode are kept for the next.
+    #[test]
+    fn code_kept_across_decodes() {
+        use super::YkPTTraceDecoder;
+        use crate::decode::TraceDecoder;
+
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(100));
+        let dec = YkPTTraceDecoder::new();
+        let mut expect = Vec::new();
+        dec.decode_into(&*trace, &mut expect).unwrap();
+        let found = {
+            let codes = dec.codes.lock().unwrap();
+            assert_eq!(codes.len(), 1);
+            codes[0].len()
+        };
+        assert!(found > 0);
+
+        let mut got = Vec::new();
+        dec.decode_into(&*trace, &mut got).unwrap();
+        assert_eq!(got, expect);
+        let codes = dec.codes.lock().unwrap();
+        assert_eq!(codes.len(), 1);
+        assert_eq!(codes[0].len(), found);
+    }
 }
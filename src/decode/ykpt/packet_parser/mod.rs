@@ -1,10 +1,14 @@
 //! A packet parser for the Yk PT trace decoder.
 
-use crate::errors::HWTracerError;
+use crate::{
+    decode::scan::{find_psb, skip_pads, PSB},
+    errors::HWTracerError,
+};
+#[cfg(test)]
 use deku::{bitvec::BitSlice, DekuRead};
 use std::iter::Iterator;
 
-mod packets;
+pub(super) mod packets;
 use packets::*;
 
 #[derive(Clone, Copy, Debug)]
@@ -18,14 +22,28 @@ enum PacketParserState {
 }
 
 impl PacketParserState {
-    /// Returns the kinds of packet that are valid for the state.
+    /// Returns `true` if packets of kind `kind` are valid in this state.
+    fn accepts(&self, kind: PacketKind) -> bool {
+        match self {
+            Self::Init => kind == PacketKind::PSB,
+            Self::Normal => !matches!(kind, PacketKind::PSBEND | PacketKind::Gap),
+            Self::PSBPlus => matches!(
+                kind,
+                PacketKind::CBR
+                    | PacketKind::MODE
+                    | PacketKind::FUP
+                    | PacketKind::PAD
+                    | PacketKind::TSC
+                    | PacketKind::TMA
+                    | PacketKind::PSBEND
+            ),
+        }
+    }
+
+    /// Returns the kinds of packet that are valid for the state, in the order in which the deku
+    /// parser tries them.
+    #[cfg(test)]
     fn valid_packets(&self) -> &'static [PacketKind] {
-        // Note that the parser will attempt to match packet kinds in the order that they appear in
-        // the returned slice. For best performance, the returned slice should be sorted, most
-        // frequently expected packet kinds first.
-        //
-        // OPT: The order below is a rough guess based on what limited traces I've seen. Benchmark
-        // and optimise.
         match self {
             Self::Init => &[PacketKind::PSB],
             Self::Normal => &[
@@ -39,8 +57,22 @@ impl PacketParserState {
                 PacketKind::MODE,
                 PacketKind::TIPPGE,
                 PacketKind::TIPPGD,
+                PacketKind::OVF,
+                PacketKind::CBR,
+                PacketKind::TSC,
+                PacketKind::MTC,
+                PacketKind::TMA,
+            ],
+            // If tracing is enabled, a PSB+ sequence carries a FUP with the current IP.
+            Self::PSBPlus => &[
+                PacketKind::CBR,
+                PacketKind::MODE,
+                PacketKind::FUP,
+                PacketKind::PAD,
+                PacketKind::TSC,
+                PacketKind::TMA,
+                PacketKind::PSBEND,
             ],
-            Self::PSBPlus => &[PacketKind::CBR, PacketKind::PSBEND],
         }
     }
 
@@ -57,8 +89,190 @@ impl PacketParserState {
     }
 }
 
+/// What the first byte of a packet tells us about it.
+#[derive(Clone, Copy)]
+enum Opcode {
+    /// The byte doesn't start a packet we know of.
+    Invalid,
+    PAD,
+    ShortTNT,
+    /// The packets carrying an IP. The top 3 bits of the byte are the `IPBytes`.
+    TIP,
+    TIPPGE,
+    TIPPGD,
+    FUP,
+    CYC,
+    MODE,
+    TSC,
+    MTC,
+    /// The first byte (0x02) of a packet identified by its second byte.
+    Extended,
+}
+
+/// Maps the first byte of a packet to its `Opcode`.
+static OPCODES: [Opcode; 256] = opcodes();
+
+const fn opcodes() -> [Opcode; 256] {
+    let mut table = [Opcode::Invalid; 256];
+    let mut i = 0;
+    while i < 256 {
+        let b = i as u8;
+        table[i] = if b == 0x00 {
+            Opcode::PAD
+        } else if b == 0x02 {
+            Opcode::Extended
+        } else if b & 0x1 == 0 {
+            // Bit 0 is clear, the stop bit is above bit 1.
+            Opcode::ShortTNT
+        } else if b & 0x3 == 0x3 {
+            Opcode::CYC
+        } else if b == 0x99 {
+            Opcode::MODE
+        } else if b == 0x19 {
+            Opcode::TSC
+        } else if b == 0x59 {
+            Opcode::MTC
+        } else {
+            match b & 0x1f {
+                0x0d => Opcode::TIP,
+                0x11 => Opcode::TIPPGE,
+                0x01 => Opcode::TIPPGD,
+                0x1d => Opcode::FUP,
+                _ => Opcode::Invalid,
+            }
+        };
+        i += 1;
+    }
+    table
+}
+
+/// The number of payload bytes of an IP packet, indexed by its `IPBytes`.
+const IP_PAYLOAD_LEN: [Option<usize>; 8] = [
+    Some(0),
+    Some(2),
+    Some(4),
+    Some(6),
+    Some(6),
+    None, // Reserved.
+    Some(8),
+    None, // Reserved.
+];
+
+/// Read a little-endian integer of up to 8 bytes.
+fn read_le(bytes: &[u8]) -> u64 {
+    bytes
+        .iter()
+        .rev()
+        .fold(0, |acc, b| acc << 8 | u64::from(*b))
+}
+
+/// Parse the IP packet starting with `b0` (the rest of it in `rest`) into `Packet` discriminant
+/// `discr`. Returns the packet and its length in bytes.
+fn parse_ip_packet<P>(
+    b0: u8,
+    rest: &[u8],
+    prev_tip: usize,
+    new: fn(IPBytes, TargetIP) -> P,
+    discr: fn(P, Option<usize>) -> Packet,
+) -> Option<(Packet, usize)> {
+    let ip_bytes_val = b0 >> 5;
+    let len = IP_PAYLOAD_LEN[usize::from(ip_bytes_val)]?;
+    let v = read_le(rest.get(..len)?);
+    let target_ip = match ip_bytes_val {
+        0b000 => TargetIP::OutOfContext,
+        0b001 => TargetIP::Ip16(v as u16),
+        0b010 => TargetIP::Ip32(v as u32),
+        0b011 | 0b100 => TargetIP::Ip48(v),
+        _ => TargetIP::Ip64(v),
+    };
+    let ip_bytes = IPBytes::new(ip_bytes_val);
+    let prev_tip = if ip_bytes.needs_prev_tip() {
+        Some(prev_tip)
+    } else {
+        None
+    };
+    Some((discr(new(ip_bytes, target_ip), prev_tip), 1 + len))
+}
+
+/// Parse the packet at the start of `bytes`, dispatching on its first (and, for extended
+/// packets, second) byte. Returns the packet and its length in bytes, or `None` if the bytes
+/// don't start with a (complete) packet we know of.
+///
+/// A run of PAD packets is parsed as one.
+fn parse_bytes(bytes: &[u8], prev_tip: usize) -> Option<(Packet, usize)> {
+    let (&b0, rest) = bytes.split_first()?;
+    match OPCODES[usize::from(b0)] {
+        Opcode::Invalid => None,
+        Opcode::PAD => Some((Packet::PAD(PADPacket {}), skip_pads(bytes, 1))),
+        Opcode::ShortTNT => Some((Packet::ShortTNT(ShortTNTPacket::new(b0 >> 1)), 1)),
+        Opcode::TIP => parse_ip_packet(b0, rest, prev_tip, TIPPacket::new, Packet::TIP),
+        Opcode::TIPPGE => parse_ip_packet(b0, rest, prev_tip, TIPPGEPacket::new, Packet::TIPPGE),
+        Opcode::TIPPGD => parse_ip_packet(b0, rest, prev_tip, TIPPGDPacket::new, Packet::TIPPGD),
+        Opcode::FUP => parse_ip_packet(b0, rest, prev_tip, FUPPacket::new, Packet::FUP),
+        Opcode::CYC => {
+            let mut len = 1;
+            if b0 & 0x4 != 0 {
+                // Extended bytes follow, each with bit 0 set if another follows it.
+                loop {
+                    let b = *rest.get(len - 1)?;
+                    len += 1;
+                    if b & 0x1 == 0 {
+                        break;
+                    }
+                }
+            }
+            Some((Packet::CYC(CYCPacket {}), len))
+        }
+        Opcode::MODE => {
+            rest.first()?;
+            Some((Packet::MODE(MODEPacket {}), 2))
+        }
+        Opcode::TSC => {
+            rest.get(..7)?;
+            Some((Packet::TSC(TSCPacket {}), 8))
+        }
+        Opcode::MTC => {
+            rest.first()?;
+            Some((Packet::MTC(MTCPacket {}), 2))
+        }
+        Opcode::Extended => match rest.first()? {
+            0x82 => {
+                if bytes.get(..PSB.len())? == PSB {
+                    Some((Packet::PSB(PSBPacket {}), PSB.len()))
+                } else {
+                    None
+                }
+            }
+            0x03 => {
+                rest.get(..3)?;
+                Some((Packet::CBR(CBRPacket {}), 4))
+            }
+            0x23 => Some((Packet::PSBEND(PSBENDPacket {}), 2)),
+            0x73 => {
+                rest.get(..6)?;
+                Some((Packet::TMA(TMAPacket {}), 7))
+            }
+            0xa3 => {
+                let branches = read_le(rest.get(1..7)?);
+                Some((Packet::LongTNT(LongTNTPacket::new(branches)), 8))
+            }
+            0xf3 => Some((Packet::OVF(OVFPacket {}), 2)),
+            _ => None,
+        },
+    }
+}
+
 pub(super) struct PacketParser<'t> {
-    /// The raw bytes of the PT trace we are iterating over.
+    /// The raw bytes of the whole PT trace.
+    trace: &'t [u8],
+    /// The offsets in `trace` at which trace data was lost. These split the trace into segments,
+    /// each of which is parsed from its first PSB.
+    gaps: &'t [usize],
+    /// The index of the segment we are parsing.
+    segment: usize,
+    /// If `true`, a packet that can't be parsed is treated like a gap rather than as an error.
+    lossy: bool,
+    /// The remaining bytes of the current segment.
     bytes: &'t [u8],
     /// The parser operates as a state machine. This field keeps track of which state we are in.
     state: PacketParserState,
@@ -69,6 +283,7 @@ pub(super) struct PacketParser<'t> {
 
 /// Attempt to read the packet of type `$packet` using deku. On success wrap the packet up into the
 /// corresponding discriminant of `Packet`.
+#[cfg(test)]
 macro_rules! read_to_packet {
     ($packet: ty, $bits: expr, $discr: expr) => {
         <$packet>::read($bits, ()).and_then(|(r, p)| Ok((r, $discr(p))))
@@ -76,6 +291,7 @@ macro_rules! read_to_packet {
 }
 
 /// Same as `read_to_packet!`, but with extra logic for dealing with packets which encode a TIP.
+#[cfg(test)]
 macro_rules! read_to_packet_tip {
     ($packet: ty, $bits: expr, $discr: expr, $prev_tip: expr) => {
         <$packet>::read($bits, ()).and_then(|(r, p)| {
@@ -90,15 +306,58 @@ macro_rules! read_to_packet_tip {
 }
 
 impl<'t> PacketParser<'t> {
+    #[cfg(test)]
     pub(super) fn new(bytes: &'t [u8]) -> Self {
-        Self {
-            bytes,
+        Self::new_lossy(bytes, &[], false)
+    }
+
+    /// Make a parser for a trace with the specified gaps, optionally treating unparseable data
+    /// as if it were a gap.
+    pub(super) fn new_lossy(bytes: &'t [u8], gaps: &'t [usize], lossy: bool) -> Self {
+        let mut ret = Self {
+            trace: bytes,
+            gaps,
+            segment: 0,
+            lossy,
+            bytes: &[],
             state: PacketParserState::Init,
             prev_tip: 0,
-        }
+        };
+        ret.bytes = &bytes[..ret.segment_end()];
+        ret
+    }
+
+    /// Returns the offset in `self.trace` at which the current segment ends.
+    fn segment_end(&self) -> usize {
+        self.gaps
+            .get(self.segment)
+            .copied()
+            .unwrap_or(self.trace.len())
+    }
+
+    /// Start parsing the next segment (which must exist).
+    fn next_segment(&mut self) {
+        let start = self.segment_end();
+        self.segment += 1;
+        self.bytes = &self.trace[start..self.segment_end()];
+        self.resync(0);
     }
 
-    /// Attempt to parse a packet of the specified `PacketKind`.
+    /// Skip to the first PSB at or after `from` bytes into the current segment (or to the end of
+    /// the segment, if there's no such PSB), ready to parse a fresh `PSB+` sequence.
+    fn resync(&mut self, from: usize) {
+        let skip = find_psb(self.bytes, from).unwrap_or(self.bytes.len());
+        self.bytes = &self.bytes[skip..];
+        self.state = PacketParserState::Init;
+        // The compression base for IPs is reset by a PSB.
+        self.prev_tip = 0;
+    }
+
+    /// Attempt to parse a packet of the specified `PacketKind` using deku.
+    ///
+    /// The deku definitions of the packets are much easier to check against the Intel manual than
+    /// `parse_bytes()`, but much slower, so they serve as a reference for testing it.
+    #[cfg(test)]
     fn parse_kind(&mut self, kind: PacketKind) -> Option<Packet> {
         let bits = BitSlice::from_slice(self.bytes).ok()?;
         let parse_res = match kind {
@@ -120,6 +379,12 @@ impl<'t> PacketParser<'t> {
             PacketKind::TIP => read_to_packet_tip!(TIPPacket, bits, Packet::TIP, self.prev_tip),
             PacketKind::FUP => read_to_packet_tip!(FUPPacket, bits, Packet::FUP, self.prev_tip),
             PacketKind::CYC => read_to_packet!(CYCPacket, bits, Packet::CYC),
+            PacketKind::OVF => read_to_packet!(OVFPacket, bits, Packet::OVF),
+            PacketKind::TSC => read_to_packet!(TSCPacket, bits, Packet::TSC),
+            PacketKind::MTC => read_to_packet!(MTCPacket, bits, Packet::MTC),
+            PacketKind::TMA => read_to_packet!(TMAPacket, bits, Packet::TMA),
+            // Gaps are never found in the packet stream, only in between segments.
+            PacketKind::Gap => unreachable!(),
         };
         if let Ok((remain, pkt)) = parse_res {
             self.bytes = remain.as_raw_slice();
@@ -131,19 +396,32 @@ impl<'t> PacketParser<'t> {
 
     /// Attempt to parse a packet for the current parser state.
     fn parse_state(&mut self) -> Result<Packet, HWTracerError> {
+        if let Some((pkt, len)) = parse_bytes(self.bytes, self.prev_tip) {
+            if self.state.accepts(pkt.kind()) {
+                self.bytes = &self.bytes[len..];
+                return Ok(pkt);
+            }
+        }
+        Err(self.parse_error())
+    }
+
+    /// Like `parse_state()`, but using deku.
+    #[cfg(test)]
+    fn parse_state_deku(&mut self) -> Result<Packet, HWTracerError> {
         for kind in self.state.valid_packets() {
             if let Some(pkt) = self.parse_kind(*kind) {
-                if *kind == PacketKind::PSBEND {
-                    self.state = PacketParserState::Normal;
-                }
                 return Ok(pkt);
             }
         }
-        Err(HWTracerError::TraceParseError(format!(
+        Err(self.parse_error())
+    }
+
+    fn parse_error(&self) -> HWTracerError {
+        HWTracerError::TraceParseError(format!(
             "In state {:?}, failed to parse packet: {}",
             self.state,
             self.byte_stream_str(8, ", ")
-        )))
+        ))
     }
 
     /// Returns a string showing a binary formatted peek at the next `nbytes` bytes of
@@ -167,9 +445,73 @@ impl<'t> PacketParser<'t> {
 
     /// Attempt to parse a packet.
     fn parse_packet(&mut self) -> Result<Packet, HWTracerError> {
-        // Attempt to parse a packet.
         let pkt = self.parse_state()?;
+        self.parsed(&pkt);
+        Ok(pkt)
+    }
 
+    /// Like `parse_packet()`, but using deku.
+    #[cfg(test)]
+    fn parse_packet_deku(&mut self) -> Result<Packet, HWTracerError> {
+        let pkt = self.parse_state_deku()?;
+        self.parsed(&pkt);
+        Ok(pkt)
+    }
+
+    /// Returns the offset into the trace of the next byte to be parsed.
+    #[cfg(decoder_libipt)]
+    pub(super) fn offset(&self) -> usize {
+        self.bytes.as_ptr() as usize - self.trace.as_ptr() as usize
+    }
+
+    /// Parse a run of TNT packets (and any PAD and timing packets amongst them), merging their branch
+    /// decisions into one bitmask. Returns the decisions, the oldest in the most significant of the
+    /// low `n` bits, and `n`. Stops before the first packet of another kind, or before a TNT packet
+    /// whose decisions don't fit into the 64 bits.
+    ///
+    /// This saves consumers going through a [Packet] for each TNT packet, which matters as
+    /// conditional branches are by far the most common thing in a trace.
+    pub(super) fn take_tnts(&mut self) -> (u64, u32) {
+        let (mut tnts, mut n) = (0, 0);
+        if !matches!(self.state, PacketParserState::Normal) {
+            return (tnts, n);
+        }
+        while let Some(&b0) = self.bytes.first() {
+            let (bits, nbits, len) = match OPCODES[usize::from(b0)] {
+                Opcode::ShortTNT => {
+                    let (bits, nbits) = tnts_from_raw(u64::from(b0 >> 1));
+                    (bits, nbits, 1)
+                }
+                Opcode::Extended if self.bytes.get(1) == Some(&0xa3) => {
+                    match self.bytes.get(2..8) {
+                        Some(payload) => {
+                            let (bits, nbits) = tnts_from_raw(read_le(payload));
+                            (bits, nbits, 8)
+                        }
+                        None => break,
+                    }
+                }
+                Opcode::PAD | Opcode::CYC | Opcode::MTC | Opcode::TSC => {
+                    match parse_bytes(self.bytes, self.prev_tip) {
+                        Some((_, len)) => (0, 0, len),
+                        None => break,
+                    }
+                }
+                _ => break,
+            };
+            if n + nbits > 64 {
+                break;
+            }
+            // `nbits` is at most 47, so this doesn't overflow.
+            tnts = tnts << nbits | bits;
+            n += nbits;
+            self.bytes = &self.bytes[len..];
+        }
+        (tnts, n)
+    }
+
+    /// Update the parser's state after parsing `pkt`.
+    fn parsed(&mut self, pkt: &Packet) {
         // If the packet contains an updated TIP, then cache it.
         if let Some(tip) = pkt.target_ip() {
             self.prev_tip = tip;
@@ -177,8 +519,6 @@ impl<'t> PacketParser<'t> {
 
         // See if the packet we just parsed triggers a state transition.
         self.state.transition(pkt.kind());
-
-        Ok(pkt)
     }
 }
 
@@ -186,17 +526,27 @@ impl<'t> Iterator for PacketParser<'t> {
     type Item = Result<Packet, HWTracerError>;
 
     fn next(&mut self) -> Option<Self::Item> {
-        if !self.bytes.is_empty() {
-            Some(self.parse_packet())
-        } else {
-            None
+        if self.bytes.is_empty() {
+            if self.segment == self.gaps.len() {
+                return None;
+            }
+            self.next_segment();
+            return Some(Ok(Packet::Gap));
+        }
+        match self.parse_packet() {
+            Err(_) if self.lossy => {
+                // Garbage, most likely from a segment that was cut short. Look for a fresh start.
+                self.resync(1);
+                Some(Ok(Packet::Gap))
+            }
+            res => Some(res),
         }
     }
 }
 
 #[cfg(test)]
 mod tests {
-    use super::{packets::*, PacketParser};
+    use super::{packets::*, PacketParser, PSB};
     use crate::{
         collect::{test_helpers::trace_closure, TraceCollectorBuilder},
         test_helpers::work_loop,
@@ -240,6 +590,56 @@ mod tests {
         assert!(matches!(ts, TestState::SawPacketGenDisable));
     }
 
+    /// Check that the parser reports gaps, and resyncs after them.
+    #[test]
+    fn parse_gaps() {
+        let psb_plus = [
+            0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+            0x02, 0x82, // PSB
+            0x02, 0x23, // PSBEND
+        ];
+        let mut bytes = Vec::new();
+        bytes.extend(psb_plus);
+        bytes.extend([0x00, 0x02, 0xf3]); // PAD, OVF
+        let gap = bytes.len();
+        bytes.extend([0x02, 0x03, 0x02]); // A truncated CBR, then garbage.
+        bytes.extend(psb_plus);
+
+        let kinds = |parser: PacketParser| {
+            parser
+                .map(|p| p.unwrap().kind())
+                .collect::<Vec<PacketKind>>()
+        };
+        let gaps = [gap];
+        assert_eq!(
+            kinds(PacketParser::new_lossy(&bytes, &gaps, false)),
+            [
+                PacketKind::PSB,
+                PacketKind::PSBEND,
+                PacketKind::PAD,
+                PacketKind::OVF,
+                PacketKind::Gap,
+                PacketKind::PSB,
+                PacketKind::PSBEND
+            ]
+        );
+
+        // Without knowing where the gap is, a lossy parser resyncs when it hits the garbage.
+        assert_eq!(
+            kinds(PacketParser::new_lossy(&bytes, &[], true)),
+            [
+                PacketKind::PSB,
+                PacketKind::PSBEND,
+                PacketKind::PAD,
+                PacketKind::OVF,
+                PacketKind::Gap,
+                PacketKind::PSB,
+                PacketKind::PSBEND
+            ]
+        );
+        assert!(PacketParser::new(&bytes).any(|p| p.is_err()));
+    }
+
     /// Test target IP decompression when the `IPBytes = 0b000`.
     #[test]
     fn ipbytes_decompress_000() {
@@ -292,4 +692,148 @@ mod tests {
             Some(0xffff887766554433)
         );
     }
+
+    /// Check that TNT packets are merged, across PAD and CYC packets, up to 64 decisions at a time.
+    #[test]
+    fn take_tnts() {
+        let mut bytes = Vec::new();
+        bytes.extend(PSB);
+        bytes.extend([0x02, 0x23]); // PSBEND
+        bytes.extend([0b0000_1010, 0x00, 0x00, 0x03, 0b0000_0110]); // TNT(01), PAD, PAD, CYC, TNT(1)
+        bytes.push(0x0d); // TIP, out of context.
+        let long_tnt = |bits: u64| {
+            let mut p = vec![0x02, 0xa3];
+            p.extend(&(1 << 47 | bits).to_le_bytes()[..6]);
+            p
+        };
+        bytes.extend(long_tnt(0x7fff_0000_0001));
+        bytes.extend(long_tnt(0x2));
+
+        let mut parser = PacketParser::new(&bytes);
+        // Nothing to merge in the PSB+.
+        assert_eq!(parser.take_tnts(), (0, 0));
+        assert_eq!(parser.next().unwrap().unwrap().kind(), PacketKind::PSB);
+        assert_eq!(parser.next().unwrap().unwrap().kind(), PacketKind::PSBEND);
+        assert_eq!(parser.take_tnts(), (0b011, 3));
+        assert_eq!(parser.take_tnts(), (0, 0));
+        assert_eq!(parser.next().unwrap().unwrap().kind(), PacketKind::TIP);
+        // Two long TNTs don't fit in 64 bits.
+        assert_eq!(parser.take_tnts(), (0x7fff_0000_0001, 47));
+        assert_eq!(parser.take_tnts(), (0x2, 47));
+        assert!(parser.next().is_none());
+    }
+
+    /// Test target IP decompression when the `IPBytes = 0b100`.
+    #[test]
+    fn ipbytes_decompress_100() {
+        let ipb = IPBytes::new(0b100);
+        assert_eq!(
+            TargetIP::from_bits(48, 0x0000887766554433).decompress(ipb, Some(0xaaaabbbbccccdddd)),
+            Some(0xaaaa887766554433)
+        );
+    }
+
+    /// A tiny (xorshift) pseudo-random number generator, so that fuzzing is repeatable.
+    struct Rng(u64);
+
+    impl Rng {
+        fn next(&mut self) -> u64 {
+            self.0 ^= self.0 << 13;
+            self.0 ^= self.0 >> 7;
+            self.0 ^= self.0 << 17;
+            self.0
+        }
+
+        fn byte(&mut self) -> u8 {
+            self.next() as u8
+        }
+    }
+
+    /// Make a PSB+ sequence followed by a stream of mostly well-formed packets, with the odd random
+    /// byte thrown in.
+    fn fuzz_bytes(rng: &mut Rng, len: usize) -> Vec<u8> {
+        let mut bytes = Vec::new();
+        bytes.extend(PSB);
+        bytes.push(0x19); // TSC
+        bytes.extend((0..7).map(|_| rng.byte()));
+        bytes.extend([0x02, 0x73]); // TMA
+        bytes.extend((0..5).map(|_| rng.byte()));
+        bytes.extend([0x02, 0x03, rng.byte(), rng.byte(), 0x02, 0x23]); // CBR, PSBEND
+        while bytes.len() < len {
+            match rng.next() % 16 {
+                0 => {
+                    bytes.extend(PSB);
+                    bytes.extend([0x99, rng.byte(), 0x02, 0x23]); // MODE, PSBEND
+                }
+                1 => bytes.push(0x00),                        // PAD
+                2 => bytes.push((2 + rng.byte() % 126) << 1), // Short TNT
+                3 => {
+                    bytes.extend([0x02, 0xa3]); // Long TNT
+                    bytes.extend((0..6).map(|_| rng.byte()));
+                }
+                4 | 5 | 6 | 7 => {
+                    // TIP, TIP.PGE, TIP.PGD or FUP.
+                    let ip_bytes =
+                        [0b000, 0b001, 0b010, 0b011, 0b100, 0b110][rng.next() as usize % 6];
+                    let opcode = [0x0d, 0x11, 0x01, 0x1d][rng.next() as usize % 4];
+                    bytes.push(ip_bytes << 5 | opcode);
+                    let len = [0, 2, 4, 6, 6, 0, 8][usize::from(ip_bytes)];
+                    bytes.extend((0..len).map(|_| rng.byte()));
+                }
+                8 => bytes.extend([0x99, rng.byte()]), // MODE
+                9 => {
+                    // CYC, sometimes with extended bytes.
+                    let b0 = rng.byte() | 0x3;
+                    bytes.push(b0);
+                    if b0 & 0x4 != 0 {
+                        while rng.next() % 2 == 0 {
+                            bytes.push(rng.byte() | 0x1);
+                        }
+                        bytes.push(rng.byte() & !0x1);
+                    }
+                }
+                10 => bytes.extend([0x02, 0xf3]),       // OVF
+                11 => bytes.extend([0x59, rng.byte()]), // MTC
+                12 => {
+                    bytes.push(0x19); // TSC
+                    bytes.extend((0..7).map(|_| rng.byte()));
+                }
+                13 => {
+                    bytes.extend([0x02, 0x73]); // TMA
+                    bytes.extend((0..5).map(|_| rng.byte()));
+                }
+                14 => bytes.extend([0x02, 0x03, rng.byte(), rng.byte()]), // CBR
+                _ => bytes.push(rng.byte()),
+            }
+        }
+        bytes
+    }
+
+    /// Check that the byte-level parser agrees with the deku definitions of the packets on random
+    /// packet streams, up to and including the first error.
+    #[test]
+    fn versus_deku() {
+        let mut rng = Rng(0x2545f4914f6cdd1d);
+        for _ in 0..2000 {
+            let bytes = fuzz_bytes(&mut rng, 256);
+            let mut table = PacketParser::new(&bytes);
+            let mut deku = PacketParser::new(&bytes);
+            while !table.bytes.is_empty() {
+                match (table.parse_packet(), deku.parse_packet_deku()) {
+                    (Ok(t), Ok(d)) => {
+                        assert_eq!(format!("{:?}", t), format!("{:?}", d));
+                        if let Packet::PAD(_) = d {
+                            // The byte-level parser parses a run of PADs as one.
+                            while deku.bytes.first() == Some(&0) {
+                                deku.parse_packet_deku().unwrap();
+                            }
+                        }
+                    }
+                    (Err(_), Err(_)) => break,
+                    (t, d) => panic!("{:?} != {:?} in {:02x?}", t, d, bytes),
+                }
+                assert_eq!(table.bytes.len(), deku.bytes.len());
+            }
+        }
+    }
 }
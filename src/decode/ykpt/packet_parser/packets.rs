@@ -1,4 +1,7 @@
 //! Intel PT packets and their constituents.
+//!
+//! The packets are parsed byte by byte (see `parse_bytes()` in the parent module). Their deku
+//! definitions here are kept as a readable reference implementation for testing that parser.
 
 use deku::prelude::*;
 use std::convert::TryFrom;
@@ -13,7 +16,6 @@ pub(in crate::decode::ykpt) struct IPBytes {
 }
 
 impl IPBytes {
-    #[cfg(test)]
     pub(in crate::decode::ykpt) fn new(val: u8) -> Self {
         debug_assert!(val >> 3 == 0);
         Self { val }
@@ -103,7 +105,15 @@ impl TargetIP {
                     unreachable!();
                 }
             }
-            0b100 => todo!(),
+            0b100 => {
+                // The result is bytes 63..=48 from `prev_tip` and bytes 47..=0 from `ip`.
+                if let Self::Ip48(v) = self {
+                    debug_assert!(v >> 48 == 0);
+                    prev_tip.unwrap() & 0xffff000000000000 | usize::try_from(*v).unwrap()
+                } else {
+                    unreachable!();
+                }
+            }
             0b101 => unreachable!(), // reserved by Intel.
             0b110 => {
                 // Uncompressed IP.
@@ -114,7 +124,7 @@ impl TargetIP {
                 }
             }
             0b111 => unreachable!(), // reserved by Intel.
-            _ => todo!("IPBytes: {:03b}", ip_bytes.val),
+            _ => unreachable!(),     // `IPBytes` is 3 bits.
         };
         Some(usize::try_from(res).unwrap())
     }
@@ -134,6 +144,33 @@ pub(in crate::decode::ykpt) struct CBRPacket {
     unused: u16,
 }
 
+/// Timestamp Counter (TSC) packet.
+#[deku_derive(DekuRead)]
+#[derive(Debug)]
+#[deku(magic = b"\x19")]
+pub(in crate::decode::ykpt) struct TSCPacket {
+    #[deku(bits = "56", temp)]
+    unused: u64,
+}
+
+/// Mini Time Counter (MTC) packet.
+#[deku_derive(DekuRead)]
+#[derive(Debug)]
+#[deku(magic = b"\x59")]
+pub(in crate::decode::ykpt) struct MTCPacket {
+    #[deku(temp)]
+    unused: u8,
+}
+
+/// Time Counter Adjust (TMA) packet.
+#[deku_derive(DekuRead)]
+#[derive(Debug)]
+#[deku(magic = b"\x02\x73")]
+pub(in crate::decode::ykpt) struct TMAPacket {
+    #[deku(bits = "40", temp)]
+    unused: u64,
+}
+
 /// End of PSB+ sequence (PSBEND) packet.
 #[derive(Debug, DekuRead)]
 #[deku(magic = b"\x02\x23")]
@@ -168,10 +205,18 @@ pub(in crate::decode::ykpt) struct TIPPGEPacket {
 }
 
 impl TIPPGEPacket {
+    pub(super) fn new(ip_bytes: IPBytes, target_ip: TargetIP) -> Self {
+        Self {
+            ip_bytes,
+            target_ip,
+        }
+    }
+
     fn target_ip(&self, prev_tip: Option<usize>) -> Option<usize> {
         self.target_ip.decompress(self.ip_bytes, prev_tip)
     }
 
+    #[cfg(test)]
     pub(super) fn needs_prev_tip(&self) -> bool {
         self.ip_bytes.needs_prev_tip()
     }
@@ -185,27 +230,57 @@ pub(in crate::decode::ykpt) struct ShortTNTPacket {
     ///
     /// The deku assertion here is subtle: we know that the `branches` field must contain a stop
     /// bit terminating the field, but if the stop bit appears in place of the first branch, then
-    /// this is not a short TNT packet at all; it's a long TNT packet.
-    ///
-    /// FIXME: marked `temp` until we actually use the field.
-    #[deku(bits = "7", assert = "*branches != 0x1", temp)]
+    /// this is not a short TNT packet at all; it's a long TNT packet. And if there is no stop bit,
+    /// it's a PAD packet.
+    #[deku(bits = "7", assert = "*branches > 0x1")]
     branches: u8,
     #[deku(bits = "1", assert = "*magic == false", temp)]
     magic: bool,
 }
 
+impl ShortTNTPacket {
+    pub(super) fn new(branches: u8) -> Self {
+        Self { branches }
+    }
+
+    /// Returns the branch decisions, and how many there are. See [tnts_from_raw].
+    pub(in crate::decode::ykpt) fn tnts(&self) -> (u64, u32) {
+        tnts_from_raw(u64::from(self.branches))
+    }
+}
+
 /// Long Taken/Not-Taken (TNT) packet.
 #[deku_derive(DekuRead)]
 #[derive(Debug)]
 #[deku(magic = b"\x02\xa3")]
 pub(in crate::decode::ykpt) struct LongTNTPacket {
     /// Bits encoding the branch decisions **and** a stop bit.
-    ///
-    /// FIXME: marked `temp` until we actually use the field.
-    #[deku(bits = "48", temp)]
+    #[deku(bits = "48")]
     branches: u64,
 }
 
+impl LongTNTPacket {
+    pub(super) fn new(branches: u64) -> Self {
+        Self { branches }
+    }
+
+    /// Returns the branch decisions, and how many there are. See [tnts_from_raw].
+    pub(in crate::decode::ykpt) fn tnts(&self) -> (u64, u32) {
+        tnts_from_raw(self.branches)
+    }
+}
+
+/// Split the raw payload of a TNT packet into the bits encoding branch decisions (1 for taken)
+/// and how many of them there are. The decisions occupy the bits below the highest set bit (the
+/// stop bit), the oldest in the most significant position.
+pub(super) fn tnts_from_raw(raw: u64) -> (u64, u32) {
+    if raw == 0 {
+        return (0, 0);
+    }
+    let n = 63 - raw.leading_zeros();
+    (raw & !(1 << n), n)
+}
+
 /// Target IP (TIP) packet.
 #[deku_derive(DekuRead)]
 #[derive(Debug)]
@@ -218,10 +293,18 @@ pub(in crate::decode::ykpt) struct TIPPacket {
 }
 
 impl TIPPacket {
+    pub(super) fn new(ip_bytes: IPBytes, target_ip: TargetIP) -> Self {
+        Self {
+            ip_bytes,
+            target_ip,
+        }
+    }
+
     fn target_ip(&self, prev_tip: Option<usize>) -> Option<usize> {
         self.target_ip.decompress(self.ip_bytes, prev_tip)
     }
 
+    #[cfg(test)]
     pub(super) fn needs_prev_tip(&self) -> bool {
         self.ip_bytes.needs_prev_tip()
     }
@@ -239,10 +322,18 @@ pub(in crate::decode::ykpt) struct TIPPGDPacket {
 }
 
 impl TIPPGDPacket {
+    pub(super) fn new(ip_bytes: IPBytes, target_ip: TargetIP) -> Self {
+        Self {
+            ip_bytes,
+            target_ip,
+        }
+    }
+
     fn target_ip(&self, prev_tip: Option<usize>) -> Option<usize> {
         self.target_ip.decompress(self.ip_bytes, prev_tip)
     }
 
+    #[cfg(test)]
     pub(super) fn needs_prev_tip(&self) -> bool {
         self.ip_bytes.needs_prev_tip()
     }
@@ -260,15 +351,30 @@ pub(in crate::decode::ykpt) struct FUPPacket {
 }
 
 impl FUPPacket {
+    pub(super) fn new(ip_bytes: IPBytes, target_ip: TargetIP) -> Self {
+        Self {
+            ip_bytes,
+            target_ip,
+        }
+    }
+
     fn target_ip(&self, prev_tip: Option<usize>) -> Option<usize> {
         self.target_ip.decompress(self.ip_bytes, prev_tip)
     }
 
+    #[cfg(test)]
     pub(super) fn needs_prev_tip(&self) -> bool {
         self.ip_bytes.needs_prev_tip()
     }
 }
 
+/// Overflow (OVF) packet.
+///
+/// The hardware lost packets internally. Tracing resumes with a FUP (or TIP.PGE) packet.
+#[derive(Debug, DekuRead)]
+#[deku(magic = b"\x02\xf3")]
+pub(in crate::decode::ykpt) struct OVFPacket {}
+
 /// Cycle count (CYC) packet.
 #[deku_derive(DekuRead)]
 #[derive(Debug)]
@@ -290,7 +396,7 @@ pub(in crate::decode::ykpt) struct CYCPacket {
 }
 
 #[derive(Clone, Copy, Debug, PartialEq)]
-pub(super) enum PacketKind {
+pub(in crate::decode::ykpt) enum PacketKind {
     PSB,
     CBR,
     PSBEND,
@@ -303,6 +409,11 @@ pub(super) enum PacketKind {
     TIP,
     FUP,
     CYC,
+    OVF,
+    TSC,
+    MTC,
+    TMA,
+    Gap,
 }
 
 /// The top-level representation of an Intel Processor Trace packet.
@@ -323,6 +434,13 @@ pub(in crate::decode::ykpt) enum Packet {
     TIP(TIPPacket, Option<usize>),
     FUP(FUPPacket, Option<usize>),
     CYC(CYCPacket),
+    OVF(OVFPacket),
+    TSC(TSCPacket),
+    MTC(MTCPacket),
+    TMA(TMAPacket),
+    /// Not a real packet: marks a point where trace data was lost (see `Trace::gaps`). Parsing
+    /// resumes from the next PSB.
+    Gap,
 }
 
 impl Packet {
@@ -337,7 +455,7 @@ impl Packet {
         }
     }
 
-    pub(super) fn kind(&self) -> PacketKind {
+    pub(in crate::decode::ykpt) fn kind(&self) -> PacketKind {
         match self {
             Self::PSB(_) => PacketKind::PSB,
             Self::CBR(_) => PacketKind::CBR,
@@ -351,6 +469,25 @@ impl Packet {
             Self::TIP(..) => PacketKind::TIP,
             Self::FUP(..) => PacketKind::FUP,
             Self::CYC(_) => PacketKind::CYC,
+            Self::OVF(_) => PacketKind::OVF,
+            Self::TSC(_) => PacketKind::TSC,
+            Self::MTC(_) => PacketKind::MTC,
+            Self::TMA(_) => PacketKind::TMA,
+            Self::Gap => PacketKind::Gap,
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::tnts_from_raw;
+
+    #[test]
+    fn tnts() {
+        assert_eq!(tnts_from_raw(0), (0, 0));
+        assert_eq!(tnts_from_raw(0b1), (0, 0));
+        assert_eq!(tnts_from_raw(0b10), (0b0, 1));
+        assert_eq!(tnts_from_raw(0b101_1001), (0b01_1001, 6));
+        assert_eq!(tnts_from_raw(1 << 47 | 1), (1, 47));
+    }
+}
@@ -3,11 +3,12 @@
 #![feature(once_cell)]
 
 mod block;
-pub use block::Block;
+pub use block::{Block, BlockTrace, BlockTraceIter};
 mod c_errors;
 pub mod collect;
 pub mod decode;
 pub mod errors;
+pub mod trace_file;
 
 pub use errors::HWTracerError;
 use std::fmt::Debug;
@@ -27,6 +28,52 @@ pub trait Trace: Debug + Send {
     /// Get the size of the trace in bytes.
     fn len(&self) -> usize;
 
+    /// Get the (ascending) offsets into [Trace::bytes] at which trace data was lost. Decoding
+    /// resumes at the first `PSB` at or after each of them.
+    fn gaps(&self) -> &[usize] {
+        &[]
+    }
+
+    /// Was the trace collected in lossy mode? If so, it may have [Trace::gaps], and decoders
+    /// report data loss as gaps rather than errors.
+    fn is_lossy(&self) -> bool {
+        false
+    }
+
+    /// Get statistics about how the trace was collected, if the collector keeps any.
+    fn collection_stats(&self) -> Option<&collect::CollectionStats> {
+        None
+    }
+
+    /// Get the CPU and code that the trace was collected with, if the trace records them (see
+    /// [trace_file]). Decoders which can use them do so in place of the current CPU and process.
+    fn image(&self) -> Option<&trace_file::TraceImage> {
+        None
+    }
+
+    /// Get the executable file mappings made while the trace was collected, in the order they
+    /// were made, if the collector recorded them (see [collect::PerfCollectorConfig::record_mmaps]).
+    /// Decoders use the code mapped for what was traced from about where each mapping was made
+    /// (see [collect::Mmap::trace_offset]) onwards, in place of whatever is at its addresses now.
+    fn mmaps(&self) -> &[collect::Mmap] {
+        &[]
+    }
+
+    /// Get the bytes of the trace as a series of frames, for traces (such as compressed ones)
+    /// whose bytes have to be made before they can be read. The frames join up to [Trace::bytes],
+    /// but needn't start at `PSB`s. Decoders decode such traces frame by frame, so as never to make
+    /// all of the bytes at once, except when decoding on many threads.
+    fn frames(&self) -> Option<Box<dyn Iterator<Item = Result<Vec<u8>, HWTracerError>> + '_>> {
+        None
+    }
+
+    /// Give up the trace, keeping its storage for its collector to collect another trace into (see
+    /// [collect::TraceCollector::recycle_trace]). Traces whose storage can't be reused return
+    /// `None`.
+    fn into_storage(self: Box<Self>) -> Option<collect::TraceStorage> {
+        None
+    }
+
     /// Dump the trace to the specified filename.
     ///
     /// The exact format varies depending on what kind of trace it is.
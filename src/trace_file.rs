@@ -0,0 +1,758 @@
+//! A file format for traces, so that they can be decoded by other processes, possibly on other
+//! machines.
+//!
+//! As well as the raw trace, a trace file records what a decoder needs to know about the process
+//! and CPU that the trace was collected from: the CPU's identity (from which libipt works out which
+//! errata to work around), and where each code segment of each loaded object was mapped. Segments
+//! are recorded by the path, file offset and build-id of their object, except for those with no
+//! file behind them (i.e. the VDSO), whose code is stored in the trace file itself. A decoder
+//! doesn't read code from a file whose build-id no longer matches the one recorded.
+//!
+//! The executable file mappings that the collector recorded being made while the trace was
+//! collected (see [crate::collect::Mmap]) are kept too.
+//!
+//! A file is a [Header], followed by an [ObjectRecord] for each segment, the offsets of the
+//! trace's gaps, an [MmapRecord] for each mapping, the paths, build-ids and code that the records
+//! refer to, and finally (page aligned) the raw trace. Trace files are opened with `mmap`, so the (possibly large) raw trace is
+//! only read in as it is decoded.
+//!
+//! Only the libipt decoder uses the image recorded in a trace file. The YkPT decoder always reads
+//! code from the live address space, so it can only decode traces collected by the same process.
+
+use crate::{collect::Mmap, errors::HWTracerError, Trace};
+use core::arch::x86_64::__cpuid;
+use libc::{c_void, MAP_FAILED, MAP_PRIVATE, PF_X, PROT_READ, PT_LOAD, PT_NOTE};
+use std::{
+    convert::{TryFrom, TryInto},
+    env,
+    ffi::OsStr,
+    fs::{self, File},
+    io::Write,
+    mem::size_of,
+    os::unix::{ffi::OsStrExt, fs::FileExt, io::AsRawFd},
+    path::{Path, PathBuf},
+    ptr, slice,
+};
+
+/// Identifies (the version of) the file format.
+const MAGIC: [u8; 8] = *b"HWTTRAC2";
+
+/// The raw trace starts at a multiple of this many bytes into a file, whatever the page size of the
+/// machine that wrote it.
+const TRACE_ALIGN: usize = 4096;
+
+/// Set in [Header::flags] if the trace was collected in lossy mode.
+const FLAG_LOSSY: u64 = 1;
+
+/// The type of the ELF note holding the build-id.
+const NT_GNU_BUILD_ID: usize = 3;
+
+/// The name the dynamic linker gives the VDSO.
+const VDSO_NAME: &str = "linux-vdso.so.1";
+
+/// The identity of a CPU whose vendor is unknown.
+const UNKNOWN_CPU: CpuId = CpuId {
+    vendor: 0,
+    family: 0,
+    model: 0,
+    stepping: 0,
+};
+
+/// The identity of a CPU, as libipt's `struct pt_cpu` has it.
+///
+// Must stay in sync with the C code.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+#[repr(C)]
+pub struct CpuId {
+    /// 1 for Intel, or 0 if the vendor is unknown (and the other fields are meaningless).
+    pub vendor: u32,
+    pub family: u16,
+    pub model: u8,
+    pub stepping: u8,
+}
+
+impl CpuId {
+    /// Identify the CPU we are running on, in the same way as libipt's `pt_cpu_read()`.
+    pub fn current() -> Self {
+        let vendor = unsafe { __cpuid(0) };
+        // "GenuineIntel", split across the registers.
+        if (vendor.ebx, vendor.edx, vendor.ecx) != (0x756e_6547, 0x4965_6e69, 0x6c65_746e) {
+            return UNKNOWN_CPU;
+        }
+        let sig = unsafe { __cpuid(1) }.eax;
+        let mut family = ((sig >> 8) & 0xf) as u16;
+        if family == 0xf {
+            family += ((sig >> 20) & 0xff) as u16;
+        }
+        let mut model = ((sig >> 4) & 0xf) as u8;
+        if family == 0x6 || family == 0xf {
+            model += (((sig >> 16) & 0xf) << 4) as u8;
+        }
+        Self {
+            vendor: 1,
+            family,
+            model,
+            stepping: (sig & 0xf) as u8,
+        }
+    }
+}
+
+/// A code segment of an object loaded into the traced process.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct TraceObject {
+    /// The virtual address at which the segment was mapped.
+    pub vaddr: u64,
+    /// The size of the segment in bytes.
+    pub size: u64,
+    /// The offset of the segment into its file.
+    pub offset: u64,
+    /// The (canonical) path of the segment's object, or `None` if it has no file.
+    pub path: Option<PathBuf>,
+    /// The build-id of the segment's object, if it has one.
+    pub build_id: Option<Vec<u8>>,
+    /// The code of the segment, if it has no file to be read from.
+    pub code: Option<Vec<u8>>,
+}
+
+/// The CPU and code that a trace was collected with.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct TraceImage {
+    pub cpu: CpuId,
+    pub objects: Vec<TraceObject>,
+}
+
+impl TraceImage {
+    /// Capture the CPU and loaded code of the current process.
+    pub fn current() -> Result<Self, HWTracerError> {
+        let exe = current_exe()?;
+        let mut objects = Vec::new();
+        for obj in phdrs::objects() {
+            let name = OsStr::from_bytes(obj.name().to_bytes());
+            let vdso = name == VDSO_NAME;
+            let path = if name.is_empty() {
+                // On Linux, an empty name means that it is the executable itself.
+                Some(exe.clone())
+            } else if vdso {
+                None
+            } else {
+                Some(fs::canonicalize(name).unwrap_or_else(|_| PathBuf::from(name)))
+            };
+            let build_id = build_id(&obj);
+            for hdr in obj.iter_phdrs() {
+                if hdr.type_() != PT_LOAD || hdr.flags() & PF_X == 0 {
+                    continue; // Only look at loadable and executable segments.
+                }
+                let vaddr = obj.addr() + hdr.vaddr();
+                // SAFETY: The VDSO is always mapped.
+                let code = vdso.then(|| unsafe {
+                    slice::from_raw_parts(vaddr as *const u8, hdr.filesz() as usize).to_vec()
+                });
+                objects.push(TraceObject {
+                    vaddr,
+                    size: hdr.filesz(),
+                    offset: if vdso { 0 } else { hdr.offset() },
+                    path: path.clone(),
+                    build_id: build_id.clone(),
+                    code,
+                });
+            }
+        }
+        Ok(Self {
+            cpu: CpuId::current(),
+            objects,
+        })
+    }
+}
+
+#[repr(C)]
+struct Header {
+    magic: [u8; 8],
+    cpu: CpuId,
+    /// `FLAG_*` bits.
+    flags: u64,
+    /// The number of [ObjectRecord]s following the header.
+    nobjects: u64,
+    /// The number of gap offsets following the records.
+    ngaps: u64,
+    /// The number of [MmapRecord]s following the gaps.
+    nmmaps: u64,
+    /// Where in the file the raw trace starts.
+    trace_offset: u64,
+    trace_len: u64,
+}
+
+/// A [TraceObject]. Its variable length parts are each stored as an offset into the file and a
+/// length. A zero length means `None`.
+#[repr(C)]
+struct ObjectRecord {
+    vaddr: u64,
+    size: u64,
+    offset: u64,
+    path: [u64; 2],
+    build_id: [u64; 2],
+    code: [u64; 2],
+}
+
+/// An [Mmap], its path stored as for an [ObjectRecord].
+#[repr(C)]
+struct MmapRecord {
+    vaddr: u64,
+    len: u64,
+    offset: u64,
+    path: [u64; 2],
+    trace_offset: u64,
+}
+
+/// Save `trace` to a new file at `path`, along with the CPU and code it was collected with.
+///
+/// Unless `trace` records those already (e.g. because it was itself loaded from a trace file),
+/// they are taken from the current process. So this must be called in the process that collected
+/// the trace, before any of the code it ran is unloaded.
+pub fn save(trace: &dyn Trace, path: &Path) -> Result<(), HWTracerError> {
+    let current;
+    let image = match trace.image() {
+        Some(image) => image,
+        None => {
+            current = TraceImage::current()?;
+            &current
+        }
+    };
+
+    // The variable length parts of the records are laid out after the mappings.
+    let mut blob_off = size_of::<Header>()
+        + image.objects.len() * size_of::<ObjectRecord>()
+        + trace.gaps().len() * size_of::<u64>()
+        + trace.mmaps().len() * size_of::<MmapRecord>();
+    let mut blob = Vec::new();
+    let mut records = Vec::new();
+    let mut put = |bytes: Option<&[u8]>| match bytes {
+        Some(b) if !b.is_empty() => {
+            let at = [(blob_off + blob.len()) as u64, b.len() as u64];
+            blob.extend_from_slice(b);
+            at
+        }
+        _ => [0, 0],
+    };
+    for obj in &image.objects {
+        records.push(ObjectRecord {
+            vaddr: obj.vaddr,
+            size: obj.size,
+            offset: obj.offset,
+            path: put(obj.path.as_ref().map(|p| p.as_os_str().as_bytes())),
+            build_id: put(obj.build_id.as_deref()),
+            code: put(obj.code.as_deref()),
+        });
+    }
+    let mut mmaps = Vec::new();
+    for m in trace.mmaps() {
+        mmaps.push(MmapRecord {
+            vaddr: m.vaddr,
+            len: m.len,
+            offset: m.offset,
+            path: put(Some(m.path.as_os_str().as_bytes())),
+            trace_offset: m.trace_offset as u64,
+        });
+    }
+    blob_off += blob.len();
+    let trace_offset = (blob_off + TRACE_ALIGN - 1) / TRACE_ALIGN * TRACE_ALIGN;
+
+    let hdr = Header {
+        magic: MAGIC,
+        cpu: image.cpu,
+        flags: if trace.is_lossy() { FLAG_LOSSY } else { 0 },
+        nobjects: records.len() as u64,
+        ngaps: trace.gaps().len() as u64,
+        nmmaps: mmaps.len() as u64,
+        trace_offset: trace_offset as u64,
+        trace_len: trace.len() as u64,
+    };
+    let mut bytes = Vec::with_capacity(trace_offset);
+    bytes.extend_from_slice(&hdr.magic);
+    bytes.extend_from_slice(&hdr.cpu.vendor.to_ne_bytes());
+    bytes.extend_from_slice(&hdr.cpu.family.to_ne_bytes());
+    bytes.extend_from_slice(&[hdr.cpu.model, hdr.cpu.stepping]);
+    let mut words = vec![
+        hdr.flags,
+        hdr.nobjects,
+        hdr.ngaps,
+        hdr.nmmaps,
+        hdr.trace_offset,
+        hdr.trace_len,
+    ];
+    for r in &records {
+        words.extend_from_slice(&[r.vaddr, r.size, r.offset]);
+        words.extend_from_slice(&r.path);
+        words.extend_from_slice(&r.build_id);
+        words.extend_from_slice(&r.code);
+    }
+    words.extend(trace.gaps().iter().map(|&g| g as u64));
+    for m in &mmaps {
+        words.extend_from_slice(&[m.vaddr, m.len, m.offset]);
+        words.extend_from_slice(&m.path);
+    }
+    for w in words {
+        bytes.extend_from_slice(&w.to_ne_bytes());
+    }
+    bytes.extend_from_slice(&blob);
+    bytes.resize(trace_offset, 0);
+
+    let mut file = File::create(path)?;
+    file.write_all(&bytes)?;
+    file.write_all(&trace.bytes()[..trace.len()])?;
+    Ok(())
+}
+
+/// A trace loaded from a trace file.
+#[derive(Debug)]
+pub struct TraceFile {
+    /// The whole file, mapped into memory.
+    addr: *mut c_void,
+    map_len: usize,
+    trace_offset: usize,
+    trace_len: usize,
+    gaps: Vec<usize>,
+    lossy: bool,
+    image: TraceImage,
+    mmaps: Vec<Mmap>,
+}
+
+/// The mapping is read-only and owned by the `TraceFile`.
+unsafe impl Send for TraceFile {}
+
+impl TraceFile {
+    /// Open the trace file at `path`.
+    pub fn open(path: &Path) -> Result<Self, HWTracerError> {
+        let file = File::open(path)?;
+        let map_len = file.metadata()?.len() as usize;
+        let bad =
+            || HWTracerError::TraceParseError(format!("{} isn't a trace file", path.display()));
+        if map_len < size_of::<Header>() {
+            return Err(bad());
+        }
+        let addr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                map_len,
+                PROT_READ,
+                MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if addr == MAP_FAILED {
+            return Err(std::io::Error::last_os_error().into());
+        }
+        let mut tf = Self {
+            addr,
+            map_len,
+            trace_offset: 0,
+            trace_len: 0,
+            gaps: Vec::new(),
+            lossy: false,
+            image: TraceImage {
+                cpu: UNKNOWN_CPU,
+                objects: Vec::new(),
+            },
+            mmaps: Vec::new(),
+        };
+        tf.parse().ok_or_else(bad)?;
+        Ok(tf)
+    }
+
+    /// The part of the mapped file `len` bytes long from `off`, or `None` if that isn't all in the
+    /// file.
+    fn get(&self, off: u64, len: u64) -> Option<&[u8]> {
+        let (off, len) = (usize::try_from(off).ok()?, usize::try_from(len).ok()?);
+        if off.checked_add(len)? > self.map_len {
+            return None;
+        }
+        // SAFETY: We checked that the range is inside the mapping.
+        Some(unsafe { slice::from_raw_parts((self.addr as *const u8).add(off), len) })
+    }
+
+    /// The `n` words of the mapped file from `off`, which must be a multiple of 8.
+    fn words(&self, off: usize, n: u64) -> Option<&[u64]> {
+        let b = self.get(off as u64, n.checked_mul(size_of::<u64>() as u64)?)?;
+        // SAFETY: The mapping is page aligned, so the words are aligned.
+        Some(unsafe { slice::from_raw_parts(b.as_ptr() as *const u64, b.len() / size_of::<u64>()) })
+    }
+
+    /// Read the headers, records, gaps and mappings of the file, or return `None` if they aren't
+    /// valid.
+    fn parse(&mut self) -> Option<()> {
+        // SAFETY: The mapping is page aligned and at least as big as the header.
+        let hdr = unsafe { &*(self.addr as *const Header) };
+        if hdr.magic != MAGIC {
+            return None;
+        }
+        self.get(hdr.trace_offset, hdr.trace_len)?;
+
+        let rec_words = (size_of::<ObjectRecord>() / size_of::<u64>()) as u64;
+        let recs = self.words(size_of::<Header>(), hdr.nobjects.checked_mul(rec_words)?)?;
+        let mut objects = Vec::new();
+        for r in recs.chunks_exact(rec_words as usize) {
+            let part = |i: usize| match r[i + 1] {
+                0 => Some(None),
+                len => self.get(r[i], len).map(|b| Some(b.to_vec())),
+            };
+            objects.push(TraceObject {
+                vaddr: r[0],
+                size: r[1],
+                offset: r[2],
+                path: part(3)?.map(|p| PathBuf::from(OsStr::from_bytes(&p))),
+                build_id: part(5)?,
+                code: part(7)?,
+            });
+        }
+        let gaps_off = size_of::<Header>() + recs.len() * size_of::<u64>();
+        let gaps = self
+            .words(gaps_off, hdr.ngaps)?
+            .iter()
+            .map(|&g| g as usize)
+            .collect::<Vec<_>>();
+
+        let mmap_words = (size_of::<MmapRecord>() / size_of::<u64>()) as u64;
+        let mmap_recs = self.words(
+            gaps_off + gaps.len() * size_of::<u64>(),
+            hdr.nmmaps.checked_mul(mmap_words)?,
+        )?;
+        let mut mmaps = Vec::new();
+        for r in mmap_recs.chunks_exact(mmap_words as usize) {
+            mmaps.push(Mmap {
+                vaddr: r[0],
+                len: r[1],
+                offset: r[2],
+                path: PathBuf::from(OsStr::from_bytes(self.get(r[3], r[4])?)),
+                trace_offset: r[5] as usize,
+            });
+        }
+
+        self.trace_offset = hdr.trace_offset as usize;
+        self.trace_len = hdr.trace_len as usize;
+        self.gaps = gaps;
+        self.lossy = hdr.flags & FLAG_LOSSY != 0;
+        self.image = TraceImage {
+            cpu: hdr.cpu,
+            objects,
+        };
+        self.mmaps = mmaps;
+        Some(())
+    }
+}
+
+impl Drop for TraceFile {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.addr, self.map_len) };
+    }
+}
+
+impl Trace for TraceFile {
+    fn bytes(&self) -> &[u8] {
+        self.get(self.trace_offset as u64, self.trace_len as u64)
+            .unwrap()
+    }
+
+    #[cfg(test)]
+    fn capacity(&self) -> usize {
+        self.trace_len
+    }
+
+    fn len(&self) -> usize {
+        self.trace_len
+    }
+
+    fn gaps(&self) -> &[usize] {
+        &self.gaps
+    }
+
+    fn is_lossy(&self) -> bool {
+        self.lossy
+    }
+
+    fn image(&self) -> Option<&TraceImage> {
+        Some(&self.image)
+    }
+
+    fn mmaps(&self) -> &[Mmap] {
+        &self.mmaps
+    }
+
+    #[cfg(test)]
+    fn to_file(&self, file: &mut File) {
+        file.write_all(self.bytes()).unwrap();
+    }
+}
+
+/// Returns the path of the executable of the current process.
+pub(crate) fn current_exe() -> Result<PathBuf, HWTracerError> {
+    // FIXME: current_exe() isn't reliable. We should find another way to do this.
+    Ok(env::current_exe()?)
+}
+
+/// Returns the build-id of `obj`, if it has one.
+pub(crate) fn build_id(obj: &phdrs::Object) -> Option<Vec<u8>> {
+    let hdrs = obj.iter_phdrs().collect::<Vec<_>>();
+    for note in hdrs.iter().filter(|h| h.type_() == PT_NOTE) {
+        // Notes are usually, but not necessarily, loaded into memory.
+        let loaded = hdrs.iter().any(|h| {
+            h.type_() == PT_LOAD
+                && h.vaddr() <= note.vaddr()
+                && note.vaddr() + note.memsz() <= h.vaddr() + h.filesz()
+        });
+        if !loaded {
+            continue;
+        }
+        // SAFETY: We checked above that the notes are mapped.
+        let notes = unsafe {
+            slice::from_raw_parts(
+                (obj.addr() + note.vaddr()) as *const u8,
+                note.memsz() as usize,
+            )
+        };
+        if let Some(id) = notes_build_id(notes) {
+            return Some(id);
+        }
+    }
+    None
+}
+
+/// Returns the build-id of the ELF file at `path`, or `None` if it has none or can't be read.
+pub(crate) fn file_build_id(path: &Path) -> Option<Vec<u8>> {
+    let file = File::open(path).ok()?;
+    let read = |off: u64, len: usize| {
+        let mut buf = vec![0; len];
+        file.read_exact_at(&mut buf, off).ok()?;
+        Some(buf)
+    };
+    let half = |b: &[u8], i: usize| u16::from_ne_bytes([b[i], b[i + 1]]) as usize;
+    let xword = |b: &[u8], i: usize| u64::from_ne_bytes(b[i..i + 8].try_into().unwrap());
+
+    // The ELF header, which must be that of a 64-bit object.
+    let ehdr = read(0, 64)?;
+    if ehdr[..4] != *b"\x7fELF" || ehdr[4] != 2 {
+        return None;
+    }
+    let (phoff, phentsize, phnum) = (xword(&ehdr, 0x20), half(&ehdr, 0x36), half(&ehdr, 0x38));
+    if phentsize < 56 {
+        return None;
+    }
+    let phdrs = read(phoff, phentsize * phnum)?;
+    for phdr in phdrs.chunks_exact(phentsize) {
+        if u32::from_ne_bytes(phdr[..4].try_into().unwrap()) != PT_NOTE {
+            continue;
+        }
+        // Notes are small: anything else is a corrupt file.
+        let size = usize::try_from(xword(phdr, 32)).ok()?;
+        if size > 1024 * 1024 {
+            return None;
+        }
+        if let Some(id) = notes_build_id(&read(xword(phdr, 8), size)?) {
+            return Some(id);
+        }
+    }
+    None
+}
+
+/// Returns the build-id in the ELF notes `notes`, if there is one.
+fn notes_build_id(mut notes: &[u8]) -> Option<Vec<u8>> {
+    // Each note is a name size, a descriptor size and a type, followed by the name and the
+    // descriptor, each padded to 4 bytes.
+    let word = |b: &[u8], i: usize| {
+        u32::from_ne_bytes([b[i * 4], b[i * 4 + 1], b[i * 4 + 2], b[i * 4 + 3]]) as usize
+    };
+    let pad = |n: usize| (n + 3) & !3;
+    while notes.len() >= 12 {
+        let (namesz, descsz, ty) = (word(notes, 0), word(notes, 1), word(notes, 2));
+        let desc_start = 12 + pad(namesz);
+        let end = desc_start + pad(descsz);
+        if end > notes.len() {
+            break;
+        }
+        if ty == NT_GNU_BUILD_ID && &notes[12..12 + namesz] == b"GNU\0" {
+            return Some(notes[desc_start..desc_start + descsz].to_vec());
+        }
+        notes = &notes[end..];
+    }
+    None
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{build_id, current_exe, file_build_id, save, TraceFile, TraceImage, MAGIC};
+    use crate::{
+        collect::{
+            test_helpers::trace_closure, TraceCollectorBuilder, TraceCollectorConfig,
+            TraceCollectorKind,
+        },
+        errors::HWTracerError,
+        test_helpers::work_loop,
+        Trace,
+    };
+    use std::{
+        env,
+        fs::{self, File},
+        os::unix::io::AsRawFd,
+        ptr,
+    };
+
+    #[test]
+    fn round_trip() {
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(500));
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("trace");
+        save(&*trace, &path).unwrap();
+
+        let tf = TraceFile::open(&path).unwrap();
+        assert_eq!(tf.bytes(), trace.bytes());
+        assert_eq!(tf.gaps(), trace.gaps());
+        assert_eq!(tf.is_lossy(), trace.is_lossy());
+        assert!(tf.mmaps().is_empty());
+        let image = TraceImage::current().unwrap();
+        assert_eq!(tf.image(), Some(&image));
+        // The VDSO's code is kept in the file.
+        assert!(image
+            .objects
+            .iter()
+            .all(|o| o.path.is_some() != o.code.is_some()));
+
+        // Saving a loaded trace keeps its image.
+        let path2 = dir.path().join("trace2");
+        save(&tf, &path2).unwrap();
+        assert_eq!(fs::read(&path).unwrap(), fs::read(&path2).unwrap());
+    }
+
+    /// Check that the mappings recorded while collecting are kept in the file.
+    #[test]
+    fn round_trip_mmaps() {
+        let mut bldr = TraceCollectorBuilder::new().kind(TraceCollectorKind::Perf);
+        match bldr.config() {
+            TraceCollectorConfig::Perf(ref mut ppt_conf) => ppt_conf.record_mmaps = true,
+        }
+        let tc = bldr.build().unwrap();
+        let file = File::open(env::current_exe().unwrap()).unwrap();
+        let mut addr = ptr::null_mut();
+        let trace = trace_closure(&tc, || {
+            addr = unsafe {
+                libc::mmap(
+                    ptr::null_mut(),
+                    4096,
+                    libc::PROT_READ | libc::PROT_EXEC,
+                    libc::MAP_PRIVATE,
+                    file.as_raw_fd(),
+                    0,
+                )
+            };
+            work_loop(500)
+        });
+        assert_ne!(addr, libc::MAP_FAILED);
+        unsafe { libc::munmap(addr, 4096) };
+        assert!(trace.mmaps().iter().any(|m| m.vaddr == addr as u64));
+
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("trace");
+        save(&*trace, &path).unwrap();
+        let tf = TraceFile::open(&path).unwrap();
+        assert_eq!(tf.mmaps(), trace.mmaps());
+        assert_eq!(tf.bytes(), trace.bytes());
+    }
+
+    /// Check that decoding a trace loaded from a file gives the same blocks as decoding it live.
+    #[cfg(decoder_libipt)]
+    #[test]
+    fn decode_saved() {
+        use crate::decode::{TraceDecoderBuilder, TraceDecoderKind};
+
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(3000));
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("trace");
+        save(&*trace, &path).unwrap();
+        let tf = TraceFile::open(&path).unwrap();
+
+        let dec = TraceDecoderBuilder::new()
+            .kind(TraceDecoderKind::LibIPT)
+            .build()
+            .unwrap();
+        let (mut expect, mut got) = (Vec::new(), Vec::new());
+        dec.decode_into(&*trace, &mut expect).unwrap();
+        dec.decode_into(&tf, &mut got).unwrap();
+        assert!(!got.is_empty());
+        assert_eq!(got, expect);
+    }
+
+    /// Check that each chunk of a trace loaded from a file, when decoded in parallel, is decoded
+    /// against the file's code, as the whole trace is.
+    #[cfg(decoder_libipt)]
+    #[test]
+    fn decode_saved_parallel() {
+        use crate::decode::{TraceDecoderBuilder, TraceDecoderKind};
+
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        let trace = trace_closure(&tc, || work_loop(100000));
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("trace");
+        save(&*trace, &path).unwrap();
+        let tf = TraceFile::open(&path).unwrap();
+
+        let dec = TraceDecoderBuilder::new()
+            .kind(TraceDecoderKind::LibIPT)
+            .build()
+            .unwrap();
+        let mut expect = Vec::new();
+        dec.decode_into(&*trace, &mut expect).unwrap();
+        for nthreads in [1, 2, 8] {
+            let mut got = Vec::new();
+            dec.decode_parallel(&tf, nthreads, &mut got).unwrap();
+            assert_eq!(got, expect);
+        }
+    }
+
+    #[test]
+    fn bad_files_refused() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("trace");
+        let tc = TraceCollectorBuilder::new().build().unwrap();
+        save(&*trace_closure(&tc, || work_loop(10)), &path).unwrap();
+        let good = fs::read(&path).unwrap();
+
+        let mut bad_magic = good.clone();
+        bad_magic[..MAGIC.len()].copy_from_slice(b"NOTATRCE");
+        // Truncated in the middle of the header, the records and the trace.
+        for bytes in [
+            &bad_magic,
+            &good[..20],
+            &good[..100],
+            &good[..good.len() - 1],
+        ] {
+            fs::write(&path, bytes).unwrap();
+            assert!(matches!(
+                TraceFile::open(&path),
+                Err(HWTracerError::TraceParseError(_))
+            ));
+        }
+    }
+
+    #[test]
+    fn build_ids() {
+        // The C library at least should have a build-id.
+        let ids = phdrs::objects()
+            .iter()
+            .filter_map(build_id)
+            .collect::<Vec<_>>();
+        assert!(!ids.is_empty());
+        assert!(ids.iter().all(|id| !id.is_empty()));
+
+        // The build-id read from an object's file is that of the loaded object.
+        let exe = phdrs::objects()
+            .into_iter()
+            .find(|o| o.name().to_bytes().is_empty())
+            .unwrap();
+        let path = current_exe().unwrap();
+        assert_eq!(file_build_id(&path), build_id(&exe));
+        let dir = tempfile::tempdir().unwrap();
+        let not_elf = dir.path().join("not_elf");
+        fs::write(&not_elf, b"not an ELF file").unwrap();
+        assert_eq!(file_build_id(&not_elf), None);
+    }
+}